@@ -0,0 +1,192 @@
+// CPU only checks of SelectDevice() on made up DeviceCandidate tables,
+// nothing is asked of a real device:
+//
+//   - a discrete GPU beats an integrated one, whatever their memory
+//   - devices missing a required extension, feature or present queue are
+//     rejected, even when they would score best
+//   - device local memory breaks ties between devices of a same type
+//   - the TRIANGLE_DEVICE override, an index or a piece of the name, wins
+//     over the score, and is ignored when it names nothing usable
+//   - without a usable device the selection fails and leaves no choice
+//
+// Usage: device-select-test, exits with 1 when a check fails.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "device-select.h"
+
+#define MIB (1024ull * 1024)
+#define NO_DEVICE 99u
+
+static int failures = 0;
+
+static void Check(bool ok, const char *format, ...) {
+  if (ok)
+    return;
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "FAILED: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  failures++;
+}
+
+// One graphics family able to present, a single device local heap and the
+// swapchain extension
+static DeviceCandidate MakeDevice(const char *name, VkPhysicalDeviceType type,
+                                  VkDeviceSize local) {
+  DeviceCandidate candidate = {};
+  snprintf(candidate.properties.deviceName,
+           sizeof(candidate.properties.deviceName), "%s", name);
+  candidate.properties.deviceType = type;
+  candidate.features.samplerAnisotropy = VK_TRUE;
+  candidate.memory.memoryHeapCount = 2;
+  candidate.memory.memoryHeaps[0].size = local;
+  candidate.memory.memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+  candidate.memory.memoryHeaps[1].size = 16384 * MIB;
+  VkQueueFamilyProperties family = {};
+  family.queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT |
+    VK_QUEUE_TRANSFER_BIT;
+  family.queueCount = 1;
+  candidate.queue_families.push_back(family);
+  candidate.present_support.push_back(VK_TRUE);
+  candidate.extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  return candidate;
+}
+
+static DeviceRequirements MakeRequirements() {
+  DeviceRequirements requirements = {};
+  requirements.extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  requirements.features.samplerAnisotropy = VK_TRUE;
+  requirements.present = true;
+  return requirements;
+}
+
+// Index of the selected device, NO_DEVICE when there is none
+static uint32_t Select(const std::vector<DeviceCandidate> &candidates,
+                       const char *override = NULL) {
+  DeviceChoice choice;
+  choice.index = NO_DEVICE;
+  if (!SelectDevice(candidates, MakeRequirements(), override, &choice))
+    return NO_DEVICE;
+  return choice.index;
+}
+
+static void CheckType() {
+  std::vector<DeviceCandidate> candidates = {
+    MakeDevice("Cpu", VK_PHYSICAL_DEVICE_TYPE_CPU, 65536 * MIB),
+    MakeDevice("Integrated", VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU, 8192 * MIB),
+    MakeDevice("Discrete", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 2048 * MIB),
+    MakeDevice("Virtual", VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU, 8192 * MIB),
+  };
+  Check(Select(candidates) == 2, "discrete GPU not picked");
+  candidates.erase(candidates.begin() + 2);
+  Check(Select(candidates) == 1, "integrated GPU not picked over virtual and cpu");
+}
+
+static void CheckRequirements() {
+  std::vector<DeviceCandidate> candidates = {
+    MakeDevice("Discrete no swapchain", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 8192 * MIB),
+    MakeDevice("Discrete no anisotropy", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 8192 * MIB),
+    MakeDevice("Discrete no present", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 8192 * MIB),
+    MakeDevice("Integrated", VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU, 512 * MIB),
+  };
+  candidates[0].extensions.clear();
+  candidates[1].features.samplerAnisotropy = VK_FALSE;
+  candidates[2].present_support[0] = VK_FALSE;
+
+  std::string reason;
+  for (uint32_t i = 0; i < 3; ++i) {
+    Check(ScoreDevice(candidates[i], MakeRequirements(), &reason) < 0,
+          "%s not rejected", candidates[i].properties.deviceName);
+    Check(!reason.empty(), "%s rejected without a reason",
+          candidates[i].properties.deviceName);
+  }
+  Check(Select(candidates) == 3, "device missing requirements picked");
+
+  // Presenting from another family than the graphics one is fine
+  VkQueueFamilyProperties transfer = {};
+  transfer.queueFlags = VK_QUEUE_TRANSFER_BIT;
+  transfer.queueCount = 1;
+  candidates[2].queue_families.push_back(transfer);
+  candidates[2].present_support.push_back(VK_TRUE);
+  DeviceChoice choice;
+  Check(SelectDevice(candidates, MakeRequirements(), NULL, &choice) &&
+        choice.index == 2 && choice.graphics_family == 0 &&
+        choice.present_family == 1, "separate present family not used");
+}
+
+static void CheckMemory() {
+  std::vector<DeviceCandidate> candidates = {
+    MakeDevice("Small", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 4096 * MIB),
+    MakeDevice("Large", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 12288 * MIB),
+    MakeDevice("Medium", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 8192 * MIB),
+  };
+  Check(Select(candidates) == 1, "device with the most memory not picked");
+
+  // Only device local heaps count
+  candidates[0].memory.memoryHeaps[1].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+  Check(Select(candidates) == 0, "second device local heap not counted");
+}
+
+static void CheckOverride() {
+  std::vector<DeviceCandidate> candidates = {
+    MakeDevice("Vendor Discrete 9000", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 8192 * MIB),
+    MakeDevice("Vendor Integrated 100", VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU, 512 * MIB),
+    MakeDevice("Broken Integrated", VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU, 512 * MIB),
+  };
+  candidates[2].extensions.clear();
+
+  // As triangle gets it
+  setenv("TRIANGLE_DEVICE", "1", 1);
+  Check(Select(candidates, getenv("TRIANGLE_DEVICE")) == 1,
+        "override by index ignored");
+  setenv("TRIANGLE_DEVICE", "integrated 1", 1);
+  Check(Select(candidates, getenv("TRIANGLE_DEVICE")) == 1,
+        "override by name ignored");
+  unsetenv("TRIANGLE_DEVICE");
+  Check(Select(candidates, getenv("TRIANGLE_DEVICE")) == 0,
+        "best device not picked without an override");
+
+  Check(Select(candidates, "") == 0, "empty override not ignored");
+  Check(Select(candidates, "7") == 0, "override past the devices not ignored");
+  Check(Select(candidates, "nothing like it") == 0,
+        "override matching no name not ignored");
+  Check(Select(candidates, "2") == 0, "override of an unusable device not ignored");
+  Check(Select(candidates, "broken") == 0,
+        "override naming an unusable device not ignored");
+}
+
+static void CheckNone() {
+  std::vector<DeviceCandidate> candidates;
+  Check(Select(candidates) == NO_DEVICE, "device picked out of none");
+  Check(Select(candidates, "0") == NO_DEVICE, "device picked out of none by index");
+
+  candidates.push_back(MakeDevice("No swapchain", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU,
+                                  8192 * MIB));
+  candidates.push_back(MakeDevice("No graphics", VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU,
+                                  8192 * MIB));
+  candidates[0].extensions.clear();
+  candidates[1].queue_families[0].queueFlags = VK_QUEUE_COMPUTE_BIT;
+  Check(Select(candidates) == NO_DEVICE, "unusable device picked");
+  Check(Select(candidates, "0") == NO_DEVICE, "unusable device picked by index");
+}
+
+int main() {
+  CheckType();
+  CheckRequirements();
+  CheckMemory();
+  CheckOverride();
+  CheckNone();
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
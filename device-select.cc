@@ -0,0 +1,237 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "device-select.h"
+#include "vulkan-dispatch.h"
+
+void QueryDeviceCandidate(VkPhysicalDevice device, VkSurfaceKHR surface,
+                          DeviceCandidate *candidate) {
+  vkGetPhysicalDeviceProperties(device, &candidate->properties);
+  vkGetPhysicalDeviceFeatures(device, &candidate->features);
+  vkGetPhysicalDeviceMemoryProperties(device, &candidate->memory);
+
+  uint32_t count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &count, NULL);
+  candidate->queue_families.resize(count);
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &count,
+                                           candidate->queue_families.data());
+
+  candidate->present_support.clear();
+  if (surface != VK_NULL_HANDLE) {
+    candidate->present_support.resize(count, VK_FALSE);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                               &candidate->present_support[i]) != VK_SUCCESS)
+        candidate->present_support[i] = VK_FALSE;
+    }
+  }
+
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(device, NULL, &extensionCount, NULL);
+  std::vector<VkExtensionProperties> extensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(device, NULL, &extensionCount,
+                                       extensions.data());
+  candidate->extensions.clear();
+  for (const VkExtensionProperties &extension : extensions)
+    candidate->extensions.push_back(extension.extensionName);
+}
+
+static int64_t TypeRank(VkPhysicalDeviceType type) {
+  switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 4;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return 3;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return 2;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: return 1;
+    default: return 0;
+  }
+}
+
+bool PickQueueFamilies(const DeviceCandidate &candidate, bool present,
+                       uint32_t *graphics_family, uint32_t *present_family) {
+  uint32_t graphics = UINT32_MAX;
+  uint32_t presenting = UINT32_MAX;
+  for (uint32_t i = 0; i < candidate.queue_families.size(); ++i) {
+    const VkQueueFamilyProperties &family = candidate.queue_families[i];
+    bool can_graphics = family.queueCount > 0 &&
+                        (family.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+    bool can_present = i < candidate.present_support.size() &&
+                       candidate.present_support[i];
+    // One family doing both is as good as it gets
+    if (can_graphics && (can_present || !present)) {
+      *graphics_family = i;
+      *present_family = i;
+      return true;
+    }
+    if (can_graphics && graphics == UINT32_MAX)
+      graphics = i;
+    if (can_present && presenting == UINT32_MAX)
+      presenting = i;
+  }
+  if (graphics == UINT32_MAX || presenting == UINT32_MAX)
+    return false;
+  *graphics_family = graphics;
+  *present_family = presenting;
+  return true;
+}
+
+uint32_t PickDedicatedFamily(const DeviceCandidate &candidate,
+                             VkQueueFlags role, uint32_t fallback) {
+  const VkQueueFlags engines = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT |
+                               VK_QUEUE_TRANSFER_BIT;
+  uint32_t best = fallback;
+  int best_engines = 4;
+  for (uint32_t i = 0; i < candidate.queue_families.size(); ++i) {
+    const VkQueueFamilyProperties &family = candidate.queue_families[i];
+    VkQueueFlags flags = family.queueFlags;
+    // Graphics and compute families can always do transfers, reporting it
+    // is optional
+    if (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+      flags |= VK_QUEUE_TRANSFER_BIT;
+    if (i == fallback || family.queueCount == 0 || !(flags & role))
+      continue;
+    int count = __builtin_popcount(flags & engines);
+    if (count < best_engines) {
+      best = i;
+      best_engines = count;
+    }
+  }
+  return best;
+}
+
+int64_t ScoreDevice(const DeviceCandidate &candidate,
+                    const DeviceRequirements &requirements,
+                    std::string *reason) {
+  for (const char *name : requirements.extensions) {
+    bool found = false;
+    for (const std::string &extension : candidate.extensions)
+      found = found || extension == name;
+    if (!found) {
+      *reason = std::string("missing extension ") + name;
+      return -1;
+    }
+  }
+
+  // VkPhysicalDeviceFeatures is nothing but VkBool32s
+  const VkBool32 *wanted = (const VkBool32 *) &requirements.features;
+  const VkBool32 *supported = (const VkBool32 *) &candidate.features;
+  for (size_t i = 0; i < sizeof(VkPhysicalDeviceFeatures) / sizeof(VkBool32); ++i) {
+    if (wanted[i] && !supported[i]) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "missing feature #%zu", i);
+      *reason = buf;
+      return -1;
+    }
+  }
+
+  uint32_t graphics, present;
+  if (!PickQueueFamilies(candidate, requirements.present, &graphics, &present)) {
+    *reason = requirements.present ? "no graphics or present queue"
+                                   : "no graphics queue";
+    return -1;
+  }
+
+  VkDeviceSize local = 0;
+  for (uint32_t i = 0; i < candidate.memory.memoryHeapCount; ++i) {
+    if (candidate.memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      local += candidate.memory.memoryHeaps[i].size;
+  }
+
+  // The type always wins, memory in MiB only orders devices of a same type
+  reason->clear();
+  return (TypeRank(candidate.properties.deviceType) << 40) + (int64_t) (local >> 20);
+}
+
+static bool NameMatches(const char *name, const char *pattern) {
+  size_t n = strlen(name), m = strlen(pattern);
+  for (size_t i = 0; i + m <= n; ++i) {
+    size_t j = 0;
+    while (j < m && tolower(name[i + j]) == tolower(pattern[j]))
+      j++;
+    if (j == m)
+      return true;
+  }
+  return false;
+}
+
+bool SelectDevice(const std::vector<DeviceCandidate> &candidates,
+                  const DeviceRequirements &requirements,
+                  const char *override, DeviceChoice *choice) {
+  std::vector<int64_t> scores(candidates.size());
+  for (uint32_t i = 0; i < candidates.size(); ++i) {
+    std::string reason;
+    scores[i] = ScoreDevice(candidates[i], requirements, &reason);
+    if (scores[i] < 0)
+      fprintf(stderr, "Device %u (%s) is not usable: %s\n", i,
+              candidates[i].properties.deviceName, reason.c_str());
+  }
+
+  uint32_t best = UINT32_MAX;
+  if (override && *override) {
+    char *end;
+    unsigned long index = strtoul(override, &end, 10);
+    for (uint32_t i = 0; i < candidates.size() && best == UINT32_MAX; ++i) {
+      bool match = *end == '\0' ? i == index
+                                : NameMatches(candidates[i].properties.deviceName, override);
+      if (match && scores[i] >= 0)
+        best = i;
+    }
+    if (best == UINT32_MAX)
+      fprintf(stderr, "No usable device matches \"%s\", ignoring it\n", override);
+  }
+
+  if (best == UINT32_MAX) {
+    for (uint32_t i = 0; i < candidates.size(); ++i) {
+      if (scores[i] >= 0 && (best == UINT32_MAX || scores[i] > scores[best]))
+        best = i;
+    }
+  }
+  if (best == UINT32_MAX)
+    return false;
+
+  choice->index = best;
+  choice->score = scores[best];
+  PickQueueFamilies(candidates[best], requirements.present,
+                    &choice->graphics_family, &choice->present_family);
+  choice->transfer_family = PickDedicatedFamily(candidates[best],
+    VK_QUEUE_TRANSFER_BIT, choice->graphics_family);
+  choice->compute_family = PickDedicatedFamily(candidates[best],
+    VK_QUEUE_COMPUTE_BIT, choice->graphics_family);
+  return true;
+}
+
+DeviceGroupMode ParseDeviceGroupMode(const char *mode) {
+  if (!mode)
+    return DEVICE_GROUP_NONE;
+  if (strcasecmp(mode, "afr") == 0)
+    return DEVICE_GROUP_AFR;
+  if (strcasecmp(mode, "sfr") == 0)
+    return DEVICE_GROUP_SFR;
+  return DEVICE_GROUP_NONE;
+}
+
+uint32_t DeviceGroupFrameMask(DeviceGroupMode mode, uint32_t device_count,
+                              uint64_t frame) {
+  if (device_count <= 1 || mode == DEVICE_GROUP_NONE)
+    return 1;
+  if (mode == DEVICE_GROUP_AFR)
+    return 1u << (frame % device_count);
+  return (device_count >= 32) ? UINT32_MAX : (1u << device_count) - 1;
+}
+
+std::vector<VkRect2D> SplitFrameAreas(VkExtent2D extent,
+                                      uint32_t device_count) {
+  std::vector<VkRect2D> areas(device_count);
+  uint32_t y = 0;
+  for (uint32_t i = 0; i < device_count; ++i) {
+    // Spread the remainder over the first bands
+    uint32_t height = extent.height / device_count +
+                      (i < extent.height % device_count ? 1 : 0);
+    areas[i].offset = {0, (int32_t) y};
+    areas[i].extent = {extent.width, height};
+    y += height;
+  }
+  return areas;
+}
@@ -0,0 +1,93 @@
+#ifndef _DEVICE_SELECT_H
+#define _DEVICE_SELECT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Physical device selection.
+//
+// Everything the choice depends on is gathered up front into plain
+// DeviceCandidate tables (QueryDeviceCandidate), the selection itself only
+// looks at those tables. It can be fed made up devices as well as real ones.
+
+struct DeviceCandidate {
+  VkPhysicalDeviceProperties properties;
+  VkPhysicalDeviceFeatures features;
+  VkPhysicalDeviceMemoryProperties memory;
+  std::vector<VkQueueFamilyProperties> queue_families;
+  // Per queue family, whether it can present to the target surface
+  std::vector<VkBool32> present_support;
+  std::vector<std::string> extensions;
+};
+
+struct DeviceRequirements {
+  std::vector<const char *> extensions;
+  // Every feature set to VK_TRUE here has to be supported
+  VkPhysicalDeviceFeatures features;
+  // Needs a queue family able to present
+  bool present;
+};
+
+struct DeviceChoice {
+  uint32_t index;
+  uint32_t graphics_family;
+  uint32_t present_family;
+  // Same as graphics_family when there's no dedicated family for them
+  uint32_t transfer_family;
+  uint32_t compute_family;
+  int64_t score;
+};
+
+// How to use a device group, if at all.
+enum DeviceGroupMode {
+  DEVICE_GROUP_NONE,
+  DEVICE_GROUP_AFR, // alternate frame: whole frames go round robin
+  DEVICE_GROUP_SFR, // split frame: every device renders a band of each frame
+};
+
+// Fills in a candidate from a real device. present_support is left empty
+// when surface is VK_NULL_HANDLE.
+void QueryDeviceCandidate(VkPhysicalDevice device, VkSurfaceKHR surface,
+                          DeviceCandidate *candidate);
+
+// Negative when the device doesn't meet the requirements, reason says why.
+// Otherwise discrete beats integrated beats virtual beats cpu, and device
+// local memory breaks ties.
+int64_t ScoreDevice(const DeviceCandidate &candidate,
+                    const DeviceRequirements &requirements,
+                    std::string *reason);
+
+// Picks graphics and present queue families, preferring a single family
+// doing both. Returns false if the device has no suitable families.
+bool PickQueueFamilies(const DeviceCandidate &candidate, bool present,
+                       uint32_t *graphics_family, uint32_t *present_family);
+
+// Family for a secondary role (VK_QUEUE_TRANSFER_BIT or
+// VK_QUEUE_COMPUTE_BIT) other than fallback, with as few other capabilities
+// as possible so that it maps to its own engine. Returns fallback if there
+// is none.
+uint32_t PickDedicatedFamily(const DeviceCandidate &candidate,
+                             VkQueueFlags role, uint32_t fallback);
+
+// Best scoring usable device. override (may be NULL) is either a device
+// index or a case insensitive substring of the device name; an override
+// that doesn't match a usable device is reported and ignored.
+bool SelectDevice(const std::vector<DeviceCandidate> &candidates,
+                  const DeviceRequirements &requirements,
+                  const char *override, DeviceChoice *choice);
+
+// "afr", "sfr" or anything else for none.
+DeviceGroupMode ParseDeviceGroupMode(const char *mode);
+
+// Devices a frame is rendered by, as a device mask.
+uint32_t DeviceGroupFrameMask(DeviceGroupMode mode, uint32_t device_count,
+                              uint64_t frame);
+
+// Horizontal bands covering extent, one per device, for split frame.
+std::vector<VkRect2D> SplitFrameAreas(VkExtent2D extent,
+                                      uint32_t device_count);
+
+#endif // _DEVICE_SELECT_H
@@ -0,0 +1,255 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "draw-queue.h"
+#include "vulkan-utils.h"
+
+namespace {
+
+// Below that many items insertion sort beats the radix passes
+const size_t kInsertionItems = 32;
+
+bool SameConstants(const DrawPacket &a, const DrawPacket &b) {
+  if (a.constants_size != b.constants_size ||
+      a.constants_stages != b.constants_stages)
+    return false;
+  return a.constants == b.constants ||
+    memcmp(a.constants, b.constants, a.constants_size) == 0;
+}
+
+}  // namespace
+
+DrawQueue::DrawQueue(unsigned threads) : threads_(std::max(threads, 1u)) {
+}
+
+uint64_t DrawQueue::SortKey(uint32_t pass, uint32_t pipeline, uint32_t material,
+                            float depth) {
+  depth = std::min(std::max(depth, 0.0f), 1.0f);
+  uint64_t quantized = (uint64_t) (depth * 16777215.0f);
+  return ((uint64_t) (pass & 0xff) << 56) | ((uint64_t) (pipeline & 0xffff) << 40) |
+    ((uint64_t) (material & 0xffff) << 24) | quantized;
+}
+
+void DrawQueue::Reserve(size_t count) {
+  packets_.reserve(count);
+  items_.reserve(count);
+  scratch_.reserve(count);
+}
+
+// Least significant byte first, skipping the bytes all keys share: most of
+// them, in a frame where few passes and pipelines are used.
+void DrawQueue::RadixSort(Item *items, Item *scratch, size_t count) {
+  if (count <= kInsertionItems) {
+    for (size_t i = 1; i < count; ++i) {
+      Item item = items[i];
+      size_t j = i;
+      for (; j > 0 && items[j - 1].key > item.key; --j)
+        items[j] = items[j - 1];
+      items[j] = item;
+    }
+    return;
+  }
+
+  // Every digit counted in one pass over the keys
+  size_t counts[8][256] = {};
+  for (size_t i = 0; i < count; ++i)
+    for (int digit = 0; digit < 8; ++digit)
+      counts[digit][(items[i].key >> (8 * digit)) & 0xff]++;
+
+  Item *from = items, *to = scratch;
+  for (int digit = 0; digit < 8; ++digit) {
+    size_t *offsets = counts[digit];
+    int shift = 8 * digit;
+    if (offsets[(from[0].key >> shift) & 0xff] == count)
+      continue;
+    size_t offset = 0;
+    for (int value = 0; value < 256; ++value) {
+      size_t n = offsets[value];
+      offsets[value] = offset;
+      offset += n;
+    }
+    for (size_t i = 0; i < count; ++i)
+      to[offsets[(from[i].key >> shift) & 0xff]++] = from[i];
+    std::swap(from, to);
+  }
+  if (from != items)
+    std::copy(from, from + count, items);
+}
+
+void DrawQueue::Sort() {
+  size_t count = packets_.size();
+  items_.resize(count);
+  scratch_.resize(count);
+  for (size_t i = 0; i < count; ++i)
+    items_[i] = {packets_[i].key, (uint32_t) i};
+  Item *items = items_.data();
+  Item *scratch = scratch_.data();
+
+  unsigned threads = count > kParallelPackets ? threads_ : 1;
+  if (threads <= 1) {
+    RadixSort(items, scratch, count);
+    return;
+  }
+
+  // A run per thread, then merged pairwise, the runs doubling every round.
+  // Merging takes the first run's items first on equal keys, which keeps
+  // the sort stable.
+  std::vector<size_t> bounds(threads + 1);
+  for (unsigned t = 0; t <= threads; ++t)
+    bounds[t] = count * t / threads;
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; ++t)
+    workers.emplace_back([&, t] {
+      RadixSort(items + bounds[t], scratch + bounds[t], bounds[t + 1] - bounds[t]);
+    });
+  RadixSort(items, scratch, bounds[1]);
+  for (std::thread &worker : workers)
+    worker.join();
+
+  auto less = [](const Item &a, const Item &b) { return a.key < b.key; };
+  for (unsigned width = 1; width < threads; width *= 2) {
+    auto merge = [&](unsigned t) {
+      size_t begin = bounds[t];
+      size_t middle = bounds[t + width];
+      size_t end = bounds[std::min(t + 2 * width, threads)];
+      std::merge(items + begin, items + middle, items + middle, items + end,
+                 scratch + begin, less);
+      std::copy(scratch + begin, scratch + end, items + begin);
+    };
+    workers.clear();
+    for (unsigned t = 2 * width; t + width < threads; t += 2 * width)
+      workers.emplace_back(merge, t);
+    merge(0);
+    for (std::thread &worker : workers)
+      worker.join();
+  }
+}
+
+bool DrawQueue::SameBindings(const DrawPacket &a, const DrawPacket &b) {
+  return a.pipeline == b.pipeline && a.layout == b.layout &&
+    a.descriptor_set == b.descriptor_set &&
+    a.vertex_buffer == b.vertex_buffer &&
+    a.vertex_buffer_offset == b.vertex_buffer_offset &&
+    a.index_buffer == b.index_buffer &&
+    a.index_buffer_offset == b.index_buffer_offset &&
+    a.index_type == b.index_type && SameConstants(a, b);
+}
+
+bool DrawQueue::Continues(const VkDrawIndexedIndirectCommand &draw,
+                          const DrawPacket &packet) {
+  return packet.index_count == draw.indexCount &&
+    packet.first_index == draw.firstIndex &&
+    packet.vertex_offset == draw.vertexOffset &&
+    packet.first_instance == draw.firstInstance + draw.instanceCount;
+}
+
+DrawQueue::Stats DrawQueue::Flush(VkCommandBuffer command_buffer,
+                                  const IndirectBuffer *indirect) {
+  Stats stats = {};
+  stats.packets = packets_.size();
+  auto start = std::chrono::steady_clock::now();
+  Sort();
+  stats.sort_seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  // Packets whose pipeline, descriptor set, buffers and constants are
+  // bound, NULL before the first bind. A packet without a set or constants
+  // leaves what was bound before in place.
+  const DrawPacket *pipeline = NULL;
+  const DrawPacket *set = NULL;
+  const DrawPacket *vertices = NULL;
+  const DrawPacket *indices = NULL;
+  const DrawPacket *constants = NULL;
+  uint32_t used = 0;
+
+  size_t count = items_.size();
+  size_t i = 0;
+  while (i < count) {
+    const DrawPacket &packet = packets_[items_[i].index];
+
+    if (!pipeline || packet.pipeline != pipeline->pipeline) {
+      vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                        packet.pipeline);
+      stats.pipeline_binds++;
+    }
+    pipeline = &packet;
+    // Nothing is known to be bound through another layout
+    if (set && set->layout != packet.layout)
+      set = NULL;
+    if (constants && constants->layout != packet.layout)
+      constants = NULL;
+    if (packet.descriptor_set != VK_NULL_HANDLE &&
+        (!set || packet.descriptor_set != set->descriptor_set)) {
+      vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              packet.layout, 0, 1, &packet.descriptor_set, 0, NULL);
+      stats.descriptor_binds++;
+      set = &packet;
+    }
+    if (!vertices || packet.vertex_buffer != vertices->vertex_buffer ||
+        packet.vertex_buffer_offset != vertices->vertex_buffer_offset) {
+      vkCmdBindVertexBuffers(command_buffer, 0, 1, &packet.vertex_buffer,
+                             &packet.vertex_buffer_offset);
+      stats.buffer_binds++;
+      vertices = &packet;
+    }
+    if (!indices || packet.index_buffer != indices->index_buffer ||
+        packet.index_buffer_offset != indices->index_buffer_offset ||
+        packet.index_type != indices->index_type) {
+      vkCmdBindIndexBuffer(command_buffer, packet.index_buffer,
+                           packet.index_buffer_offset, packet.index_type);
+      stats.buffer_binds++;
+      indices = &packet;
+    }
+    if (packet.constants_size &&
+        (!constants || !SameConstants(packet, *constants))) {
+      vkCmdPushConstants(command_buffer, packet.layout, packet.constants_stages,
+                         0, packet.constants_size, packet.constants);
+      stats.constant_pushes++;
+      constants = &packet;
+    }
+
+    // The next draw of the same bindings, with the packets after it that
+    // carry on its instances folded in
+    auto next_draw = [&](VkDrawIndexedIndirectCommand *draw) {
+      const DrawPacket &first = packets_[items_[i++].index];
+      *draw = {first.index_count, first.instance_count, first.first_index,
+               first.vertex_offset, first.first_instance};
+      while (i < count) {
+        const DrawPacket &next = packets_[items_[i].index];
+        if (!SameBindings(packet, next) || !Continues(*draw, next))
+          break;
+        draw->instanceCount += next.instance_count;
+        stats.instanced++;
+        i++;
+      }
+    };
+
+    VkDrawIndexedIndirectCommand draw;
+    next_draw(&draw);
+    uint32_t first = used;
+    if (indirect && used < indirect->capacity) {
+      indirect->commands[used++] = draw;
+      while (i < count && used < indirect->capacity &&
+             SameBindings(packet, packets_[items_[i].index])) {
+        next_draw(&indirect->commands[used++]);
+        stats.multi_drawn++;
+      }
+    }
+    if (used - first > 1) {
+      vkCmdDrawIndexedIndirect(command_buffer, indirect->buffer,
+                               first * sizeof(VkDrawIndexedIndirectCommand),
+                               used - first, sizeof(VkDrawIndexedIndirectCommand));
+    } else {
+      // Alone, not worth going indirect
+      used = first;
+      vkCmdDrawIndexed(command_buffer, draw.indexCount, draw.instanceCount,
+                       draw.firstIndex, draw.vertexOffset, draw.firstInstance);
+    }
+    stats.draws++;
+  }
+
+  packets_.clear();
+  return stats;
+}
@@ -0,0 +1,116 @@
+#ifndef _DRAW_QUEUE_H
+#define _DRAW_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Draws of a frame, sorted by state before they go into a command buffer.
+//
+// Draws are added in any order as packets holding everything they bind,
+// with a 64 bit sort key. Flush() sorts them by key, stable for equal keys,
+// and records them binding only what changed from the draw before. Packets
+// that only differ by their instance range and follow each other become one
+// instanced draw. With an indirect buffer and multiDrawIndirect, draws with
+// the same bindings become one vkCmdDrawIndexedIndirect.
+//
+// The key decides the order, and so how many binds there are: pass first,
+// then pipeline, material (descriptor set) and depth, see SortKey().
+// Sorting is a radix sort, on several threads for large queues: each sorts
+// a share of the packets, then the sorted runs are merged.
+
+struct DrawPacket {
+  uint64_t key;
+  VkPipeline pipeline;
+  VkPipelineLayout layout;
+  VkDescriptorSet descriptor_set;   // set 0, VK_NULL_HANDLE for none
+  VkBuffer vertex_buffer;           // binding 0
+  VkDeviceSize vertex_buffer_offset;
+  VkBuffer index_buffer;
+  VkDeviceSize index_buffer_offset;
+  VkIndexType index_type;
+  // Pushed at offset 0, has to stay valid until Flush()
+  const void *constants;
+  uint32_t constants_size;
+  VkShaderStageFlags constants_stages;
+  uint32_t index_count;
+  uint32_t instance_count;
+  uint32_t first_index;
+  int32_t vertex_offset;
+  uint32_t first_instance;
+};
+
+class DrawQueue {
+public:
+  // What a Flush() recorded
+  struct Stats {
+    uint32_t packets;
+    uint32_t draws;             // vkCmdDraw* calls
+    uint32_t instanced;         // packets merged into the instances of another
+    uint32_t multi_drawn;       // packets merged into a multi-draw
+    uint32_t pipeline_binds;
+    uint32_t descriptor_binds;
+    uint32_t buffer_binds;      // vertex and index
+    uint32_t constant_pushes;
+    double sort_seconds;
+
+    uint32_t binds() const {
+      return pipeline_binds + descriptor_binds + buffer_binds + constant_pushes;
+    }
+  };
+
+  // Host visible and coherent, the commands of one command buffer: it can't
+  // be reused before the GPU is done with that command buffer.
+  struct IndirectBuffer {
+    VkBuffer buffer;
+    VkDrawIndexedIndirectCommand *commands;
+    uint32_t capacity;          // in commands
+  };
+
+  // threads sort queues of more than kParallelPackets packets
+  explicit DrawQueue(unsigned threads = 1);
+
+  static const size_t kParallelPackets = 1 << 14;
+
+  // pass and pipeline are the high bits, 8 and 16 of them, then 16 of
+  // material and 24 of depth, in [0, 1] and clamped. Smaller keys go
+  // first: pass the depth as 1 - depth for back to front.
+  static uint64_t SortKey(uint32_t pass, uint32_t pipeline, uint32_t material,
+                          float depth);
+
+  // Makes room for count packets, so that the render loop doesn't allocate
+  void Reserve(size_t count);
+  void Add(const DrawPacket &packet) { packets_.push_back(packet); }
+  size_t size() const { return packets_.size(); }
+
+  // Sorts and records the packets into command_buffer, inside a render
+  // pass, and empties the queue. indirect can be NULL, and should be unless
+  // the device has multiDrawIndirect enabled. Draws that don't fit in it are
+  // recorded directly.
+  Stats Flush(VkCommandBuffer command_buffer, const IndirectBuffer *indirect);
+
+private:
+  struct Item {
+    uint64_t key;
+    uint32_t index;             // into packets_, for stability
+  };
+
+  // Sorts items by key in place, scratch being as large
+  static void RadixSort(Item *items, Item *scratch, size_t count);
+  void Sort();
+
+  // Same bindings, the draw parameters aside
+  static bool SameBindings(const DrawPacket &a, const DrawPacket &b);
+  // packet draws what draw does, for the instances right after draw's
+  static bool Continues(const VkDrawIndexedIndirectCommand &draw,
+                        const DrawPacket &packet);
+
+  unsigned threads_;
+  std::vector<DrawPacket> packets_;
+  std::vector<Item> items_;
+  std::vector<Item> scratch_;
+};
+
+#endif // _DRAW_QUEUE_H
@@ -0,0 +1,237 @@
+// CPU only check that the work of a frame stays off the heap once warmed
+// up, counted with AllocationCount():
+//
+//   - Scene::Update() with objects moving, BVH rebuilds included, and a
+//     single threaded Query() as in the render loop
+//   - a DrawQueue filled with what is visible and flushed into a command
+//     buffer, the vkCmd* pointers only counting what gets recorded
+//   - a FrameVector in a FrameArena reset every frame
+//
+// and that over aligned operator new is counted too.
+//
+// Usage: frame-allocator-test, exits with 1 when a check fails.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "draw-queue.h"
+#include "frame-allocator.h"
+#include "scene.h"
+#include "vulkan-dispatch.h"
+
+#define OBJECTS 4096
+#define WORLD_SIZE 200.0f
+#define WARMUP_FRAMES 16
+#define FRAMES 200
+
+static int failures = 0;
+
+static void Check(bool ok, const char *format, ...) {
+  if (ok)
+    return;
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "FAILED: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  failures++;
+}
+
+// Commands recorded by the fake vkCmd* functions
+static uint32_t commands = 0;
+
+static void VKAPI_CALL FakeBindPipeline(VkCommandBuffer, VkPipelineBindPoint,
+                                        VkPipeline) {
+  commands++;
+}
+
+static void VKAPI_CALL FakeBindDescriptorSets(VkCommandBuffer, VkPipelineBindPoint,
+                                              VkPipelineLayout, uint32_t, uint32_t,
+                                              const VkDescriptorSet *, uint32_t,
+                                              const uint32_t *) {
+  commands++;
+}
+
+static void VKAPI_CALL FakeBindVertexBuffers(VkCommandBuffer, uint32_t, uint32_t,
+                                             const VkBuffer *, const VkDeviceSize *) {
+  commands++;
+}
+
+static void VKAPI_CALL FakeBindIndexBuffer(VkCommandBuffer, VkBuffer, VkDeviceSize,
+                                           VkIndexType) {
+  commands++;
+}
+
+static void VKAPI_CALL FakePushConstants(VkCommandBuffer, VkPipelineLayout,
+                                         VkShaderStageFlags, uint32_t, uint32_t,
+                                         const void *) {
+  commands++;
+}
+
+static void VKAPI_CALL FakeDrawIndexed(VkCommandBuffer, uint32_t, uint32_t,
+                                       uint32_t, int32_t, uint32_t) {
+  commands++;
+}
+
+static void VKAPI_CALL FakeDrawIndexedIndirect(VkCommandBuffer, VkBuffer,
+                                               VkDeviceSize, uint32_t, uint32_t) {
+  commands++;
+}
+
+// xorshift, in [0, 1)
+static float Random() {
+  static uint32_t state = 1234;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return (state >> 8) / (float) (1 << 24);
+}
+
+static void Translation(const float position[3], Scene::Transform t) {
+  for (int r = 0; r < 3; ++r)
+    for (int c = 0; c < 4; ++c)
+      t[r * 4 + c] = c == 3 ? position[r] : (r == c ? 1.0f : 0.0f);
+}
+
+template <typename T>
+static T Handle(uint32_t n) {
+  return (T) (uintptr_t) (n + 1);
+}
+
+// Stored through, so that the compiler can't drop the new/delete pairs
+struct alignas(64) Line {
+  char bytes[64];
+};
+static Line *volatile escape;
+
+static void CheckAligned() {
+  uint64_t before = AllocationCount();
+  Line *line = new Line;
+  escape = line;
+  Check(AllocationCount() == before + 1, "aligned new not counted");
+  Check((uintptr_t) line % alignof(Line) == 0, "aligned new misaligned");
+  delete line;
+
+  before = AllocationCount();
+  Line *lines = new Line[4];
+  escape = lines;
+  Check(AllocationCount() == before + 1, "aligned new[] not counted");
+  Check((uintptr_t) lines % alignof(Line) == 0, "aligned new[] misaligned");
+  delete[] lines;
+}
+
+static void CheckFrames() {
+  vkCmdBindPipeline = FakeBindPipeline;
+  vkCmdBindDescriptorSets = FakeBindDescriptorSets;
+  vkCmdBindVertexBuffers = FakeBindVertexBuffers;
+  vkCmdBindIndexBuffer = FakeBindIndexBuffer;
+  vkCmdPushConstants = FakePushConstants;
+  vkCmdDrawIndexed = FakeDrawIndexed;
+  vkCmdDrawIndexedIndirect = FakeDrawIndexedIndirect;
+
+  // Nothing gets destroyed, handles are the indices into positions
+  Scene scene;
+  std::vector<Scene::Object> objects(OBJECTS);
+  std::vector<float> positions(OBJECTS * 3);
+  Aabb unit = {{-1.0f, -1.0f, -1.0f}, {1.0f, 1.0f, 1.0f}};
+  for (uint32_t i = 0; i < OBJECTS; ++i) {
+    for (int k = 0; k < 3; ++k)
+      positions[i * 3 + k] = (Random() - 0.5f) * WORLD_SIZE;
+    Scene::Transform t;
+    Translation(&positions[i * 3], t);
+    objects[i] = scene.Create(unit, t, i % 8, i % 32);
+  }
+
+  // Orthographic, a quarter of the world
+  float m[16] = {};
+  m[0] = m[5] = 4.0f / WORLD_SIZE;
+  m[10] = 1.0f / WORLD_SIZE;
+  m[14] = 0.5f;
+  m[15] = 1.0f;
+  Frustum frustum = FrustumFromMatrix(m);
+
+  // What the render loop sizes up front
+  std::vector<Scene::Object> visible;
+  visible.reserve(OBJECTS);
+  DrawQueue queue;
+  queue.Reserve(OBJECTS);
+  FrameArena arena;
+
+  uint64_t frameAllocations = 0, rebuilds = 0, drawn = 0;
+  for (uint32_t frame = 0; frame < WARMUP_FRAMES + FRAMES; ++frame) {
+    uint64_t before = AllocationCount();
+
+    // An eighth of the objects move a bit, a few of them jump anywhere,
+    // which lets the BVH get loose and rebuilt now and then
+    for (uint32_t j = 0; j < OBJECTS / 8; ++j) {
+      uint32_t i = (frame * (OBJECTS / 8) + j) % OBJECTS;
+      float step = j % 32 ? 1.0f : WORLD_SIZE;
+      for (int k = 0; k < 3; ++k) {
+        float &p = positions[i * 3 + k];
+        p = std::min(std::max(p + (Random() - 0.5f) * step, -WORLD_SIZE / 2),
+                     WORLD_SIZE / 2);
+      }
+      Scene::Transform t;
+      Translation(&positions[i * 3], t);
+      scene.SetTransform(objects[i], t);
+    }
+    scene.Update();
+    scene.Query(frustum, 1, &visible);
+
+    FrameVector<uint32_t> meshes(&arena);
+    for (Scene::Object object : visible)
+      meshes.push_back(scene.mesh(object));
+
+    for (size_t v = 0; v < visible.size(); ++v) {
+      Scene::Object object = visible[v];
+      DrawPacket packet = {};
+      uint32_t mesh = meshes[v], material = scene.material(object);
+      float depth = positions[object * 3 + 2] / WORLD_SIZE + 0.5f;
+      packet.key = DrawQueue::SortKey(0, mesh % 4, material, depth);
+      packet.pipeline = Handle<VkPipeline>(mesh % 4);
+      packet.layout = Handle<VkPipelineLayout>(0);
+      packet.descriptor_set = Handle<VkDescriptorSet>(material);
+      packet.vertex_buffer = Handle<VkBuffer>(mesh);
+      packet.index_buffer = Handle<VkBuffer>(mesh);
+      packet.index_type = VK_INDEX_TYPE_UINT32;
+      packet.constants = &positions[object * 3];
+      packet.constants_size = 3 * sizeof(float);
+      packet.constants_stages = VK_SHADER_STAGE_VERTEX_BIT;
+      packet.index_count = 36;
+      packet.instance_count = 1;
+      queue.Add(packet);
+    }
+    DrawQueue::Stats stats = queue.Flush(VK_NULL_HANDLE, NULL);
+    arena.Reset();
+
+    if (frame < WARMUP_FRAMES)
+      continue;
+    uint64_t allocations = AllocationCount() - before;
+    Check(allocations == 0, "frame %u made %lu heap allocations", frame,
+          (unsigned long) allocations);
+    frameAllocations += allocations;
+    rebuilds += scene.stats().rebuilt;
+    drawn += stats.packets;
+  }
+
+  // Otherwise the test doesn't test much
+  Check(rebuilds > 0, "no BVH rebuild in %u frames", FRAMES);
+  Check(drawn > 0 && commands > 0, "nothing drawn");
+  printf("%u frames: %lu heap allocations, %lu BVH rebuilds, %.0f draws per frame\n",
+         FRAMES, (unsigned long) frameAllocations, (unsigned long) rebuilds,
+         (double) drawn / FRAMES);
+}
+
+int main() {
+  CheckAligned();
+  CheckFrames();
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
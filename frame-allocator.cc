@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <algorithm>
+
+#include "frame-allocator.h"
+
+FrameArena::FrameArena(size_t block_size) : block_size_(block_size) {
+  AddBlock(block_size_);
+}
+
+FrameArena::~FrameArena() {
+  for (Block &block : blocks_)
+    delete[] block.data;
+}
+
+void FrameArena::AddBlock(size_t size) {
+  Block block = {new char[size], size};
+  blocks_.push_back(block);
+}
+
+void *FrameArena::Allocate(size_t size, size_t align) {
+  for (;;) {
+    Block &block = blocks_[current_];
+    uintptr_t base = (uintptr_t) block.data;
+    size_t start = ((base + offset_ + align - 1) & ~(uintptr_t) (align - 1)) - base;
+    if (start + size <= block.size) {
+      offset_ = start + size;
+      return block.data + start;
+    }
+    current_++;
+    offset_ = 0;
+    if (current_ == blocks_.size())
+      AddBlock(std::max(block_size_, size + align));
+  }
+}
+
+void FrameArena::Reset() {
+  if (blocks_.size() > 1) {
+    size_t total = capacity();
+    for (Block &block : blocks_)
+      delete[] block.data;
+    blocks_.clear();
+    AddBlock(total);
+  }
+  current_ = 0;
+  offset_ = 0;
+}
+
+size_t FrameArena::used() const {
+  size_t used = offset_;
+  for (size_t i = 0; i < current_; ++i)
+    used += blocks_[i].size;
+  return used;
+}
+
+size_t FrameArena::capacity() const {
+  size_t total = 0;
+  for (const Block &block : blocks_)
+    total += block.size;
+  return total;
+}
+
+FixedPool::FixedPool(size_t size, size_t align, size_t per_chunk)
+    : per_chunk_(per_chunk) {
+  // Free blocks hold the next pointer
+  size = std::max(size, sizeof(void *));
+  align = std::max(align, alignof(void *));
+  size_ = (size + align - 1) / align * align;
+}
+
+FixedPool::~FixedPool() {
+  for (char *chunk : chunks_)
+    delete[] chunk;
+}
+
+void *FixedPool::Allocate() {
+  if (!free_) {
+    // new[] is aligned for anything fundamental, size_ keeps the blocks so
+    char *chunk = new char[size_ * per_chunk_];
+    chunks_.push_back(chunk);
+    for (size_t i = per_chunk_; i-- > 0;)
+      Free(chunk + i * size_);
+  }
+  void *p = free_;
+  free_ = *(void **) p;
+  return p;
+}
+
+void FixedPool::Free(void *p) {
+  *(void **) p = free_;
+  free_ = p;
+}
+
+PoolSet::~PoolSet() {
+  for (FixedPool *pool : pools_)
+    delete pool;
+}
+
+void *PoolSet::Allocate(size_t size) {
+  if (size == 0 || size > kMaxSize)
+    return ::operator new(size);
+  size_t index = (size - 1) / kGranularity;
+  if (!pools_[index])
+    pools_[index] = new FixedPool((index + 1) * kGranularity, kGranularity);
+  return pools_[index]->Allocate();
+}
+
+void PoolSet::Free(void *p, size_t size) {
+  if (size == 0 || size > kMaxSize) {
+    ::operator delete(p);
+    return;
+  }
+  pools_[(size - 1) / kGranularity]->Free(p);
+}
+
+// Allocation counting. Per thread, so that the streaming thread doesn't show
+// up in the render loop's numbers.
+
+namespace {
+
+thread_local uint64_t allocations = 0;
+
+void *CountedAllocate(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+// For over aligned types, alignas(64) and such. free() takes it back.
+void *CountedAllocate(size_t size, std::align_val_t align) {
+  allocations++;
+  void *p;
+  if (posix_memalign(&p, std::max((size_t) align, sizeof(void *)), size ? size : 1))
+    throw std::bad_alloc();
+  return p;
+}
+
+}  // namespace
+
+uint64_t AllocationCount() {
+  return allocations;
+}
+
+void *operator new(size_t size) {
+  return CountedAllocate(size);
+}
+
+void *operator new[](size_t size) {
+  return CountedAllocate(size);
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+  return CountedAllocate(size, align);
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+  return CountedAllocate(size, align);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
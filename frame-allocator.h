@@ -0,0 +1,163 @@
+#ifndef _FRAME_ALLOCATOR_H
+#define _FRAME_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+// Allocators for what the render loop creates over and over: a linear arena
+// for the data that only lives for a frame and pools for fixed size
+// objects, both usable from STL containers. Once they have grown to what a
+// frame needs, rendering doesn't touch the heap anymore.
+
+// Bump allocator reset at frame boundaries. Single threaded.
+class FrameArena {
+public:
+  explicit FrameArena(size_t block_size = 64 << 10);
+  ~FrameArena();
+
+  void *Allocate(size_t size, size_t align);
+
+  // Frees everything allocated since the last Reset(). When the frame took
+  // more than one block they are replaced by a single one as big as all of
+  // them, so that the next frames fit in it.
+  void Reset();
+
+  size_t used() const;
+  size_t capacity() const;
+
+private:
+  struct Block {
+    char *data;
+    size_t size;
+  };
+
+  void AddBlock(size_t size);
+
+  size_t block_size_;
+  std::vector<Block> blocks_;
+  size_t current_ = 0;  // block being allocated from
+  size_t offset_ = 0;   // in the current block
+};
+
+// Free list of same sized blocks, carved out of chunks that are only given
+// back on destruction. Single threaded.
+class FixedPool {
+public:
+  FixedPool(size_t size, size_t align, size_t per_chunk = 64);
+  ~FixedPool();
+
+  void *Allocate();
+  void Free(void *p);
+
+  size_t size() const { return size_; }
+
+private:
+  size_t size_;
+  size_t per_chunk_;
+  void *free_ = NULL;
+  std::vector<char *> chunks_;
+};
+
+// FixedPool per size class, for allocators that get rebound to types they
+// can't know about, like the nodes of std::map.
+class PoolSet {
+public:
+  // Larger objects go to the heap
+  static const size_t kMaxSize = 256;
+  static const size_t kGranularity = 16;
+
+  PoolSet() {}
+  ~PoolSet();
+
+  void *Allocate(size_t size);
+  void Free(void *p, size_t size);
+
+private:
+  FixedPool *pools_[kMaxSize / kGranularity] = {};
+};
+
+// Typed pool for render objects.
+template <typename T>
+class ObjectPool {
+public:
+  explicit ObjectPool(size_t per_chunk = 64)
+      : pool_(sizeof(T), alignof(T), per_chunk) {}
+
+  template <typename... Args>
+  T *New(Args&&... args) {
+    return new (pool_.Allocate()) T(static_cast<Args&&>(args)...);
+  }
+  void Delete(T *object) {
+    object->~T();
+    pool_.Free(object);
+  }
+
+private:
+  FixedPool pool_;
+};
+
+// STL allocator over a FrameArena: deallocation is a no op, the memory
+// goes away with the next Reset(). Containers using it must not outlive the
+// frame.
+template <typename T>
+struct ArenaAllocator {
+  typedef T value_type;
+
+  FrameArena *arena;
+
+  ArenaAllocator(FrameArena *a) : arena(a) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena->Allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena == b.arena;
+}
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena != b.arena;
+}
+
+template <typename T>
+using FrameVector = std::vector<T, ArenaAllocator<T>>;
+
+// STL allocator over a PoolSet, for node based containers.
+template <typename T>
+struct PoolAllocator {
+  typedef T value_type;
+
+  PoolSet *pools;
+
+  PoolAllocator(PoolSet *p) : pools(p) {}
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U> &other) : pools(other.pools) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(pools->Allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) { pools->Free(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &a, const PoolAllocator<U> &b) {
+  return a.pools == b.pools;
+}
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &a, const PoolAllocator<U> &b) {
+  return a.pools != b.pools;
+}
+
+// Number of operator new calls made by the calling thread so far, aligned
+// ones included. Global operator new is replaced to count them, so that the
+// render loop can check it stays off the heap.
+uint64_t AllocationCount();
+
+#endif // _FRAME_ALLOCATOR_H
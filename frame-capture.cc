@@ -0,0 +1,307 @@
+#include <string.h>
+
+#include "frame-capture.h"
+
+bool FrameCapture::Open(const char *path) {
+  Close();
+  file_ = fopen(path, "wb");
+  if (!file_) {
+    fprintf(stderr, "Could not open capture file %s\n", path);
+    return false;
+  }
+  // Frames are small, let stdio batch them up
+  setvbuf(file_, NULL, _IOFBF, 1 << 20);
+  fwrite(CAPTURE_MAGIC, 1, 8, file_);
+  next_id_ = 0;
+  frame_ = 0;
+  return true;
+}
+
+void FrameCapture::Close() {
+  if (file_)
+    fclose(file_);
+  file_ = NULL;
+}
+
+void FrameCapture::Put(uint64_t v) {
+  while (v >= 0x80) {
+    record_.push_back((uint8_t) (v | 0x80));
+    v >>= 7;
+  }
+  record_.push_back((uint8_t) v);
+}
+
+void FrameCapture::PutBlob(const void *data, size_t size) {
+  Put(size);
+  const uint8_t *bytes = (const uint8_t *) data;
+  record_.insert(record_.end(), bytes, bytes + size);
+}
+
+void FrameCapture::Emit(CaptureOp op) {
+  uint8_t header[11];
+  size_t n = 0;
+  header[n++] = (uint8_t) op;
+  uint64_t size = record_.size();
+  while (size >= 0x80) {
+    header[n++] = (uint8_t) (size | 0x80);
+    size >>= 7;
+  }
+  header[n++] = (uint8_t) size;
+
+  fwrite(header, 1, n, file_);
+  fwrite(record_.data(), 1, record_.size(), file_);
+  record_.clear();
+}
+
+uint32_t FrameCapture::CreateShader(VkShaderStageFlagBits stage,
+                                    const void *code, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t id = next_id_++;
+  Put(id);
+  Put(stage);
+  PutBlob(code, size);
+  Emit(CAPTURE_OP_CREATE_SHADER);
+  return id;
+}
+
+uint32_t FrameCapture::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t id = next_id_++;
+  Put(id);
+  Put(size);
+  Put(usage);
+  Emit(CAPTURE_OP_CREATE_BUFFER);
+  return id;
+}
+
+void FrameCapture::UploadBuffer(uint32_t id, VkDeviceSize offset,
+                                const void *data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(id);
+  Put(offset);
+  PutBlob(data, size);
+  Emit(CAPTURE_OP_UPLOAD_BUFFER);
+}
+
+uint32_t FrameCapture::CreateImage(VkFormat format, uint32_t width,
+                                   uint32_t height, uint32_t levels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t id = next_id_++;
+  Put(id);
+  Put(format);
+  Put(width);
+  Put(height);
+  Put(levels);
+  Emit(CAPTURE_OP_CREATE_IMAGE);
+  return id;
+}
+
+void FrameCapture::UploadImage(uint32_t id, uint32_t level, uint32_t width,
+                               uint32_t height, const void *data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(id);
+  Put(level);
+  Put(width);
+  Put(height);
+  PutBlob(data, size);
+  Emit(CAPTURE_OP_UPLOAD_IMAGE);
+}
+
+uint32_t FrameCapture::CreatePipeline(const CapturePipeline &pipeline) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t id = next_id_++;
+  Put(id);
+  Put(pipeline.vertex_shader);
+  Put(pipeline.fragment_shader);
+  Put(pipeline.vertex_stride);
+  Put(pipeline.attributes.size());
+  for (const VkVertexInputAttributeDescription &a : pipeline.attributes) {
+    Put(a.location);
+    Put(a.binding);
+    Put(a.format);
+    Put(a.offset);
+  }
+  Put(pipeline.topology);
+  Put(pipeline.cull_mode);
+  Put(pipeline.front_face);
+  Put(pipeline.blend_enable);
+  Put(pipeline.features);
+  Emit(CAPTURE_OP_CREATE_PIPELINE);
+  return id;
+}
+
+void FrameCapture::BeginFrame(uint32_t width, uint32_t height, VkFormat format) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(frame_++);
+  Put(width);
+  Put(height);
+  Put(format);
+  Emit(CAPTURE_OP_BEGIN_FRAME);
+}
+
+void FrameCapture::BindPipeline(uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(id);
+  Emit(CAPTURE_OP_BIND_PIPELINE);
+}
+
+void FrameCapture::BindVertexBuffer(uint32_t id, VkDeviceSize offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(id);
+  Put(offset);
+  Emit(CAPTURE_OP_BIND_VERTEX_BUFFER);
+}
+
+void FrameCapture::BindIndexBuffer(uint32_t id, VkDeviceSize offset,
+                                   VkIndexType type) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(id);
+  Put(offset);
+  Put(type);
+  Emit(CAPTURE_OP_BIND_INDEX_BUFFER);
+}
+
+void FrameCapture::BindUniformBuffer(uint32_t binding, uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(binding);
+  Put(id);
+  Emit(CAPTURE_OP_BIND_UNIFORM_BUFFER);
+}
+
+void FrameCapture::BindTexture(uint32_t binding, uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(binding);
+  Put(id);
+  Emit(CAPTURE_OP_BIND_TEXTURE);
+}
+
+void FrameCapture::DrawIndexed(uint32_t index_count, uint32_t instance_count,
+                               uint32_t first_index, int32_t vertex_offset,
+                               uint32_t first_instance) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Put(index_count);
+  Put(instance_count);
+  Put(first_index);
+  Put((uint64_t) (int64_t) vertex_offset);
+  Put(first_instance);
+  Emit(CAPTURE_OP_DRAW_INDEXED);
+}
+
+void FrameCapture::EndFrame() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Emit(CAPTURE_OP_END_FRAME);
+  fflush(file_);
+}
+
+bool CaptureReader::Open(const char *path) {
+  Close();
+  file_ = fopen(path, "rb");
+  if (!file_) {
+    fprintf(stderr, "Could not open capture file %s\n", path);
+    return false;
+  }
+  char magic[8];
+  if (fread(magic, 1, 8, file_) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s is not a capture file\n", path);
+    Close();
+    return false;
+  }
+  // Records can't be sized past it, whatever their varint says
+  long size = -1;
+  if (fseek(file_, 0, SEEK_END) == 0)
+    size = ftell(file_);
+  if (size < 0 || fseek(file_, 8, SEEK_SET) != 0) {
+    fprintf(stderr, "Could not read capture file %s\n", path);
+    Close();
+    return false;
+  }
+  file_size_ = size;
+  return true;
+}
+
+void CaptureReader::Close() {
+  if (file_)
+    fclose(file_);
+  file_ = NULL;
+}
+
+bool CaptureReader::ReadVarint(uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(file_);
+    if (c == EOF)
+      return false;
+    *v |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool CaptureReader::Next(CaptureOp *op) {
+  int c = fgetc(file_);
+  if (c == EOF)
+    return false;
+  uint64_t size;
+  long at = ftell(file_);
+  if (!ReadVarint(&size) || at < 0 || size > file_size_ - at)
+    return false;
+  record_.resize(size);
+  if (fread(record_.data(), 1, size, file_) != size)
+    return false;
+  pos_ = 0;
+  ok_ = true;
+  *op = (CaptureOp) c;
+  return true;
+}
+
+uint64_t CaptureReader::Get() {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos_ >= record_.size()) {
+      ok_ = false;
+      return 0;
+    }
+    uint8_t c = record_[pos_++];
+    v |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return v;
+  }
+  ok_ = false;
+  return 0;
+}
+
+const uint8_t *CaptureReader::GetBlob(size_t *size) {
+  *size = Get();
+  if (!ok_ || *size > record_.size() - pos_) {
+    ok_ = false;
+    *size = 0;
+    return NULL;
+  }
+  const uint8_t *data = record_.data() + pos_;
+  pos_ += *size;
+  return data;
+}
+
+void CaptureReader::GetPipeline(CapturePipeline *pipeline) {
+  pipeline->vertex_shader = Get();
+  pipeline->fragment_shader = Get();
+  pipeline->vertex_stride = Get();
+  uint64_t count = Get();
+  if (count > CAPTURE_MAX_ATTRIBUTES) {
+    ok_ = false;
+    count = 0;
+  }
+  pipeline->attributes.resize(count);
+  for (VkVertexInputAttributeDescription &a : pipeline->attributes) {
+    a.location = Get();
+    a.binding = Get();
+    a.format = (VkFormat) Get();
+    a.offset = Get();
+  }
+  pipeline->topology = (VkPrimitiveTopology) Get();
+  pipeline->cull_mode = Get();
+  pipeline->front_face = (VkFrontFace) Get();
+  pipeline->blend_enable = Get();
+  pipeline->features = Get();
+}
@@ -0,0 +1,131 @@
+#ifndef _FRAME_CAPTURE_H
+#define _FRAME_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Capture file format
+//
+// The file starts with the 8 bytes magic "VKSBCAP2" followed by a stream of
+// records. Each record is a one byte opcode, the payload length as a varint
+// and the payload. Integers in the payload are varints, blobs are a varint
+// length followed by the raw bytes.
+//
+// Objects are named by ids handed out by the capture, in creation order.
+// Uploads recorded between two frames are replayed as part of the next one.
+// The file is flushed at the end of every frame, so a capture that gets cut
+// short is still valid up to the last complete frame.
+
+#define CAPTURE_MAGIC "VKSBCAP2"
+// Vertex attributes of a pipeline at most, what every device supports
+#define CAPTURE_MAX_ATTRIBUTES 16
+
+enum CaptureOp {
+  CAPTURE_OP_CREATE_SHADER = 1,   // id, stage, spirv
+  CAPTURE_OP_CREATE_BUFFER,       // id, size, usage
+  CAPTURE_OP_UPLOAD_BUFFER,       // id, offset, data
+  CAPTURE_OP_CREATE_IMAGE,        // id, format, width, height, levels
+  CAPTURE_OP_UPLOAD_IMAGE,        // id, level, width, height, data
+  CAPTURE_OP_CREATE_PIPELINE,     // id, CapturePipeline
+  CAPTURE_OP_BEGIN_FRAME,         // frame, width, height, format
+  CAPTURE_OP_BIND_PIPELINE,       // id
+  CAPTURE_OP_BIND_VERTEX_BUFFER,  // id, offset
+  CAPTURE_OP_BIND_INDEX_BUFFER,   // id, offset, index type
+  CAPTURE_OP_BIND_UNIFORM_BUFFER, // binding, id
+  CAPTURE_OP_BIND_TEXTURE,        // binding, id
+  CAPTURE_OP_DRAW_INDEXED,        // count, instances, first index, vertex offset, first instance
+  CAPTURE_OP_END_FRAME,
+};
+
+// Everything the replay needs to rebuild one of our graphics pipelines.
+// The descriptor layout is implied: a uniform buffer at binding 0 for the
+// vertex stage and a combined image sampler at binding 1 for the fragment.
+// features is specialization constant 0 of the fragment shader.
+struct CapturePipeline {
+  uint32_t vertex_shader;
+  uint32_t fragment_shader;
+  uint32_t vertex_stride;
+  std::vector<VkVertexInputAttributeDescription> attributes;
+  VkPrimitiveTopology topology;
+  VkCullModeFlags cull_mode;
+  VkFrontFace front_face;
+  VkBool32 blend_enable;
+  uint32_t features;
+};
+
+// Safe to use from several threads, records come out in call order.
+class FrameCapture {
+public:
+  FrameCapture() {}
+  ~FrameCapture() { Close(); }
+
+  bool Open(const char *path);
+  void Close();
+  bool enabled() const { return file_ != NULL; }
+
+  uint32_t CreateShader(VkShaderStageFlagBits stage, const void *code, size_t size);
+  uint32_t CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage);
+  void UploadBuffer(uint32_t id, VkDeviceSize offset, const void *data, size_t size);
+  uint32_t CreateImage(VkFormat format, uint32_t width, uint32_t height, uint32_t levels);
+  void UploadImage(uint32_t id, uint32_t level, uint32_t width, uint32_t height,
+                   const void *data, size_t size);
+  uint32_t CreatePipeline(const CapturePipeline &pipeline);
+
+  void BeginFrame(uint32_t width, uint32_t height, VkFormat format);
+  void BindPipeline(uint32_t id);
+  void BindVertexBuffer(uint32_t id, VkDeviceSize offset);
+  void BindIndexBuffer(uint32_t id, VkDeviceSize offset, VkIndexType type);
+  void BindUniformBuffer(uint32_t binding, uint32_t id);
+  void BindTexture(uint32_t binding, uint32_t id);
+  void DrawIndexed(uint32_t index_count, uint32_t instance_count,
+                   uint32_t first_index, int32_t vertex_offset,
+                   uint32_t first_instance);
+  void EndFrame();
+
+private:
+  void Put(uint64_t v);
+  void PutBlob(const void *data, size_t size);
+  void Emit(CaptureOp op);
+
+  std::mutex mutex_;
+  FILE *file_ = NULL;
+  std::vector<uint8_t> record_;
+  uint32_t next_id_ = 0;
+  uint32_t frame_ = 0;
+};
+
+// Reads back what FrameCapture wrote, one record at a time.
+class CaptureReader {
+public:
+  CaptureReader() {}
+  ~CaptureReader() { Close(); }
+
+  bool Open(const char *path);
+  void Close();
+
+  // Returns false at the end of the file or on a truncated record, one
+  // longer than what is left of the file.
+  bool Next(CaptureOp *op);
+
+  // Payload accessors for the current record, in the order they were written.
+  uint64_t Get();
+  int64_t GetSigned() { return (int64_t) Get(); }
+  const uint8_t *GetBlob(size_t *size);
+  void GetPipeline(CapturePipeline *pipeline);
+  bool ok() const { return ok_; }
+
+private:
+  bool ReadVarint(uint64_t *v);
+
+  FILE *file_ = NULL;
+  uint64_t file_size_ = 0;
+  std::vector<uint8_t> record_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+#endif // _FRAME_CAPTURE_H
@@ -0,0 +1,636 @@
+#include <signal.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "frame-export.h"
+#include "vulkan-utils.h"
+
+namespace {
+
+struct CrcTable {
+  uint32_t entries[256];
+
+  CrcTable() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      entries[n] = c;
+    }
+  }
+};
+
+uint32_t Crc32(const uint8_t *data, size_t size) {
+  static const CrcTable table;
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < size; ++i)
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+uint32_t Adler32(const uint8_t *data, size_t size) {
+  uint32_t a = 1, b = 0;
+  while (size > 0) {
+    // Largest run that can't overflow b before the modulo
+    size_t n = std::min(size, (size_t) 5552);
+    for (size_t i = 0; i < n; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += n;
+    size -= n;
+  }
+  return (b << 16) | a;
+}
+
+void PutBe32(std::vector<uint8_t> *out, uint32_t v) {
+  out->push_back(v >> 24);
+  out->push_back(v >> 16);
+  out->push_back(v >> 8);
+  out->push_back(v);
+}
+
+// Returns where the chunk starts, for EndChunk()
+size_t BeginChunk(std::vector<uint8_t> *out, const char *type) {
+  size_t start = out->size();
+  PutBe32(out, 0);
+  out->insert(out->end(), type, type + 4);
+  return start;
+}
+
+void EndChunk(std::vector<uint8_t> *out, size_t start) {
+  uint32_t length = out->size() - start - 8;
+  uint8_t *p = out->data() + start;
+  p[0] = length >> 24;
+  p[1] = length >> 16;
+  p[2] = length >> 8;
+  p[3] = length;
+  PutBe32(out, Crc32(p + 4, length + 4));
+}
+
+// Splits a png: pattern around its one integer conversion, % with optional
+// flags and width then u or d, with %% turned into %. The conversion comes
+// out taking a long long. False for anything else printf would look at.
+bool SplitPattern(const std::string &pattern, std::string *prefix,
+                  std::string *number, std::string *suffix) {
+  prefix->clear();
+  number->clear();
+  suffix->clear();
+  std::string *out = prefix;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    if (pattern[i] != '%') {
+      out->push_back(pattern[i]);
+      continue;
+    }
+    if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+      out->push_back('%');
+      ++i;
+      continue;
+    }
+    if (!number->empty())
+      return false;
+    size_t width = pattern.find_first_not_of("-+ 0", i + 1);
+    size_t end = width == std::string::npos ? width :
+      pattern.find_first_not_of("0123456789", width);
+    // Two digits of width at most keep the number short
+    if (end == std::string::npos || end - width > 2 ||
+        (pattern[end] != 'u' && pattern[end] != 'd'))
+      return false;
+    *number = pattern.substr(i, end - i) + "ll" + pattern[end];
+    out = suffix;
+    i = end;
+  }
+  return !number->empty();
+}
+
+}  // namespace
+
+FrameExporter::FrameExporter(VkPhysicalDevice physical_device, VkDevice device,
+                             uint32_t queue_family, VkFormat format,
+                             VkExtent2D extent, uint32_t ring_size,
+                             bool drop_when_full)
+    : device_(VK_NULL_HANDLE), drop_when_full_(drop_when_full),
+      ring_size_(ring_size) {
+  CreateRing(physical_device, device, queue_family, format, extent);
+}
+
+FrameExporter::FrameExporter(VkFormat format, VkExtent2D extent,
+                             uint32_t ring_size, bool drop_when_full)
+    : device_(VK_NULL_HANDLE), format_(format), extent_(extent),
+      drop_when_full_(drop_when_full), ring_size_(ring_size), coherent_(true) {
+  bgra_ = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+  frame_size_ = (VkDeviceSize) extent.width * extent.height * 4;
+  host_memory_.resize(frame_size_ * ring_size_);
+  slots_.resize(ring_size_);
+  for (uint32_t i = 0; i < ring_size_; ++i) {
+    slots_[i].buffer = VK_NULL_HANDLE;
+    slots_[i].memory = VK_NULL_HANDLE;
+    slots_[i].command_buffer = VK_NULL_HANDLE;
+    slots_[i].data = &host_memory_[i * frame_size_];
+  }
+}
+
+FrameExporter::~FrameExporter() {
+  Close();
+  ReleaseDevice();
+}
+
+bool FrameExporter::CreateRing(VkPhysicalDevice physical_device,
+                               VkDevice device, uint32_t queue_family,
+                               VkFormat format, VkExtent2D extent) {
+  device_ = device;
+  format_ = format;
+  extent_ = extent;
+  bgra_ = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+  frame_size_ = (VkDeviceSize) extent.width * extent.height * 4;
+  next_slot_ = 0;
+
+  std::vector<Slot> slots(ring_size_);
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = queue_family;
+  VK_CHECK_RESULT(vkCreateCommandPool(device_, &poolInfo, NULL, &command_pool_));
+
+  std::vector<VkCommandBuffer> commandBuffers(ring_size_);
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.commandPool = command_pool_;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = ring_size_;
+  VK_CHECK_RESULT(
+    vkAllocateCommandBuffers(device_, &allocInfo, commandBuffers.data()));
+
+  for (uint32_t i = 0; i < ring_size_; ++i) {
+    Slot &slot = slots[i];
+    slot.command_buffer = commandBuffers[i];
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = frame_size_;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK_RESULT(vkCreateBuffer(device_, &bufferInfo, NULL, &slot.buffer));
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device_, slot.buffer, &memRequirements);
+
+    // The CPU reads every byte: cached memory is much faster to read than
+    // the write combined kind, at the price of invalidating it.
+    uint32_t type = FindMemoryType(physical_device, memRequirements.memoryTypeBits,
+                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                   VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    if (type == UINT32_MAX)
+      type = FindMemoryType(physical_device, memRequirements.memoryTypeBits,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    if (type == UINT32_MAX) {
+      fprintf(stderr, "No host visible memory for frame export\n");
+      for (uint32_t j = 0; j < i; ++j) {
+        vkUnmapMemory(device_, slots[j].memory);
+        vkDestroyBuffer(device_, slots[j].buffer, NULL);
+        vkFreeMemory(device_, slots[j].memory, NULL);
+      }
+      vkDestroyBuffer(device_, slot.buffer, NULL);
+      vkDestroyCommandPool(device_, command_pool_, NULL);
+      device_ = VK_NULL_HANDLE;
+      return false;
+    }
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &memProperties);
+    coherent_ = memProperties.memoryTypes[type].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    VkMemoryAllocateInfo memInfo = {};
+    memInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memInfo.allocationSize = memRequirements.size;
+    memInfo.memoryTypeIndex = type;
+    VK_CHECK_RESULT(vkAllocateMemory(device_, &memInfo, NULL, &slot.memory));
+    VK_CHECK_RESULT(vkBindBufferMemory(device_, slot.buffer, slot.memory, 0));
+
+    void *data;
+    VK_CHECK_RESULT(
+      vkMapMemory(device_, slot.memory, 0, VK_WHOLE_SIZE, 0, &data));
+    slot.data = (uint8_t *) data;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  slots_.swap(slots);
+  return true;
+}
+
+void FrameExporter::ReleaseDevice() {
+  if (!device_)
+    return;
+  {
+    // Slots already handed over are fine, let the worker finish them. The
+    // others were on the GPU, their frames are gone.
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] {
+      for (const Slot &slot : slots_)
+        if (slot.state == SLOT_READY)
+          return false;
+      return true;
+    });
+  }
+  for (Slot &slot : slots_) {
+    vkUnmapMemory(device_, slot.memory);
+    vkDestroyBuffer(device_, slot.buffer, NULL);
+    vkFreeMemory(device_, slot.memory, NULL);
+  }
+  vkDestroyCommandPool(device_, command_pool_, NULL);
+  std::lock_guard<std::mutex> lock(mutex_);
+  slots_.clear();
+  device_ = VK_NULL_HANDLE;
+}
+
+bool FrameExporter::ResetDevice(VkPhysicalDevice physical_device,
+                                VkDevice device, uint32_t queue_family,
+                                VkFormat format, VkExtent2D extent) {
+  ReleaseDevice();
+  if (!SupportedFormat(format)) {
+    fprintf(stderr, "Can't export frames of format %d, stopping\n", (int) format);
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    return false;
+  }
+  if (running_ && mode_ != MODE_PNG &&
+      (extent.width != extent_.width || extent.height != extent_.height))
+    fprintf(stderr, "Exported frames change size from %ux%u to %ux%u\n",
+            extent_.width, extent_.height, extent.width, extent.height);
+  if (!CreateRing(physical_device, device, queue_family, format, extent)) {
+    fprintf(stderr, "Stopping frame export\n");
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool FrameExporter::SupportedFormat(VkFormat format) {
+  return format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB ||
+    format == VK_FORMAT_R8G8B8A8_UNORM || format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+bool FrameExporter::Open(const char *spec) {
+  Close();
+
+  // CreateRing() failed and said why
+  if (slots_.empty())
+    return false;
+
+  if (!SupportedFormat(format_)) {
+    fprintf(stderr, "Can't export frames of format %d\n", (int) format_);
+    return false;
+  }
+
+  const char *colon = strchr(spec, ':');
+  std::string kind = colon ? std::string(spec, colon - spec) : "";
+  target_ = colon ? colon + 1 : "";
+  if (target_.empty()) {
+    fprintf(stderr, "Bad export spec %s, expected yuv:, png: or pipe:\n", spec);
+    return false;
+  }
+
+  if (kind == "yuv") {
+    mode_ = MODE_YUV;
+    file_ = fopen(target_.c_str(), "wb");
+  } else if (kind == "png") {
+    mode_ = MODE_PNG;
+    if (!SplitPattern(target_, &png_prefix_, &png_number_, &png_suffix_)) {
+      fprintf(stderr, "PNG export needs a pattern with one %%u or %%d for the "
+              "frame number and %%%% for a %%, not %s\n", target_.c_str());
+      return false;
+    }
+  } else if (kind == "pipe") {
+    mode_ = MODE_PIPE;
+    // An encoder that goes away shows up as failed writes
+    signal(SIGPIPE, SIG_IGN);
+    file_ = popen(target_.c_str(), "w");
+  } else {
+    fprintf(stderr, "Unknown export kind %s\n", kind.c_str());
+    return false;
+  }
+  if (mode_ != MODE_PNG) {
+    if (!file_) {
+      fprintf(stderr, "Could not open %s for export\n", target_.c_str());
+      return false;
+    }
+    setvbuf(file_, NULL, _IOFBF, 1 << 20);
+  }
+
+  fprintf(stdout, "Exporting %ux%u frames to %s\n", extent_.width,
+          extent_.height, spec);
+  std::lock_guard<std::mutex> lock(mutex_);
+  failed_ = false;
+  running_ = true;
+  thread_ = std::thread(&FrameExporter::Run, this);
+  return true;
+}
+
+void FrameExporter::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_)
+      return;
+    running_ = false;
+  }
+  cv_.notify_all();
+  thread_.join();
+
+  for (Slot &slot : slots_)
+    slot.state = SLOT_FREE;
+  if (file_) {
+    if (mode_ == MODE_PIPE)
+      pclose(file_);
+    else
+      fclose(file_);
+  }
+  file_ = NULL;
+}
+
+FrameExporter::Slot *FrameExporter::Acquire(uint32_t *slot_index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!running_ || failed_ || slots_.empty())
+    return NULL;
+  Slot *slot = &slots_[next_slot_];
+  // Only wait on the worker: a slot that is still on the GPU won't be
+  // handed over before this returns.
+  if (!drop_when_full_)
+    cv_.wait(lock, [&] { return slot->state != SLOT_READY || failed_; });
+  if (slot->state != SLOT_FREE || failed_) {
+    dropped_++;
+    return NULL;
+  }
+  slot->state = SLOT_RECORDED;
+  slot->frame = next_frame_++;
+  *slot_index = next_slot_;
+  next_slot_ = (next_slot_ + 1) % slots_.size();
+  return slot;
+}
+
+uint8_t *FrameExporter::Map(uint32_t *slot_index) {
+  Slot *slot = Acquire(slot_index);
+  return slot ? slot->data : NULL;
+}
+
+VkCommandBuffer FrameExporter::Record(VkImage image, VkImageLayout layout,
+                                      uint32_t *slot_index) {
+  Slot *slot = Acquire(slot_index);
+  if (!slot)
+    return VK_NULL_HANDLE;
+
+  VkCommandBuffer cmd = slot->command_buffer;
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK_RESULT(vkBeginCommandBuffer(cmd, &beginInfo));
+
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = layout;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.layerCount = 1;
+  barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+                       1, &barrier);
+
+  VkBufferImageCopy region = {};
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent = {extent_.width, extent_.height, 1};
+  vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         slot->buffer, 1, &region);
+
+  // Back to where it was, before anything renders to it again
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.newLayout = layout;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  VkBufferMemoryBarrier bufferBarrier = {};
+  bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.buffer = slot->buffer;
+  bufferBarrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL,
+                       1, &bufferBarrier, 1, &barrier);
+  VK_CHECK_RESULT(vkEndCommandBuffer(cmd));
+  return cmd;
+}
+
+void FrameExporter::Ready(uint32_t slot) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slots_[slot].state != SLOT_RECORDED)
+      return;
+    slots_[slot].state = SLOT_READY;
+    ready_.push_back(slot);
+  }
+  cv_.notify_all();
+}
+
+FrameExporter::Stats FrameExporter::GetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  stats.frames = frames_;
+  stats.dropped = dropped_;
+  stats.bytes = bytes_;
+  stats.write_seconds = write_seconds_;
+  return stats;
+}
+
+void FrameExporter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [&] { return !ready_.empty() || !running_; });
+    // Whatever is ready still gets written when closing
+    if (ready_.empty())
+      break;
+    uint32_t index = ready_.front();
+    ready_.pop_front();
+    Slot slot = slots_[index];
+    bool failed = failed_;
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    size_t written = 0;
+    VkResult result = VK_SUCCESS;
+    if (!failed && !coherent_) {
+      VkMappedMemoryRange range = {};
+      range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+      range.memory = slot.memory;
+      range.size = VK_WHOLE_SIZE;
+      // ReleaseDevice() waits for this slot, device_ stays valid meanwhile
+      result = vkInvalidateMappedMemoryRanges(device_, 1, &range);
+      if (result != VK_SUCCESS)
+        fprintf(stderr, "Could not read back frame %lu: %s\n",
+                (unsigned long) slot.frame, VkResultName(result));
+    }
+    if (!failed && result == VK_SUCCESS) {
+      written = Write(slot);
+      if (!written)
+        fprintf(stderr, "Frame export to %s failed, stopping\n", target_.c_str());
+    }
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    lock.lock();
+    slots_[index].state = SLOT_FREE;
+    if (result != VK_SUCCESS) {
+      // Only the frame is lost, the device may well come back
+      dropped_++;
+    } else if (!failed) {
+      failed_ = !written;
+      frames_ += written ? 1 : 0;
+      bytes_ += written;
+      write_seconds_ += seconds;
+    }
+    cv_.notify_all();
+  }
+}
+
+size_t FrameExporter::Write(const Slot &slot) {
+  switch (mode_) {
+    case MODE_YUV:
+      return WriteYuv(slot.data);
+    case MODE_PNG:
+      return WritePng(slot.data, slot.frame);
+    case MODE_PIPE:
+      return WriteRgb(slot.data);
+  }
+  return 0;
+}
+
+void FrameExporter::ToRgb(const uint8_t *row, uint8_t *rgb) {
+  int r = bgra_ ? 2 : 0;
+  int b = bgra_ ? 0 : 2;
+  for (uint32_t x = 0; x < extent_.width; ++x) {
+    rgb[0] = row[r];
+    rgb[1] = row[1];
+    rgb[2] = row[b];
+    row += 4;
+    rgb += 3;
+  }
+}
+
+size_t FrameExporter::WriteYuv(const uint8_t *pixels) {
+  uint32_t w = extent_.width, h = extent_.height;
+  uint32_t cw = (w + 1) / 2, ch = (h + 1) / 2;
+  size_t size = (size_t) w * h + 2 * (size_t) cw * ch;
+  scratch_.resize(size);
+  uint8_t *yPlane = scratch_.data();
+  uint8_t *uPlane = yPlane + (size_t) w * h;
+  uint8_t *vPlane = uPlane + (size_t) cw * ch;
+  int ri = bgra_ ? 2 : 0;
+  int bi = bgra_ ? 0 : 2;
+
+  for (uint32_t y = 0; y < h; ++y) {
+    const uint8_t *p = pixels + (size_t) y * w * 4;
+    for (uint32_t x = 0; x < w; ++x, p += 4)
+      yPlane[(size_t) y * w + x] =
+        ((66 * p[ri] + 129 * p[1] + 25 * p[bi] + 128) >> 8) + 16;
+  }
+  // Chroma from the average of each 2x2 block, clamped at the edges
+  for (uint32_t cy = 0; cy < ch; ++cy) {
+    for (uint32_t cx = 0; cx < cw; ++cx) {
+      int r = 0, g = 0, b = 0;
+      for (uint32_t dy = 0; dy < 2; ++dy) {
+        for (uint32_t dx = 0; dx < 2; ++dx) {
+          uint32_t x = std::min(cx * 2 + dx, w - 1);
+          uint32_t y = std::min(cy * 2 + dy, h - 1);
+          const uint8_t *p = pixels + ((size_t) y * w + x) * 4;
+          r += p[ri];
+          g += p[1];
+          b += p[bi];
+        }
+      }
+      r = (r + 2) / 4;
+      g = (g + 2) / 4;
+      b = (b + 2) / 4;
+      uPlane[(size_t) cy * cw + cx] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+      vPlane[(size_t) cy * cw + cx] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+  }
+  return fwrite(scratch_.data(), 1, size, file_) == size ? size : 0;
+}
+
+size_t FrameExporter::WriteRgb(const uint8_t *pixels) {
+  size_t row = (size_t) extent_.width * 3;
+  size_t size = row * extent_.height;
+  scratch_.resize(size);
+  for (uint32_t y = 0; y < extent_.height; ++y)
+    ToRgb(pixels + (size_t) y * extent_.width * 4, scratch_.data() + y * row);
+  return fwrite(scratch_.data(), 1, size, file_) == size ? size : 0;
+}
+
+// Uncompressed PNG: deflate's stored blocks are enough to make a valid file
+// at the speed of a copy, which matters more here than the size.
+size_t FrameExporter::WritePng(const uint8_t *pixels, uint64_t frame) {
+  // Filter type 0 in front of every row
+  size_t row = (size_t) extent_.width * 3 + 1;
+  size_t rawSize = row * extent_.height;
+  scratch_.resize(rawSize);
+  for (uint32_t y = 0; y < extent_.height; ++y) {
+    scratch_[y * row] = 0;
+    ToRgb(pixels + (size_t) y * extent_.width * 4, scratch_.data() + y * row + 1);
+  }
+
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  png_.assign(signature, signature + 8);
+
+  size_t chunk = BeginChunk(&png_, "IHDR");
+  PutBe32(&png_, extent_.width);
+  PutBe32(&png_, extent_.height);
+  // 8 bits, RGB, deflate, adaptive filtering, no interlace
+  const uint8_t header[5] = {8, 2, 0, 0, 0};
+  png_.insert(png_.end(), header, header + 5);
+  EndChunk(&png_, chunk);
+
+  chunk = BeginChunk(&png_, "IDAT");
+  png_.push_back(0x78);
+  png_.push_back(0x01);
+  for (size_t offset = 0; offset < rawSize; offset += 65535) {
+    size_t n = std::min(rawSize - offset, (size_t) 65535);
+    png_.push_back(offset + n == rawSize ? 1 : 0);
+    png_.push_back(n);
+    png_.push_back(n >> 8);
+    png_.push_back(~n);
+    png_.push_back(~n >> 8);
+    png_.insert(png_.end(), scratch_.begin() + offset, scratch_.begin() + offset + n);
+  }
+  PutBe32(&png_, Adler32(scratch_.data(), rawSize));
+  EndChunk(&png_, chunk);
+
+  chunk = BeginChunk(&png_, "IEND");
+  EndChunk(&png_, chunk);
+
+  // Open() checked the conversion, it's the only thing printf gets to see
+  char number[128];
+  if (png_number_.back() == 'd')
+    snprintf(number, sizeof(number), png_number_.c_str(), (long long) frame);
+  else
+    snprintf(number, sizeof(number), png_number_.c_str(),
+             (unsigned long long) frame);
+  std::string path = png_prefix_ + number + png_suffix_;
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file)
+    return 0;
+  bool ok = fwrite(png_.data(), 1, png_.size(), file) == png_.size();
+  ok = fclose(file) == 0 && ok;
+  return ok ? png_.size() : 0;
+}
@@ -0,0 +1,166 @@
+#ifndef _FRAME_EXPORT_H
+#define _FRAME_EXPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Exports rendered frames, for videos and image comparisons.
+//
+// Frames are copied on the GPU into a ring of persistently mapped host
+// buffers, as part of the frame's own submission. Once the GPU is done with
+// it, the renderer hands the slot over with Ready() and a worker thread
+// converts and writes it while the following frames render. With a ring
+// a few frames deeper than what's in flight, rendering never waits on the
+// readback, only on the worker when it can't keep up.
+//
+// Where frames go is given by a spec:
+//   yuv:<path>       raw I420 (BT.601, limited range) frames, one file
+//   png:<pattern>    one PNG per frame, pattern takes the frame number
+//                    with a single %u or %d, flags and width allowed,
+//                    and %% for a %, e.g. png:frames/%05u.png
+//   pipe:<command>   raw rgb24 frames to the standard input of command,
+//                    e.g. pipe:ffmpeg -f rawvideo -pix_fmt rgb24 -s 800x600
+//                    -r 60 -i - out.mp4
+// Only 8 bit RGBA and BGRA images are supported.
+//
+// Frames rendered on the CPU go through a ring of plain host memory
+// instead, see Map().
+class FrameExporter {
+public:
+  struct Stats {
+    uint64_t frames;         // written out
+    uint64_t dropped;        // skipped because the ring was full
+    uint64_t bytes;
+    double write_seconds;    // worker time converting and writing
+  };
+
+  // With drop_when_full, Record() skips frames rather than waiting for the
+  // worker, for interactive rendering. Offline rendering wants every frame.
+  FrameExporter(VkPhysicalDevice physical_device, VkDevice device,
+                uint32_t queue_family, VkFormat format, VkExtent2D extent,
+                uint32_t ring_size, bool drop_when_full);
+  // For frames rendered on the CPU, no device involved
+  FrameExporter(VkFormat format, VkExtent2D extent, uint32_t ring_size,
+                bool drop_when_full);
+  ~FrameExporter();
+
+  // For device loss: lets the worker finish what was handed over, then
+  // destroys everything made from the device. Frames still on the GPU are
+  // lost, and Record() drops frames until ResetDevice(). The output stays
+  // open.
+  void ReleaseDevice();
+  // Makes a new ring on device, for frames that may have changed format or
+  // size. Prints why and stops exporting when the format isn't supported or
+  // there is no memory to read the frames back into.
+  bool ResetDevice(VkPhysicalDevice physical_device, VkDevice device,
+                   uint32_t queue_family, VkFormat format, VkExtent2D extent);
+
+  // Parses the spec and opens the output. Prints why and returns false when
+  // it can't.
+  bool Open(const char *spec);
+  // Writes whatever was handed over with Ready() and closes the output.
+  // Slots still on the GPU are lost, wait for them first.
+  void Close();
+
+  // Records the copy of image into the next slot of the ring. The image is
+  // in layout before and after the copy, and has to have been created with
+  // transfer source usage. The returned command buffer goes into the
+  // frame's submission, after the rendering. Returns VK_NULL_HANDLE when the
+  // frame is dropped.
+  VkCommandBuffer Record(VkImage image, VkImageLayout layout, uint32_t *slot);
+
+  // The CPU counterpart of Record(): the next slot of the host ring, to be
+  // filled with the frame, width * height * 4 bytes of the format, then
+  // handed over with Ready(). Returns NULL when the frame is dropped.
+  uint8_t *Map(uint32_t *slot);
+
+  // The GPU is done with the submission holding slot's command buffer, or
+  // the CPU with the slot's memory.
+  void Ready(uint32_t slot);
+
+  Stats GetStats();
+
+private:
+  enum Mode { MODE_YUV, MODE_PNG, MODE_PIPE };
+
+  enum SlotState {
+    SLOT_FREE,
+    SLOT_RECORDED,  // copy submitted or about to be
+    SLOT_READY,     // queued for the worker
+  };
+
+  struct Slot {
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    uint8_t *data;
+    VkCommandBuffer command_buffer;
+    SlotState state = SLOT_FREE;
+    uint64_t frame = 0;
+  };
+
+  // Prints why and returns false, without a device or slots, when there is
+  // no host visible memory
+  bool CreateRing(VkPhysicalDevice physical_device, VkDevice device,
+                  uint32_t queue_family, VkFormat format, VkExtent2D extent);
+  static bool SupportedFormat(VkFormat format);
+  // Claims the next slot, NULL when the frame is dropped
+  Slot *Acquire(uint32_t *slot_index);
+  void Run();
+  // Return the number of bytes written, 0 on failure
+  size_t Write(const Slot &slot);
+  size_t WriteYuv(const uint8_t *pixels);
+  size_t WritePng(const uint8_t *pixels, uint64_t frame);
+  size_t WriteRgb(const uint8_t *pixels);
+  void ToRgb(const uint8_t *row, uint8_t *rgb);
+
+  VkDevice device_;
+  VkFormat format_;
+  VkExtent2D extent_;
+  bool drop_when_full_;
+  uint32_t ring_size_;
+  bool coherent_;
+  bool bgra_;
+  VkDeviceSize frame_size_;
+  VkCommandPool command_pool_;
+  // Backs the slots of the host ring
+  std::vector<uint8_t> host_memory_;
+
+  // Render thread only
+  uint32_t next_slot_ = 0;
+  uint64_t next_frame_ = 0;
+
+  // Output, owned by the worker while it runs
+  Mode mode_;
+  std::string target_;
+  FILE *file_ = NULL;
+  std::vector<uint8_t> scratch_;
+  std::vector<uint8_t> png_;
+  // The png: pattern around its conversion, see SplitPattern()
+  std::string png_prefix_;
+  std::string png_number_;
+  std::string png_suffix_;
+
+  // Everything below is protected by mutex_
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Slot> slots_;
+  std::deque<uint32_t> ready_;
+  bool running_ = false;
+  bool failed_ = false;
+  uint64_t frames_ = 0;
+  uint64_t dropped_ = 0;
+  uint64_t bytes_ = 0;
+  double write_seconds_ = 0.0;
+
+  std::thread thread_;
+};
+
+#endif // _FRAME_EXPORT_H
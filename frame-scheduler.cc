@@ -0,0 +1,124 @@
+#include <mutex>
+#include <vector>
+
+#include "frame-scheduler.h"
+
+namespace {
+
+// Way longer than any frame, short enough not to look frozen for good
+const uint64_t kWaitTimeout = 5000000000ull;
+
+}  // namespace
+
+FrameScheduler::FrameScheduler(VkDevice device, const DeviceQueue &queue)
+    : device_(device), queue_(queue) {
+  // Before there is a semaphore to leak
+  if (!vkGetSemaphoreCounterValueKHR || !vkWaitSemaphoresKHR)
+    throw VulkanError(VK_ERROR_EXTENSION_NOT_PRESENT,
+                      "VK_KHR_timeline_semaphore (entry points missing)",
+                      __FILE__, __LINE__);
+
+  VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+  typeInfo.initialValue = 0;
+
+  VkSemaphoreCreateInfo semaphoreInfo = {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+  VK_CHECK_RESULT(vkCreateSemaphore(device_, &semaphoreInfo, NULL, &semaphore_));
+}
+
+FrameScheduler::~FrameScheduler() {
+  try {
+    Wait(last_submitted_);
+    Collect();
+  } catch (const VulkanError &) {
+    // Being torn down after losing the device
+  }
+  vkDestroySemaphore(device_, semaphore_, NULL);
+}
+
+uint64_t FrameScheduler::Submit(const VkSubmitInfo &submit,
+                                const VkDeviceGroupSubmitInfoKHR *group,
+                                uint32_t device_index, VkFence fence) {
+  uint64_t value = last_submitted_ + 1;
+
+  std::vector<VkSemaphore> &semaphores = signal_semaphores_;
+  semaphores.assign(submit.pSignalSemaphores,
+                    submit.pSignalSemaphores + submit.signalSemaphoreCount);
+  semaphores.push_back(semaphore_);
+  // Binary semaphores ignore their value
+  std::vector<uint64_t> &values = signal_values_;
+  values.assign(semaphores.size(), 0);
+  values.back() = value;
+
+  VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+  timelineInfo.signalSemaphoreValueCount = values.size();
+  timelineInfo.pSignalSemaphoreValues = values.data();
+
+  VkSubmitInfo submitInfo = submit;
+  submitInfo.signalSemaphoreCount = semaphores.size();
+  submitInfo.pSignalSemaphores = semaphores.data();
+  submitInfo.pNext = &timelineInfo;
+
+  VkDeviceGroupSubmitInfoKHR groupInfo;
+  std::vector<uint32_t> &indices = signal_indices_;
+  if (group) {
+    groupInfo = *group;
+    indices.assign(group->pSignalSemaphoreDeviceIndices,
+                   group->pSignalSemaphoreDeviceIndices + group->signalSemaphoreCount);
+    indices.push_back(device_index);
+    groupInfo.signalSemaphoreCount = indices.size();
+    groupInfo.pSignalSemaphoreDeviceIndices = indices.data();
+    groupInfo.pNext = NULL;
+    timelineInfo.pNext = &groupInfo;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(*queue_.mutex);
+    VK_CHECK_RESULT(vkQueueSubmit(queue_.queue, 1, &submitInfo, fence));
+  }
+  last_submitted_ = value;
+  return value;
+}
+
+uint64_t FrameScheduler::completed() {
+  if (completed_ < last_submitted_) {
+    uint64_t value;
+    VK_CHECK_RESULT(vkGetSemaphoreCounterValueKHR(device_, semaphore_, &value));
+    completed_ = value;
+  }
+  return completed_;
+}
+
+void FrameScheduler::Wait(uint64_t value) {
+  if (value <= completed_)
+    return;
+  VkSemaphoreWaitInfoKHR waitInfo = {};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &semaphore_;
+  waitInfo.pValues = &value;
+  VkResult result = vkWaitSemaphoresKHR(device_, &waitInfo, kWaitTimeout);
+  if (result == VK_TIMEOUT)
+    throw VulkanError(VK_ERROR_DEVICE_LOST, "vkWaitSemaphoresKHR (timed out)",
+                      __FILE__, __LINE__);
+  if (result != VK_SUCCESS)
+    throw VulkanError(result, "vkWaitSemaphoresKHR", __FILE__, __LINE__);
+  completed_ = value;
+}
+
+void FrameScheduler::Defer(uint64_t value, std::function<void()> fn) {
+  deferred_.insert(std::make_pair(value, std::move(fn)));
+}
+
+void FrameScheduler::Collect() {
+  uint64_t done = completed();
+  while (!deferred_.empty() && deferred_.begin()->first <= done) {
+    std::function<void()> fn = std::move(deferred_.begin()->second);
+    deferred_.erase(deferred_.begin());
+    fn();
+  }
+}
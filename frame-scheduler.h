@@ -0,0 +1,67 @@
+#ifndef _FRAME_SCHEDULER_H
+#define _FRAME_SCHEDULER_H
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "frame-allocator.h"
+#include "vulkan-utils.h"
+
+// Tracks GPU progress on a queue with a VK_KHR_timeline_semaphore: every
+// Submit() signals the next value of a single timeline, so "is the GPU done
+// with X" becomes a comparison against the value of the submission that used
+// X. Resources that can't go away yet are deferred until their value is
+// reached instead of waiting for the queue to drain.
+//
+// Render thread only, except for the queue itself which is locked on submit.
+class FrameScheduler {
+public:
+  FrameScheduler(VkDevice device, const DeviceQueue &queue);
+  // Waits for everything submitted and runs whatever is still deferred. With
+  // the device lost, deferred work is dropped: it all goes with the device.
+  ~FrameScheduler();
+
+  // Submits with the timeline semaphore added to the signal list, returns
+  // the value it signals. group, when not NULL, replaces submit.pNext and
+  // device_index is the device of the group signalling the timeline.
+  uint64_t Submit(const VkSubmitInfo &submit,
+                  const VkDeviceGroupSubmitInfoKHR *group = NULL,
+                  uint32_t device_index = 0, VkFence fence = VK_NULL_HANDLE);
+
+  // Value of the most recent Submit(), 0 before the first one.
+  uint64_t last_submitted() const { return last_submitted_; }
+  // Largest value the GPU is known to have reached.
+  uint64_t completed();
+
+  // Blocks until the GPU reaches value. Cheap when it already has. A GPU
+  // that hangs for seconds is treated as lost.
+  void Wait(uint64_t value);
+
+  // Runs fn from Collect() once the GPU reaches value.
+  void Defer(uint64_t value, std::function<void()> fn);
+  void Collect();
+
+private:
+  typedef std::pair<const uint64_t, std::function<void()>> Deferred;
+
+  VkDevice device_;
+  DeviceQueue queue_;
+  VkSemaphore semaphore_;
+  uint64_t last_submitted_ = 0;
+  uint64_t completed_ = 0;
+  // Nodes come from the pool so that deferring doesn't hit the heap
+  PoolSet pools_;
+  std::multimap<uint64_t, std::function<void()>, std::less<uint64_t>,
+                PoolAllocator<Deferred>> deferred_{PoolAllocator<Deferred>(&pools_)};
+
+  // Submit() scratch, kept around for the same reason
+  std::vector<VkSemaphore> signal_semaphores_;
+  std::vector<uint64_t> signal_values_;
+  std::vector<uint32_t> signal_indices_;
+};
+
+#endif // _FRAME_SCHEDULER_H
@@ -0,0 +1,95 @@
+#include <algorithm>
+
+#include "gpu-timeline.h"
+
+namespace {
+
+typedef std::pair<uint64_t, uint64_t> Interval;
+
+// Sorted, non overlapping union of the intervals
+std::vector<Interval> Merge(std::vector<Interval> intervals) {
+  std::sort(intervals.begin(), intervals.end());
+  std::vector<Interval> merged;
+  for (const Interval &i : intervals) {
+    if (!merged.empty() && i.first <= merged.back().second)
+      merged.back().second = std::max(merged.back().second, i.second);
+    else
+      merged.push_back(i);
+  }
+  return merged;
+}
+
+uint64_t Length(const std::vector<Interval> &merged) {
+  uint64_t total = 0;
+  for (const Interval &i : merged)
+    total += i.second - i.first;
+  return total;
+}
+
+uint64_t Intersection(const std::vector<Interval> &a,
+                      const std::vector<Interval> &b) {
+  uint64_t total = 0;
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    uint64_t begin = std::max(a[i].first, b[j].first);
+    uint64_t end = std::min(a[i].second, b[j].second);
+    if (begin < end)
+      total += end - begin;
+    if (a[i].second < b[j].second)
+      i++;
+    else
+      j++;
+  }
+  return total;
+}
+
+}  // namespace
+
+void GpuTimeline::Add(Track track, uint64_t begin, uint64_t end,
+                      uint32_t valid_bits) {
+  if (valid_bits == 0)
+    return;
+  if (valid_bits < 64) {
+    uint64_t mask = (1ull << valid_bits) - 1;
+    begin &= mask;
+    end &= mask;
+  }
+  // Wrapped around, not worth reconstructing
+  if (end < begin)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Interval> &intervals = tracks_[track];
+  if (intervals.size() == kMaxIntervals)
+    intervals.erase(intervals.begin(), intervals.begin() + kMaxIntervals / 2);
+  intervals.push_back(Interval(begin, end));
+}
+
+void GpuTimeline::Summary(double busy_ms[TRACK_COUNT],
+                          double overlap_ms[TRACK_COUNT]) {
+  std::vector<Interval> merged[TRACK_COUNT];
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int t = 0; t < TRACK_COUNT; ++t)
+      merged[t] = Merge(tracks_[t]);
+  }
+  double ms = period_ / 1e6;
+  for (int t = 0; t < TRACK_COUNT; ++t) {
+    busy_ms[t] = Length(merged[t]) * ms;
+    overlap_ms[t] = Intersection(merged[t], merged[GRAPHICS]) * ms;
+  }
+}
+
+void GpuTimeline::Print(FILE *out) {
+  static const char *names[TRACK_COUNT] = {"graphics", "transfer", "compute"};
+  double busy[TRACK_COUNT], overlap[TRACK_COUNT];
+  Summary(busy, overlap);
+  fprintf(out, "GPU queues (ms busy, overlapping graphics):\n");
+  for (int t = 0; t < TRACK_COUNT; ++t) {
+    if (t == GRAPHICS)
+      fprintf(out, "  %-10s %10.3f\n", names[t], busy[t]);
+    else
+      fprintf(out, "  %-10s %10.3f %10.3f (%.0f%%)\n", names[t], busy[t],
+              overlap[t], busy[t] > 0.0 ? 100.0 * overlap[t] / busy[t] : 0.0);
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef _GPU_TIMELINE_H
+#define _GPU_TIMELINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Busy intervals of the GPU queues, from timestamp queries, to see how much
+// work on the transfer and compute queues actually overlaps rendering.
+// Timestamps from different queues of a same device are assumed to share a
+// time base, which is what the drivers we care about do.
+class GpuTimeline {
+public:
+  enum Track {
+    GRAPHICS,
+    TRANSFER,
+    COMPUTE,
+    TRACK_COUNT
+  };
+
+  // timestamp_period is VkPhysicalDeviceLimits::timestampPeriod
+  explicit GpuTimeline(float timestamp_period) : period_(timestamp_period) {
+    // Add() is called every frame, it shouldn't allocate
+    for (std::vector<Interval> &intervals : tracks_)
+      intervals.reserve(kMaxIntervals);
+  }
+
+  // Raw timestamps as returned by vkGetQueryPoolResults, valid_bits is the
+  // queue family timestampValidBits. Thread safe.
+  void Add(Track track, uint64_t begin, uint64_t end, uint32_t valid_bits);
+
+  // Milliseconds each track was busy and how much of that overlapped with
+  // GRAPHICS.
+  void Summary(double busy_ms[TRACK_COUNT], double overlap_ms[TRACK_COUNT]);
+  void Print(FILE *out);
+
+private:
+  typedef std::pair<uint64_t, uint64_t> Interval;
+
+  // Only the most recent intervals are kept around
+  static const size_t kMaxIntervals = 1 << 14;
+
+  std::mutex mutex_;
+  float period_;
+  std::vector<Interval> tracks_[TRACK_COUNT];
+};
+
+#endif // _GPU_TIMELINE_H
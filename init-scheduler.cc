@@ -0,0 +1,107 @@
+#include <assert.h>
+#include <algorithm>
+#include <thread>
+
+#include "init-scheduler.h"
+
+InitScheduler::Task InitScheduler::Add(const char *name,
+                                       std::function<void()> fn,
+                                       std::initializer_list<Task> deps) {
+  Task task = nodes_.size();
+  Node node;
+  node.name = name;
+  node.fn = fn;
+  node.deps = deps.size();
+  node.worker = 0;
+  nodes_.push_back(node);
+  for (Task dep : deps) {
+    assert(dep < task);
+    nodes_[dep].dependents.push_back(task);
+  }
+  return task;
+}
+
+void InitScheduler::Run(unsigned threads) {
+  threads_ = std::max(threads, 1u);
+  start_ = Clock::now();
+  done_ = 0;
+  ready_.clear();
+  error_ = NULL;
+  for (Task t = 0; t < nodes_.size(); ++t) {
+    if (nodes_[t].deps == 0)
+      ready_.push_back(t);
+  }
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads_; ++i)
+    workers.push_back(std::thread(&InitScheduler::Work, this, i));
+  Work(0);
+  for (std::thread &worker : workers)
+    worker.join();
+  end_ = Clock::now();
+  if (error_)
+    std::rethrow_exception(error_);
+}
+
+void InitScheduler::Work(unsigned worker) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this]{
+      return !ready_.empty() || done_ == nodes_.size() || error_;
+    });
+    if (ready_.empty() || error_)
+      return;
+
+    // Tasks are added in a sensible serial order, keep following it
+    Task task = ready_.front();
+    ready_.erase(ready_.begin());
+    Node &node = nodes_[task];
+
+    lock.unlock();
+    node.worker = worker;
+    node.start = Clock::now();
+    try {
+      node.fn();
+    } catch (...) {
+      lock.lock();
+      if (!error_)
+        error_ = std::current_exception();
+      cv_.notify_all();
+      return;
+    }
+    node.end = Clock::now();
+    lock.lock();
+
+    done_++;
+    for (Task dependent : node.dependents) {
+      if (--nodes_[dependent].deps == 0)
+        ready_.push_back(dependent);
+    }
+    cv_.notify_all();
+  }
+}
+
+void InitScheduler::PrintReport(FILE *out) const {
+  typedef std::chrono::duration<double, std::milli> Ms;
+
+  std::vector<const Node *> sorted;
+  for (const Node &node : nodes_)
+    sorted.push_back(&node);
+  std::sort(sorted.begin(), sorted.end(), [](const Node *a, const Node *b) {
+    return a->start < b->start;
+  });
+
+  double serial = 0.0;
+  fprintf(out, "Startup phases (ms):\n");
+  fprintf(out, "  %-24s %8s %8s %8s %6s\n", "phase", "start", "end", "took",
+          "thread");
+  for (const Node *node : sorted) {
+    double took = Ms(node->end - node->start).count();
+    serial += took;
+    fprintf(out, "  %-24s %8.3f %8.3f %8.3f %6u\n", node->name,
+            Ms(node->start - start_).count(), Ms(node->end - start_).count(),
+            took, node->worker);
+  }
+  fprintf(out, "Startup: %.3f ms on %u threads (%.3f ms of work)\n",
+          Ms(end_ - start_).count(), threads_, serial);
+}
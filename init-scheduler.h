@@ -0,0 +1,64 @@
+#ifndef _INIT_SCHEDULER_H
+#define _INIT_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+
+// Runs the startup steps as a dependency graph on a few threads, so that
+// independent work (X11 round-trips, instance creation, file reads, pipeline
+// compilation, uploads...) overlaps. Every step is timed for the report.
+class InitScheduler {
+public:
+  typedef uint32_t Task;
+
+  InitScheduler() {}
+
+  // The task runs once all of deps are done.
+  Task Add(const char *name, std::function<void()> fn,
+           std::initializer_list<Task> deps = {});
+
+  // Blocks until every task has run. The calling thread works too. When a
+  // task throws no other task starts, and Run() rethrows once the running
+  // ones are done.
+  void Run(unsigned threads);
+
+  // Per step start, end and duration in milliseconds since Run().
+  void PrintReport(FILE *out) const;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Node {
+    const char *name;
+    std::function<void()> fn;
+    std::vector<Task> dependents;
+    uint32_t deps;
+    Clock::time_point start;
+    Clock::time_point end;
+    unsigned worker;
+  };
+
+  void Work(unsigned worker);
+
+  std::vector<Node> nodes_;
+
+  // Run() state
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Task> ready_;
+  size_t done_ = 0;
+  std::exception_ptr error_;
+
+  Clock::time_point start_;
+  Clock::time_point end_;
+  unsigned threads_ = 0;
+};
+
+#endif // _INIT_SCHEDULER_H
@@ -0,0 +1,213 @@
+// CPU only checks of the mesh simplifier on height fields over the unit
+// square: a flat one and a curved one, simplified into LOD chains.
+//
+//   - the flat grid simplifies with next to no error
+//   - every level's error bounds how far the original vertices are from the
+//     level's surface, which is what SelectLod() relies on
+//   - errors never decrease down the chain
+//   - the outline stays: the corners are kept, boundary edges stay on the
+//     sides of the square and the area covered doesn't change
+//   - no triangle is flipped
+//
+// Usage: mesh-lod-test, exits with 1 when a check fails.
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "mesh-lod.h"
+
+// Vertices per side of the grids
+#define GRID_SIZE 33
+
+static int failures = 0;
+
+static void Check(bool ok, const char *format, ...) {
+  if (ok)
+    return;
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "FAILED: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  failures++;
+}
+
+struct Grid {
+  std::vector<float> positions;   // x, y, z
+  std::vector<uint32_t> indices;  // counter clockwise seen from +z
+};
+
+static Grid MakeGrid(std::function<float(float, float)> height) {
+  Grid grid;
+  for (int y = 0; y < GRID_SIZE; ++y) {
+    for (int x = 0; x < GRID_SIZE; ++x) {
+      float u = x / (float) (GRID_SIZE - 1), v = y / (float) (GRID_SIZE - 1);
+      grid.positions.insert(grid.positions.end(), {u, v, height(u, v)});
+    }
+  }
+  for (uint32_t y = 0; y + 1 < GRID_SIZE; ++y) {
+    for (uint32_t x = 0; x + 1 < GRID_SIZE; ++x) {
+      uint32_t i = y * GRID_SIZE + x;
+      grid.indices.insert(grid.indices.end(), {i, i + 1, i + GRID_SIZE + 1,
+                                               i, i + GRID_SIZE + 1, i + GRID_SIZE});
+    }
+  }
+  return grid;
+}
+
+static const float *Vertex(const Grid &grid, uint32_t i) {
+  return &grid.positions[i * 3];
+}
+
+static double SegmentDistance(const double p[3], const double a[3], const double b[3]) {
+  double ab[3], ap[3], t = 0.0, length2 = 0.0;
+  for (int k = 0; k < 3; ++k) {
+    ab[k] = b[k] - a[k];
+    ap[k] = p[k] - a[k];
+    t += ap[k] * ab[k];
+    length2 += ab[k] * ab[k];
+  }
+  t = length2 > 0.0 ? std::min(std::max(t / length2, 0.0), 1.0) : 0.0;
+  double d2 = 0.0;
+  for (int k = 0; k < 3; ++k)
+    d2 += (ap[k] - t * ab[k]) * (ap[k] - t * ab[k]);
+  return sqrt(d2);
+}
+
+// Closest point by barycentric coordinates when it falls inside, else the
+// closest edge
+static double TriangleDistance(const double p[3], const double a[3],
+                               const double b[3], const double c[3]) {
+  double e0[3], e1[3], ap[3];
+  for (int k = 0; k < 3; ++k) {
+    e0[k] = b[k] - a[k];
+    e1[k] = c[k] - a[k];
+    ap[k] = p[k] - a[k];
+  }
+  double d00 = 0, d01 = 0, d11 = 0, d20 = 0, d21 = 0;
+  for (int k = 0; k < 3; ++k) {
+    d00 += e0[k] * e0[k];
+    d01 += e0[k] * e1[k];
+    d11 += e1[k] * e1[k];
+    d20 += ap[k] * e0[k];
+    d21 += ap[k] * e1[k];
+  }
+  double denominator = d00 * d11 - d01 * d01;
+  if (denominator > 0.0) {
+    double v = (d11 * d20 - d01 * d21) / denominator;
+    double w = (d00 * d21 - d01 * d20) / denominator;
+    if (v >= 0.0 && w >= 0.0 && v + w <= 1.0) {
+      double d2 = 0.0;
+      for (int k = 0; k < 3; ++k) {
+        double q = a[k] + v * e0[k] + w * e1[k];
+        d2 += (p[k] - q) * (p[k] - q);
+      }
+      return sqrt(d2);
+    }
+  }
+  return std::min(SegmentDistance(p, a, b),
+                  std::min(SegmentDistance(p, b, c), SegmentDistance(p, c, a)));
+}
+
+// Largest distance of an original vertex to the level's surface
+static double Deviation(const Grid &grid, const uint32_t *level, uint32_t count) {
+  double deviation = 0.0;
+  for (size_t v = 0; v < grid.positions.size() / 3; ++v) {
+    double p[3] = {Vertex(grid, v)[0], Vertex(grid, v)[1], Vertex(grid, v)[2]};
+    double nearest = HUGE_VAL;
+    for (uint32_t t = 0; t < count; t += 3) {
+      double corners[3][3];
+      for (int k = 0; k < 3; ++k)
+        for (int j = 0; j < 3; ++j)
+          corners[k][j] = Vertex(grid, level[t + k])[j];
+      nearest = std::min(nearest, TriangleDistance(p, corners[0], corners[1], corners[2]));
+    }
+    deviation = std::max(deviation, nearest);
+  }
+  return deviation;
+}
+
+static bool OnSide(const float *a, const float *b) {
+  for (int k = 0; k < 2; ++k) {
+    if ((a[k] == 0.0f && b[k] == 0.0f) || (a[k] == 1.0f && b[k] == 1.0f))
+      return true;
+  }
+  return false;
+}
+
+static void CheckChain(const char *name, const Grid &grid, bool flat) {
+  MeshPositions positions = {grid.positions.data(), 3, 3,
+                             grid.positions.size() / 3};
+  LodChain chain;
+  BuildLodChain(positions, grid.indices, 6, 0.5f, &chain);
+  Check(chain.levels.size() > 2, "%s: only %zu levels", name, chain.levels.size());
+
+  for (size_t i = 0; i < chain.levels.size(); ++i) {
+    const LodLevel &level = chain.levels[i];
+    const uint32_t *indices = &chain.indices[level.first_index];
+    double deviation = Deviation(grid, indices, level.index_count);
+    printf("%s level %zu: %u triangles, error %.6f, deviation %.6f\n", name, i,
+           level.index_count / 3, level.error, deviation);
+
+    if (flat)
+      Check(level.error < 1e-5f, "%s level %zu: error %g on a flat grid", name, i,
+            level.error);
+    Check(deviation <= level.error * 1.0001 + 1e-6,
+          "%s level %zu: deviation %g beyond error %g", name, i, deviation, level.error);
+    if (i > 0)
+      Check(level.error >= chain.levels[i - 1].error,
+            "%s level %zu: error decreases from %g to %g", name, i,
+            chain.levels[i - 1].error, level.error);
+
+    // Seen from +z every triangle stays counter clockwise and together
+    // they still cover the square exactly
+    double area = 0.0;
+    for (uint32_t t = 0; t < level.index_count; t += 3) {
+      const float *a = Vertex(grid, indices[t]);
+      const float *b = Vertex(grid, indices[t + 1]);
+      const float *c = Vertex(grid, indices[t + 2]);
+      double signedArea = 0.5 * ((b[0] - a[0]) * (c[1] - a[1]) -
+                                 (c[0] - a[0]) * (b[1] - a[1]));
+      Check(signedArea > 0.0, "%s level %zu: triangle %u flipped", name, i, t / 3);
+      area += signedArea;
+    }
+    Check(fabs(area - 1.0) < 1e-5, "%s level %zu: covers %g instead of 1", name, i, area);
+
+    // Edges used once are the boundary, they have to run along the sides
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    for (uint32_t t = 0; t < level.index_count; t += 3)
+      for (int k = 0; k < 3; ++k)
+        edges.push_back(std::make_pair(indices[t + k], indices[t + (k + 1) % 3]));
+    std::sort(edges.begin(), edges.end());
+    for (const auto &edge : edges) {
+      if (std::binary_search(edges.begin(), edges.end(),
+                             std::make_pair(edge.second, edge.first)))
+        continue;
+      Check(OnSide(Vertex(grid, edge.first), Vertex(grid, edge.second)),
+            "%s level %zu: boundary edge %u-%u off the sides", name, i,
+            edge.first, edge.second);
+    }
+    uint32_t last = GRID_SIZE - 1;
+    for (uint32_t corner : {0u, last, last * GRID_SIZE, last * GRID_SIZE + last})
+      Check(std::find(indices, indices + level.index_count, corner) !=
+            indices + level.index_count, "%s level %zu: corner %u gone", name, i, corner);
+  }
+}
+
+int main() {
+  CheckChain("flat", MakeGrid([](float, float) { return 0.0f; }), true);
+  CheckChain("curved", MakeGrid([](float x, float y) {
+    return 0.1f * sinf(3.0f * x) * cosf(2.0f * y);
+  }), false);
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,408 @@
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <iterator>
+
+#include "mesh-lod.h"
+
+namespace {
+
+// Boundary edges get a plane perpendicular to their triangle so that the
+// outline doesn't get eaten away, weighted heavier than the surface itself.
+const double kBoundaryWeight = 10.0;
+
+// Cosine of the largest turn of a triangle's normal a collapse can make
+const double kMinFlipCosine = 0.25;
+
+struct Vec3 {
+  double x, y, z;
+};
+
+Vec3 Sub(const Vec3 &a, const Vec3 &b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+double Dot(const Vec3 &a, const Vec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+Vec3 Cross(const Vec3 &a, const Vec3 &b) {
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+double Length(const Vec3 &a) { return sqrt(Dot(a, a)); }
+
+// Sum of squared distances to a set of weighted planes, as
+// p.A.p + 2 b.p + c with A symmetric.
+struct Quadric {
+  double xx = 0, xy = 0, xz = 0, yy = 0, yz = 0, zz = 0;
+  double bx = 0, by = 0, bz = 0;
+  double c = 0;
+  double weight = 0;
+
+  // Plane n.p + d = 0, n normalized
+  void AddPlane(const Vec3 &n, double d, double w) {
+    xx += w * n.x * n.x; xy += w * n.x * n.y; xz += w * n.x * n.z;
+    yy += w * n.y * n.y; yz += w * n.y * n.z; zz += w * n.z * n.z;
+    bx += w * n.x * d; by += w * n.y * d; bz += w * n.z * d;
+    c += w * d * d;
+    weight += w;
+  }
+
+  void Add(const Quadric &q) {
+    xx += q.xx; xy += q.xy; xz += q.xz; yy += q.yy; yz += q.yz; zz += q.zz;
+    bx += q.bx; by += q.by; bz += q.bz;
+    c += q.c;
+    weight += q.weight;
+  }
+
+  double Eval(const Vec3 &p) const {
+    double e = xx * p.x * p.x + yy * p.y * p.y + zz * p.z * p.z +
+               2.0 * (xy * p.x * p.y + xz * p.x * p.z + yz * p.y * p.z) +
+               2.0 * (bx * p.x + by * p.y + bz * p.z) + c;
+    return std::max(e, 0.0);
+  }
+};
+
+struct Collapse {
+  uint32_t from;
+  uint32_t to;
+  double cost; // mean squared distance
+};
+
+std::vector<Vec3> LoadPositions(const MeshPositions &positions) {
+  std::vector<Vec3> p(positions.vertex_count);
+  for (size_t i = 0; i < p.size(); ++i) {
+    const float *v = positions.data + i * positions.stride;
+    p[i].x = v[0];
+    p[i].y = positions.dimensions > 1 ? v[1] : 0.0;
+    p[i].z = positions.dimensions > 2 ? v[2] : 0.0;
+  }
+  return p;
+}
+
+uint64_t EdgeKey(uint32_t a, uint32_t b) { return ((uint64_t) a << 32) | b; }
+
+std::vector<Quadric> BuildQuadrics(const std::vector<Vec3> &p,
+                                   const std::vector<uint32_t> &indices) {
+  std::vector<Quadric> quadrics(p.size());
+
+  // An edge is on the boundary when its opposite half edge doesn't exist
+  std::vector<uint64_t> halfEdges;
+  halfEdges.reserve(indices.size());
+  for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+    for (int k = 0; k < 3; ++k)
+      halfEdges.push_back(EdgeKey(indices[t + k], indices[t + (k + 1) % 3]));
+  }
+  std::sort(halfEdges.begin(), halfEdges.end());
+
+  for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+    const Vec3 &p0 = p[indices[t]];
+    Vec3 n = Cross(Sub(p[indices[t + 1]], p0), Sub(p[indices[t + 2]], p0));
+    double length = Length(n);
+    if (length == 0.0)
+      continue;
+    n = {n.x / length, n.y / length, n.z / length};
+    double area = 0.5 * length;
+    for (int k = 0; k < 3; ++k)
+      quadrics[indices[t + k]].AddPlane(n, -Dot(n, p0), area);
+
+    for (int k = 0; k < 3; ++k) {
+      uint32_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+      if (std::binary_search(halfEdges.begin(), halfEdges.end(), EdgeKey(b, a)))
+        continue;
+      Vec3 edge = Sub(p[b], p[a]);
+      Vec3 side = Cross(edge, n);
+      double sideLength = Length(side);
+      if (sideLength == 0.0)
+        continue;
+      side = {side.x / sideLength, side.y / sideLength, side.z / sideLength};
+      double w = kBoundaryWeight * Dot(edge, edge);
+      quadrics[a].AddPlane(side, -Dot(side, p[a]), w);
+      quadrics[b].AddPlane(side, -Dot(side, p[a]), w);
+    }
+  }
+  return quadrics;
+}
+
+double SegmentDistance(const Vec3 &p, const Vec3 &a, const Vec3 &b) {
+  Vec3 ab = Sub(b, a);
+  double length2 = Dot(ab, ab);
+  double t = length2 > 0.0 ? std::min(std::max(Dot(Sub(p, a), ab) / length2, 0.0), 1.0)
+                           : 0.0;
+  return Length(Sub(p, {a.x + t * ab.x, a.y + t * ab.y, a.z + t * ab.z}));
+}
+
+// Distance from p to the triangle abc
+double TriangleDistance(const Vec3 &p, const Vec3 &a, const Vec3 &b, const Vec3 &c) {
+  Vec3 n = Cross(Sub(b, a), Sub(c, a));
+  double length = Length(n);
+  // Over the inside of the triangle it is the distance to its plane
+  if (length > 0.0 && Dot(Cross(Sub(b, a), Sub(p, a)), n) >= 0.0 &&
+      Dot(Cross(Sub(c, b), Sub(p, b)), n) >= 0.0 &&
+      Dot(Cross(Sub(a, c), Sub(p, c)), n) >= 0.0)
+    return fabs(Dot(Sub(p, a), n)) / length;
+  return std::min(SegmentDistance(p, a, b),
+                  std::min(SegmentDistance(p, b, c), SegmentDistance(p, c, a)));
+}
+
+// Would moving from onto to turn any of the triangles around from over, or
+// tilt one far enough to become a sliver standing on its edge?
+bool Flips(const std::vector<Vec3> &p, const std::vector<uint32_t> &tris,
+           const uint32_t *around, size_t count, uint32_t from, uint32_t to) {
+  for (size_t i = 0; i < count; ++i) {
+    const uint32_t *t = &tris[around[i] * 3];
+    if (t[0] == to || t[1] == to || t[2] == to)
+      continue;
+    Vec3 v[3], w[3];
+    for (int k = 0; k < 3; ++k) {
+      v[k] = p[t[k]];
+      w[k] = p[t[k] == from ? to : t[k]];
+    }
+    Vec3 before = Cross(Sub(v[1], v[0]), Sub(v[2], v[0]));
+    Vec3 after = Cross(Sub(w[1], w[0]), Sub(w[2], w[0]));
+    if (Dot(before, after) <= kMinFlipCosine * Length(before) * Length(after))
+      return true;
+  }
+  return false;
+}
+
+// The link condition: from and to can only share the neighbors across the
+// triangles on their edge, else the collapse folds the mesh onto itself and
+// leaves a hole behind.
+bool Pinches(const std::vector<uint32_t> &tris, const uint32_t *fromAround,
+             size_t fromCount, const uint32_t *toAround, size_t toCount,
+             uint32_t from, uint32_t to) {
+  std::vector<uint32_t> fromNeighbors, toNeighbors;
+  size_t shared = 0;
+  for (size_t i = 0; i < fromCount; ++i) {
+    const uint32_t *t = &tris[fromAround[i] * 3];
+    if (t[0] == to || t[1] == to || t[2] == to)
+      shared++;
+    for (int k = 0; k < 3; ++k) {
+      if (t[k] != from && t[k] != to)
+        fromNeighbors.push_back(t[k]);
+    }
+  }
+  for (size_t i = 0; i < toCount; ++i) {
+    const uint32_t *t = &tris[toAround[i] * 3];
+    for (int k = 0; k < 3; ++k) {
+      if (t[k] != from && t[k] != to)
+        toNeighbors.push_back(t[k]);
+    }
+  }
+  std::sort(fromNeighbors.begin(), fromNeighbors.end());
+  fromNeighbors.erase(std::unique(fromNeighbors.begin(), fromNeighbors.end()),
+                      fromNeighbors.end());
+  std::sort(toNeighbors.begin(), toNeighbors.end());
+  toNeighbors.erase(std::unique(toNeighbors.begin(), toNeighbors.end()),
+                    toNeighbors.end());
+  std::vector<uint32_t> common;
+  std::set_intersection(fromNeighbors.begin(), fromNeighbors.end(),
+                        toNeighbors.begin(), toNeighbors.end(),
+                        std::back_inserter(common));
+  return common.size() > shared;
+}
+
+}  // namespace
+
+float SimplifyMesh(const MeshPositions &positions,
+                   const std::vector<uint32_t> &indices,
+                   size_t target_index_count, float max_error,
+                   std::vector<uint32_t> *result) {
+  std::vector<Vec3> p = LoadPositions(positions);
+  std::vector<Quadric> quadrics = BuildQuadrics(p, indices);
+  std::vector<uint32_t> tris = indices;
+  std::vector<uint32_t> remap(p.size());
+  // What every vertex ended up collapsed into, through all the passes
+  std::vector<uint32_t> target(p.size());
+  for (size_t i = 0; i < p.size(); ++i)
+    target[i] = i;
+  double maxCost = (double) max_error * max_error;
+  double error = 0.0;
+
+  // Every pass collapses as many cheap edges as it can without two
+  // collapses touching the same neighborhood, then rebuilds everything.
+  while (tris.size() > target_index_count) {
+    size_t triangles = tris.size() / 3;
+
+    std::vector<uint32_t> offsets(p.size() + 1, 0);
+    for (uint32_t v : tris)
+      offsets[v + 1]++;
+    for (size_t i = 0; i < p.size(); ++i)
+      offsets[i + 1] += offsets[i];
+    std::vector<uint32_t> around(tris.size());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < tris.size(); ++i)
+      around[fill[tris[i]]++] = i / 3;
+
+    std::vector<uint64_t> halfEdges;
+    halfEdges.reserve(tris.size());
+    for (size_t t = 0; t < triangles; ++t) {
+      for (int k = 0; k < 3; ++k)
+        halfEdges.push_back(EdgeKey(tris[t * 3 + k], tris[t * 3 + (k + 1) % 3]));
+    }
+    std::sort(halfEdges.begin(), halfEdges.end());
+    auto isHalfEdge = [&](uint32_t a, uint32_t b) {
+      return std::binary_search(halfEdges.begin(), halfEdges.end(), EdgeKey(a, b));
+    };
+    // Boundary vertices only slide along the boundary, onto the next one
+    std::vector<bool> boundary(p.size(), false);
+    std::vector<uint64_t> edges;
+    edges.reserve(tris.size() * 2);
+    for (uint64_t key : halfEdges) {
+      uint32_t a = key >> 32, b = (uint32_t) key;
+      if (!isHalfEdge(b, a))
+        boundary[a] = boundary[b] = true;
+      edges.push_back(key);
+      edges.push_back(EdgeKey(b, a));
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    std::vector<Collapse> collapses;
+    collapses.reserve(edges.size());
+    for (uint64_t key : edges) {
+      uint32_t from = key >> 32, to = (uint32_t) key;
+      if (boundary[from] && isHalfEdge(from, to) == isHalfEdge(to, from))
+        continue;
+      Quadric q = quadrics[from];
+      q.Add(quadrics[to]);
+      double cost = q.weight > 0.0 ? q.Eval(p[to]) / q.weight : 0.0;
+      if (cost <= maxCost)
+        collapses.push_back({from, to, cost});
+    }
+    std::sort(collapses.begin(), collapses.end(),
+              [](const Collapse &a, const Collapse &b) { return a.cost < b.cost; });
+
+    for (size_t i = 0; i < p.size(); ++i)
+      remap[i] = i;
+    std::vector<bool> locked(p.size(), false);
+    size_t removed = 0;
+    bool collapsed = false;
+    for (const Collapse &c : collapses) {
+      if ((triangles - removed) * 3 <= target_index_count)
+        break;
+      if (locked[c.from] || locked[c.to])
+        continue;
+      const uint32_t *ring = &around[offsets[c.from]];
+      size_t ringSize = offsets[c.from + 1] - offsets[c.from];
+      if (Flips(p, tris, ring, ringSize, c.from, c.to) ||
+          Pinches(tris, ring, ringSize, &around[offsets[c.to]],
+                  offsets[c.to + 1] - offsets[c.to], c.from, c.to))
+        continue;
+
+      remap[c.from] = c.to;
+      quadrics[c.to].Add(quadrics[c.from]);
+      for (size_t i = 0; i < ringSize; ++i) {
+        const uint32_t *t = &tris[ring[i] * 3];
+        if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+          removed++;
+        for (int k = 0; k < 3; ++k)
+          locked[t[k]] = true;
+      }
+      error = std::max(error, c.cost);
+      collapsed = true;
+    }
+    if (!collapsed)
+      break;
+    // A collapse's to is locked, nothing collapses further within a pass
+    for (uint32_t &t : target)
+      t = remap[t];
+
+    size_t kept = 0;
+    for (size_t t = 0; t < triangles; ++t) {
+      uint32_t a = remap[tris[t * 3]];
+      uint32_t b = remap[tris[t * 3 + 1]];
+      uint32_t c = remap[tris[t * 3 + 2]];
+      if (a == b || b == c || c == a)
+        continue;
+      tris[kept++] = a;
+      tris[kept++] = b;
+      tris[kept++] = c;
+    }
+    tris.resize(kept);
+  }
+
+  // The quadrics measure a weighted mean over planes, boundary ones included,
+  // SelectLod() needs how far the surface moved. Every original vertex is
+  // measured against the triangles now around the vertex it collapsed into,
+  // then walks over to neighboring triangles while they get closer: always
+  // the distance to some triangle of the result, so never less than to the
+  // nearest one, and this bounds it.
+  double deviation = 0.0;
+  if (tris.size() < indices.size()) {
+    std::vector<uint32_t> offsets(p.size() + 1, 0);
+    for (uint32_t v : tris)
+      offsets[v + 1]++;
+    for (size_t i = 0; i < p.size(); ++i)
+      offsets[i + 1] += offsets[i];
+    std::vector<uint32_t> around(tris.size());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < tris.size(); ++i)
+      around[fill[tris[i]]++] = i / 3;
+
+    std::vector<bool> measured(p.size(), false);
+    for (uint32_t v : indices) {
+      uint32_t to = target[v];
+      if (measured[v] || (to == v && offsets[v + 1] > offsets[v]))
+        continue;
+      measured[v] = true;
+      double nearest = DBL_MAX;
+      uint32_t closest = 0;
+      const uint32_t *corners = &to;
+      int cornerCount = 1;
+      for (;;) {
+        bool closer = false;
+        for (int k = 0; k < cornerCount; ++k) {
+          for (uint32_t i = offsets[corners[k]]; i < offsets[corners[k] + 1]; ++i) {
+            const uint32_t *t = &tris[around[i] * 3];
+            double d = TriangleDistance(p[v], p[t[0]], p[t[1]], p[t[2]]);
+            if (d < nearest) {
+              nearest = d;
+              closest = around[i];
+              closer = true;
+            }
+          }
+        }
+        if (!closer)
+          break;
+        corners = &tris[closest * 3];
+        cornerCount = 3;
+      }
+      // Gone with all of its triangles, the quadric is all there is
+      deviation = std::max(deviation, nearest != DBL_MAX ? nearest : sqrt(error));
+    }
+  }
+
+  result->swap(tris);
+  return (float) deviation;
+}
+
+void BuildLodChain(const MeshPositions &positions,
+                   const std::vector<uint32_t> &indices, uint32_t max_levels,
+                   float reduction, LodChain *chain) {
+  chain->indices = indices;
+  chain->levels.clear();
+  chain->levels.push_back({0, (uint32_t) indices.size(), 0.0f});
+
+  // Every level is simplified from the original, so that its error is
+  // measured against the real surface rather than the previous level.
+  size_t count = indices.size();
+  float error = 0.0f;
+  while (chain->levels.size() < max_levels) {
+    size_t target = (size_t) (count / 3 * reduction) * 3;
+    std::vector<uint32_t> level;
+    float levelError = SimplifyMesh(positions, indices, target, FLT_MAX, &level);
+    // Not worth a level if it saves less than 5% of the triangles
+    if (level.empty() || level.size() * 20 > count * 19)
+      break;
+    error = std::max(error, levelError);
+    chain->levels.push_back({(uint32_t) chain->indices.size(),
+                             (uint32_t) level.size(), error});
+    chain->indices.insert(chain->indices.end(), level.begin(), level.end());
+    count = level.size();
+  }
+}
+
+uint32_t SelectLod(const LodChain &chain, float pixels_per_unit,
+                   float max_pixels) {
+  for (uint32_t i = chain.levels.size(); i-- > 1;) {
+    if (chain.levels[i].error * pixels_per_unit <= max_pixels)
+      return i;
+  }
+  return 0;
+}
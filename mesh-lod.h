@@ -0,0 +1,59 @@
+#ifndef _MESH_LOD_H
+#define _MESH_LOD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Levels of detail of an indexed triangle mesh.
+//
+// Simplification is quadric error edge collapse onto existing vertices, so
+// every level indexes the same vertex buffer and only the index lists
+// differ. The levels are stored one after the other in a single index list.
+
+// Where a mesh's positions are: vertex i starts at data + i * stride floats
+// and has dimensions (2 or 3) coordinates, missing ones being 0.
+struct MeshPositions {
+  const float *data;
+  size_t stride;
+  uint32_t dimensions;
+  size_t vertex_count;
+};
+
+struct LodLevel {
+  uint32_t first_index;
+  uint32_t index_count;
+  // How far the level strays from the original surface, in mesh units.
+  // 0 for the full mesh, never decreasing from one level to the next.
+  float error;
+};
+
+struct LodChain {
+  std::vector<uint32_t> indices;
+  std::vector<LodLevel> levels;
+};
+
+// Collapses edges until at most target_index_count indices are left or
+// nothing can be collapsed without exceeding max_error, as estimated by the
+// quadrics. Returns the error of the result: how far the original vertices
+// are from its surface at most. Boundary vertices only move along the
+// boundary and triangles don't flip.
+float SimplifyMesh(const MeshPositions &positions,
+                   const std::vector<uint32_t> &indices,
+                   size_t target_index_count, float max_error,
+                   std::vector<uint32_t> *result);
+
+// Level 0 is the mesh itself, every following level aims at reduction times
+// the triangles of the previous one. Stops after max_levels or as soon as a
+// level doesn't get meaningfully smaller.
+void BuildLodChain(const MeshPositions &positions,
+                   const std::vector<uint32_t> &indices, uint32_t max_levels,
+                   float reduction, LodChain *chain);
+
+// Coarsest level whose error projects to at most max_pixels on screen.
+// pixels_per_unit is how many pixels a mesh unit covers where the instance
+// is, for a perspective projection viewport_height * proj[1][1] / (2 * w).
+uint32_t SelectLod(const LodChain &chain, float pixels_per_unit,
+                   float max_pixels);
+
+#endif // _MESH_LOD_H
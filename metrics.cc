@@ -0,0 +1,328 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "metrics.h"
+
+namespace {
+
+// How long Stop() may wait for the serving thread to notice
+const int kPollMilliseconds = 200;
+// A scraper that doesn't send its request within that is dropped
+const int kRequestSeconds = 1;
+const size_t kMaxRequest = 4096;
+
+void AppendNumber(std::string *out, double value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.9g", value);
+  *out += text;
+}
+
+void AppendNumber(std::string *out, uint64_t value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%lu", (unsigned long) value);
+  *out += text;
+}
+
+// name{labels} or name{labels,extra}, without braces when both are empty
+void AppendSeries(std::string *out, const std::string &name, const char *suffix,
+                  const std::string &labels, const std::string &extra) {
+  *out += name;
+  *out += suffix;
+  if (labels.empty() && extra.empty())
+    return;
+  *out += '{';
+  *out += labels;
+  if (!labels.empty() && !extra.empty())
+    *out += ',';
+  *out += extra;
+  *out += '}';
+}
+
+bool SendAll(int connection, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(connection, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+}  // namespace
+
+Metrics::Histogram::Histogram(const std::vector<double> &bounds)
+  : bounds_(bounds), counts_(new std::atomic<uint64_t>[bounds.size() + 1]) {
+  for (size_t i = 0; i <= bounds_.size(); ++i)
+    counts_[i].store(0, std::memory_order_relaxed);
+}
+
+void Metrics::Histogram::Observe(double value) {
+  size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+    bounds_.begin();
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  double sum = sum_.load(std::memory_order_relaxed);
+  while (!sum_.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed))
+    ;
+}
+
+void Metrics::Histogram::Snapshot(std::vector<uint64_t> *counts,
+                                  double *sum) const {
+  counts->resize(bounds_.size() + 1);
+  for (size_t i = 0; i <= bounds_.size(); ++i)
+    (*counts)[i] = counts_[i].load(std::memory_order_relaxed);
+  *sum = sum_.load(std::memory_order_relaxed);
+}
+
+Metrics::~Metrics() {
+  Stop();
+}
+
+Metrics::Entry *Metrics::Add(const char *name, const char *help,
+                             const char *labels, Kind kind) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const std::unique_ptr<Entry> &entry : entries_) {
+    if (entry->name == name && entry->kind != kind) {
+      fprintf(stderr, "Metric %s registered as two kinds\n", name);
+      abort();
+    }
+  }
+  Entry *entry = new Entry;
+  entry->name = name;
+  entry->help = help;
+  entry->labels = labels;
+  entry->kind = kind;
+  entries_.emplace_back(entry);
+  return entry;
+}
+
+Metrics::Counter *Metrics::AddCounter(const char *name, const char *help,
+                                      const char *labels) {
+  Counter *counter = new Counter;
+  Add(name, help, labels, KIND_COUNTER)->counter.reset(counter);
+  return counter;
+}
+
+Metrics::Gauge *Metrics::AddGauge(const char *name, const char *help,
+                                  const char *labels) {
+  Gauge *gauge = new Gauge;
+  Add(name, help, labels, KIND_GAUGE)->gauge.reset(gauge);
+  return gauge;
+}
+
+Metrics::Histogram *Metrics::AddHistogram(const char *name, const char *help,
+                                          const std::vector<double> &bounds,
+                                          const char *labels) {
+  Histogram *histogram = new Histogram(bounds);
+  Add(name, help, labels, KIND_HISTOGRAM)->histogram.reset(histogram);
+  return histogram;
+}
+
+std::vector<double> Metrics::ExponentialBounds(double start, double factor,
+                                               uint32_t count) {
+  std::vector<double> bounds(count);
+  for (uint32_t i = 0; i < count; ++i, start *= factor)
+    bounds[i] = start;
+  return bounds;
+}
+
+std::string Metrics::Format() {
+  static const char *kTypes[] = {"counter", "gauge", "histogram"};
+  std::string out;
+  std::vector<uint64_t> counts;
+  std::lock_guard<std::mutex> lock(mutex_);
+  // A family's series go together, under its first HELP and TYPE
+  std::vector<bool> done(entries_.size(), false);
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (done[i])
+      continue;
+    const Entry &first = *entries_[i];
+    out += "# HELP " + first.name + " " + first.help + "\n";
+    out += "# TYPE " + first.name + " " + kTypes[first.kind] + "\n";
+    for (size_t j = i; j < entries_.size(); ++j) {
+      const Entry &entry = *entries_[j];
+      if (done[j] || entry.name != first.name)
+        continue;
+      done[j] = true;
+      if (entry.kind == KIND_COUNTER) {
+        AppendSeries(&out, entry.name, "", entry.labels, "");
+        out += ' ';
+        AppendNumber(&out, entry.counter->value());
+        out += '\n';
+      } else if (entry.kind == KIND_GAUGE) {
+        AppendSeries(&out, entry.name, "", entry.labels, "");
+        out += ' ';
+        AppendNumber(&out, entry.gauge->value());
+        out += '\n';
+      } else {
+        double sum;
+        entry.histogram->Snapshot(&counts, &sum);
+        const std::vector<double> &bounds = entry.histogram->bounds();
+        uint64_t total = 0;
+        for (size_t b = 0; b < counts.size(); ++b) {
+          total += counts[b];
+          std::string le = "le=\"";
+          if (b < bounds.size())
+            AppendNumber(&le, bounds[b]);
+          else
+            le += "+Inf";
+          le += '"';
+          AppendSeries(&out, entry.name, "_bucket", entry.labels, le);
+          out += ' ';
+          AppendNumber(&out, total);
+          out += '\n';
+        }
+        AppendSeries(&out, entry.name, "_sum", entry.labels, "");
+        out += ' ';
+        AppendNumber(&out, sum);
+        out += '\n';
+        AppendSeries(&out, entry.name, "_count", entry.labels, "");
+        out += ' ';
+        AppendNumber(&out, total);
+        out += '\n';
+      }
+    }
+  }
+  return out;
+}
+
+bool Metrics::Serve(const char *spec) {
+  Stop();
+
+  const char *colon = strchr(spec, ':');
+  std::string kind = colon ? std::string(spec, colon - spec) : "";
+  std::string target = colon ? colon + 1 : "";
+  if (target.empty()) {
+    fprintf(stderr, "Bad metrics spec %s, expected unix:<path> or tcp:<port>\n", spec);
+    return false;
+  }
+
+  if (kind == "unix") {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (target.size() >= sizeof(address.sun_path)) {
+      fprintf(stderr, "Metrics socket path too long: %s\n", target.c_str());
+      return false;
+    }
+    strcpy(address.sun_path, target.c_str());
+    // Left behind by a previous run, anything else is not ours to remove
+    struct stat info;
+    if (stat(target.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+      unlink(target.c_str());
+    socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_ >= 0 &&
+        bind(socket_, (const sockaddr *) &address, sizeof(address)) == 0)
+      unix_path_ = target;
+    else if (socket_ >= 0) {
+      close(socket_);
+      socket_ = -1;
+    }
+  } else if (kind == "tcp") {
+    char *end;
+    unsigned long port = strtoul(target.c_str(), &end, 10);
+    if (*end || port == 0 || port > 65535) {
+      fprintf(stderr, "Bad metrics port %s\n", target.c_str());
+      return false;
+    }
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socket_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (socket_ >= 0)
+      setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (socket_ >= 0 &&
+        bind(socket_, (const sockaddr *) &address, sizeof(address)) != 0) {
+      close(socket_);
+      socket_ = -1;
+    }
+  } else {
+    fprintf(stderr, "Unknown metrics kind %s\n", kind.c_str());
+    return false;
+  }
+  if (socket_ < 0 || listen(socket_, 4) != 0) {
+    fprintf(stderr, "Can't serve metrics on %s: %s\n", spec, strerror(errno));
+    Stop();
+    return false;
+  }
+
+  fprintf(stdout, "Serving metrics on %s\n", spec);
+  running_ = true;
+  thread_ = std::thread(&Metrics::Run, this);
+  return true;
+}
+
+void Metrics::Stop() {
+  running_ = false;
+  if (thread_.joinable())
+    thread_.join();
+  if (socket_ >= 0)
+    close(socket_);
+  socket_ = -1;
+  if (!unix_path_.empty())
+    unlink(unix_path_.c_str());
+  unix_path_.clear();
+}
+
+// One scraper at a time, a scrape is a few kilobytes
+void Metrics::Run() {
+  while (running_) {
+    pollfd listening = {socket_, POLLIN, 0};
+    if (poll(&listening, 1, kPollMilliseconds) <= 0)
+      continue;
+    int connection = accept4(socket_, NULL, NULL, SOCK_CLOEXEC);
+    if (connection < 0)
+      continue;
+    Answer(connection);
+    close(connection);
+  }
+}
+
+void Metrics::Answer(int connection) {
+  timeval timeout = {kRequestSeconds, 0};
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // Whatever the path, up to the end of the headers
+  std::string request;
+  char buffer[512];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < kMaxRequest) {
+    ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return;
+    request.append(buffer, received);
+  }
+
+  std::string body;
+  const char *status = "200 OK";
+  if (request.compare(0, 4, "GET ") == 0 || request.compare(0, 5, "HEAD ") == 0)
+    body = Format();
+  else
+    status = "405 Method Not Allowed";
+  char header[160];
+  snprintf(header, sizeof(header),
+           "HTTP/1.0 %s\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: %lu\r\n"
+           "Connection: close\r\n\r\n",
+           status, (unsigned long) body.size());
+  if (SendAll(connection, header, strlen(header)) &&
+      request.compare(0, 5, "HEAD ") != 0)
+    SendAll(connection, body.data(), body.size());
+}
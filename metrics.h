@@ -0,0 +1,111 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counters, gauges and histograms of a running renderer, for monitoring.
+//
+// Metrics are registered once, at setup, and the pointers returned are
+// updated from the render loop: every update is a relaxed atomic, no lock
+// and no allocation. Serve() starts a thread answering HTTP requests with
+// all of them in the Prometheus text format, on
+//   unix:<path>      a Unix domain socket, e.g. curl --unix-socket <path> x
+//   tcp:<port>       127.0.0.1 only
+// Only the serving thread and registration take the lock, the render
+// thread never waits for a scrape.
+class Metrics {
+public:
+  class Counter {
+  public:
+    void Add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<uint64_t> value_{0};
+  };
+
+  class Gauge {
+  public:
+    void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<double> value_{0.0};
+  };
+
+  class Histogram {
+  public:
+    // bounds are the upper bounds of the buckets, increasing. Values above
+    // the last one land in the +Inf bucket.
+    explicit Histogram(const std::vector<double> &bounds);
+
+    void Observe(double value);
+
+    // Per bucket, not cumulative, bounds().size() + 1 of them
+    void Snapshot(std::vector<uint64_t> *counts, double *sum) const;
+    const std::vector<double> &bounds() const { return bounds_; }
+
+  private:
+    std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    std::atomic<double> sum_{0.0};
+  };
+
+  Metrics() = default;
+  ~Metrics();
+
+  // name is the Prometheus one, e.g. triangle_frames_total, labels what
+  // goes between the braces, e.g. heap="0". Metrics sharing a name are the
+  // same family and must be of the same kind.
+  Counter *AddCounter(const char *name, const char *help, const char *labels = "");
+  Gauge *AddGauge(const char *name, const char *help, const char *labels = "");
+  Histogram *AddHistogram(const char *name, const char *help,
+                          const std::vector<double> &bounds,
+                          const char *labels = "");
+
+  // Every metric, in the Prometheus text exposition format
+  std::string Format();
+
+  // Opens the socket and starts serving. Prints why and returns false when
+  // it can't.
+  bool Serve(const char *spec);
+  void Stop();
+
+  // Bucket bounds growing by factor from start, count of them
+  static std::vector<double> ExponentialBounds(double start, double factor,
+                                               uint32_t count);
+
+private:
+  enum Kind { KIND_COUNTER, KIND_GAUGE, KIND_HISTOGRAM };
+
+  struct Entry {
+    std::string name;
+    std::string help;
+    std::string labels;
+    Kind kind;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+  };
+
+  Entry *Add(const char *name, const char *help, const char *labels, Kind kind);
+  void Run();
+  void Answer(int connection);
+
+  int socket_ = -1;
+  std::string unix_path_;
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+
+  // Protects entries_, not what they point to
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Entry>> entries_;
+};
+
+#endif // _METRICS_H
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <chrono>
+
+#include "pipeline-variants.h"
+#include "vulkan-utils.h"
+
+uint64_t PipelineKey::Hash() const {
+  // FNV-1a over the fields, not the bytes, padding is garbage
+  const uint64_t fields[] = {
+    features, (uint64_t) topology, cull_mode, (uint64_t) front_face,
+    blend_enable,
+  };
+  uint64_t hash = 14695981039346656037ull;
+  for (uint64_t field : fields) {
+    for (int i = 0; i < 8; ++i) {
+      hash ^= (field >> (i * 8)) & 0xff;
+      hash *= 1099511628211ull;
+    }
+  }
+  return hash;
+}
+
+PipelineVariants::PipelineVariants(VkDevice device, Builder builder)
+  : device_(device), builder_(builder) {
+  VkPipelineCacheCreateInfo cacheInfo = {};
+  cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  VK_CHECK_RESULT(vkCreatePipelineCache(device_, &cacheInfo, NULL, &cache_));
+  thread_ = std::thread(&PipelineVariants::Run, this);
+}
+
+PipelineVariants::~PipelineVariants() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  cv_.notify_one();
+  thread_.join();
+  for (auto &it : variants_) {
+    if (it.second.pipeline != VK_NULL_HANDLE)
+      vkDestroyPipeline(device_, it.second.pipeline, NULL);
+  }
+  vkDestroyPipelineCache(device_, cache_, NULL);
+}
+
+PipelineKey PipelineVariants::GenericKey(const PipelineKey &key) {
+  PipelineKey generic = key;
+  generic.features = PIPELINE_FEATURES_GENERIC;
+  return generic;
+}
+
+void PipelineVariants::Prepare(const PipelineKey &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CheckError();
+  GetGeneric(key);
+  Queue(key);
+}
+
+VkPipeline PipelineVariants::Get(const PipelineKey &key, bool *specialized) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CheckError();
+  auto it = variants_.find(key);
+  if (it != variants_.end() && it->second.pipeline != VK_NULL_HANDLE) {
+    if (specialized)
+      *specialized = true;
+    return it->second.pipeline;
+  }
+  Queue(key);
+  ++fallbacks_;
+  if (specialized)
+    *specialized = false;
+  return GetGeneric(key);
+}
+
+bool PipelineVariants::Ready(const PipelineKey &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CheckError();
+  auto it = variants_.find(key);
+  return it != variants_.end() && it->second.pipeline != VK_NULL_HANDLE;
+}
+
+PipelineVariants::Stats PipelineVariants::GetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = {};
+  for (auto &it : variants_) {
+    if (it.second.pipeline != VK_NULL_HANDLE)
+      ++stats.variants;
+  }
+  stats.pending = queue_.size() + (compiling_ ? 1 : 0);
+  stats.fallbacks = fallbacks_;
+  stats.compile_seconds = compile_seconds_;
+  return stats;
+}
+
+VkPipeline PipelineVariants::GetGeneric(const PipelineKey &key) {
+  // Only when a new fixed function state shows up, which Prepare() is for.
+  // The compile thread waits meanwhile, it would be competing for the
+  // cache anyway.
+  Variant &generic = variants_[GenericKey(key)];
+  if (generic.pipeline == VK_NULL_HANDLE)
+    generic.pipeline = builder_(cache_, key, PIPELINE_FEATURES_GENERIC);
+  return generic.pipeline;
+}
+
+void PipelineVariants::Queue(const PipelineKey &key) {
+  Variant &variant = variants_[key];
+  if (variant.queued || key.features == PIPELINE_FEATURES_GENERIC)
+    return;
+  variant.queued = true;
+  queue_.push_back(key);
+  cv_.notify_one();
+}
+
+void PipelineVariants::CheckError() {
+  if (error_ != VK_SUCCESS)
+    throw VulkanError(error_, "pipeline compilation", __FILE__, __LINE__);
+}
+
+void PipelineVariants::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    if (queue_.empty()) {
+      cv_.wait(lock, [this]{ return !running_ || !queue_.empty(); });
+      continue;
+    }
+    PipelineKey key = queue_.front();
+    queue_.pop_front();
+    compiling_ = true;
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult error = VK_SUCCESS;
+    try {
+      pipeline = builder_(cache_, key, key.features);
+    } catch (const VulkanError &e) {
+      fprintf(stderr, "Pipeline compilation stopped: %s\n", e.what());
+      error = e.result();
+    }
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    lock.lock();
+    compiling_ = false;
+    if (error != VK_SUCCESS) {
+      // The render thread throws it, the variants go away with the device
+      error_ = error;
+      return;
+    }
+    variants_[key].pipeline = pipeline;
+    compile_seconds_ += seconds;
+  }
+}
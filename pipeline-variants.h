@@ -0,0 +1,114 @@
+#ifndef _PIPELINE_VARIANTS_H
+#define _PIPELINE_VARIANTS_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <vulkan/vulkan.h>
+
+// Value of the features specialization constant of the generic variants,
+// which read the features from a push constant instead.
+#define PIPELINE_FEATURES_GENERIC 0x80000000u
+
+// What tells pipeline variants apart. features is up to the shaders, they
+// get it as specialization constant 0 and branch on it, which the driver
+// folds away when it compiles the variant.
+struct PipelineKey {
+  uint32_t features;
+  VkPrimitiveTopology topology;
+  VkCullModeFlags cull_mode;
+  VkFrontFace front_face;
+  VkBool32 blend_enable;
+
+  bool operator==(const PipelineKey &other) const {
+    return features == other.features && topology == other.topology &&
+      cull_mode == other.cull_mode && front_face == other.front_face &&
+      blend_enable == other.blend_enable;
+  }
+  uint64_t Hash() const;
+};
+
+// Pipeline variants, compiled when first asked for.
+//
+// Specializing the shaders per feature set makes for fast shaders, but
+// compiling every combination up front doesn't scale and compiling one on
+// first use hitches. Instead every fixed function state has a generic
+// variant, whose shaders branch on the features at runtime, compiled
+// synchronously. Specialized variants compile on a background thread and
+// Get() hands out the generic one until they're ready, callers record again
+// once Ready() says so. Compilations share a pipeline cache.
+//
+// Thread safe. Errors of the compile thread are thrown by the next Get()
+// or Ready().
+class PipelineVariants {
+public:
+  struct Stats {
+    uint32_t variants;        // compiled, generic ones included
+    uint32_t pending;         // queued or compiling
+    uint64_t fallbacks;       // Get() answered with a generic variant
+    double compile_seconds;   // background compilation
+  };
+
+  // Makes the pipeline of key, with features as the value of the
+  // specialization constant. Called from the compile thread too.
+  typedef std::function<VkPipeline(VkPipelineCache cache, const PipelineKey &key,
+                                   uint32_t features)> Builder;
+
+  PipelineVariants(VkDevice device, Builder builder);
+  // Waits for the compilation in progress. The GPU has to be done with the
+  // pipelines.
+  ~PipelineVariants();
+
+  // Compiles the generic variant of key now unless it is there already,
+  // and queues the specialized one. For startup, so that nothing compiles
+  // synchronously later.
+  void Prepare(const PipelineKey &key);
+  // The specialized variant when compiled, the generic one otherwise.
+  // specialized, when not NULL, tells which.
+  VkPipeline Get(const PipelineKey &key, bool *specialized = NULL);
+  // Whether the specialized variant of key is compiled.
+  bool Ready(const PipelineKey &key);
+
+  Stats GetStats();
+
+private:
+  struct KeyHash {
+    size_t operator()(const PipelineKey &key) const { return key.Hash(); }
+  };
+
+  struct Variant {
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    bool queued = false;
+  };
+
+  static PipelineKey GenericKey(const PipelineKey &key);
+  // With mutex_ held
+  VkPipeline GetGeneric(const PipelineKey &key);
+  void Queue(const PipelineKey &key);
+  void CheckError();
+  void Run();
+
+  VkDevice device_;
+  Builder builder_;
+  VkPipelineCache cache_;
+
+  // Everything below is protected by mutex_
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<PipelineKey, Variant, KeyHash> variants_;
+  std::deque<PipelineKey> queue_;
+  bool compiling_ = false;
+  bool running_ = true;
+  VkResult error_ = VK_SUCCESS;
+  uint64_t fallbacks_ = 0;
+  double compile_seconds_ = 0.0;
+
+  std::thread thread_;
+};
+
+#endif // _PIPELINE_VARIANTS_H
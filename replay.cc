@@ -0,0 +1,1360 @@
+// Replays the frames recorded by FrameCapture as fast as the GPU allows,
+// headless, and reports CPU and GPU frame times.
+//
+// Usage: replay <capture file> [loops] [export spec]
+//
+// With an export spec (see frame-export.h) every replayed frame is written
+// out too, e.g. to encode a video of the capture without a window.
+//
+// REPLAY_BACKEND=software replays on the CPU with SoftRasterizer instead,
+// without loading Vulkan at all. Exporting both with the same png: spec
+// gives the frames to diff the GPU's against, and the frame times a
+// baseline.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "frame-capture.h"
+#include "frame-export.h"
+#include "soft-raster.h"
+#include "texture-file.h"
+#include "vulkan-utils.h"
+
+#define FRAMES_IN_FLIGHT 2
+// Readback slots: the ones in flight plus some for the writer to work on
+#define EXPORT_RING (FRAMES_IN_FLIGHT + 2)
+#define NO_ID UINT32_MAX
+
+struct ReplayBuffer {
+  VkBuffer buffer;
+  VkDeviceMemory memory;
+};
+
+struct ReplayImage {
+  VkImage image;
+  VkDeviceMemory memory;
+  VkImageView view;
+  uint32_t levels;
+};
+
+struct ReplayUpload {
+  uint32_t buffer;
+  VkDeviceSize offset;
+  VkDeviceSize staging_offset;
+  VkDeviceSize size;
+};
+
+// What Load() keeps of a captured image to check its uploads against
+struct CapturedImage {
+  VkFormat format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t levels;
+};
+
+struct ReplayImageUpload {
+  uint32_t image;
+  uint32_t level;
+  uint32_t width;
+  uint32_t height;
+  VkDeviceSize staging_offset;
+  VkDeviceSize size;
+};
+
+struct ReplayCommand {
+  CaptureOp op;
+  uint32_t id;
+  VkDeviceSize offset;
+  uint32_t args[4];
+  int32_t vertex_offset;
+};
+
+struct ReplayFrame {
+  std::vector<ReplayUpload> uploads;
+  std::vector<ReplayCommand> commands;
+};
+
+class Replay {
+public:
+  // software: SoftRasterizer rather than the GPU, see CreateSoftware()
+  explicit Replay(bool software) : software_(software) {}
+
+  bool Load(const char *path);
+  // After Load(), once the target is known.
+  bool Export(const char *spec);
+  void Run(uint32_t loops);
+
+private:
+  void InitVulkan();
+  void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                    VkMemoryPropertyFlags properties, VkBuffer *buffer,
+                    VkDeviceMemory *memory);
+  void CreateImage(uint32_t id, VkFormat format, uint32_t width,
+                   uint32_t height, uint32_t levels);
+  void CreateShader(uint32_t id, const uint8_t *code, size_t size);
+  VkDeviceSize Stage(const uint8_t *data, size_t size);
+  void CreateTarget();
+  void CreatePipelines();
+  void CreateDescriptorSets();
+  void UploadImages();
+  void RecordFrame(VkCommandBuffer cmd, uint32_t slot, const ReplayFrame &frame);
+  bool CreateSoftware();
+  void DrawSoftware(const ReplayFrame &frame, uint8_t *pixels);
+  void RunSoftware(uint32_t loops);
+
+  bool software_;
+  VkInstance instance_;
+  VkPhysicalDevice physical_device_;
+  VkDevice device_;
+  VkQueue queue_;
+  uint32_t queue_family_index_;
+  VkCommandPool command_pool_;
+  float timestamp_period_ = 0.0f;
+
+  // Objects by capture id
+  std::map<uint32_t, VkShaderModule> shaders_;
+  std::map<uint32_t, ReplayBuffer> buffers_;
+  std::map<uint32_t, ReplayImage> images_;
+  std::map<uint32_t, CapturePipeline> pipeline_states_;
+  std::map<uint32_t, VkPipeline> pipelines_;
+
+  // Every upload of the capture sits in one staging buffer
+  std::vector<uint8_t> staging_data_;
+  std::vector<ReplayImageUpload> image_uploads_;
+  VkBuffer staging_buffer_;
+  VkDeviceMemory staging_memory_;
+
+  std::vector<ReplayFrame> frames_;
+
+  // Descriptor sets for every (uniform buffer, texture) pair drawn with
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> set_keys_;
+  std::vector<VkDescriptorSet> descriptor_sets_;
+  VkDescriptorSetLayout descriptor_set_layout_;
+  VkDescriptorPool descriptor_pool_;
+  VkPipelineLayout pipeline_layout_;
+  VkSampler sampler_;
+
+  // Offscreen render target
+  VkExtent2D extent_ = {0, 0};
+  VkFormat format_ = VK_FORMAT_UNDEFINED;
+  VkImage target_;
+  VkDeviceMemory target_memory_;
+  VkImageView target_view_;
+  VkRenderPass render_pass_;
+  VkFramebuffer framebuffer_;
+
+  VkQueryPool query_pool_ = VK_NULL_HANDLE;
+
+  std::unique_ptr<FrameExporter> exporter_;
+
+  // Software backend: buffers as the CPU sees them, textures pointing into
+  // staging_data_ and the (uniform buffer, texture) pair of every set
+  std::map<uint32_t, std::vector<uint8_t>> host_buffers_;
+  std::map<uint32_t, SoftTexture> soft_textures_;
+  std::vector<std::pair<uint32_t, uint32_t>> set_bindings_;
+  std::unique_ptr<SoftRasterizer> rasterizer_;
+  std::vector<uint8_t> pixels_;
+};
+
+void Replay::InitVulkan() {
+  VkApplicationInfo appInfo = {};
+  appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  appInfo.pApplicationName = "Replay";
+  appInfo.apiVersion = VK_API_VERSION_1_0;
+
+  // Headless: no surface extensions, no layers
+  VkInstanceCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  createInfo.pApplicationInfo = &appInfo;
+  VK_CHECK_RESULT(vkCreateInstance(&createInfo, NULL, &instance_));
+  LoadInstanceFunctions(instance_);
+
+  uint32_t deviceCount = 0;
+  VK_CHECK_RESULT(vkEnumeratePhysicalDevices(instance_, &deviceCount, NULL));
+  std::vector<VkPhysicalDevice> physicalDevices(deviceCount);
+  VK_CHECK_RESULT(
+    vkEnumeratePhysicalDevices(instance_, &deviceCount, physicalDevices.data()));
+
+  // First device with a graphics queue
+  physical_device_ = VK_NULL_HANDLE;
+  std::vector<VkQueueFamilyProperties> families;
+  for (VkPhysicalDevice device : physicalDevices) {
+    uint32_t count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &count, NULL);
+    families.resize(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &count, families.data());
+    for (uint32_t i = 0; i < count; ++i) {
+      if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+        physical_device_ = device;
+        queue_family_index_ = i;
+        break;
+      }
+    }
+    if (physical_device_ != VK_NULL_HANDLE)
+      break;
+  }
+  if (physical_device_ == VK_NULL_HANDLE) {
+    fprintf(stderr, "No Vulkan device with a graphics queue\n");
+    exit(1);
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+  fprintf(stdout, "Device Name:    %s\n", properties.deviceName);
+  if (families[queue_family_index_].timestampValidBits != 0)
+    timestamp_period_ = properties.limits.timestampPeriod;
+
+  float priorities[] = {1.0f};
+  VkDeviceQueueCreateInfo queueInfo = {};
+  queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queueInfo.queueFamilyIndex = queue_family_index_;
+  queueInfo.queueCount = 1;
+  queueInfo.pQueuePriorities = priorities;
+
+  VkDeviceCreateInfo deviceInfo = {};
+  deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  deviceInfo.queueCreateInfoCount = 1;
+  deviceInfo.pQueueCreateInfos = &queueInfo;
+  VK_CHECK_RESULT(vkCreateDevice(physical_device_, &deviceInfo, NULL, &device_));
+  LoadDeviceFunctions(device_);
+  vkGetDeviceQueue(device_, queue_family_index_, 0, &queue_);
+
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.queueFamilyIndex = queue_family_index_;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VK_CHECK_RESULT(vkCreateCommandPool(device_, &poolInfo, NULL, &command_pool_));
+
+  if (timestamp_period_ > 0.0f) {
+    VkQueryPoolCreateInfo queryInfo = {};
+    queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount = 2 * FRAMES_IN_FLIGHT;
+    VK_CHECK_RESULT(vkCreateQueryPool(device_, &queryInfo, NULL, &query_pool_));
+  }
+}
+
+void Replay::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                          VkMemoryPropertyFlags properties, VkBuffer *buffer,
+                          VkDeviceMemory *memory) {
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = size;
+  bufferInfo.usage = usage;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VK_CHECK_RESULT(vkCreateBuffer(device_, &bufferInfo, NULL, buffer));
+
+  VkMemoryRequirements memRequirements;
+  vkGetBufferMemoryRequirements(device_, *buffer, &memRequirements);
+
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = memRequirements.size;
+  allocInfo.memoryTypeIndex = FindMemoryType(physical_device_,
+    memRequirements.memoryTypeBits, properties);
+  VK_CHECK_RESULT(vkAllocateMemory(device_, &allocInfo, NULL, memory));
+  VK_CHECK_RESULT(vkBindBufferMemory(device_, *buffer, *memory, 0));
+}
+
+void Replay::CreateImage(uint32_t id, VkFormat format, uint32_t width,
+                         uint32_t height, uint32_t levels) {
+  ReplayImage &image = images_[id];
+  image.levels = levels;
+
+  VkImageCreateInfo imageInfo = {};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = format;
+  imageInfo.extent = {width, height, 1};
+  imageInfo.mipLevels = levels;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VK_CHECK_RESULT(vkCreateImage(device_, &imageInfo, NULL, &image.image));
+
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device_, image.image, &memRequirements);
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = memRequirements.size;
+  allocInfo.memoryTypeIndex = FindMemoryType(physical_device_,
+    memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  VK_CHECK_RESULT(vkAllocateMemory(device_, &allocInfo, NULL, &image.memory));
+  VK_CHECK_RESULT(vkBindImageMemory(device_, image.image, image.memory, 0));
+
+  VkImageViewCreateInfo viewInfo = {};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = image.image;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.format = format;
+  viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  viewInfo.subresourceRange.baseMipLevel = 0;
+  viewInfo.subresourceRange.levelCount = levels;
+  viewInfo.subresourceRange.baseArrayLayer = 0;
+  viewInfo.subresourceRange.layerCount = 1;
+  VK_CHECK_RESULT(vkCreateImageView(device_, &viewInfo, NULL, &image.view));
+}
+
+void Replay::CreateShader(uint32_t id, const uint8_t *code, size_t size) {
+  // pCode has to be 4 bytes aligned, the record payload isn't
+  std::vector<uint32_t> words((size + 3) / 4);
+  memcpy(words.data(), code, size);
+
+  VkShaderModuleCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  createInfo.codeSize = size;
+  createInfo.pCode = words.data();
+  VK_CHECK_RESULT(
+    vkCreateShaderModule(device_, &createInfo, NULL, &shaders_[id]));
+}
+
+VkDeviceSize Replay::Stage(const uint8_t *data, size_t size) {
+  VkDeviceSize offset = (staging_data_.size() + 15) & ~(VkDeviceSize) 15;
+  staging_data_.resize(offset + size);
+  memcpy(staging_data_.data() + offset, data, size);
+  return offset;
+}
+
+bool Replay::Load(const char *path) {
+  CaptureReader reader;
+  if (!reader.Open(path))
+    return false;
+
+  if (!software_)
+    InitVulkan();
+
+  ReplayFrame frame;
+  uint32_t uniform = NO_ID;
+  uint32_t texture = NO_ID;
+  CaptureOp op;
+  size_t size;
+  const uint8_t *data;
+
+  // Everything gets checked before either backend uses it, neither the
+  // GPU nor SoftRasterizer should see ids, offsets or levels that aren't
+  // there. What is created, ids are shared by all kinds of objects:
+  std::set<uint32_t> ids;
+  std::set<uint32_t> shaders;
+  std::map<uint32_t, VkDeviceSize> bufferSizes;
+  std::map<uint32_t, CapturedImage> images;
+  // and what is bound, which doesn't outlive a frame
+  uint32_t pipeline = NO_ID;
+  uint32_t vertices = NO_ID;
+  uint32_t indices = NO_ID;
+  VkDeviceSize indexOffset = 0;
+  uint32_t indexSize = 2;
+
+  while (reader.Next(&op)) {
+    const char *error = NULL;
+    switch (op) {
+      case CAPTURE_OP_CREATE_SHADER: {
+        uint32_t id = reader.Get();
+        reader.Get(); // stage, the pipeline knows
+        data = reader.GetBlob(&size);
+        if (!reader.ok())
+          break;
+        if (!ids.insert(id).second)
+          error = "Id used twice";
+        else if (size == 0 || size % 4)
+          error = "SPIR-V not a whole number of words";
+        if (error)
+          break;
+        shaders.insert(id);
+        if (!software_)
+          CreateShader(id, data, size);
+        break;
+      }
+      case CAPTURE_OP_CREATE_BUFFER: {
+        uint32_t id = reader.Get();
+        VkDeviceSize bufferSize = reader.Get();
+        VkBufferUsageFlags usage = reader.Get();
+        if (!reader.ok())
+          break;
+        if (!ids.insert(id).second)
+          error = "Id used twice";
+        else if (bufferSize == 0)
+          error = "Empty buffer";
+        if (error)
+          break;
+        bufferSizes[id] = bufferSize;
+        if (software_) {
+          host_buffers_[id].resize(bufferSize);
+          break;
+        }
+        ReplayBuffer &buffer = buffers_[id];
+        CreateBuffer(bufferSize, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer.buffer,
+                     &buffer.memory);
+        break;
+      }
+      case CAPTURE_OP_UPLOAD_BUFFER: {
+        ReplayUpload upload;
+        upload.buffer = reader.Get();
+        upload.offset = reader.Get();
+        data = reader.GetBlob(&size);
+        if (!reader.ok())
+          break;
+        auto buffer = bufferSizes.find(upload.buffer);
+        if (buffer == bufferSizes.end()) {
+          error = "Upload to an unknown buffer";
+          break;
+        }
+        if (upload.offset > buffer->second || size > buffer->second - upload.offset) {
+          error = "Upload past the end of its buffer";
+          break;
+        }
+        upload.size = size;
+        upload.staging_offset = Stage(data, size);
+        frame.uploads.push_back(upload);
+        break;
+      }
+      case CAPTURE_OP_CREATE_IMAGE: {
+        uint32_t id = reader.Get();
+        CapturedImage image;
+        image.format = (VkFormat) reader.Get();
+        image.width = reader.Get();
+        image.height = reader.Get();
+        image.levels = reader.Get();
+        if (!reader.ok())
+          break;
+        uint32_t blockWidth, blockHeight, blockBytes;
+        if (!ids.insert(id).second)
+          error = "Id used twice";
+        else if (image.width == 0 || image.height == 0 || image.levels == 0 ||
+                 image.levels > MaxLevelCount(image.width, image.height))
+          error = "Image size or level count out of range";
+        else if (!GetFormatBlockInfo(image.format, &blockWidth, &blockHeight,
+                                     &blockBytes))
+          error = "Image of an unknown format";
+        if (error)
+          break;
+        images[id] = image;
+        if (software_) {
+          soft_textures_[id].format = image.format;
+          soft_textures_[id].levels.assign(image.levels, TextureLevel());
+          break;
+        }
+        CreateImage(id, image.format, image.width, image.height, image.levels);
+        break;
+      }
+      case CAPTURE_OP_UPLOAD_IMAGE: {
+        // Images never change once uploaded, they are set up front
+        ReplayImageUpload upload;
+        upload.image = reader.Get();
+        upload.level = reader.Get();
+        upload.width = reader.Get();
+        upload.height = reader.Get();
+        data = reader.GetBlob(&size);
+        if (!reader.ok())
+          break;
+        auto it = images.find(upload.image);
+        if (it == images.end()) {
+          error = "Upload to an unknown image";
+          break;
+        }
+        // Whole levels only, as the application uploads them
+        const CapturedImage &image = it->second;
+        uint32_t blockWidth, blockHeight, blockBytes;
+        GetFormatBlockInfo(image.format, &blockWidth, &blockHeight, &blockBytes);
+        if (upload.level >= image.levels ||
+            upload.width != std::max(image.width >> upload.level, 1u) ||
+            upload.height != std::max(image.height >> upload.level, 1u)) {
+          error = "Image upload to a level that isn't there";
+          break;
+        }
+        if (size < (uint64_t) ((upload.width + blockWidth - 1) / blockWidth) *
+            ((upload.height + blockHeight - 1) / blockHeight) * blockBytes) {
+          error = "Image upload smaller than its level";
+          break;
+        }
+        upload.staging_offset = Stage(data, size);
+        upload.size = size;
+        image_uploads_.push_back(upload);
+        break;
+      }
+      case CAPTURE_OP_CREATE_PIPELINE: {
+        uint32_t id = reader.Get();
+        CapturePipeline state;
+        reader.GetPipeline(&state);
+        if (!reader.ok())
+          break;
+        if (!ids.insert(id).second) {
+          error = "Id used twice";
+          break;
+        }
+        if (!shaders.count(state.vertex_shader) ||
+            !shaders.count(state.fragment_shader)) {
+          error = "Pipeline with an unknown shader";
+          break;
+        }
+        // Only one vertex buffer gets bound
+        for (const VkVertexInputAttributeDescription &a : state.attributes)
+          if (a.binding != 0)
+            error = "Pipeline with a vertex binding other than 0";
+        if (error)
+          break;
+        pipeline_states_[id] = std::move(state);
+        break;
+      }
+      case CAPTURE_OP_BEGIN_FRAME: {
+        reader.Get(); // frame number
+        VkExtent2D extent;
+        extent.width = reader.Get();
+        extent.height = reader.Get();
+        VkFormat format = (VkFormat) reader.Get();
+        if (extent.width == 0 || extent.height == 0) {
+          error = "Empty frame";
+          break;
+        }
+        if (format_ == VK_FORMAT_UNDEFINED) {
+          extent_ = extent;
+          format_ = format;
+        }
+        frame.commands.clear();
+        pipeline = vertices = indices = NO_ID;
+        break;
+      }
+      case CAPTURE_OP_BIND_UNIFORM_BUFFER:
+        reader.Get(); // binding
+        uniform = reader.Get();
+        if (!bufferSizes.count(uniform))
+          error = "Unknown uniform buffer";
+        break;
+      case CAPTURE_OP_BIND_TEXTURE:
+        reader.Get(); // binding
+        texture = reader.Get();
+        if (!images.count(texture))
+          error = "Unknown texture";
+        break;
+      case CAPTURE_OP_END_FRAME:
+        frames_.push_back(frame);
+        frame = ReplayFrame();
+        break;
+      default: {
+        ReplayCommand command = {};
+        command.op = op;
+        if (op == CAPTURE_OP_DRAW_INDEXED) {
+          command.args[0] = reader.Get();
+          command.args[1] = reader.Get();
+          command.args[2] = reader.Get();
+          command.vertex_offset = reader.GetSigned();
+          command.args[3] = reader.Get();
+          // Bindings are resolved to a descriptor set at draw time
+          if (uniform == NO_ID || texture == NO_ID) {
+            error = "Draw without descriptors";
+            break;
+          }
+          if (pipeline == NO_ID || vertices == NO_ID || indices == NO_ID) {
+            error = "Draw without a pipeline or buffers";
+            break;
+          }
+          if ((uint64_t) command.args[2] + command.args[0] >
+              (bufferSizes[indices] - indexOffset) / indexSize) {
+            error = "Draw past the end of its index buffer";
+            break;
+          }
+          auto key = std::make_pair(uniform, texture);
+          if (!set_keys_.count(key)) {
+            uint32_t index = set_keys_.size();
+            set_keys_[key] = index;
+          }
+          command.id = set_keys_[key];
+        } else if (op == CAPTURE_OP_BIND_PIPELINE) {
+          command.id = reader.Get();
+          if (!pipeline_states_.count(command.id))
+            error = "Unknown pipeline";
+          pipeline = command.id;
+        } else if (op == CAPTURE_OP_BIND_VERTEX_BUFFER ||
+                   op == CAPTURE_OP_BIND_INDEX_BUFFER) {
+          command.id = reader.Get();
+          command.offset = reader.Get();
+          if (op == CAPTURE_OP_BIND_INDEX_BUFFER)
+            command.args[0] = reader.Get();
+          auto buffer = bufferSizes.find(command.id);
+          if (buffer == bufferSizes.end() || command.offset > buffer->second) {
+            error = "Unknown buffer or offset past its end";
+          } else if (op == CAPTURE_OP_BIND_VERTEX_BUFFER) {
+            vertices = command.id;
+          } else if (command.args[0] != VK_INDEX_TYPE_UINT16 &&
+                     command.args[0] != VK_INDEX_TYPE_UINT32) {
+            error = "Unknown index type";
+          } else {
+            indices = command.id;
+            indexOffset = command.offset;
+            indexSize = command.args[0] == VK_INDEX_TYPE_UINT32 ? 4 : 2;
+          }
+        } else {
+          fprintf(stderr, "Unknown capture record %d\n", op);
+          return false;
+        }
+        if (!error)
+          frame.commands.push_back(command);
+      }
+    }
+    if (!reader.ok()) {
+      fprintf(stderr, "Corrupted capture record %d\n", op);
+      return false;
+    }
+    if (error) {
+      fprintf(stderr, "%s, capture record %d of frame %zu\n", error, op,
+              frames_.size());
+      return false;
+    }
+  }
+
+  if (frames_.empty()) {
+    fprintf(stderr, "No complete frame in %s\n", path);
+    return false;
+  }
+
+  if (software_) {
+    if (!CreateSoftware())
+      return false;
+  } else {
+    if (!staging_data_.empty()) {
+      CreateBuffer(staging_data_.size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                   &staging_buffer_, &staging_memory_);
+      void *mapped;
+      VK_CHECK_RESULT(vkMapMemory(device_, staging_memory_, 0,
+                                  staging_data_.size(), 0, &mapped));
+      memcpy(mapped, staging_data_.data(), staging_data_.size());
+      vkUnmapMemory(device_, staging_memory_);
+    }
+
+    CreateTarget();
+    CreatePipelines();
+    CreateDescriptorSets();
+    UploadImages();
+  }
+
+  fprintf(stdout, "Loaded %zu frames, %ux%u, %zu KiB of uploads\n",
+          frames_.size(), extent_.width, extent_.height,
+          staging_data_.size() / 1024);
+  return true;
+}
+
+void Replay::CreateTarget() {
+  VkImageCreateInfo imageInfo = {};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = format_;
+  imageInfo.extent = {extent_.width, extent_.height, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+    VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VK_CHECK_RESULT(vkCreateImage(device_, &imageInfo, NULL, &target_));
+
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device_, target_, &memRequirements);
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = memRequirements.size;
+  allocInfo.memoryTypeIndex = FindMemoryType(physical_device_,
+    memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  VK_CHECK_RESULT(vkAllocateMemory(device_, &allocInfo, NULL, &target_memory_));
+  VK_CHECK_RESULT(vkBindImageMemory(device_, target_, target_memory_, 0));
+
+  VkImageViewCreateInfo viewInfo = {};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = target_;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.format = format_;
+  viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  viewInfo.subresourceRange.levelCount = 1;
+  viewInfo.subresourceRange.layerCount = 1;
+  VK_CHECK_RESULT(vkCreateImageView(device_, &viewInfo, NULL, &target_view_));
+
+  // Same pass as the application, but nobody presents the result
+  VkAttachmentDescription colorAttachment = {};
+  colorAttachment.format = format_;
+  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference colorAttachmentRef = {};
+  colorAttachmentRef.attachment = 0;
+  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDescription subpass = {};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = 1;
+  subpass.pColorAttachments = &colorAttachmentRef;
+
+  VkSubpassDependency dependency = {};
+  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependency.dstSubpass = 0;
+  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+  VkRenderPassCreateInfo renderPassInfo = {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  renderPassInfo.attachmentCount = 1;
+  renderPassInfo.pAttachments = &colorAttachment;
+  renderPassInfo.subpassCount = 1;
+  renderPassInfo.pSubpasses = &subpass;
+  renderPassInfo.dependencyCount = 1;
+  renderPassInfo.pDependencies = &dependency;
+  VK_CHECK_RESULT(
+    vkCreateRenderPass(device_, &renderPassInfo, NULL, &render_pass_));
+
+  VkFramebufferCreateInfo framebufferInfo = {};
+  framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebufferInfo.renderPass = render_pass_;
+  framebufferInfo.attachmentCount = 1;
+  framebufferInfo.pAttachments = &target_view_;
+  framebufferInfo.width = extent_.width;
+  framebufferInfo.height = extent_.height;
+  framebufferInfo.layers = 1;
+  VK_CHECK_RESULT(
+    vkCreateFramebuffer(device_, &framebufferInfo, NULL, &framebuffer_));
+}
+
+void Replay::CreatePipelines() {
+  VkDescriptorSetLayoutBinding bindings[2] = {};
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = 2;
+  layoutInfo.pBindings = bindings;
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device_, &layoutInfo, NULL,
+                                              &descriptor_set_layout_));
+
+  // The fragment shader declares the features of its generic variant. The
+  // capture only has specialized ones, nothing gets pushed.
+  VkPushConstantRange pushConstantRange = {};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  pushConstantRange.size = sizeof(uint32_t);
+
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 1;
+  pipelineLayoutInfo.pSetLayouts = &descriptor_set_layout_;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+  VK_CHECK_RESULT(vkCreatePipelineLayout(device_, &pipelineLayoutInfo, NULL,
+                                         &pipeline_layout_));
+
+  for (auto &entry : pipeline_states_) {
+    const CapturePipeline &state = entry.second;
+
+    VkSpecializationMapEntry specializationEntry = {0, 0, sizeof(uint32_t)};
+    VkSpecializationInfo specializationInfo = {};
+    specializationInfo.mapEntryCount = 1;
+    specializationInfo.pMapEntries = &specializationEntry;
+    specializationInfo.dataSize = sizeof(state.features);
+    specializationInfo.pData = &state.features;
+
+    VkPipelineShaderStageCreateInfo shaderStages[2] = {};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].module = shaders_[state.vertex_shader];
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].module = shaders_[state.fragment_shader];
+    shaderStages[1].pName = "main";
+    shaderStages[1].pSpecializationInfo = &specializationInfo;
+
+    VkVertexInputBindingDescription bindingDescription = {};
+    bindingDescription.binding = 0;
+    bindingDescription.stride = state.vertex_stride;
+    bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+    vertexInputInfo.vertexAttributeDescriptionCount = state.attributes.size();
+    vertexInputInfo.pVertexAttributeDescriptions = state.attributes.data();
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = state.topology;
+
+    VkViewport viewport = {0.0f, 0.0f, (float) extent_.width,
+                           (float) extent_.height, 0.0f, 1.0f};
+    VkRect2D scissor = {{0, 0}, extent_};
+    VkPipelineViewportStateCreateInfo viewportState = {};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.pViewports = &viewport;
+    viewportState.scissorCount = 1;
+    viewportState.pScissors = &scissor;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer = {};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = state.cull_mode;
+    rasterizer.frontFace = state.front_face;
+
+    VkPipelineMultisampleStateCreateInfo multisampling = {};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisampling.minSampleShading = 1.0f;
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = state.blend_enable;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    VkPipelineColorBlendStateCreateInfo colorBlending = {};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.layout = pipeline_layout_;
+    pipelineInfo.renderPass = render_pass_;
+    pipelineInfo.subpass = 0;
+    pipelineInfo.basePipelineIndex = -1;
+    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1,
+      &pipelineInfo, NULL, &pipelines_[entry.first]));
+  }
+}
+
+void Replay::CreateDescriptorSets() {
+  VkSamplerCreateInfo samplerInfo = {};
+  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerInfo.magFilter = VK_FILTER_LINEAR;
+  samplerInfo.minFilter = VK_FILTER_LINEAR;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.maxAnisotropy = 1.0f;
+  samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+  VK_CHECK_RESULT(vkCreateSampler(device_, &samplerInfo, NULL, &sampler_));
+
+  uint32_t count = std::max<size_t>(set_keys_.size(), 1);
+  VkDescriptorPoolSize poolSizes[2] = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  poolSizes[0].descriptorCount = count;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[1].descriptorCount = count;
+
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.poolSizeCount = 2;
+  poolInfo.pPoolSizes = poolSizes;
+  poolInfo.maxSets = count;
+  VK_CHECK_RESULT(
+    vkCreateDescriptorPool(device_, &poolInfo, NULL, &descriptor_pool_));
+
+  descriptor_sets_.resize(set_keys_.size());
+  for (auto &entry : set_keys_) {
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptor_pool_;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &descriptor_set_layout_;
+    VkDescriptorSet &set = descriptor_sets_[entry.second];
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device_, &allocInfo, &set));
+
+    VkDescriptorBufferInfo bufferInfo = {};
+    bufferInfo.buffer = buffers_[entry.first.first].buffer;
+    bufferInfo.offset = 0;
+    bufferInfo.range = VK_WHOLE_SIZE;
+
+    VkDescriptorImageInfo imageInfo = {};
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageInfo.imageView = images_[entry.first.second].view;
+    imageInfo.sampler = sampler_;
+
+    VkWriteDescriptorSet writes[2] = {};
+    writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[0].dstSet = set;
+    writes[0].dstBinding = 0;
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writes[0].descriptorCount = 1;
+    writes[0].pBufferInfo = &bufferInfo;
+    writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[1].dstSet = set;
+    writes[1].dstBinding = 1;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writes[1].descriptorCount = 1;
+    writes[1].pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets(device_, 2, writes, 0, NULL);
+  }
+}
+
+void Replay::UploadImages() {
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandPool = command_pool_;
+  allocInfo.commandBufferCount = 1;
+  VkCommandBuffer cmd;
+  VK_CHECK_RESULT(vkAllocateCommandBuffers(device_, &allocInfo, &cmd));
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(cmd, &beginInfo);
+
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.layerCount = 1;
+
+  for (auto &entry : images_) {
+    barrier.image = entry.second.image;
+    barrier.subresourceRange.levelCount = entry.second.levels;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+                         1, &barrier);
+  }
+
+  for (const ReplayImageUpload &upload : image_uploads_) {
+    VkBufferImageCopy region = {};
+    region.bufferOffset = upload.staging_offset;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = upload.level;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = {upload.width, upload.height, 1};
+    vkCmdCopyBufferToImage(cmd, staging_buffer_, images_[upload.image].image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+  }
+
+  for (auto &entry : images_) {
+    barrier.image = entry.second.image;
+    barrier.subresourceRange.levelCount = entry.second.levels;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+  }
+  VK_CHECK_RESULT(vkEndCommandBuffer(cmd));
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &cmd;
+  VK_CHECK_RESULT(vkQueueSubmit(queue_, 1, &submitInfo, VK_NULL_HANDLE));
+  VK_CHECK_RESULT(vkQueueWaitIdle(queue_));
+  vkFreeCommandBuffers(device_, command_pool_, 1, &cmd);
+}
+
+void Replay::RecordFrame(VkCommandBuffer cmd, uint32_t slot,
+                         const ReplayFrame &frame) {
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(cmd, &beginInfo);
+
+  if (query_pool_ != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(cmd, query_pool_, 2 * slot, 2);
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool_,
+                        2 * slot);
+  }
+
+  if (!frame.uploads.empty()) {
+    // The previous frame might still be reading what we overwrite
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0,
+                         NULL, 0, NULL);
+
+    for (const ReplayUpload &upload : frame.uploads) {
+      VkBufferCopy copyRegion = {};
+      copyRegion.srcOffset = upload.staging_offset;
+      copyRegion.dstOffset = upload.offset;
+      copyRegion.size = upload.size;
+      vkCmdCopyBuffer(cmd, staging_buffer_, buffers_[upload.buffer].buffer,
+                      1, &copyRegion);
+    }
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+      VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 1, &barrier,
+                         0, NULL, 0, NULL);
+  }
+
+  VkRenderPassBeginInfo renderPassInfo = {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderPassInfo.renderPass = render_pass_;
+  renderPassInfo.framebuffer = framebuffer_;
+  renderPassInfo.renderArea.offset = {0, 0};
+  renderPassInfo.renderArea.extent = extent_;
+  VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
+  renderPassInfo.clearValueCount = 1;
+  renderPassInfo.pClearValues = &clearColor;
+  vkCmdBeginRenderPass(cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  for (const ReplayCommand &command : frame.commands) {
+    switch (command.op) {
+      case CAPTURE_OP_BIND_PIPELINE:
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          pipelines_[command.id]);
+        break;
+      case CAPTURE_OP_BIND_VERTEX_BUFFER:
+        vkCmdBindVertexBuffers(cmd, 0, 1, &buffers_[command.id].buffer,
+                               &command.offset);
+        break;
+      case CAPTURE_OP_BIND_INDEX_BUFFER:
+        vkCmdBindIndexBuffer(cmd, buffers_[command.id].buffer, command.offset,
+                             (VkIndexType) command.args[0]);
+        break;
+      case CAPTURE_OP_DRAW_INDEXED:
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipeline_layout_, 0, 1,
+                                &descriptor_sets_[command.id], 0, NULL);
+        vkCmdDrawIndexed(cmd, command.args[0], command.args[1],
+                         command.args[2], command.vertex_offset,
+                         command.args[3]);
+        break;
+      default:
+        break;
+    }
+  }
+
+  vkCmdEndRenderPass(cmd);
+  if (query_pool_ != VK_NULL_HANDLE)
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool_,
+                        2 * slot + 1);
+  VK_CHECK_RESULT(vkEndCommandBuffer(cmd));
+}
+
+bool Replay::Export(const char *spec) {
+  // Offline, so every frame gets written even when that slows the replay
+  if (software_)
+    exporter_.reset(new FrameExporter(format_, extent_, EXPORT_RING, false));
+  else
+    exporter_.reset(new FrameExporter(physical_device_, device_,
+                                      queue_family_index_, format_, extent_,
+                                      EXPORT_RING, false));
+  return exporter_->Open(spec);
+}
+
+// Everything the software backend needs once the capture is read. Textures
+// point into staging_data_, which doesn't change anymore.
+bool Replay::CreateSoftware() {
+  if (!SoftRasterizer::SupportedFormat(format_)) {
+    fprintf(stderr, "The software backend can't render format %d\n",
+            (int) format_);
+    return false;
+  }
+  // Load() checked the images and levels
+  for (const ReplayImageUpload &upload : image_uploads_) {
+    TextureLevel &level = soft_textures_[upload.image].levels[upload.level];
+    level.width = upload.width;
+    level.height = upload.height;
+    level.data = staging_data_.data() + upload.staging_offset;
+    level.size = upload.size;
+  }
+  set_bindings_.resize(set_keys_.size());
+  for (auto &entry : set_keys_)
+    set_bindings_[entry.second] = entry.first;
+
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+  rasterizer_.reset(new SoftRasterizer(format_, extent_, threads));
+  pixels_.resize((size_t) extent_.width * extent_.height * 4);
+  fprintf(stdout, "Device Name:    software, %u threads\n", threads);
+  return true;
+}
+
+// Mirrors RecordFrame()
+void Replay::DrawSoftware(const ReplayFrame &frame, uint8_t *pixels) {
+  for (const ReplayUpload &upload : frame.uploads)
+    memcpy(host_buffers_[upload.buffer].data() + upload.offset,
+           staging_data_.data() + upload.staging_offset, upload.size);
+
+  float clear[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+  rasterizer_->Begin(clear);
+  const CapturePipeline *pipeline = NULL;
+  const std::vector<uint8_t> *vertices = NULL;
+  const std::vector<uint8_t> *indices = NULL;
+  VkDeviceSize vertexOffset = 0;
+  VkDeviceSize indexOffset = 0;
+  VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+
+  for (const ReplayCommand &command : frame.commands) {
+    switch (command.op) {
+      case CAPTURE_OP_BIND_PIPELINE:
+        pipeline = &pipeline_states_[command.id];
+        break;
+      case CAPTURE_OP_BIND_VERTEX_BUFFER:
+        vertices = &host_buffers_[command.id];
+        vertexOffset = command.offset;
+        break;
+      case CAPTURE_OP_BIND_INDEX_BUFFER:
+        indices = &host_buffers_[command.id];
+        indexOffset = command.offset;
+        indexType = (VkIndexType) command.args[0];
+        break;
+      case CAPTURE_OP_DRAW_INDEXED: {
+        const std::vector<uint8_t> &uniforms =
+          host_buffers_[set_bindings_[command.id].first];
+        auto texture = soft_textures_.find(set_bindings_[command.id].second);
+        // Load() checked that all is bound, offsets within their buffers
+        SoftDraw draw;
+        draw.pipeline = pipeline;
+        draw.vertices = vertices->data() + vertexOffset;
+        draw.vertex_bytes = vertices->size() - vertexOffset;
+        draw.indices = indices->data() + indexOffset;
+        draw.index_bytes = indices->size() - indexOffset;
+        draw.index_type = indexType;
+        draw.index_count = command.args[0];
+        draw.instance_count = command.args[1];
+        draw.first_index = command.args[2];
+        draw.vertex_offset = command.vertex_offset;
+        draw.uniforms = uniforms.data();
+        draw.uniform_bytes = uniforms.size();
+        draw.texture = texture != soft_textures_.end() ? &texture->second : NULL;
+        rasterizer_->Draw(draw);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  rasterizer_->Finish(pixels);
+}
+
+void Replay::RunSoftware(uint32_t loops) {
+  uint64_t frame_count = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t loop = 0; loop < loops; ++loop) {
+    for (const ReplayFrame &frame : frames_) {
+      uint32_t slot = NO_ID;
+      uint8_t *pixels = exporter_ ? exporter_->Map(&slot) : NULL;
+      DrawSoftware(frame, pixels ? pixels : pixels_.data());
+      if (pixels)
+        exporter_->Ready(slot);
+      frame_count++;
+    }
+  }
+  if (exporter_)
+    exporter_->Close();
+  double total_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+
+  SoftRasterizer::Stats stats = rasterizer_->GetStats();
+  fprintf(stdout, "Frames:         %lu in %.2f ms, %.1f fps\n",
+          (unsigned long) frame_count, total_ms,
+          frame_count * 1000.0 / total_ms);
+  fprintf(stdout, "CPU setup:      %.3f ms/frame, %.1f triangles (%.1f culled)\n",
+          stats.setup_seconds * 1000.0 / frame_count,
+          (double) stats.triangles / frame_count,
+          (double) stats.culled / frame_count);
+  fprintf(stdout, "CPU raster:     %.3f ms/frame, %.1f Mpixels/s shaded\n",
+          stats.raster_seconds * 1000.0 / frame_count,
+          stats.raster_seconds > 0.0 ? stats.pixels / stats.raster_seconds / 1e6 : 0.0);
+  if (exporter_) {
+    FrameExporter::Stats exportStats = exporter_->GetStats();
+    fprintf(stdout, "Export:         %lu frames, %.1f MiB, %.3f ms/frame writing\n",
+            (unsigned long) exportStats.frames, exportStats.bytes / (1024.0 * 1024.0),
+            exportStats.frames ? exportStats.write_seconds * 1000.0 / exportStats.frames : 0.0);
+  }
+}
+
+void Replay::Run(uint32_t loops) {
+  if (software_) {
+    RunSoftware(loops);
+    return;
+  }
+
+  VkCommandBuffer command_buffers[FRAMES_IN_FLIGHT];
+  VkFence fences[FRAMES_IN_FLIGHT];
+  bool pending[FRAMES_IN_FLIGHT] = {};
+  uint32_t export_slots[FRAMES_IN_FLIGHT];
+
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.commandPool = command_pool_;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = FRAMES_IN_FLIGHT;
+  VK_CHECK_RESULT(
+    vkAllocateCommandBuffers(device_, &allocInfo, command_buffers));
+
+  VkFenceCreateInfo fenceInfo = {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+    VK_CHECK_RESULT(vkCreateFence(device_, &fenceInfo, NULL, &fences[i]));
+    export_slots[i] = NO_ID;
+  }
+
+  double record_ms = 0.0;
+  double gpu_ms = 0.0;
+  double gpu_min_ms = 1e9;
+  double gpu_max_ms = 0.0;
+  uint64_t gpu_frames = 0;
+  uint64_t frame_count = 0;
+
+  auto collect = [&](uint32_t slot) {
+    VK_CHECK_RESULT(
+      vkWaitForFences(device_, 1, &fences[slot], VK_TRUE, UINT64_MAX));
+    VK_CHECK_RESULT(vkResetFences(device_, 1, &fences[slot]));
+    pending[slot] = false;
+    if (export_slots[slot] != NO_ID)
+      exporter_->Ready(export_slots[slot]);
+    if (query_pool_ == VK_NULL_HANDLE)
+      return;
+    uint64_t timestamps[2];
+    if (vkGetQueryPoolResults(device_, query_pool_, 2 * slot, 2,
+                              sizeof(timestamps), timestamps, sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+      return;
+    double ms = (timestamps[1] - timestamps[0]) * timestamp_period_ / 1e6;
+    gpu_ms += ms;
+    gpu_min_ms = std::min(gpu_min_ms, ms);
+    gpu_max_ms = std::max(gpu_max_ms, ms);
+    gpu_frames++;
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t loop = 0; loop < loops; ++loop) {
+    for (const ReplayFrame &frame : frames_) {
+      uint32_t slot = frame_count % FRAMES_IN_FLIGHT;
+      if (pending[slot])
+        collect(slot);
+
+      auto record_start = std::chrono::steady_clock::now();
+      RecordFrame(command_buffers[slot], slot, frame);
+      record_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - record_start).count();
+
+      VkCommandBuffer buffers[2] = {command_buffers[slot], VK_NULL_HANDLE};
+      export_slots[slot] = NO_ID;
+      if (exporter_)
+        buffers[1] = exporter_->Record(target_, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                       &export_slots[slot]);
+
+      VkSubmitInfo submitInfo = {};
+      submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submitInfo.commandBufferCount = buffers[1] != VK_NULL_HANDLE ? 2 : 1;
+      submitInfo.pCommandBuffers = buffers;
+      VK_CHECK_RESULT(vkQueueSubmit(queue_, 1, &submitInfo, fences[slot]));
+      pending[slot] = true;
+      frame_count++;
+    }
+  }
+  for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i)
+    if (pending[i])
+      collect(i);
+  // Frames still being written count in the time
+  if (exporter_)
+    exporter_->Close();
+  double total_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+
+  fprintf(stdout, "Frames:         %lu in %.2f ms, %.1f fps\n",
+          (unsigned long) frame_count, total_ms,
+          frame_count * 1000.0 / total_ms);
+  fprintf(stdout, "CPU record:     %.3f ms/frame\n", record_ms / frame_count);
+  if (gpu_frames > 0)
+    fprintf(stdout, "GPU:            %.3f ms/frame (min %.3f, max %.3f)\n",
+            gpu_ms / gpu_frames, gpu_min_ms, gpu_max_ms);
+  if (exporter_) {
+    FrameExporter::Stats stats = exporter_->GetStats();
+    fprintf(stdout, "Export:         %lu frames, %.1f MiB, %.3f ms/frame writing\n",
+            (unsigned long) stats.frames, stats.bytes / (1024.0 * 1024.0),
+            stats.frames ? stats.write_seconds * 1000.0 / stats.frames : 0.0);
+  }
+
+  for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i)
+    vkDestroyFence(device_, fences[i], NULL);
+}
+
+int main(int argc, char *argv[]) {
+  // At least one loop, the frame times are averaged over them
+  uint32_t loops = 1;
+  if (argc > 2) {
+    char *end;
+    unsigned long n = strtoul(argv[2], &end, 10);
+    loops = end != argv[2] && !*end && n <= UINT32_MAX ? n : 0;
+  }
+  if (argc < 2 || loops == 0) {
+    fprintf(stderr, "Usage: %s <capture file> [loops] [export spec]\n"
+                    "loops is a number of at least 1\n", argv[0]);
+    return 1;
+  }
+  const char *backend = getenv("REPLAY_BACKEND");
+  bool software = backend && !strcmp(backend, "software");
+  if (backend && !software && strcmp(backend, "vulkan")) {
+    fprintf(stderr, "Unknown REPLAY_BACKEND %s, expected vulkan or software\n",
+            backend);
+    return 1;
+  }
+
+  // Nothing to recover here: a replay that fails is what's being looked at
+  if (!software && !LoadVulkan())
+    return 1;
+  try {
+    Replay replay(software);
+    if (!replay.Load(argv[1]))
+      return 1;
+    if (argc > 3 && !replay.Export(argv[3]))
+      return 1;
+    replay.Run(loops);
+  } catch (const VulkanError &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+// CPU only benchmark of the scene container: a field of objects, a share of
+// which moves every frame, culled against a camera flying through it.
+// Reports per frame update (bounds + BVH refit or rebuild) and cull times.
+//
+// Usage: scene-bench [objects] [moving fraction] [frames] [threads]
+// Build with make RELEASE=1 for meaningful numbers.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "scene.h"
+
+// Objects are spread over a cube of that side
+#define WORLD_SIZE 2000.0f
+
+typedef std::chrono::steady_clock Clock;
+
+static double Ms(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Column major view projection of a camera at eye looking down -z, with a
+// Vulkan style projection.
+static void ViewProjection(const float eye[3], float fovy, float aspect,
+                           float near, float far, float m[16]) {
+  float f = 1.0f / tanf(fovy / 2.0f);
+  float p[16] = {};
+  p[0] = f / aspect;
+  p[5] = -f;
+  p[10] = far / (near - far);
+  p[11] = -1.0f;
+  p[14] = near * far / (near - far);
+  // The view is a translation only, fold it into the last column
+  for (int i = 0; i < 16; ++i)
+    m[i] = p[i];
+  for (int r = 0; r < 4; ++r)
+    m[12 + r] = p[12 + r] - (p[r] * eye[0] + p[4 + r] * eye[1] + p[8 + r] * eye[2]);
+}
+
+static void Translation(float x, float y, float z, float scale,
+                        Scene::Transform t) {
+  float m[12] = {scale, 0, 0, x,
+                 0, scale, 0, y,
+                 0, 0, scale, z};
+  std::copy(m, m + 12, t);
+}
+
+// A whole number of at least 1, false for anything else
+static bool ParseCount(const char *s, uint32_t *n) {
+  char *end;
+  unsigned long v = strtoul(s, &end, 10);
+  if (end == s || *end || strchr(s, '-') || v == 0 || v > UINT32_MAX)
+    return false;
+  *n = v;
+  return true;
+}
+
+static bool ParseFraction(const char *s, float *f) {
+  char *end;
+  *f = strtof(s, &end);
+  return end != s && !*end && *f >= 0.0f && *f <= 1.0f;
+}
+
+int main(int argc, char **argv) {
+  uint32_t count = 1000000;
+  float moving = 0.1f;
+  uint32_t frames = 100;
+  uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc > 5 || (argc > 1 && !ParseCount(argv[1], &count)) ||
+      (argc > 2 && !ParseFraction(argv[2], &moving)) ||
+      (argc > 3 && !ParseCount(argv[3], &frames)) ||
+      (argc > 4 && !ParseCount(argv[4], &threads))) {
+    fprintf(stderr, "Usage: %s [objects] [moving fraction] [frames] [threads]\n"
+                    "Counts are at least 1, the fraction is from 0 to 1\n", argv[0]);
+    return 1;
+  }
+
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> position(-WORLD_SIZE / 2, WORLD_SIZE / 2);
+  std::uniform_real_distribution<float> scale(0.5f, 4.0f);
+  std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+
+  Scene scene;
+  std::vector<Scene::Object> objects(count);
+  std::vector<float> positions(count * 3);
+  std::vector<float> scales(count);
+  Aabb unit = {{-1.0f, -1.0f, -1.0f}, {1.0f, 1.0f, 1.0f}};
+
+  Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k)
+      positions[i * 3 + k] = position(rng);
+    scales[i] = scale(rng);
+    Scene::Transform t;
+    Translation(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2],
+                scales[i], t);
+    objects[i] = scene.Create(unit, t, i % 64, i % 16);
+  }
+  Clock::time_point created = Clock::now();
+  scene.Update();
+  Clock::time_point built = Clock::now();
+  printf("%u objects: created in %.1f ms, BVH of %u nodes built in %.1f ms\n",
+         count, Ms(start, created), scene.stats().nodes, Ms(created, built));
+
+  uint32_t movers = count * moving;
+  std::vector<double> update(frames), cull(frames), cullSingle(frames);
+  std::vector<Scene::Object> visible;
+  size_t visibleTotal = 0;
+  uint32_t rebuilds = 0;
+  for (uint32_t frame = 0; frame < frames; ++frame) {
+    // A different share of the objects moves every frame
+    for (uint32_t j = 0; j < movers; ++j) {
+      uint32_t i = (uint32_t) (((uint64_t) frame * movers + j) % count);
+      for (int k = 0; k < 3; ++k)
+        positions[i * 3 + k] += step(rng);
+      Scene::Transform t;
+      Translation(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2],
+                  scales[i], t);
+      scene.SetTransform(objects[i], t);
+    }
+    Clock::time_point t1 = Clock::now();
+    scene.Update();
+    Clock::time_point t2 = Clock::now();
+    rebuilds += scene.stats().rebuilt;
+
+    float eye[3] = {0.0f, 0.0f, WORLD_SIZE / 2 - frame * (WORLD_SIZE / frames)};
+    float m[16];
+    ViewProjection(eye, 1.0f, 16.0f / 9.0f, 0.1f, WORLD_SIZE / 4, m);
+    Frustum frustum = FrustumFromMatrix(m);
+
+    Clock::time_point t3 = Clock::now();
+    scene.Query(frustum, 1, &visible);
+    Clock::time_point t4 = Clock::now();
+    scene.Query(frustum, threads, &visible);
+    Clock::time_point t5 = Clock::now();
+
+    update[frame] = Ms(t1, t2);
+    cullSingle[frame] = Ms(t3, t4);
+    cull[frame] = Ms(t4, t5);
+    visibleTotal += visible.size();
+  }
+
+  auto report = [&](const char *name, std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    double sum = 0.0;
+    for (double t : times)
+      sum += t;
+    printf("  %-22s avg %8.3f  median %8.3f  max %8.3f ms\n", name,
+           sum / times.size(), times[times.size() / 2], times.back());
+  };
+  printf("%u frames, %u objects moving per frame, %u rebuilds, %.0f visible on average\n",
+         frames, movers, rebuilds, (double) visibleTotal / frames);
+  report("update", update);
+  report("cull, 1 thread", cullSingle);
+  char name[32];
+  snprintf(name, sizeof(name), "cull, %u threads", threads);
+  report(name, cull);
+  return 0;
+}
@@ -0,0 +1,490 @@
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "scene.h"
+
+namespace {
+
+const uint32_t kLeafSize = 8;
+const uint32_t kNone = UINT32_MAX;
+// Refits may make the tree this much more expensive to query than the build
+// did before it is rebuilt
+const double kRebuildCost = 1.5;
+
+enum Classification {
+  OUTSIDE,
+  INTERSECTS,
+  INSIDE
+};
+
+Classification Classify(const Frustum &frustum, const float min[3],
+                        const float max[3]) {
+  Classification result = INSIDE;
+  for (const float *plane : frustum.planes) {
+    // Corners furthest along and against the plane normal
+    float far = plane[3], near = plane[3];
+    for (int k = 0; k < 3; ++k) {
+      if (plane[k] >= 0.0f) {
+        far += plane[k] * max[k];
+        near += plane[k] * min[k];
+      } else {
+        far += plane[k] * min[k];
+        near += plane[k] * max[k];
+      }
+    }
+    if (far < 0.0f)
+      return OUTSIDE;
+    if (near < 0.0f)
+      result = INTERSECTS;
+  }
+  return result;
+}
+
+// Half the surface area, which is all the ratios need. 0 for empty boxes.
+float Area(const float min[3], const float max[3]) {
+  float d[3];
+  for (int k = 0; k < 3; ++k)
+    d[k] = std::max(max[k] - min[k], 0.0f);
+  return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+// What a node adds to the cost: visiting it, or testing its objects
+float NodeCost(float area, uint32_t left, uint32_t count) {
+  return left ? area : area * count;
+}
+
+}  // namespace
+
+Frustum FrustumFromMatrix(const float m[16]) {
+  // Rows of the matrix, m being column major
+  float r[4][4];
+  for (int i = 0; i < 4; ++i)
+    for (int j = 0; j < 4; ++j)
+      r[i][j] = m[j * 4 + i];
+
+  Frustum f;
+  for (int j = 0; j < 4; ++j) {
+    f.planes[0][j] = r[3][j] + r[0][j];  // left
+    f.planes[1][j] = r[3][j] - r[0][j];  // right
+    f.planes[2][j] = r[3][j] + r[1][j];  // bottom
+    f.planes[3][j] = r[3][j] - r[1][j];  // top
+    f.planes[4][j] = r[2][j];            // near, z >= 0
+    f.planes[5][j] = r[3][j] - r[2][j];  // far
+  }
+  for (float *plane : f.planes) {
+    float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] +
+                         plane[2] * plane[2]);
+    if (length > 0.0f)
+      for (int j = 0; j < 4; ++j)
+        plane[j] /= length;
+  }
+  return f;
+}
+
+Scene::Object Scene::Create(const Aabb &local_bounds, const Transform transform,
+                            uint32_t mesh, uint32_t material) {
+  Object object;
+  if (!free_handles_.empty()) {
+    object = free_handles_.back();
+    free_handles_.pop_back();
+  } else {
+    object = dense_.size();
+    dense_.push_back(kNone);
+  }
+  dense_[object] = mesh_.size();
+  handle_.push_back(object);
+
+  transform_.insert(transform_.end(), transform, transform + 12);
+  for (int k = 0; k < 3; ++k) {
+    local_min_[k].push_back(local_bounds.min[k]);
+    local_max_[k].push_back(local_bounds.max[k]);
+    world_min_[k].push_back(0.0f);
+    world_max_[k].push_back(0.0f);
+  }
+  mesh_.push_back(mesh);
+  material_.push_back(material);
+  leaf_.push_back(0);
+  dirty_.push_back(1);
+  dirty_list_.push_back(object);
+  needs_build_ = true;
+  return object;
+}
+
+// The last object takes the place of the destroyed one.
+void Scene::Destroy(Object object) {
+  uint32_t index = dense_[object];
+  uint32_t last = mesh_.size() - 1;
+  if (index != last) {
+    std::copy(&transform_[last * 12], &transform_[last * 12 + 12],
+              &transform_[index * 12]);
+    for (int k = 0; k < 3; ++k) {
+      local_min_[k][index] = local_min_[k][last];
+      local_max_[k][index] = local_max_[k][last];
+      world_min_[k][index] = world_min_[k][last];
+      world_max_[k][index] = world_max_[k][last];
+    }
+    mesh_[index] = mesh_[last];
+    material_[index] = material_[last];
+    leaf_[index] = leaf_[last];
+    dirty_[index] = dirty_[last];
+    handle_[index] = handle_[last];
+    dense_[handle_[index]] = index;
+  }
+
+  transform_.resize(last * 12);
+  for (int k = 0; k < 3; ++k) {
+    local_min_[k].pop_back();
+    local_max_[k].pop_back();
+    world_min_[k].pop_back();
+    world_max_[k].pop_back();
+  }
+  mesh_.pop_back();
+  material_.pop_back();
+  leaf_.pop_back();
+  dirty_.pop_back();
+  handle_.pop_back();
+  dense_[object] = kNone;
+  free_handles_.push_back(object);
+  needs_build_ = true;
+}
+
+void Scene::SetTransform(Object object, const Transform transform) {
+  uint32_t index = dense_[object];
+  std::copy(transform, transform + 12, &transform_[index * 12]);
+  if (!dirty_[index]) {
+    dirty_[index] = 1;
+    dirty_list_.push_back(object);
+  }
+}
+
+Aabb Scene::world_bounds(Object object) const {
+  uint32_t index = dense_[object];
+  Aabb bounds;
+  for (int k = 0; k < 3; ++k) {
+    bounds.min[k] = world_min_[k][index];
+    bounds.max[k] = world_max_[k][index];
+  }
+  return bounds;
+}
+
+// Transformed box around the transformed local box: center goes through the
+// transform, half extents through its absolute value.
+void Scene::UpdateBounds(uint32_t index) {
+  const float *m = &transform_[index * 12];
+  float center[3], extent[3];
+  for (int k = 0; k < 3; ++k) {
+    center[k] = 0.5f * (local_min_[k][index] + local_max_[k][index]);
+    extent[k] = 0.5f * (local_max_[k][index] - local_min_[k][index]);
+  }
+  for (int r = 0; r < 3; ++r) {
+    const float *row = m + r * 4;
+    float c = row[0] * center[0] + row[1] * center[1] + row[2] * center[2] + row[3];
+    float e = fabsf(row[0]) * extent[0] + fabsf(row[1]) * extent[1] +
+              fabsf(row[2]) * extent[2];
+    world_min_[r][index] = c - e;
+    world_max_[r][index] = c + e;
+  }
+}
+
+void Scene::Update() {
+  stats_.updated = 0;
+  stats_.rebuilt = false;
+  for (Object object : dirty_list_) {
+    uint32_t index = dense_[object];
+    // Destroyed since, or handle reused and already done
+    if (index == kNone || !dirty_[index])
+      continue;
+    UpdateBounds(index);
+    stats_.updated++;
+  }
+
+  if (!needs_build_)
+    Refit();
+  if (needs_build_ || Cost() > kRebuildCost * built_cost_) {
+    for (Object object : dirty_list_) {
+      if (dense_[object] != kNone)
+        dirty_[dense_[object]] = 0;
+    }
+    dirty_list_.clear();
+    Build();
+  }
+  stats_.nodes = nodes_.size();
+}
+
+double Scene::Cost() const {
+  if (nodes_.empty())
+    return 0.0;
+  float root = Area(nodes_[0].min, nodes_[0].max);
+  return root > 0.0f ? area_sum_ / root : 0.0;
+}
+
+// Puts the element at order[i] at i. The copy goes through scratch, which
+// keeps its capacity for the next time.
+template <typename T>
+void Scene::Permute(const std::vector<uint32_t> &order, size_t stride,
+                    std::vector<T> *array, std::vector<T> *scratch) {
+  scratch->assign(array->begin(), array->end());
+  for (size_t i = 0; i < order.size(); ++i)
+    std::copy(scratch->begin() + order[i] * stride,
+              scratch->begin() + (order[i] + 1) * stride,
+              array->begin() + i * stride);
+}
+
+void Scene::Build() {
+  uint32_t count = mesh_.size();
+  // Sorting goes through a packed copy of the bounds
+  std::vector<BuildItem> &items = build_items_;
+  items.resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      items[i].min[k] = world_min_[k][i];
+      items[i].max[k] = world_max_[k][i];
+    }
+    items[i].index = i;
+  }
+
+  // Leaves hold at least half of kLeafSize objects, the tree has less than
+  // twice as many nodes as leaves
+  nodes_.clear();
+  nodes_.reserve(2 * (2 * count / kLeafSize + 1));
+  Node root = {};
+  root.first = 0;
+  root.count = count;
+  root.parent = kNone;
+  nodes_.push_back(root);
+  area_sum_ = 0.0;
+
+  std::vector<uint32_t> &stack = build_stack_;
+  stack.assign(1, 0);
+  while (!stack.empty()) {
+    uint32_t n = stack.back();
+    stack.pop_back();
+    uint32_t first = nodes_[n].first, size = nodes_[n].count;
+
+    float lo[3], hi[3], clo[3], chi[3];
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = clo[k] = INFINITY;
+      hi[k] = chi[k] = -INFINITY;
+    }
+    for (uint32_t i = first; i < first + size; ++i) {
+      const BuildItem &item = items[i];
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = std::min(lo[k], item.min[k]);
+        hi[k] = std::max(hi[k], item.max[k]);
+        clo[k] = std::min(clo[k], item.min[k] + item.max[k]);
+        chi[k] = std::max(chi[k], item.min[k] + item.max[k]);
+      }
+    }
+    std::copy(lo, lo + 3, nodes_[n].min);
+    std::copy(hi, hi + 3, nodes_[n].max);
+
+    if (size <= kLeafSize) {
+      nodes_[n].left = 0;
+      area_sum_ += NodeCost(Area(lo, hi), 0, size);
+      for (uint32_t i = first; i < first + size; ++i)
+        leaf_[i] = n;
+      continue;
+    }
+
+    // Median split along the axis the centers spread the most
+    int axis = 0;
+    for (int k = 1; k < 3; ++k) {
+      if (chi[k] - clo[k] > chi[axis] - clo[axis])
+        axis = k;
+    }
+    uint32_t half = size / 2;
+    std::nth_element(items.begin() + first, items.begin() + first + half,
+                     items.begin() + first + size,
+                     [axis](const BuildItem &a, const BuildItem &b) {
+                       return a.min[axis] + a.max[axis] < b.min[axis] + b.max[axis];
+                     });
+
+    uint32_t left = nodes_.size();
+    Node child = {};
+    child.parent = n;
+    child.first = first;
+    child.count = half;
+    nodes_.push_back(child);
+    child.first = first + half;
+    child.count = size - half;
+    nodes_.push_back(child);
+    nodes_[n].left = left;
+    area_sum_ += NodeCost(Area(lo, hi), left, size);
+    stack.push_back(left);
+    stack.push_back(left + 1);
+  }
+
+  // Objects go in leaf order
+  std::vector<uint32_t> &order = build_order_;
+  order.resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    order[i] = items[i].index;
+    for (int k = 0; k < 3; ++k) {
+      world_min_[k][i] = items[i].min[k];
+      world_max_[k][i] = items[i].max[k];
+    }
+  }
+  Permute(order, 12, &transform_, &scratch_floats_);
+  for (int k = 0; k < 3; ++k) {
+    Permute(order, 1, &local_min_[k], &scratch_floats_);
+    Permute(order, 1, &local_max_[k], &scratch_floats_);
+  }
+  Permute(order, 1, &mesh_, &scratch_uints_);
+  Permute(order, 1, &material_, &scratch_uints_);
+  Permute(order, 1, &handle_, &scratch_uints_);
+  for (uint32_t i = 0; i < count; ++i)
+    dense_[handle_[i]] = i;
+
+  needs_build_ = false;
+  built_cost_ = Cost();
+  stats_.rebuilt = true;
+}
+
+// Returns whether the bounds changed.
+bool Scene::RefitNode(uint32_t n) {
+  Node &node = nodes_[n];
+  float lo[3], hi[3];
+  if (node.left) {
+    const Node &a = nodes_[node.left], &b = nodes_[node.left + 1];
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = std::min(a.min[k], b.min[k]);
+      hi[k] = std::max(a.max[k], b.max[k]);
+    }
+  } else {
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = INFINITY;
+      hi[k] = -INFINITY;
+    }
+    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = std::min(lo[k], world_min_[k][i]);
+        hi[k] = std::max(hi[k], world_max_[k][i]);
+      }
+    }
+  }
+  bool changed = false;
+  for (int k = 0; k < 3; ++k)
+    changed = changed || lo[k] != node.min[k] || hi[k] != node.max[k];
+  if (!changed)
+    return false;
+  area_sum_ += NodeCost(Area(lo, hi), node.left, node.count) -
+    NodeCost(Area(node.min, node.max), node.left, node.count);
+  std::copy(lo, lo + 3, node.min);
+  std::copy(hi, hi + 3, node.max);
+  return true;
+}
+
+void Scene::Refit() {
+  if (dirty_list_.empty() || nodes_.empty())
+    return;
+
+  // Lots of moving objects: one pass over all the nodes, children come
+  // after their parent. Otherwise walk up from the leaves that changed.
+  if (dirty_list_.size() * kLeafSize > nodes_.size()) {
+    for (uint32_t n = nodes_.size(); n-- > 0;)
+      RefitNode(n);
+  } else {
+    for (Object object : dirty_list_) {
+      uint32_t index = dense_[object];
+      if (index == kNone)
+        continue;
+      uint32_t n = leaf_[index];
+      while (n != kNone && RefitNode(n))
+        n = nodes_[n].parent;
+    }
+  }
+  for (Object object : dirty_list_) {
+    if (dense_[object] != kNone)
+      dirty_[dense_[object]] = 0;
+  }
+  dirty_list_.clear();
+}
+
+void Scene::AppendRange(uint32_t n, std::vector<Object> *visible) const {
+  const Node &node = nodes_[n];
+  for (uint32_t i = node.first; i < node.first + node.count; ++i)
+    visible->push_back(handle_[i]);
+}
+
+void Scene::QueryNode(const Frustum &frustum, uint32_t root,
+                      std::vector<Object> *visible) const {
+  uint32_t stack[64];
+  uint32_t depth = 0;
+  stack[depth++] = root;
+  while (depth) {
+    uint32_t n = stack[--depth];
+    const Node &node = nodes_[n];
+    Classification c = Classify(frustum, node.min, node.max);
+    if (c == OUTSIDE)
+      continue;
+    if (c == INSIDE) {
+      AppendRange(n, visible);
+    } else if (node.left) {
+      stack[depth++] = node.left;
+      stack[depth++] = node.left + 1;
+    } else {
+      for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        float lo[3] = {world_min_[0][i], world_min_[1][i], world_min_[2][i]};
+        float hi[3] = {world_max_[0][i], world_max_[1][i], world_max_[2][i]};
+        if (Classify(frustum, lo, hi) != OUTSIDE)
+          visible->push_back(handle_[i]);
+      }
+    }
+  }
+}
+
+void Scene::Query(const Frustum &frustum, unsigned threads,
+                  std::vector<Object> *visible) const {
+  visible->clear();
+  if (nodes_.empty() || mesh_.empty())
+    return;
+  if (threads <= 1) {
+    QueryNode(frustum, 0, visible);
+    return;
+  }
+
+  // Open up the top of the tree into enough subtrees to balance the
+  // threads, then hand them out as they go.
+  std::vector<uint32_t> subtrees(1, 0);
+  while (subtrees.size() < threads * 16) {
+    std::vector<uint32_t> next;
+    for (uint32_t n : subtrees) {
+      const Node &node = nodes_[n];
+      Classification c = Classify(frustum, node.min, node.max);
+      if (c == OUTSIDE)
+        continue;
+      if (c == INSIDE || !node.left) {
+        next.push_back(n);
+      } else {
+        next.push_back(node.left);
+        next.push_back(node.left + 1);
+      }
+    }
+    if (next.size() == subtrees.size())
+      break;
+    subtrees.swap(next);
+  }
+
+  std::vector<std::vector<Object>> results(threads);
+  std::atomic<uint32_t> cursor(0);
+  auto work = [&](unsigned t) {
+    uint32_t i;
+    while ((i = cursor++) < subtrees.size())
+      QueryNode(frustum, subtrees[i], &results[t]);
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; ++t)
+    workers.emplace_back(work, t);
+  work(0);
+  for (std::thread &worker : workers)
+    worker.join();
+
+  size_t total = 0;
+  for (const std::vector<Object> &r : results)
+    total += r.size();
+  visible->reserve(total);
+  for (const std::vector<Object> &r : results)
+    visible->insert(visible->end(), r.begin(), r.end());
+}
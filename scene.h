@@ -0,0 +1,138 @@
+#ifndef _SCENE_H
+#define _SCENE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Objects of the scene and a BVH over their world bounds, for culling.
+//
+// Objects live in plain parallel arrays (structure of arrays), densely
+// packed: culling only streams through the bounds, updates only through
+// the transforms. Handles stay valid while objects get moved around.
+//
+// The BVH is built by median splits over the object centers and refit in
+// place when objects move. It is rebuilt when objects come and go, or when
+// refits have let its surface area heuristic cost grow too far over what
+// the build made. Building also sorts the arrays in leaf order, so that
+// every node covers a contiguous range of objects. Neither allocates once
+// the scene has been built at its size.
+
+struct Aabb {
+  float min[3];
+  float max[3];
+};
+
+// Planes as a x + b y + c z + d >= 0 inside.
+struct Frustum {
+  float planes[6][4];
+};
+
+// From a column major (glm) view projection matrix with Vulkan's [0, 1]
+// depth range.
+Frustum FrustumFromMatrix(const float m[16]);
+
+class Scene {
+public:
+  typedef uint32_t Object;
+
+  // Row major 3x4 affine transform, the last row being implicitly 0 0 0 1.
+  typedef float Transform[12];
+
+  Scene() {}
+
+  // local_bounds is in object space, usually the bounds of the mesh.
+  Object Create(const Aabb &local_bounds, const Transform transform,
+                uint32_t mesh, uint32_t material);
+  void Destroy(Object object);
+  void SetTransform(Object object, const Transform transform);
+
+  // Brings world bounds and the BVH up to date with the changes since the
+  // last call.
+  void Update();
+
+  // Every object whose world bounds intersect the frustum, on up to threads
+  // threads. Bounds are as of the last Update().
+  void Query(const Frustum &frustum, unsigned threads,
+             std::vector<Object> *visible) const;
+
+  size_t size() const { return mesh_.size(); }
+  uint32_t mesh(Object object) const { return mesh_[dense_[object]]; }
+  uint32_t material(Object object) const { return material_[dense_[object]]; }
+  Aabb world_bounds(Object object) const;
+
+  // What the last Update() did, for the benchmark and stats.
+  struct Stats {
+    uint32_t nodes;
+    uint32_t updated;  // objects whose world bounds were recomputed
+    bool rebuilt;
+  };
+  const Stats &stats() const { return stats_; }
+
+private:
+  struct Node {
+    float min[3];
+    float max[3];
+    // Objects [first, first + count), for inner nodes too
+    uint32_t first;
+    uint32_t count;
+    // Children are left and left + 1, 0 for leaves
+    uint32_t left;
+    uint32_t parent;
+  };
+
+  struct BuildItem {
+    float min[3];
+    float max[3];
+    uint32_t index;
+  };
+
+  void UpdateBounds(uint32_t index);
+  void Build();
+  void Refit();
+  bool RefitNode(uint32_t node);
+  double Cost() const;
+  void QueryNode(const Frustum &frustum, uint32_t node,
+                 std::vector<Object> *visible) const;
+  void AppendRange(uint32_t node, std::vector<Object> *visible) const;
+  template <typename T>
+  void Permute(const std::vector<uint32_t> &order, size_t stride,
+               std::vector<T> *array, std::vector<T> *scratch);
+
+  // Handle to dense index and back. Freed handles are reused.
+  std::vector<uint32_t> dense_;
+  std::vector<Object> handle_;
+  std::vector<Object> free_handles_;
+
+  // Dense, one entry per object
+  std::vector<float> transform_;  // 12 floats per object
+  std::vector<float> local_min_[3];
+  std::vector<float> local_max_[3];
+  std::vector<float> world_min_[3];
+  std::vector<float> world_max_[3];
+  std::vector<uint32_t> mesh_;
+  std::vector<uint32_t> material_;
+  std::vector<uint32_t> leaf_;    // BVH leaf holding the object
+  std::vector<uint8_t> dirty_;
+  std::vector<Object> dirty_list_;
+
+  // BVH
+  std::vector<Node> nodes_;
+  bool needs_build_ = true;
+  // Node areas summed, leaves weighted by their object count. Refits keep
+  // the tree valid but not good: it gets rebuilt once the cost, relative to
+  // the root's area, has grown enough over the one of the build.
+  double area_sum_ = 0.0;
+  double built_cost_ = 0.0;
+
+  // Kept from build to build, so that rebuilding doesn't allocate
+  std::vector<BuildItem> build_items_;
+  std::vector<uint32_t> build_stack_;
+  std::vector<uint32_t> build_order_;
+  std::vector<float> scratch_floats_;
+  std::vector<uint32_t> scratch_uints_;
+
+  Stats stats_ = {};
+};
+
+#endif // _SCENE_H
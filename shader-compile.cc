@@ -0,0 +1,67 @@
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+
+#include "shader-compile.h"
+
+extern char **environ;
+
+namespace {
+
+// Reads the SPIR-V words of path
+bool ReadWords(const char *path, std::vector<uint32_t> *code) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  bool ok = size > 0 && size % sizeof(uint32_t) == 0;
+  if (ok) {
+    code->resize(size / sizeof(uint32_t));
+    ok = fread(code->data(), size, 1, file) == 1;
+  }
+  fclose(file);
+  return ok;
+}
+
+}  // namespace
+
+bool CompileGlsl(const char *path, std::vector<uint32_t> *code) {
+  const char *compiler = getenv("GLSLANG");
+  if (!compiler)
+    compiler = "glslangValidator";
+  const char *tmp = getenv("TMPDIR");
+  std::string output = std::string(tmp ? tmp : "/tmp") + "/shader-XXXXXX";
+  int fd = mkstemp(&output[0]);
+  if (fd < 0) {
+    fprintf(stderr, "Can't make a file for the SPIR-V of %s\n", path);
+    return false;
+  }
+  close(fd);
+
+  // No shell in between, path is taken as is
+  std::string include = std::string("-I") + path;
+  size_t slash = include.rfind('/');
+  include = slash == std::string::npos ? "-I." : include.substr(0, slash);
+  const char *argv[] = {compiler, "-V", include.c_str(), path, "-o",
+                        output.c_str(), NULL};
+  pid_t pid;
+  int status = -1;
+  int error = posix_spawnp(&pid, compiler, NULL, NULL, (char **) argv, environ);
+  if (error == 0)
+    waitpid(pid, &status, 0);
+  bool ok = false;
+  if (error != 0)
+    fprintf(stderr, "Can't run %s: %s\n", compiler, strerror(error));
+  else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fprintf(stderr, "Compiling %s failed\n", path);
+  else if (!(ok = ReadWords(output.c_str(), code)))
+    fprintf(stderr, "%s didn't make SPIR-V out of %s\n", compiler, path);
+  unlink(output.c_str());
+  return ok;
+}
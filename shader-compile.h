@@ -0,0 +1,18 @@
+#ifndef _SHADER_COMPILE_H
+#define _SHADER_COMPILE_H
+
+#include <stdint.h>
+#include <vector>
+
+// GLSL compiled at runtime, for working on the shaders without rebuilding.
+//
+// The build embeds the SPIR-V of the shaders in the binary (see the
+// Makefile), this is only for development. It runs glslangValidator, or
+// whatever $GLSLANG names, on the file the way the build does, so #include
+// and the stage from the extension work the same. The compiler's messages
+// go to the terminal.
+//
+// Returns false when the compiler can't be run or fails.
+bool CompileGlsl(const char *path, std::vector<uint32_t> *code);
+
+#endif // _SHADER_COMPILE_H
@@ -0,0 +1,499 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "soft-raster.h"
+
+namespace {
+
+// Features of triangle.frag, specialization constant 0
+const uint32_t kFeatureTexture = 0x1;
+const uint32_t kFeatureVertexColor = 0x2;
+
+// Subpixel precision, the least Vulkan allows
+const int kSubpixelBits = 4;
+const int64_t kSubpixel = 1 << kSubpixelBits;
+// Vertices further than this from the origin, in subpixels, drop their
+// triangle. Keeps the edge function steps of a group of four pixels within
+// 32 bits.
+const int64_t kGuardBand = 1 << 22;
+// Edge functions of a pixel group are clamped to this before adding the
+// steps of its lanes, which are smaller: the signs stay right.
+const int64_t kClamp = 1 << 30;
+
+bool IsRgba8(VkFormat format) {
+  return format == VK_FORMAT_R8G8B8A8_UNORM || format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+bool IsBgra8(VkFormat format) {
+  return format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+}
+
+bool IsSrgb(VkFormat format) {
+  return format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_B8G8R8A8_SRGB;
+}
+
+// Components of a float vertex attribute, 0 for the formats we don't read
+uint32_t FloatComponents(VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_R32_SFLOAT: return 1;
+    case VK_FORMAT_R32G32_SFLOAT: return 2;
+    case VK_FORMAT_R32G32B32_SFLOAT: return 3;
+    case VK_FORMAT_R32G32B32A32_SFLOAT: return 4;
+    default: return 0;
+  }
+}
+
+// out = a * b, column major 4x4
+void Multiply(const float *a, const float *b, float *out) {
+  for (int col = 0; col < 4; ++col)
+    for (int row = 0; row < 4; ++row) {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; ++k)
+        sum += a[k * 4 + row] * b[col * 4 + k];
+      out[col * 4 + row] = sum;
+    }
+}
+
+int64_t Clamp(int64_t v, int64_t limit) {
+  return std::min(std::max(v, -limit), limit);
+}
+
+// Lanes of a group of four pixels inside all three edges, as bits. e are
+// the edge functions of the first pixel, step from one pixel to the next.
+uint32_t Cover(const int64_t e[3], const int32_t step[3],
+               const int64_t bias[3]) {
+#ifdef __SSE2__
+  __m128i inside = _mm_set1_epi32(-1);
+  for (int i = 0; i < 3; ++i) {
+    __m128i lanes = _mm_add_epi32(
+      _mm_set1_epi32((int32_t) Clamp(e[i], kClamp)),
+      _mm_setr_epi32(0, step[i], 2 * step[i], 3 * step[i]));
+    inside = _mm_and_si128(inside,
+      _mm_cmpgt_epi32(lanes, _mm_set1_epi32((int32_t) bias[i])));
+  }
+  return _mm_movemask_ps(_mm_castsi128_ps(inside));
+#else
+  uint32_t mask = 0;
+  for (int lane = 0; lane < 4; ++lane) {
+    bool inside = true;
+    for (int i = 0; i < 3; ++i)
+      inside = inside && e[i] + (int64_t) lane * step[i] > bias[i];
+    mask |= (uint32_t) inside << lane;
+  }
+  return mask;
+#endif
+}
+
+}  // namespace
+
+SoftRasterizer::SoftRasterizer(VkFormat format, VkExtent2D extent,
+                               unsigned threads)
+  : format_(format), extent_(extent), threads_(std::max(threads, 1u)) {
+  srgb_ = IsSrgb(format);
+  bgra_ = IsBgra8(format);
+  tiles_x_ = (extent.width + kTileSize - 1) / kTileSize;
+  tiles_y_ = (extent.height + kTileSize - 1) / kTileSize;
+  color_.resize((size_t) extent.width * extent.height * 4);
+  bins_.resize(tiles_x_ * tiles_y_);
+
+  for (int i = 0; i < 256; ++i) {
+    float c = i / 255.0f;
+    srgb_to_linear_[i] = c <= 0.04045f ? c / 12.92f :
+      powf((c + 0.055f) / 1.055f, 2.4f);
+  }
+  for (int i = 0; i < 4096; ++i) {
+    float l = (i + 0.5f) / 4096.0f;
+    float c = l <= 0.0031308f ? l * 12.92f :
+      1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+    linear_to_srgb_[i] = (uint8_t) (c * 255.0f + 0.5f);
+  }
+}
+
+bool SoftRasterizer::SupportedFormat(VkFormat format) {
+  return IsRgba8(format) || IsBgra8(format);
+}
+
+void SoftRasterizer::Begin(const float clear[4]) {
+  for (size_t i = 0; i < color_.size(); i += 4)
+    memcpy(&color_[i], clear, 4 * sizeof(float));
+  triangles_.clear();
+  for (std::vector<uint32_t> &bin : bins_)
+    bin.clear();
+}
+
+void SoftRasterizer::Draw(const SoftDraw &draw) {
+  auto start = std::chrono::steady_clock::now();
+  const CapturePipeline &pipeline = *draw.pipeline;
+
+  uint32_t indexSize = draw.index_type == VK_INDEX_TYPE_UINT32 ? 4 : 2;
+  if (((uint64_t) draw.first_index + draw.index_count) * indexSize >
+      draw.index_bytes || draw.uniform_bytes < 3 * 16 * sizeof(float)) {
+    fprintf(stderr, "Software draw of %u indices past its buffers, skipped\n",
+            draw.index_count);
+    return;
+  }
+
+  // triangle.vert: locations 0 to 2 are the position, color and texcoord
+  const VkVertexInputAttributeDescription *attributes[3] = {};
+  uint32_t components[3] = {};
+  uint32_t extent = 0;
+  for (const VkVertexInputAttributeDescription &a : pipeline.attributes) {
+    if (a.location >= 3 || !FloatComponents(a.format))
+      continue;
+    attributes[a.location] = &a;
+    components[a.location] = std::min(FloatComponents(a.format), a.location == 1 ? 3u : 2u);
+    extent = std::max(extent, a.offset + FloatComponents(a.format) * 4);
+  }
+
+  auto vertexAt = [&](uint32_t i) {
+    size_t at = (size_t) (draw.first_index + i) * indexSize;
+    uint32_t index = indexSize == 4 ? *(const uint32_t *) (draw.indices + at)
+      : *(const uint16_t *) (draw.indices + at);
+    return (int64_t) index + draw.vertex_offset;
+  };
+  // All the vertices first, so that a draw is skipped whole rather than
+  // after some of its triangles were binned
+  for (uint32_t i = 0; i < draw.index_count / 3 * 3; ++i) {
+    int64_t vertex = vertexAt(i);
+    if (vertex < 0 || (uint64_t) vertex * pipeline.vertex_stride + extent >
+        draw.vertex_bytes) {
+      fprintf(stderr, "Software draw reads vertex %ld past its buffer, skipped\n",
+              (long) vertex);
+      return;
+    }
+  }
+
+  float uniforms[48];
+  memcpy(uniforms, draw.uniforms, sizeof(uniforms));
+  float viewModel[16];
+  float mvp[16];
+  Multiply(&uniforms[16], &uniforms[0], viewModel);
+  Multiply(&uniforms[32], viewModel, mvp);
+
+  // Unless it's one we can read, the texture is white
+  SoftDraw resolved = draw;
+  if (draw.texture) {
+    const SoftTexture &t = *draw.texture;
+    bool usable = SupportedFormat(t.format) && !t.levels.empty();
+    for (const TextureLevel &level : t.levels)
+      usable = usable && level.width && level.height &&
+        level.size >= (size_t) level.width * level.height * 4;
+    if (!usable)
+      resolved.texture = NULL;
+  }
+
+  Vertex vertices[3];
+  bool valid[3];
+  for (uint32_t i = 0; i + 2 < draw.index_count; i += 3) {
+    for (uint32_t k = 0; k < 3; ++k) {
+      const uint8_t *data = draw.vertices + vertexAt(i + k) * pipeline.vertex_stride;
+      float in[3][3] = {};
+      for (int l = 0; l < 3; ++l)
+        if (attributes[l])
+          memcpy(in[l], data + attributes[l]->offset, components[l] * sizeof(float));
+
+      // gl_Position = proj * view * model * vec4(inPosition, 0.0, 1.0)
+      float clip[4];
+      for (int row = 0; row < 4; ++row)
+        clip[row] = mvp[row] * in[0][0] + mvp[4 + row] * in[0][1] + mvp[12 + row];
+      Vertex &v = vertices[k];
+      valid[k] = clip[3] > 1e-6f;
+      if (!valid[k])
+        continue;
+      v.q = 1.0f / clip[3];
+      float x = (clip[0] * v.q + 1.0f) * 0.5f * extent_.width * kSubpixel;
+      float y = (clip[1] * v.q + 1.0f) * 0.5f * extent_.height * kSubpixel;
+      valid[k] = fabsf(x) < kGuardBand && fabsf(y) < kGuardBand;
+      v.x = lrintf(x);
+      v.y = lrintf(y);
+      for (int c = 0; c < 3; ++c)
+        v.attributes[c] = in[1][c] * v.q;
+      for (int c = 0; c < 2; ++c)
+        v.attributes[3 + c] = in[2][c] * v.q;
+    }
+    if (!valid[0] || !valid[1] || !valid[2]) {
+      stats_.culled += draw.instance_count;
+      continue;
+    }
+    // Nothing in the shaders tells instances apart, they draw over each
+    // other
+    for (uint32_t instance = 0; instance < draw.instance_count; ++instance)
+      SetupTriangle(resolved, vertices[0], vertices[1], vertices[2]);
+  }
+
+  stats_.setup_seconds += std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+void SoftRasterizer::SetupTriangle(const SoftDraw &draw, const Vertex &v0,
+                                   const Vertex &v1, const Vertex &v2) {
+  const Vertex *v[3] = {&v0, &v1, &v2};
+  Triangle t;
+  // Edge i is the one facing vertex i
+  for (int i = 0; i < 3; ++i) {
+    const Vertex &from = *v[(i + 1) % 3];
+    const Vertex &to = *v[(i + 2) % 3];
+    t.a[i] = from.y - to.y;
+    t.b[i] = to.x - from.x;
+    t.c[i] = -t.a[i] * from.x - t.b[i] * from.y;
+  }
+  int64_t area = t.a[0] * v0.x + t.b[0] * v0.y + t.c[0];
+
+  // Vulkan's area has the opposite sign, y pointing down
+  const CapturePipeline &pipeline = *draw.pipeline;
+  bool counterClockwise = area < 0;
+  bool front = counterClockwise ==
+    (pipeline.front_face == VK_FRONT_FACE_COUNTER_CLOCKWISE);
+  if (area == 0 || (front && (pipeline.cull_mode & VK_CULL_MODE_FRONT_BIT)) ||
+      (!front && (pipeline.cull_mode & VK_CULL_MODE_BACK_BIT))) {
+    stats_.culled++;
+    return;
+  }
+  if (area < 0) {
+    area = -area;
+    for (int i = 0; i < 3; ++i) {
+      t.a[i] = -t.a[i];
+      t.b[i] = -t.b[i];
+      t.c[i] = -t.c[i];
+    }
+  }
+  // Top-left rule: pixels right on an edge belong to the triangle to its
+  // right or below it
+  for (int i = 0; i < 3; ++i)
+    t.bias[i] = t.a[i] > 0 || (t.a[i] == 0 && t.b[i] > 0) ? -1 : 0;
+
+  // Pixel x has its center at x * kSubpixel + kSubpixel / 2
+  int64_t minX = std::min({v0.x, v1.x, v2.x});
+  int64_t maxX = std::max({v0.x, v1.x, v2.x});
+  int64_t minY = std::min({v0.y, v1.y, v2.y});
+  int64_t maxY = std::max({v0.y, v1.y, v2.y});
+  int64_t half = kSubpixel / 2;
+  t.min_x = std::max<int64_t>((minX - half + kSubpixel - 1) >> kSubpixelBits, 0);
+  t.min_y = std::max<int64_t>((minY - half + kSubpixel - 1) >> kSubpixelBits, 0);
+  t.max_x = std::min<int64_t>((maxX - half) >> kSubpixelBits, extent_.width - 1);
+  t.max_y = std::min<int64_t>((maxY - half) >> kSubpixelBits, extent_.height - 1);
+  if (t.min_x > t.max_x || t.min_y > t.max_y) {
+    stats_.culled++;
+    return;
+  }
+
+  t.inv_area = 1.0f / area;
+  for (int i = 0; i < 3; ++i) {
+    t.q[i] = v[i]->q;
+    memcpy(t.attributes[i], v[i]->attributes, sizeof(t.attributes[i]));
+  }
+  for (int d = 0; d < 2; ++d) {
+    t.du[d] = t.dv[d] = t.dq[d] = 0.0f;
+    for (int i = 0; i < 3; ++i) {
+      float weight = (d == 0 ? t.a[i] : t.b[i]) * kSubpixel * t.inv_area;
+      t.du[d] += weight * t.attributes[i][3];
+      t.dv[d] += weight * t.attributes[i][4];
+      t.dq[d] += weight * t.q[i];
+    }
+  }
+  t.features = pipeline.features;
+  t.texture = draw.texture;
+
+  uint32_t index = triangles_.size();
+  triangles_.push_back(t);
+  stats_.triangles++;
+  for (uint32_t ty = t.min_y / kTileSize; ty <= t.max_y / kTileSize; ++ty)
+    for (uint32_t tx = t.min_x / kTileSize; tx <= t.max_x / kTileSize; ++tx)
+      bins_[ty * tiles_x_ + tx].push_back(index);
+}
+
+void SoftRasterizer::Finish(uint8_t *pixels) {
+  auto start = std::chrono::steady_clock::now();
+  uint32_t tiles = tiles_x_ * tiles_y_;
+  unsigned threads = std::min<unsigned>(threads_, tiles);
+
+  std::atomic<uint32_t> cursor(0);
+  std::atomic<uint64_t> shaded(0);
+  auto work = [&]() {
+    uint64_t count = 0;
+    uint32_t tile;
+    while ((tile = cursor++) < tiles)
+      count += RasterTile(tile, pixels);
+    shaded += count;
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; ++t)
+    workers.emplace_back(work);
+  work();
+  for (std::thread &worker : workers)
+    worker.join();
+
+  stats_.frames++;
+  stats_.pixels += shaded;
+  stats_.raster_seconds += std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t SoftRasterizer::RasterTile(uint32_t tile, uint8_t *pixels) {
+  int32_t tileX = (tile % tiles_x_) * kTileSize;
+  int32_t tileY = (tile / tiles_x_) * kTileSize;
+  int32_t tileMaxX = std::min<int32_t>(tileX + kTileSize, extent_.width) - 1;
+  int32_t tileMaxY = std::min<int32_t>(tileY + kTileSize, extent_.height) - 1;
+  uint64_t shaded = 0;
+
+  for (uint32_t index : bins_[tile]) {
+    const Triangle &t = triangles_[index];
+    int32_t x0 = std::max(t.min_x, tileX);
+    int32_t x1 = std::min(t.max_x, tileMaxX);
+    int32_t y0 = std::max(t.min_y, tileY);
+    int32_t y1 = std::min(t.max_y, tileMaxY);
+
+    int32_t step[3];
+    for (int i = 0; i < 3; ++i)
+      step[i] = (int32_t) (t.a[i] * kSubpixel);
+
+    for (int32_t y = y0; y <= y1; ++y) {
+      int64_t py = y * kSubpixel + kSubpixel / 2;
+      int64_t px = x0 * kSubpixel + kSubpixel / 2;
+      int64_t e[3];
+      for (int i = 0; i < 3; ++i)
+        e[i] = t.a[i] * px + t.b[i] * py + t.c[i];
+      float *row = &color_[((size_t) y * extent_.width) * 4];
+
+      for (int32_t x = x0; x <= x1; x += 4) {
+        uint32_t mask = Cover(e, step, t.bias);
+        if (x1 - x < 3)
+          mask &= (1u << (x1 - x + 1)) - 1;
+        while (mask) {
+          int lane = __builtin_ctz(mask);
+          mask &= mask - 1;
+          int64_t pixel[3];
+          for (int i = 0; i < 3; ++i)
+            pixel[i] = e[i] + (int64_t) lane * step[i];
+          Shade(t, pixel, &row[(x + lane) * 4]);
+          shaded++;
+        }
+        for (int i = 0; i < 3; ++i)
+          e[i] += 4 * (int64_t) step[i];
+      }
+    }
+  }
+
+  for (int32_t y = tileY; y <= tileMaxY; ++y) {
+    const float *in = &color_[((size_t) y * extent_.width + tileX) * 4];
+    uint8_t *out = pixels + ((size_t) y * extent_.width + tileX) * 4;
+    for (int32_t x = tileX; x <= tileMaxX; ++x, in += 4, out += 4) {
+      out[bgra_ ? 2 : 0] = Encode(in[0]);
+      out[1] = Encode(in[1]);
+      out[bgra_ ? 0 : 2] = Encode(in[2]);
+      out[3] = (uint8_t) (std::min(std::max(in[3], 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+  }
+  return shaded;
+}
+
+void SoftRasterizer::Shade(const Triangle &t, const int64_t e[3],
+                           float *color) const {
+  float b[3];
+  float q = 0.0f;
+  for (int i = 0; i < 3; ++i) {
+    b[i] = e[i] * t.inv_area;
+    q += b[i] * t.q[i];
+  }
+  float w = 1.0f / q;
+  float attributes[5];
+  for (int k = 0; k < 5; ++k)
+    attributes[k] = (b[0] * t.attributes[0][k] + b[1] * t.attributes[1][k] +
+                     b[2] * t.attributes[2][k]) * w;
+
+  // triangle.frag
+  float rgb[3] = {1.0f, 1.0f, 1.0f};
+  if (t.features & kFeatureVertexColor)
+    memcpy(rgb, attributes, sizeof(rgb));
+  if ((t.features & kFeatureTexture) && t.texture) {
+    float u = attributes[3];
+    float v = attributes[4];
+    // d(u q / q) = (d(u q) - u dq) / q
+    const TextureLevel &top = t.texture->levels[0];
+    float rho = 0.0f;
+    for (int d = 0; d < 2; ++d) {
+      float dudx = (t.du[d] - u * t.dq[d]) * w * top.width;
+      float dvdx = (t.dv[d] - v * t.dq[d]) * w * top.height;
+      rho = std::max(rho, sqrtf(dudx * dudx + dvdx * dvdx));
+    }
+    float texel[3];
+    Sample(*t.texture, u, v, rho > 0.0f ? log2f(rho) : 0.0f, texel);
+    for (int c = 0; c < 3; ++c)
+      rgb[c] *= texel[c];
+  }
+
+  // outColor = vec4(color, 1.0), which blending leaves as is
+  memcpy(color, rgb, sizeof(rgb));
+  color[3] = 1.0f;
+}
+
+void SoftRasterizer::Sample(const SoftTexture &texture, float u, float v,
+                            float lod, float *rgb) const {
+  uint32_t last = texture.levels.size() - 1;
+  lod = std::min(std::max(lod, 0.0f), (float) last);
+  uint32_t level = (uint32_t) lod;
+  float blend = lod - level;
+
+  rgb[0] = rgb[1] = rgb[2] = 0.0f;
+  for (uint32_t l = level; l <= std::min(level + 1, last); ++l) {
+    float weight = l == level ? 1.0f - blend : blend;
+    if (weight <= 0.0f)
+      continue;
+    const TextureLevel &mip = texture.levels[l];
+    float x = u * mip.width - 0.5f;
+    float y = v * mip.height - 0.5f;
+    float fx = x - floorf(x);
+    float fy = y - floorf(y);
+    int32_t ix = (int32_t) floorf(x);
+    int32_t iy = (int32_t) floorf(y);
+    float texels[4][3];
+    Fetch(texture, mip, ix, iy, texels[0]);
+    Fetch(texture, mip, ix + 1, iy, texels[1]);
+    Fetch(texture, mip, ix, iy + 1, texels[2]);
+    Fetch(texture, mip, ix + 1, iy + 1, texels[3]);
+    for (int c = 0; c < 3; ++c) {
+      float top = texels[0][c] + (texels[1][c] - texels[0][c]) * fx;
+      float bottom = texels[2][c] + (texels[3][c] - texels[2][c]) * fx;
+      rgb[c] += weight * (top + (bottom - top) * fy);
+    }
+  }
+}
+
+void SoftRasterizer::Fetch(const SoftTexture &texture,
+                           const TextureLevel &level, int32_t x, int32_t y,
+                           float *rgb) const {
+  // Repeat
+  if ((uint32_t) x >= level.width) {
+    x %= (int32_t) level.width;
+    if (x < 0)
+      x += level.width;
+  }
+  if ((uint32_t) y >= level.height) {
+    y %= (int32_t) level.height;
+    if (y < 0)
+      y += level.height;
+  }
+  const uint8_t *texel = level.data + ((size_t) y * level.width + x) * 4;
+  bool bgra = IsBgra8(texture.format);
+  bool srgb = IsSrgb(texture.format);
+  for (int c = 0; c < 3; ++c) {
+    uint8_t value = texel[bgra ? 2 - c : c];
+    rgb[c] = srgb ? srgb_to_linear_[value] : value / 255.0f;
+  }
+}
+
+uint8_t SoftRasterizer::Encode(float v) const {
+  v = std::min(std::max(v, 0.0f), 1.0f);
+  if (srgb_)
+    return linear_to_srgb_[std::min((int) (v * 4096.0f), 4095)];
+  return (uint8_t) (v * 255.0f + 0.5f);
+}
@@ -0,0 +1,145 @@
+#ifndef _SOFT_RASTER_H
+#define _SOFT_RASTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "frame-capture.h"
+#include "texture-file.h"
+
+// Reference rasterizer on the CPU, for what the GPU should have drawn.
+//
+// Draws what FrameCapture records, the way triangle.vert and triangle.frag
+// would: vertices are transformed by the model, view and projection
+// matrices of the uniform buffer, fragments get the vertex color and the
+// texture as the pipeline's features say. It needs no Vulkan device, only
+// the formats.
+//
+// Draw() transforms and sets up the triangles and bins them into tiles of
+// kTileSize pixels. Finish() rasterizes the tiles on several threads, each
+// tile going through its triangles in submission order so that overlaps
+// come out the same. Vertices are snapped to 1/16 pixel and edge functions
+// evaluated exactly in integers, four pixels at a time with SSE2, with
+// Vulkan's top-left rule and pixel centers at half pixels. Interpolation is
+// perspective correct and textures are sampled trilinear with repeat, like
+// the samplers of triangle and replay. Colors stay linear floats until
+// Finish() converts them to the target format, sRGB encoded where the
+// format says so.
+//
+// The GPU frames should be close, not identical: filtering and rounding
+// differ. There is no clipping either, triangles reaching behind the eye or
+// far outside the frame are dropped, and block compressed textures read as
+// white. Blending isn't emulated: triangle.frag writes an alpha of 1, which
+// leaves the source color as is with the pipeline's blend factors.
+
+// Mip levels of a texture, of the 8 bit RGBA and BGRA formats.
+struct SoftTexture {
+  VkFormat format;
+  std::vector<TextureLevel> levels;
+};
+
+// One indexed draw, with the buffers as bound.
+struct SoftDraw {
+  const CapturePipeline *pipeline;
+  const uint8_t *vertices;    // at the vertex buffer binding offset
+  size_t vertex_bytes;
+  const uint8_t *indices;     // at the index buffer binding offset
+  size_t index_bytes;
+  VkIndexType index_type;
+  uint32_t index_count;
+  uint32_t instance_count;
+  uint32_t first_index;
+  int32_t vertex_offset;
+  const uint8_t *uniforms;    // model, view, proj: column major mat4s
+  size_t uniform_bytes;
+  const SoftTexture *texture;
+};
+
+class SoftRasterizer {
+public:
+  static const uint32_t kTileSize = 64;
+
+  struct Stats {
+    uint64_t frames;
+    uint64_t triangles;       // set up, after culling
+    uint64_t culled;          // back facing, degenerate or dropped
+    uint64_t pixels;          // shaded
+    double setup_seconds;     // in Draw()
+    double raster_seconds;    // in Finish()
+  };
+
+  // threads is how many rasterize the tiles in Finish()
+  SoftRasterizer(VkFormat format, VkExtent2D extent, unsigned threads);
+
+  // What Finish() can write: 8 bit RGBA and BGRA, UNORM or SRGB.
+  static bool SupportedFormat(VkFormat format);
+
+  // Starts a frame, cleared to the linear color clear.
+  void Begin(const float clear[4]);
+  // Indices out of the vertex buffer and short buffers skip the draw,
+  // with a message.
+  void Draw(const SoftDraw &draw);
+  // Rasterizes the frame into pixels, width * height * 4 bytes of the
+  // format.
+  void Finish(uint8_t *pixels);
+
+  Stats GetStats() const { return stats_; }
+
+private:
+  struct Vertex {
+    int64_t x, y;           // framebuffer position, 1/16 pixel
+    float q;                // 1 / w
+    float attributes[5];    // color, texcoord, over w
+  };
+
+  // A triangle once set up. Edge functions are a x + b y + c on 1/16
+  // pixel coordinates, positive inside, oriented whatever the winding.
+  struct Triangle {
+    int64_t a[3], b[3], c[3];
+    int64_t bias[3];        // inside when the edge function exceeds it
+    float inv_area;         // of the edge functions
+    float q[3];
+    float attributes[3][5];
+    // Screen space derivatives of u q, v q and q, for the mip level
+    float du[2], dv[2], dq[2];
+    int32_t min_x, min_y, max_x, max_y;   // pixels, inclusive
+    uint32_t features;
+    const SoftTexture *texture;
+  };
+
+  void SetupTriangle(const SoftDraw &draw, const Vertex &v0, const Vertex &v1,
+                     const Vertex &v2);
+  // Rasterizes the tile and writes it to pixels. Returns the pixels shaded.
+  uint64_t RasterTile(uint32_t tile, uint8_t *pixels);
+  // Fragment of t where its edge functions are e, written to color
+  void Shade(const Triangle &t, const int64_t e[3], float *color) const;
+  void Sample(const SoftTexture &texture, float u, float v, float lod,
+              float *rgb) const;
+  void Fetch(const SoftTexture &texture, const TextureLevel &level, int32_t x,
+             int32_t y, float *rgb) const;
+  uint8_t Encode(float v) const;
+
+  VkFormat format_;
+  VkExtent2D extent_;
+  unsigned threads_;
+  bool srgb_;
+  bool bgra_;
+  uint32_t tiles_x_;
+  uint32_t tiles_y_;
+
+  // Linear RGBA
+  std::vector<float> color_;
+  std::vector<Triangle> triangles_;
+  // Triangles touching each tile, in submission order
+  std::vector<std::vector<uint32_t>> bins_;
+  // sRGB decoding of 8 bit values, encoding of 12 bit linear ones
+  float srgb_to_linear_[256];
+  uint8_t linear_to_srgb_[4096];
+
+  Stats stats_ = {};
+};
+
+#endif // _SOFT_RASTER_H
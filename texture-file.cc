@@ -0,0 +1,351 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "texture-file.h"
+
+namespace {
+
+const uint8_t kKTX2Identifier[12] = {
+  0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+// KTX2 header, everything is little endian and we only run on little endian.
+struct KTX2Header {
+  uint8_t identifier[12];
+  uint32_t vkFormat;
+  uint32_t typeSize;
+  uint32_t pixelWidth;
+  uint32_t pixelHeight;
+  uint32_t pixelDepth;
+  uint32_t layerCount;
+  uint32_t faceCount;
+  uint32_t levelCount;
+  uint32_t supercompressionScheme;
+  uint32_t dfdByteOffset;
+  uint32_t dfdByteLength;
+  uint32_t kvdByteOffset;
+  uint32_t kvdByteLength;
+  uint64_t sgdByteOffset;
+  uint64_t sgdByteLength;
+};
+
+struct KTX2LevelIndex {
+  uint64_t byteOffset;
+  uint64_t byteLength;
+  uint64_t uncompressedByteLength;
+};
+
+#define DDS_FOURCC(a, b, c, d) \
+  ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+const uint32_t kDDSMagic = DDS_FOURCC('D', 'D', 'S', ' ');
+const uint32_t kDDSFlagMipMapCount = 0x20000;
+const uint32_t kDDSPixelFormatFourCC = 0x4;
+const uint32_t kDDSCaps2CubeMap = 0x200;
+const uint32_t kDDSCaps2Volume = 0x200000;
+const uint32_t kDXGIDimensionTexture2D = 3;
+
+struct DDSPixelFormat {
+  uint32_t dwSize;
+  uint32_t dwFlags;
+  uint32_t dwFourCC;
+  uint32_t dwRGBBitCount;
+  uint32_t dwRBitMask;
+  uint32_t dwGBitMask;
+  uint32_t dwBBitMask;
+  uint32_t dwABitMask;
+};
+
+struct DDSHeader {
+  uint32_t dwSize;
+  uint32_t dwFlags;
+  uint32_t dwHeight;
+  uint32_t dwWidth;
+  uint32_t dwPitchOrLinearSize;
+  uint32_t dwDepth;
+  uint32_t dwMipMapCount;
+  uint32_t dwReserved1[11];
+  DDSPixelFormat ddspf;
+  uint32_t dwCaps;
+  uint32_t dwCaps2;
+  uint32_t dwCaps3;
+  uint32_t dwCaps4;
+  uint32_t dwReserved2;
+};
+
+struct DDSHeaderDX10 {
+  uint32_t dxgiFormat;
+  uint32_t resourceDimension;
+  uint32_t miscFlag;
+  uint32_t arraySize;
+  uint32_t miscFlags2;
+};
+
+VkFormat DXGIToVkFormat(uint32_t dxgi) {
+  switch (dxgi) {
+    case 28: return VK_FORMAT_R8G8B8A8_UNORM;
+    case 29: return VK_FORMAT_R8G8B8A8_SRGB;
+    case 71: return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+    case 72: return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+    case 74: return VK_FORMAT_BC2_UNORM_BLOCK;
+    case 75: return VK_FORMAT_BC2_SRGB_BLOCK;
+    case 77: return VK_FORMAT_BC3_UNORM_BLOCK;
+    case 78: return VK_FORMAT_BC3_SRGB_BLOCK;
+    case 80: return VK_FORMAT_BC4_UNORM_BLOCK;
+    case 81: return VK_FORMAT_BC4_SNORM_BLOCK;
+    case 83: return VK_FORMAT_BC5_UNORM_BLOCK;
+    case 84: return VK_FORMAT_BC5_SNORM_BLOCK;
+    case 87: return VK_FORMAT_B8G8R8A8_UNORM;
+    case 91: return VK_FORMAT_B8G8R8A8_SRGB;
+    case 95: return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+    case 96: return VK_FORMAT_BC6H_SFLOAT_BLOCK;
+    case 98: return VK_FORMAT_BC7_UNORM_BLOCK;
+    case 99: return VK_FORMAT_BC7_SRGB_BLOCK;
+    default: return VK_FORMAT_UNDEFINED;
+  }
+}
+
+VkFormat DDSPixelFormatToVkFormat(const DDSPixelFormat &pf) {
+  if (pf.dwFlags & kDDSPixelFormatFourCC) {
+    switch (pf.dwFourCC) {
+      case DDS_FOURCC('D', 'X', 'T', '1'): return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+      case DDS_FOURCC('D', 'X', 'T', '3'): return VK_FORMAT_BC2_UNORM_BLOCK;
+      case DDS_FOURCC('D', 'X', 'T', '5'): return VK_FORMAT_BC3_UNORM_BLOCK;
+      case DDS_FOURCC('A', 'T', 'I', '1'):
+      case DDS_FOURCC('B', 'C', '4', 'U'): return VK_FORMAT_BC4_UNORM_BLOCK;
+      case DDS_FOURCC('A', 'T', 'I', '2'):
+      case DDS_FOURCC('B', 'C', '5', 'U'): return VK_FORMAT_BC5_UNORM_BLOCK;
+      default: return VK_FORMAT_UNDEFINED;
+    }
+  }
+  if (pf.dwRGBBitCount == 32 && pf.dwRBitMask == 0x000000ff &&
+      pf.dwBBitMask == 0x00ff0000)
+    return VK_FORMAT_R8G8B8A8_UNORM;
+  if (pf.dwRGBBitCount == 32 && pf.dwRBitMask == 0x00ff0000 &&
+      pf.dwBBitMask == 0x000000ff)
+    return VK_FORMAT_B8G8R8A8_UNORM;
+  return VK_FORMAT_UNDEFINED;
+}
+
+size_t LevelSize(VkFormat format, uint32_t width, uint32_t height) {
+  uint32_t bw, bh, bytes;
+  if (!GetFormatBlockInfo(format, &bw, &bh, &bytes))
+    return 0;
+  return (size_t) ((width + bw - 1) / bw) * ((height + bh - 1) / bh) * bytes;
+}
+
+// level is below MaxLevelCount(), shifting by 32 or more is undefined
+uint32_t MipDimension(uint32_t size, uint32_t level) {
+  uint32_t d = size >> level;
+  return d ? d : 1;
+}
+
+}  // namespace
+
+uint32_t MaxLevelCount(uint32_t width, uint32_t height) {
+  uint32_t size = width > height ? width : height;
+  uint32_t count = 0;
+  for (; size; size >>= 1)
+    count++;
+  return count;
+}
+
+bool GetFormatBlockInfo(VkFormat format, uint32_t *block_width,
+                        uint32_t *block_height, uint32_t *block_bytes) {
+  *block_width = 4;
+  *block_height = 4;
+  switch (format) {
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+    case VK_FORMAT_BC4_SNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+      *block_bytes = 8;
+      return true;
+    case VK_FORMAT_BC2_UNORM_BLOCK:
+    case VK_FORMAT_BC2_SRGB_BLOCK:
+    case VK_FORMAT_BC3_UNORM_BLOCK:
+    case VK_FORMAT_BC3_SRGB_BLOCK:
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC5_SNORM_BLOCK:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+    case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+    case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
+    case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+      *block_bytes = 16;
+      return true;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+      *block_width = 1;
+      *block_height = 1;
+      *block_bytes = 4;
+      return true;
+    default:
+      return false;
+  }
+}
+
+TextureFile::~TextureFile() {
+  Close();
+}
+
+bool TextureFile::Open(const char *path) {
+  Close();
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open texture %s\n", path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the descriptor
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Could not map texture %s\n", path);
+    return false;
+  }
+
+  data_ = (const uint8_t *) map;
+  size_ = st.st_size;
+  mapped_ = true;
+
+  bool ok = false;
+  if (size_ >= sizeof(kKTX2Identifier) &&
+      memcmp(data_, kKTX2Identifier, sizeof(kKTX2Identifier)) == 0) {
+    ok = ParseKTX2();
+  } else if (size_ >= 4 && memcmp(data_, &kDDSMagic, 4) == 0) {
+    ok = ParseDDS();
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Unsupported texture container %s\n", path);
+    Close();
+  }
+  return ok;
+}
+
+void TextureFile::InitSolid(uint32_t rgba) {
+  Close();
+  solid_ = rgba;
+  format_ = VK_FORMAT_R8G8B8A8_UNORM;
+  levels_.push_back({1, 1, (const uint8_t *) &solid_, sizeof(solid_)});
+}
+
+void TextureFile::Close() {
+  if (mapped_)
+    munmap((void *) data_, size_);
+  data_ = NULL;
+  size_ = 0;
+  mapped_ = false;
+  format_ = VK_FORMAT_UNDEFINED;
+  levels_.clear();
+}
+
+size_t TextureFile::ChainSize(uint32_t base) const {
+  size_t size = 0;
+  for (uint32_t i = base; i < levels_.size(); ++i)
+    size += levels_[i].size;
+  return size;
+}
+
+bool TextureFile::ParseKTX2() {
+  KTX2Header header;
+  if (size_ < sizeof(header))
+    return false;
+  memcpy(&header, data_, sizeof(header));
+
+  if (header.supercompressionScheme != 0 || header.pixelDepth > 1 ||
+      header.layerCount > 1 || header.faceCount != 1)
+    return false;
+
+  format_ = (VkFormat) header.vkFormat;
+  uint32_t level_count = header.levelCount ? header.levelCount : 1;
+  if (level_count > MaxLevelCount(header.pixelWidth, header.pixelHeight))
+    return false;
+
+  if (sizeof(header) + level_count * sizeof(KTX2LevelIndex) > size_)
+    return false;
+
+  for (uint32_t i = 0; i < level_count; ++i) {
+    KTX2LevelIndex index;
+    memcpy(&index, data_ + sizeof(header) + i * sizeof(index), sizeof(index));
+
+    TextureLevel level;
+    level.width = MipDimension(header.pixelWidth, i);
+    level.height = MipDimension(header.pixelHeight, i);
+    level.size = LevelSize(format_, level.width, level.height);
+    if (level.size == 0 || index.byteLength < level.size ||
+        index.byteOffset > size_ || level.size > size_ - index.byteOffset)
+      return false;
+    level.data = data_ + index.byteOffset;
+    levels_.push_back(level);
+  }
+  return true;
+}
+
+bool TextureFile::ParseDDS() {
+  DDSHeader header;
+  size_t offset = 4;
+  if (size_ < offset + sizeof(header))
+    return false;
+  memcpy(&header, data_ + offset, sizeof(header));
+  offset += sizeof(header);
+
+  if (header.dwCaps2 & (kDDSCaps2CubeMap | kDDSCaps2Volume))
+    return false;
+
+  if ((header.ddspf.dwFlags & kDDSPixelFormatFourCC) &&
+      header.ddspf.dwFourCC == DDS_FOURCC('D', 'X', '1', '0')) {
+    DDSHeaderDX10 dx10;
+    if (size_ < offset + sizeof(dx10))
+      return false;
+    memcpy(&dx10, data_ + offset, sizeof(dx10));
+    offset += sizeof(dx10);
+    if (dx10.resourceDimension != kDXGIDimensionTexture2D ||
+        dx10.arraySize > 1)
+      return false;
+    format_ = DXGIToVkFormat(dx10.dxgiFormat);
+  } else {
+    format_ = DDSPixelFormatToVkFormat(header.ddspf);
+  }
+  if (format_ == VK_FORMAT_UNDEFINED)
+    return false;
+
+  uint32_t level_count = 1;
+  if ((header.dwFlags & kDDSFlagMipMapCount) && header.dwMipMapCount > 0)
+    level_count = header.dwMipMapCount;
+  if (level_count > MaxLevelCount(header.dwWidth, header.dwHeight))
+    return false;
+
+  // DDS levels are tightly packed one after the other
+  for (uint32_t i = 0; i < level_count; ++i) {
+    TextureLevel level;
+    level.width = MipDimension(header.dwWidth, i);
+    level.height = MipDimension(header.dwHeight, i);
+    level.size = LevelSize(format_, level.width, level.height);
+    if (level.size > size_ - offset)
+      return false;
+    level.data = data_ + offset;
+    offset += level.size;
+    levels_.push_back(level);
+  }
+  return true;
+}
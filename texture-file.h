@@ -0,0 +1,64 @@
+#ifndef _TEXTURE_FILE_H
+#define _TEXTURE_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// A single mip level as it sits in the container. Block compressed formats
+// are kept compressed, the data pointer goes straight into the mapping.
+struct TextureLevel {
+  uint32_t width;
+  uint32_t height;
+  const uint8_t *data;
+  size_t size;
+};
+
+// Read-only view over a KTX2 or DDS file mmap'd in memory.
+// Only 2D, single layer, single face and non supercompressed files are
+// supported. Levels are ordered from the largest (0) to the smallest.
+class TextureFile {
+public:
+  TextureFile() {}
+  ~TextureFile();
+
+  bool Open(const char *path);
+  // 1x1 R8G8B8A8 texture, handy as a placeholder when there is no file.
+  void InitSolid(uint32_t rgba);
+  void Close();
+
+  VkFormat format() const { return format_; }
+  uint32_t width() const { return levels_.empty() ? 0 : levels_[0].width; }
+  uint32_t height() const { return levels_.empty() ? 0 : levels_[0].height; }
+  uint32_t level_count() const { return levels_.size(); }
+  const TextureLevel &level(uint32_t i) const { return levels_[i]; }
+
+  // Bytes needed to keep levels [base, level_count()) around.
+  size_t ChainSize(uint32_t base) const;
+
+private:
+  bool ParseKTX2();
+  bool ParseDDS();
+
+  const uint8_t *data_ = NULL;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  uint32_t solid_ = 0;
+
+  VkFormat format_ = VK_FORMAT_UNDEFINED;
+  std::vector<TextureLevel> levels_;
+};
+
+// Block size in texels and bytes per block of the formats we can upload.
+// Uncompressed formats are reported as 1x1 blocks. Returns false for
+// unknown formats.
+bool GetFormatBlockInfo(VkFormat format, uint32_t *block_width,
+                        uint32_t *block_height, uint32_t *block_bytes);
+
+// Levels of a full mip chain down to 1x1, at most 32, 0 when both sides
+// are 0. Anything claiming more levels is broken.
+uint32_t MaxLevelCount(uint32_t width, uint32_t height);
+
+#endif // _TEXTURE_FILE_H
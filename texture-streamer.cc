@@ -0,0 +1,660 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "texture-streamer.h"
+#include "vulkan-utils.h"
+
+namespace {
+
+// Levels this size or smaller are uploaded at load time and never evicted
+const uint32_t kTailSize = 64;
+
+// Copy offsets have to be aligned to the texel block size (and to 4)
+const VkDeviceSize kLevelAlignment = 16;
+
+VkDeviceSize AlignUp(VkDeviceSize v, VkDeviceSize a) {
+  return (v + a - 1) & ~(a - 1);
+}
+
+}  // namespace
+
+TextureStreamer::TextureStreamer(VkPhysicalDevice physical_device,
+                                 VkDevice device, const DeviceQueue &upload,
+                                 const DeviceQueue &graphics,
+                                 GpuTimeline *timeline, VkDeviceSize budget)
+  : physical_device_(physical_device), device_(device), upload_(upload),
+    graphics_(graphics), timeline_(timeline), budget_(budget) {
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.queueFamilyIndex = upload_.family;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+    VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  VK_CHECK_RESULT(
+    vkCreateCommandPool(device_, &poolInfo, NULL, &command_pool_));
+
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.commandPool = command_pool_;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+  VK_CHECK_RESULT(
+    vkAllocateCommandBuffers(device_, &allocInfo, &command_buffer_));
+
+  VkFenceCreateInfo fenceInfo = {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VK_CHECK_RESULT(vkCreateFence(device_, &fenceInfo, NULL, &fence_));
+
+  bool transfer = upload_.family != graphics_.family;
+  if (transfer) {
+    poolInfo.queueFamilyIndex = graphics_.family;
+    VK_CHECK_RESULT(
+      vkCreateCommandPool(device_, &poolInfo, NULL, &acquire_pool_));
+    allocInfo.commandPool = acquire_pool_;
+    VK_CHECK_RESULT(
+      vkAllocateCommandBuffers(device_, &allocInfo, &acquire_buffer_));
+
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VK_CHECK_RESULT(
+      vkCreateSemaphore(device_, &semaphoreInfo, NULL, &semaphore_));
+  }
+
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &familyCount, NULL);
+  std::vector<VkQueueFamilyProperties> families(familyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &familyCount,
+                                           families.data());
+  timestamp_bits_ = families[upload_.family].timestampValidBits;
+  if (!timeline_ || timestamp_bits_ == 0)
+    return;
+
+  VkQueryPoolCreateInfo queryInfo = {};
+  queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryInfo.queryCount = 4;
+  VK_CHECK_RESULT(vkCreateQueryPool(device_, &queryInfo, NULL, &query_pool_));
+  if (!transfer)
+    return;
+
+  // Queries start out unavailable and have to be reset once before use
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(acquire_buffer_, &beginInfo);
+  vkCmdResetQueryPool(acquire_buffer_, query_pool_, 0, 4);
+  VK_CHECK_RESULT(vkEndCommandBuffer(acquire_buffer_));
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &acquire_buffer_;
+  {
+    std::lock_guard<std::mutex> queue_lock(*graphics_.mutex);
+    VK_CHECK_RESULT(vkQueueSubmit(graphics_.queue, 1, &submitInfo, fence_));
+  }
+  VK_CHECK_RESULT(vkWaitForFences(device_, 1, &fence_, VK_TRUE, UINT64_MAX));
+  VK_CHECK_RESULT(vkResetFences(device_, 1, &fence_));
+}
+
+TextureStreamer::~TextureStreamer() {
+  Stop();
+  ReleaseRetired(UINT64_MAX);
+  for (auto &t : textures_) {
+    Destroy(&t->current);
+    if (t->has_pending)
+      Destroy(&t->pending);
+  }
+  if (staging_buffer_ != VK_NULL_HANDLE) {
+    vkUnmapMemory(device_, staging_memory_);
+    vkDestroyBuffer(device_, staging_buffer_, NULL);
+    vkFreeMemory(device_, staging_memory_, NULL);
+  }
+  if (query_pool_ != VK_NULL_HANDLE)
+    vkDestroyQueryPool(device_, query_pool_, NULL);
+  if (acquire_pool_ != VK_NULL_HANDLE) {
+    vkDestroySemaphore(device_, semaphore_, NULL);
+    vkDestroyCommandPool(device_, acquire_pool_, NULL);
+  }
+  vkDestroyFence(device_, fence_, NULL);
+  vkDestroyCommandPool(device_, command_pool_, NULL);
+}
+
+void TextureStreamer::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_)
+    return;
+  running_ = true;
+  thread_ = std::thread(&TextureStreamer::Run, this);
+}
+
+void TextureStreamer::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_)
+      return;
+    running_ = false;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+uint32_t TextureStreamer::Load(const char *path) {
+  std::unique_ptr<Texture> texture(new Texture());
+  if (!texture->file.Open(path))
+    return UINT32_MAX;
+  return AddTexture(std::move(texture));
+}
+
+uint32_t TextureStreamer::LoadSolid(uint32_t rgba) {
+  std::unique_ptr<Texture> texture(new Texture());
+  texture->file.InitSolid(rgba);
+  return AddTexture(std::move(texture));
+}
+
+uint32_t TextureStreamer::AddTexture(std::unique_ptr<Texture> texture) {
+  const TextureFile &file = texture->file;
+
+  uint32_t tail = file.level_count() - 1;
+  for (uint32_t i = 0; i < file.level_count(); ++i) {
+    const TextureLevel &level = file.level(i);
+    if (std::max(level.width, level.height) <= kTailSize) {
+      tail = i;
+      break;
+    }
+  }
+  texture->tail_level = tail;
+
+  if (!Upload(file, tail, &texture->current))
+    return UINT32_MAX;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  resident_bytes_ += texture->current.size;
+  committed_bytes_ += texture->current.size;
+  textures_.push_back(std::move(texture));
+  return textures_.size() - 1;
+}
+
+void TextureStreamer::SetScreenSize(uint32_t id, float pixels) {
+  bool notify = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Texture &t = *textures_[id];
+    uint32_t before = WantedLevel(t);
+    t.screen_size = pixels;
+    if (pixels > 0.0f)
+      t.last_used = ++use_clock_;
+    if (WantedLevel(t) != before) {
+      dirty_ = true;
+      notify = true;
+    }
+  }
+  if (notify)
+    cv_.notify_one();
+}
+
+bool TextureStreamer::Update(uint32_t id, VkImageView *view,
+                             uint64_t retire_value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (error_ != VK_SUCCESS)
+    throw VulkanError(error_, "texture upload", __FILE__, __LINE__);
+  Texture &t = *textures_[id];
+  if (!t.has_pending)
+    return false;
+
+  retired_.push_back(t.current);
+  retired_.back().retire_value = retire_value;
+  t.current = t.pending;
+  t.pending = Resident();
+  t.has_pending = false;
+  *view = t.current.view;
+
+  // The streaming thread might be waiting on this swap to go on
+  dirty_ = true;
+  cv_.notify_one();
+  return true;
+}
+
+VkImageView TextureStreamer::view(uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return textures_[id]->current.view;
+}
+
+const TextureFile &TextureStreamer::file(uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return textures_[id]->file;
+}
+
+uint32_t TextureStreamer::base_level(uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return textures_[id]->current.base_level;
+}
+
+void TextureStreamer::ReleaseRetired(uint64_t completed) {
+  std::vector<Resident> retired;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t kept = 0;
+    for (const Resident &r : retired_) {
+      if (r.retire_value <= completed) {
+        retired.push_back(r);
+        resident_bytes_ -= r.size;
+      } else {
+        retired_[kept++] = r;
+      }
+    }
+    retired_.resize(kept);
+  }
+  for (Resident &r : retired)
+    Destroy(&r);
+}
+
+TextureStreamer::Stats TextureStreamer::GetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = {};
+  stats.uploaded_bytes = uploaded_bytes_;
+  stats.uploads = uploads_;
+  stats.upload_seconds = upload_seconds_;
+  stats.upload_bandwidth =
+    upload_seconds_ > 0.0 ? uploaded_bytes_ / upload_seconds_ : 0.0;
+  stats.resident_bytes = resident_bytes_;
+  stats.committed_bytes = committed_bytes_;
+  stats.budget_bytes = budget_;
+  stats.textures = textures_.size();
+  stats.evictions = evictions_;
+  for (const auto &t : textures_) {
+    stats.total_levels += t->file.level_count();
+    stats.resident_levels += t->file.level_count() - t->current.base_level;
+  }
+  return stats;
+}
+
+uint32_t TextureStreamer::WantedLevel(const Texture &t) const {
+  if (t.screen_size <= 0.0f)
+    return t.tail_level;
+  float size = std::max(t.file.width(), t.file.height());
+  float ratio = size / t.screen_size;
+  if (ratio <= 1.0f)
+    return 0;
+  return std::min((uint32_t) floorf(log2f(ratio)), t.tail_level);
+}
+
+// Called with mutex_ held.
+bool TextureStreamer::PickJob(Job *job) {
+  // The most magnified texture gets refined first
+  Texture *best = NULL;
+  float best_priority = 0.0f;
+  for (auto &t : textures_) {
+    if (t->has_pending || t->busy || t->failed)
+      continue;
+    uint32_t target = TargetLevel(*t);
+    if (target <= WantedLevel(*t))
+      continue;
+    const TextureLevel &level = t->file.level(target);
+    float priority = t->screen_size / std::max(level.width, level.height);
+    if (!best || priority > best_priority) {
+      best = t.get();
+      best_priority = priority;
+    }
+  }
+  if (!best)
+    return false;
+
+  uint32_t base = TargetLevel(*best) - 1;
+  if (committed_bytes_ - TargetSize(*best) + best->file.ChainSize(base) <=
+      budget_) {
+    job->texture = best;
+    job->base_level = base;
+    job->eviction = false;
+    return true;
+  }
+
+  // Over budget: drop the least recently used texture holding more levels
+  // than it currently needs.
+  Texture *victim = NULL;
+  for (auto &t : textures_) {
+    if (t.get() == best || t->has_pending || t->busy || t->failed)
+      continue;
+    if (TargetLevel(*t) >= WantedLevel(*t))
+      continue;
+    if (!victim || t->last_used < victim->last_used)
+      victim = t.get();
+  }
+  if (!victim)
+    return false;
+
+  job->texture = victim;
+  job->base_level = WantedLevel(*victim);
+  job->eviction = true;
+  return true;
+}
+
+void TextureStreamer::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    Job job;
+    if (!PickJob(&job)) {
+      dirty_ = false;
+      cv_.wait(lock, [this]{ return !running_ || dirty_; });
+      continue;
+    }
+
+    Texture *t = job.texture;
+    t->busy = true;
+    lock.unlock();
+
+    Resident resident;
+    bool ok;
+    VkResult error = VK_SUCCESS;
+    try {
+      ok = Upload(t->file, job.base_level, &resident);
+    } catch (const VulkanError &e) {
+      fprintf(stderr, "Texture streaming stopped: %s\n", e.what());
+      error = e.result();
+      ok = false;
+    }
+
+    lock.lock();
+    t->busy = false;
+    if (error != VK_SUCCESS) {
+      // The render thread throws it, the streamer goes away with the device
+      error_ = error;
+      return;
+    }
+    if (!ok) {
+      // Upload() said why
+      t->failed = true;
+      continue;
+    }
+
+    committed_bytes_ += resident.size;
+    committed_bytes_ -= TargetSize(*t);
+    resident_bytes_ += resident.size;
+    if (job.eviction)
+      evictions_++;
+    t->pending = resident;
+    t->has_pending = true;
+  }
+}
+
+bool TextureStreamer::Upload(const TextureFile &file, uint32_t base_level,
+                             Resident *out) {
+  const TextureLevel &top = file.level(base_level);
+  uint32_t levels = file.level_count() - base_level;
+
+  VkImageCreateInfo imageInfo = {};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = file.format();
+  imageInfo.extent = {top.width, top.height, 1};
+  imageInfo.mipLevels = levels;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  VkFormatProperties formatProperties;
+  vkGetPhysicalDeviceFormatProperties(physical_device_, file.format(),
+                                      &formatProperties);
+  if (!(formatProperties.optimalTilingFeatures &
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+    fprintf(stderr, "Texture format %d can't be sampled on this device\n",
+            (int) file.format());
+    return false;
+  }
+
+  Resident r;
+  r.base_level = base_level;
+  if (vkCreateImage(device_, &imageInfo, NULL, &r.image) != VK_SUCCESS) {
+    fprintf(stderr, "Could not create a %ux%u texture image\n",
+            top.width, top.height);
+    return false;
+  }
+
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device_, r.image, &memRequirements);
+
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = memRequirements.size;
+  allocInfo.memoryTypeIndex = FindMemoryType(physical_device_,
+    memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  if (allocInfo.memoryTypeIndex == UINT32_MAX) {
+    fprintf(stderr, "No device local memory for a %ux%u texture image\n",
+            top.width, top.height);
+    vkDestroyImage(device_, r.image, NULL);
+    return false;
+  }
+  // Out of device memory gets the device rebuilt with a smaller budget
+  VkResult allocated = vkAllocateMemory(device_, &allocInfo, NULL, &r.memory);
+  if (allocated != VK_SUCCESS) {
+    vkDestroyImage(device_, r.image, NULL);
+    throw VulkanError(allocated, "vkAllocateMemory", __FILE__, __LINE__);
+  }
+  r.size = memRequirements.size;
+  VK_CHECK_RESULT(vkBindImageMemory(device_, r.image, r.memory, 0));
+
+  std::lock_guard<std::mutex> upload_lock(upload_mutex_);
+  auto start = std::chrono::steady_clock::now();
+
+  // Block compressed data is copied as it is, no decoding on the CPU
+  VkDeviceSize staging_size = 0;
+  for (uint32_t i = base_level; i < file.level_count(); ++i)
+    staging_size = AlignUp(staging_size, kLevelAlignment) + file.level(i).size;
+  if (!EnsureStaging(staging_size)) {
+    vkDestroyImage(device_, r.image, NULL);
+    vkFreeMemory(device_, r.memory, NULL);
+    return false;
+  }
+
+  std::vector<VkBufferImageCopy> regions(levels);
+  VkDeviceSize offset = 0;
+  for (uint32_t i = 0; i < levels; ++i) {
+    const TextureLevel &level = file.level(base_level + i);
+    offset = AlignUp(offset, kLevelAlignment);
+    memcpy((uint8_t *) staging_data_ + offset, level.data, level.size);
+
+    VkBufferImageCopy &region = regions[i];
+    region = {};
+    region.bufferOffset = offset;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = i;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = {level.width, level.height, 1};
+    offset += level.size;
+  }
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(command_buffer_, &beginInfo);
+
+  bool transfer = upload_.family != graphics_.family;
+  uint32_t query = query_pair_ * 2;
+  if (query_pool_ != VK_NULL_HANDLE) {
+    if (!transfer)
+      vkCmdResetQueryPool(command_buffer_, query_pool_, query, 2);
+    vkCmdWriteTimestamp(command_buffer_, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        query_pool_, query);
+  }
+
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = r.image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = levels;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+                       1, &barrier);
+
+  vkCmdCopyBufferToImage(command_buffer_, staging_buffer_, r.image,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         regions.size(), regions.data());
+
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  if (transfer) {
+    // Release, the graphics family acquires it below
+    barrier.srcQueueFamilyIndex = upload_.family;
+    barrier.dstQueueFamilyIndex = graphics_.family;
+    barrier.dstAccessMask = 0;
+    vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+  } else {
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+  }
+  if (query_pool_ != VK_NULL_HANDLE)
+    vkCmdWriteTimestamp(command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        query_pool_, query + 1);
+  VK_CHECK_RESULT(vkEndCommandBuffer(command_buffer_));
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &command_buffer_;
+  submitInfo.signalSemaphoreCount = transfer ? 1 : 0;
+  submitInfo.pSignalSemaphores = &semaphore_;
+  {
+    std::lock_guard<std::mutex> queue_lock(*upload_.mutex);
+    VK_CHECK_RESULT(vkQueueSubmit(upload_.queue, 1, &submitInfo,
+                                  transfer ? VK_NULL_HANDLE : fence_));
+  }
+
+  if (transfer) {
+    vkBeginCommandBuffer(acquire_buffer_, &beginInfo);
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(acquire_buffer_, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &barrier);
+    if (query_pool_ != VK_NULL_HANDLE)
+      vkCmdResetQueryPool(acquire_buffer_, query_pool_, (query + 2) % 4, 2);
+    VK_CHECK_RESULT(vkEndCommandBuffer(acquire_buffer_));
+
+    // Waiting at the fragment stage is enough, that's the only one reading
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    VkSubmitInfo acquireInfo = {};
+    acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    acquireInfo.waitSemaphoreCount = 1;
+    acquireInfo.pWaitSemaphores = &semaphore_;
+    acquireInfo.pWaitDstStageMask = &waitStage;
+    acquireInfo.commandBufferCount = 1;
+    acquireInfo.pCommandBuffers = &acquire_buffer_;
+    std::lock_guard<std::mutex> queue_lock(*graphics_.mutex);
+    VK_CHECK_RESULT(vkQueueSubmit(graphics_.queue, 1, &acquireInfo, fence_));
+  }
+  VK_CHECK_RESULT(vkWaitForFences(device_, 1, &fence_, VK_TRUE, UINT64_MAX));
+  VK_CHECK_RESULT(vkResetFences(device_, 1, &fence_));
+
+  if (query_pool_ != VK_NULL_HANDLE) {
+    uint64_t timestamps[2];
+    if (vkGetQueryPoolResults(device_, query_pool_, query, 2, sizeof(timestamps),
+                              timestamps, sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+      timeline_->Add(GpuTimeline::TRANSFER, timestamps[0], timestamps[1],
+                     timestamp_bits_);
+    query_pair_ ^= 1;
+  }
+
+  VkImageViewCreateInfo viewInfo = {};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = r.image;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.format = file.format();
+  viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+  viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+  viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+  viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+  viewInfo.subresourceRange = barrier.subresourceRange;
+  VK_CHECK_RESULT(vkCreateImageView(device_, &viewInfo, NULL, &r.view));
+
+  double seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploaded_bytes_ += offset;
+    uploads_++;
+    upload_seconds_ += seconds;
+  }
+
+  *out = r;
+  return true;
+}
+
+// Called with upload_mutex_ held.
+bool TextureStreamer::EnsureStaging(VkDeviceSize size) {
+  if (size <= staging_size_)
+    return true;
+
+  if (staging_buffer_ != VK_NULL_HANDLE) {
+    vkUnmapMemory(device_, staging_memory_);
+    vkDestroyBuffer(device_, staging_buffer_, NULL);
+    vkFreeMemory(device_, staging_memory_, NULL);
+    staging_buffer_ = VK_NULL_HANDLE;
+    staging_size_ = 0;
+  }
+
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = size;
+  bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VK_CHECK_RESULT(vkCreateBuffer(device_, &bufferInfo, NULL, &staging_buffer_));
+
+  VkMemoryRequirements memRequirements;
+  vkGetBufferMemoryRequirements(device_, staging_buffer_, &memRequirements);
+
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = memRequirements.size;
+  allocInfo.memoryTypeIndex = FindMemoryType(physical_device_,
+    memRequirements.memoryTypeBits,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (allocInfo.memoryTypeIndex == UINT32_MAX) {
+    fprintf(stderr, "No host visible memory for texture staging\n");
+    vkDestroyBuffer(device_, staging_buffer_, NULL);
+    staging_buffer_ = VK_NULL_HANDLE;
+    return false;
+  }
+  VkResult allocated =
+    vkAllocateMemory(device_, &allocInfo, NULL, &staging_memory_);
+  if (allocated != VK_SUCCESS) {
+    vkDestroyBuffer(device_, staging_buffer_, NULL);
+    staging_buffer_ = VK_NULL_HANDLE;
+    throw VulkanError(allocated, "vkAllocateMemory", __FILE__, __LINE__);
+  }
+  VK_CHECK_RESULT(
+    vkBindBufferMemory(device_, staging_buffer_, staging_memory_, 0));
+
+  // Persistently mapped
+  VK_CHECK_RESULT(
+    vkMapMemory(device_, staging_memory_, 0, size, 0, &staging_data_));
+  staging_size_ = size;
+  return true;
+}
+
+void TextureStreamer::Destroy(Resident *r) {
+  vkDestroyImageView(device_, r->view, NULL);
+  vkDestroyImage(device_, r->image, NULL);
+  vkFreeMemory(device_, r->memory, NULL);
+  *r = Resident();
+}
@@ -0,0 +1,176 @@
+#ifndef _TEXTURE_STREAMER_H
+#define _TEXTURE_STREAMER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "texture-file.h"
+#include "gpu-timeline.h"
+#include "vulkan-utils.h"
+
+// Streams the mip chain of mmap'd textures to the GPU on a background thread.
+//
+// Each texture starts with only its coarse tail resident and gets refined one
+// level at a time, most magnified texture first, based on the screen size
+// reported by the renderer. Residency is kept within a fixed budget: when a
+// refinement doesn't fit, the least recently used textures that hold more
+// levels than they currently need are dropped back down.
+//
+// A residency change is a brand new image holding levels [base, count), which
+// the render thread picks up with Update() and has to rebind.
+//
+// Uploads go to their own queue when the device has a transfer family, in
+// which case images are released to the graphics family and acquired there
+// before being handed out.
+class TextureStreamer {
+public:
+  struct Stats {
+    uint64_t uploaded_bytes;
+    uint64_t uploads;
+    double upload_seconds;
+    double upload_bandwidth;  // bytes per second while uploading
+    uint64_t resident_bytes;  // device memory held by texture images
+    uint64_t committed_bytes; // what counts against the budget
+    uint64_t budget_bytes;
+    uint32_t textures;
+    uint32_t resident_levels;
+    uint32_t total_levels;
+    uint64_t evictions;
+  };
+
+  // Upload timestamps go to timeline when not NULL.
+  TextureStreamer(VkPhysicalDevice physical_device, VkDevice device,
+                  const DeviceQueue &upload, const DeviceQueue &graphics,
+                  GpuTimeline *timeline, VkDeviceSize budget);
+  ~TextureStreamer();
+
+  void Start();
+  void Stop();
+
+  // Registers a texture and synchronously uploads its coarse tail, so that it
+  // can be bound right away. Returns UINT32_MAX on failure.
+  uint32_t Load(const char *path);
+  uint32_t LoadSolid(uint32_t rgba);
+
+  // Largest side of the texture as projected on screen, in pixels.
+  // 0 means not visible.
+  void SetScreenSize(uint32_t id, float pixels);
+
+  // Render thread only. Returns true when a new residency for the texture is
+  // ready, in which case view has to be rebound by the caller. The replaced
+  // image is retired until the GPU reaches retire_value, the timeline value
+  // of the last submission that may still use it. Throws the VulkanError
+  // that stopped streaming, if any.
+  bool Update(uint32_t id, VkImageView *view, uint64_t retire_value);
+  VkImageView view(uint32_t id);
+
+  // Source and first level of what view() currently holds.
+  const TextureFile &file(uint32_t id);
+  uint32_t base_level(uint32_t id);
+
+  // Render thread only. Destroys the images replaced by Update() whose
+  // retire value is at most completed.
+  void ReleaseRetired(uint64_t completed);
+
+  Stats GetStats();
+
+private:
+  struct Resident {
+    VkImage image = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t base_level = 0;
+    // Only meaningful once retired
+    uint64_t retire_value = 0;
+  };
+
+  struct Texture {
+    TextureFile file;
+    Resident current;
+    Resident pending;
+    bool has_pending = false;
+    bool busy = false;
+    // An upload failed in a way that doesn't go away by trying again, like
+    // a format the device can't sample: the texture keeps what it has.
+    bool failed = false;
+    // Coarsest level worth streaming: everything below is always resident.
+    uint32_t tail_level = 0;
+    float screen_size = 0.0f;
+    uint64_t last_used = 0;
+  };
+
+  struct Job {
+    Texture *texture;
+    uint32_t base_level;
+    bool eviction;
+  };
+
+  uint32_t AddTexture(std::unique_ptr<Texture> texture);
+  uint32_t WantedLevel(const Texture &t) const;
+  uint32_t TargetLevel(const Texture &t) const {
+    return t.has_pending ? t.pending.base_level : t.current.base_level;
+  }
+  VkDeviceSize TargetSize(const Texture &t) const {
+    return t.has_pending ? t.pending.size : t.current.size;
+  }
+  bool PickJob(Job *job);
+  void Run();
+
+  bool Upload(const TextureFile &file, uint32_t base_level, Resident *out);
+  // Prints why and returns false when there is no memory type for it
+  bool EnsureStaging(VkDeviceSize size);
+  void Destroy(Resident *r);
+
+  VkPhysicalDevice physical_device_;
+  VkDevice device_;
+  DeviceQueue upload_;
+  DeviceQueue graphics_;
+  GpuTimeline *timeline_;
+  VkDeviceSize budget_;
+
+  // Everything below is protected by mutex_
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool running_ = false;
+  bool dirty_ = false;
+  VkResult error_ = VK_SUCCESS;
+  uint64_t use_clock_ = 0;
+  std::vector<std::unique_ptr<Texture>> textures_;
+  std::vector<Resident> retired_;
+  VkDeviceSize resident_bytes_ = 0;
+  VkDeviceSize committed_bytes_ = 0;
+  uint64_t uploaded_bytes_ = 0;
+  uint64_t uploads_ = 0;
+  double upload_seconds_ = 0.0;
+  uint64_t evictions_ = 0;
+
+  // Upload state, protected by upload_mutex_
+  std::mutex upload_mutex_;
+  VkCommandPool command_pool_;
+  VkCommandBuffer command_buffer_;
+  VkFence fence_;
+  // Ownership transfer to graphics_, only when the families differ
+  VkCommandPool acquire_pool_ = VK_NULL_HANDLE;
+  VkCommandBuffer acquire_buffer_;
+  VkSemaphore semaphore_ = VK_NULL_HANDLE;
+  // Two begin/end timestamp pairs used in turn: a dedicated transfer family
+  // can't reset queries, so the acquire resets the pair of the next upload.
+  VkQueryPool query_pool_ = VK_NULL_HANDLE;
+  uint32_t query_pair_ = 0;
+  uint32_t timestamp_bits_ = 0;
+  VkBuffer staging_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory_ = VK_NULL_HANDLE;
+  VkDeviceSize staging_size_ = 0;
+  void *staging_data_ = NULL;
+
+  std::thread thread_;
+};
+
+#endif // _TEXTURE_STREAMER_H
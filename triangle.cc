@@ -1,15 +1,23 @@
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <iostream>
 #include <string.h>
+#include <math.h>
 #include <vector>
 #include <assert.h>
-#include <fstream>
 #include <limits>
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <array>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
 
 #include <chrono>
 
@@ -18,10 +26,49 @@
 
 #include "vulkan-utils.h"
 #include "vulkan-core.h"
+#include "texture-streamer.h"
+#include "frame-capture.h"
+#include "init-scheduler.h"
+#include "device-select.h"
+#include "gpu-timeline.h"
+#include "frame-scheduler.h"
+#include "mesh-lod.h"
+#include "scene.h"
+#include "frame-allocator.h"
+#include "frame-export.h"
+#include "pipeline-variants.h"
+#include "metrics.h"
+#include "draw-queue.h"
+#include "shader-compile.h"
+
+// SPIR-V made by the build, see the Makefile
+#include "triangle.vert.spv.h"
+#include "triangle.frag.spv.h"
+
+// Device memory the texture streamer is allowed to keep resident
+#define TEXTURE_BUDGET (64 << 20)
+// Frames the CPU can get ahead of the GPU
+#define FRAMES_IN_FLIGHT 2
+// Frames before the render loop is expected to stop allocating
+#define WARMUP_FRAMES 100
+// Mesh LODs: how far a level may stray from the full mesh on screen
+#define LOD_MAX_PIXEL_ERROR 1.0f
+#define LOD_MAX_LEVELS 8
+// Readback slots: the frames in flight plus some for the writer to work on
+#define EXPORT_RING (FRAMES_IN_FLIGHT + 2)
+// Device rebuilds allowed within RECOVERY_WINDOW seconds before giving up
+#define MAX_RECOVERIES 3
+#define RECOVERY_WINDOW 60
+// Frames between copies of the GetStats() totals into the metrics
+#define METRICS_INTERVAL 30
+// Shader features, specialization constant 0 of triangle.frag
+#define FEATURE_TEXTURE 0x1u
+#define FEATURE_VERTEX_COLOR 0x2u
 
 struct Vertex {
   glm::vec2 pos;
   glm::vec3 color;
+  glm::vec2 texCoord;
 
   static VkVertexInputBindingDescription getBindingDescription() {
     VkVertexInputBindingDescription bindingDescription = {};
@@ -31,8 +78,8 @@ struct Vertex {
     return bindingDescription;
   }
 
-  static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
-    std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions = {};
+  static std::array<VkVertexInputAttributeDescription, 3> getAttributeDescriptions() {
+    std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions = {};
     attributeDescriptions[0].binding = 0;
     attributeDescriptions[0].location = 0;
     attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
@@ -43,6 +90,11 @@ struct Vertex {
     attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
     attributeDescriptions[1].offset = offsetof(Vertex, color);
 
+    attributeDescriptions[2].binding = 0;
+    attributeDescriptions[2].location = 2;
+    attributeDescriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
+    attributeDescriptions[2].offset = offsetof(Vertex, texCoord);
+
     return attributeDescriptions;
   }
 };
@@ -55,86 +107,272 @@ struct UniformBufferObject {
 
 class Triangle : public VulkanCore {
 public:
-  Triangle() {}
-
-  void CreateWindow(uint32_t x, uint32_t y, uint16_t width, uint16_t height);
-  void InitVulkan() {
-    InitVulkanInstance();
-    InitVulkanPhysicalDevice();
-    CreateSurface();
-    //DrawFrame();
+  Triangle() {
+    const char *validation = getenv("TRIANGLE_VALIDATION");
+    if (validation)
+      validation_ = atoi(validation) != 0;
+    device_group_mode_ = ParseDeviceGroupMode(getenv("TRIANGLE_DEVICE_GROUP"));
+    CreateMetrics();
   }
+
+  // Window and Vulkan setup, independent steps run in parallel.
+  void Init(uint32_t x, uint32_t y, uint16_t width, uint16_t height);
   void Loop();
 
-  void LoadShaderModule(const char *path, VkShaderModule *module);
+  void LoadShaderModule(const std::vector<uint32_t> &code,
+                        VkShaderStageFlagBits stage, VkShaderModule *module);
+
+  // KTX2 or DDS file to stream, a plain white texture is used otherwise.
+  void SetTexturePath(const char *path) { texture_path_ = path; }
+  // Records everything submitted from now on, see frame-capture.h.
+  bool SetCapturePath(const char *path) { return capture_.Open(path); }
+  // Compiles the GLSL shaders of directory at startup instead of using the
+  // SPIR-V built in, for working on them. See shader-compile.h.
+  void SetShaderDirectory(const char *directory) { shader_directory_ = directory; }
+  // Writes the presented frames out, see frame-export.h. Frames are
+  // dropped rather than slowing rendering down when the writer lags.
+  void SetExportSpec(const char *spec) { export_spec_ = spec; }
+  // Serves the metrics, see metrics.h.
+  bool ServeMetrics(const char *spec) { return metrics_.Serve(spec); }
 
 private:
 
   const char *application_name_ = "Triangle";
 
   const std::vector<Vertex> vertices_ = {
-    {{-0.5f, -0.5f}, {1.0f, 0.0f, 0.0f}},
-    {{0.5f, -0.5f}, {0.0f, 1.0f, 0.0f}},
-    {{0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}},
-    {{-0.5f, 0.5f}, {1.0f, 1.0f, 1.0f}}
+    {{-0.5f, -0.5f}, {1.0f, 0.0f, 0.0f}, {0.0f, 0.0f}},
+    {{0.5f, -0.5f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
+    {{0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f}},
+    {{-0.5f, 0.5f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}}
   };
 
   const std::vector<uint16_t> indices_ = {
       0, 1, 2, 2, 3, 0
   };
 
+  // Simplified levels of the mesh, all of them in index_buffer_. lod_ is
+  // the level the instance is drawn with.
+  LodChain lod_chain_;
+  uint32_t lod_ = 0;
+
+  // The quad is the one object of the scene, culled like any other
+  Scene scene_;
+  Scene::Object quad_ = UINT32_MAX;
+  std::vector<Scene::Object> visible_;
+
   // Shader stuff
   VkShaderModule shader_module_;
-
-  // Vulkan stuff
-  VkDevice device_;
+  const char *shader_directory_ = NULL;
+  std::vector<uint32_t> vertex_code_;
+  std::vector<uint32_t> fragment_code_;
+
+  // Frame capture, ids of the objects as named in the capture file
+  FrameCapture capture_;
+  std::map<VkShaderModule, uint32_t> capture_shaders_;
+  uint32_t capture_pipeline_;
+  uint32_t capture_vertex_buffer_;
+  uint32_t capture_index_buffer_;
+  uint32_t capture_uniform_buffer_;
+  uint32_t capture_texture_;
+
+  // Frame export
+  const char *export_spec_ = NULL;
+  std::unique_ptr<FrameExporter> exporter_;
+
+  // Metrics, made by CreateMetrics() and kept across device rebuilds. The
+  // heap ones come with the first device.
+  Metrics metrics_;
+  Metrics::Counter *frames_metric_;
+  Metrics::Counter *draws_metric_;
+  Metrics::Counter *binds_metric_;
+  Metrics::Histogram *sort_time_metric_;
+  Metrics::Counter *triangles_metric_;
+  Metrics::Histogram *frame_time_metric_;
+  Metrics::Histogram *gpu_time_metric_;
+  Metrics::Counter *swapchain_metric_;
+  Metrics::Counter *recoveries_metric_;
+  Metrics::Counter *uploads_metric_;
+  Metrics::Counter *upload_bytes_metric_;
+  Metrics::Gauge *upload_bandwidth_metric_;
+  Metrics::Gauge *resident_metric_;
+  Metrics::Gauge *budget_metric_;
+  Metrics::Counter *evictions_metric_;
+  Metrics::Counter *exported_metric_;
+  Metrics::Counter *export_dropped_metric_;
+  // The GetStats() UpdateMetrics() last saw, the counters get what came
+  // since. The streamer's start over with every device.
+  TextureStreamer::Stats streamer_stats_ = {};
+  FrameExporter::Stats export_stats_ = {};
+  std::vector<Metrics::Gauge *> heap_size_metrics_;
+  std::vector<Metrics::Gauge *> heap_allocated_metrics_;
+  VkPhysicalDeviceMemoryProperties memory_properties_;
+  std::chrono::steady_clock::time_point last_frame_time_;
+
+  // Vulkan stuff. Device level handles are reset to VK_NULL_HANDLE when
+  // destroyed, for DestroyDeviceObjects() to work on a partly built device.
+  VkDevice device_ = VK_NULL_HANDLE;
   VkPhysicalDevice physical_device_;
   VkInstance instance_;
   VkSurfaceKHR surface_;
-  VkSwapchainKHR swap_chain_;
-  VkCommandPool command_pool_;
+  VkSwapchainKHR swap_chain_ = VK_NULL_HANDLE;
+  VkCommandPool command_pool_ = VK_NULL_HANDLE;
   std::vector<VkCommandBuffer> command_buffers_;
 
-  VkDeviceMemory vertex_buffer_memory_;
-  VkBuffer vertex_buffer_;
-  VkDeviceMemory index_buffer_memory_;
-  VkBuffer index_buffer_;
-  VkBuffer uniform_staging_buffer_;
-  VkDeviceMemory uniform_staging_buffer_memory_;
-  VkBuffer uniform_buffer_;
-  VkDeviceMemory uniform_buffer_memory_;
-
-  VkDescriptorPool descriptor_pool_;
-  VkDescriptorSet descriptor_set_;
-
-  VkSemaphore image_available_semaphore_;
-  VkSemaphore render_finished_semaphore_;
-
+  VkDeviceMemory vertex_buffer_memory_ = VK_NULL_HANDLE;
+  VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory index_buffer_memory_ = VK_NULL_HANDLE;
+  VkBuffer index_buffer_ = VK_NULL_HANDLE;
+  // Per swapchain image, persistently mapped so that a frame only ever
+  // writes the copy the GPU is done with
+  std::vector<VkBuffer> uniform_buffers_;
+  std::vector<VkDeviceMemory> uniform_buffer_memories_;
+  std::vector<void *> uniform_data_;
+
+  VkDescriptorPool descriptor_pool_ = VK_NULL_HANDLE;
+  std::vector<VkDescriptorSet> descriptor_sets_;
+
+  // Textures
+  const char *texture_path_ = NULL;
+  std::unique_ptr<TextureStreamer> texture_streamer_;
+  uint32_t texture_;
+  VkImageView texture_view_;
+  VkSampler texture_sampler_ = VK_NULL_HANDLE;
+  // Halved every time the device runs out of memory
+  VkDeviceSize texture_budget_ = TEXTURE_BUDGET;
+
+  // Every graphics submission signals the next value of a timeline
+  // semaphore. A frame slot or swapchain image is reused once the GPU
+  // reaches the value of the last submission that used it.
+  std::unique_ptr<FrameScheduler> scheduler_;
+  VkSemaphore image_available_semaphores_[FRAMES_IN_FLIGHT] = {};
+  uint64_t frame_values_[FRAMES_IN_FLIGHT] = {};
+  // Transient data of the frame being built, reset by DrawFrame()
+  FrameArena frame_arena_;
+  // Heap allocations of the render thread once warmed up
+  uint64_t steady_allocations_ = 0;
+  uint64_t steady_frames_ = 0;
+  std::vector<uint64_t> image_values_;
+  // Descriptor set and command buffer of the image still use an old texture
+  // or mesh LOD
+  std::vector<bool> image_dirty_;
+  // Per image, one per device rendering a frame: only split frame has more
+  // than one.
+  std::vector<VkSemaphore> render_finished_semaphores_;
+
+  // One queue per role, roles on the same family share the queue. Uploads
+  // go to the transfer queue and overlap with rendering when the device has
+  // a dedicated transfer family.
   VkQueue graphics_queue_;
   VkQueue present_queue_;
+  VkQueue transfer_queue_;
+  VkQueue compute_queue_;
+  uint32_t graphics_family_;
+  uint32_t present_family_;
+  uint32_t transfer_family_;
+  uint32_t compute_family_;
+  // Queues are shared with the texture streaming thread. queue_mutex_ goes
+  // with the graphics family.
+  std::mutex queue_mutex_;
+  std::mutex transfer_queue_mutex_;
+  std::mutex compute_queue_mutex_;
+
+  // GPU timestamps of the frames and uploads
+  std::unique_ptr<GpuTimeline> timeline_;
+  VkQueryPool frame_query_pool_ = VK_NULL_HANDLE;
+  uint32_t frame_timestamp_bits_;
+  float timestamp_period_;
   VkDebugReportCallbackEXT callback_;
   std::vector<VkImage> swap_chain_images_;
   VkFormat swapChainImageFormat;
+  VkExtent2D swap_chain_extent_;
   std::vector<VkImageView> swap_chain_image_views_;
 
-  VkDescriptorSetLayout descriptor_set_layout_;
-  VkPipelineLayout pipeline_layout_;
-  VkRenderPass render_pass_;
-  VkPipeline graphics_pipeline_;
+  // Device group, TRIANGLE_DEVICE_GROUP=afr|sfr. Falls back to a single
+  // device when the group has one device or lacks what the mode needs.
+  DeviceGroupMode device_group_mode_;
+  uint32_t device_group_size_ = 1;
+  VkDeviceGroupPresentModeFlagBitsKHR device_group_present_mode_;
+  VkFence acquire_fence_ = VK_NULL_HANDLE;
+  uint64_t frame_ = 0;
+
+  VkDescriptorSetLayout descriptor_set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  VkRenderPass render_pass_ = VK_NULL_HANDLE;
+  // Variants of the one pipeline, made with CreatePipelineVariant(). The
+  // shader modules stay around for the compile thread.
+  std::unique_ptr<PipelineVariants> pipelines_;
+  PipelineKey pipeline_key_;
+  VkShaderModule vertex_module_ = VK_NULL_HANDLE;
+  VkShaderModule fragment_module_ = VK_NULL_HANDLE;
+  // The command buffer of the image uses the generic variant, recorded
+  // again once the specialized one is compiled
+  std::vector<bool> image_generic_;
+  // Draws go through the queue, sorted by state. What went into the command
+  // buffer of each image, counted every time it is submitted.
+  DrawQueue draw_queue_;
+  std::vector<DrawQueue::Stats> image_draw_stats_;
+  DrawQueue::Stats draw_stats_ = {};
   std::vector<VkFramebuffer> swap_chain_frame_buffers_;
 
+  // Error recovery, see Recover(). Start times of the recent device
+  // rebuilds, to give up on a device that keeps getting lost.
+  std::deque<std::chrono::steady_clock::time_point> recovery_times_;
+  uint32_t recoveries_ = 0;
+  // The swapchain no longer matches the window, rebuilt by the next frame
+  bool swapchain_stale_ = false;
+  uint32_t swapchain_recreations_ = 0;
+
 
+  void CreateWindow(uint32_t x, uint32_t y, uint16_t width, uint16_t height);
+  void AddDeviceTasks(InitScheduler *init, InitScheduler::Task after,
+                      InitScheduler::Task shaders);
   void InitVulkanInstance();
   void InitVulkanPhysicalDevice();
   void CreateSurface();
+  void CreateSwapChain();
+  void CreateDescriptorSetLayout();
+  void CreateRenderPass();
+  void CreatePipeline();
+  VkPipeline CreatePipelineVariant(VkPipelineCache cache, const PipelineKey &key,
+                                   uint32_t features);
+  void CreateFramebuffers();
+  void CreateCommandPool();
+  void CreateTextures();
+  void CreateBuffers();
+  void CreateUniformBuffers();
+  void CreateDescriptorSets();
+  void CreateCommandBuffers();
+  void CreateExporter();
+  void FinishExport();
+  void CreateMetrics();
+  void CreateHeapMetrics();
+  void UpdateMetrics();
+  VkResult WaitIdle();
+  void DestroySwapChainObjects();
+  void DestroyDeviceObjects();
+  bool RecreateSwapChain();
+  void Recover(const VulkanError &error);
   void DrawFrame();
-  void UpdateUniformBuffer();
+  void UpdateUniformBuffer(uint32_t image);
+  void RecordCommandBuffer(uint32_t image);
+  void UpdateDescriptorSet(uint32_t image);
+  void UpdateTexture();
+  void PrintStats();
+  DeviceQueue GetQueue(VkQueue queue, uint32_t family);
+  void CaptureTexture();
+  void CaptureFrame();
 
-  void CopyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
   void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                     VkMemoryPropertyFlags properties, VkBuffer *buffer,
                     VkDeviceMemory *bufferMemory);
 
+  // Validation is expensive, both at startup and per call, so it is only on
+  // by default in debug builds. TRIANGLE_VALIDATION=0/1 overrides it.
+#ifdef NDEBUG
+  bool validation_ = false;
+#else
+  bool validation_ = true;
+#endif
   const std::vector<const char*> validation_layers_ = {
     "VK_LAYER_LUNARG_standard_validation"
   };
@@ -185,54 +423,93 @@ void Triangle::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
   vkBindBufferMemory(device_, *buffer, *bufferMemory, 0);
 }
 
-void Triangle::CopyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-  VkCommandBufferAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocInfo.commandPool = command_pool_;
-  allocInfo.commandBufferCount = 1;
-
-  VkCommandBuffer commandBuffer;
-  vkAllocateCommandBuffers(device_, &allocInfo, &commandBuffer);
-  VkCommandBufferBeginInfo beginInfo = {};
-  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-  vkBeginCommandBuffer(commandBuffer, &beginInfo);
-  VkBufferCopy copyRegion = {};
-  copyRegion.srcOffset = 0; // Optional
-  copyRegion.dstOffset = 0; // Optional
-  copyRegion.size = size;
-  vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-  vkEndCommandBuffer(commandBuffer);
-
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffer;
-
-  vkQueueSubmit(graphics_queue_, 1, &submitInfo, VK_NULL_HANDLE);
-  vkQueueWaitIdle(graphics_queue_);
-  vkFreeCommandBuffers(device_, command_pool_, 1, &commandBuffer);
+DeviceQueue Triangle::GetQueue(VkQueue queue, uint32_t family) {
+  DeviceQueue q;
+  q.queue = queue;
+  q.family = family;
+  if (family == graphics_family_)
+    q.mutex = &queue_mutex_;
+  else if (family == transfer_family_)
+    q.mutex = &transfer_queue_mutex_;
+  else
+    q.mutex = &compute_queue_mutex_;
+  return q;
 }
 
-void Triangle::LoadShaderModule(const char *path, VkShaderModule *module) {
-  // Open the file
-  std::ifstream file(path, std::ios::ate | std::ios::binary);
-  size_t fileSize = (size_t) file.tellg();
-  file.seekg(0);
-
-  std::vector<char> buffer(fileSize);
-  file.read(buffer.data(), fileSize);
-  file.close();
-
+void Triangle::LoadShaderModule(const std::vector<uint32_t> &code,
+                                VkShaderStageFlagBits stage,
+                                VkShaderModule *module) {
   VkShaderModuleCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  createInfo.codeSize = buffer.size();
-  createInfo.pCode = (uint32_t*) buffer.data();
+  createInfo.codeSize = code.size() * sizeof(uint32_t);
+  createInfo.pCode = code.data();
 
   VK_CHECK_RESULT(
     vkCreateShaderModule(device_, &createInfo, NULL, module));
+
+  if (capture_.enabled())
+    capture_shaders_[*module] = capture_.CreateShader(stage, code.data(),
+                                                      createInfo.codeSize);
+}
+
+// Startup as a dependency graph. The X11 connection, the instance and the
+// shaders don't depend on each other, neither does pipeline compilation
+// on the buffer and texture uploads.
+void Triangle::Init(uint32_t x, uint32_t y, uint16_t width, uint16_t height) {
+  InitScheduler init;
+  auto window = init.Add("window", [=]{ CreateWindow(x, y, width, height); });
+  auto instance = init.Add("instance", [this]{ InitVulkanInstance(); });
+  auto shaders = init.Add("shaders", [this]{
+    if (!shader_directory_) {
+      vertex_code_.assign(std::begin(triangle_vert_spv), std::end(triangle_vert_spv));
+      fragment_code_.assign(std::begin(triangle_frag_spv), std::end(triangle_frag_spv));
+      return;
+    }
+    // On a worker: thrown, for Init() to rethrow
+    std::string vertex = std::string(shader_directory_) + "/triangle.vert";
+    if (!CompileGlsl(vertex.c_str(), &vertex_code_))
+      throw std::runtime_error("Can't compile " + vertex);
+    std::string fragment = std::string(shader_directory_) + "/triangle.frag";
+    if (!CompileGlsl(fragment.c_str(), &fragment_code_))
+      throw std::runtime_error("Can't compile " + fragment);
+  });
+  auto surface = init.Add("surface", [this]{ CreateSurface(); },
+                          {window, instance});
+  AddDeviceTasks(&init, surface, shaders);
+
+  unsigned threads = std::thread::hardware_concurrency();
+  init.Run(std::min(std::max(threads, 2u), 4u));
+  init.PrintReport(stdout);
+}
+
+// Everything made from the device, once after is done. The pipeline also
+// waits for shaders. Recover() builds the device again with these.
+void Triangle::AddDeviceTasks(InitScheduler *init, InitScheduler::Task after,
+                              InitScheduler::Task shaders) {
+  // Device selection needs the surface to check present support
+  auto device = init->Add("device", [this]{ InitVulkanPhysicalDevice(); },
+                          {after});
+  auto swapchain = init->Add("swapchain", [this]{ CreateSwapChain(); },
+                             {device});
+  auto layout = init->Add("descriptor set layout",
+                          [this]{ CreateDescriptorSetLayout(); }, {device});
+  auto render_pass = init->Add("render pass", [this]{ CreateRenderPass(); },
+                               {swapchain});
+  auto pipeline = init->Add("pipeline", [this]{ CreatePipeline(); },
+                            {render_pass, layout, shaders});
+  auto framebuffers = init->Add("framebuffers", [this]{ CreateFramebuffers(); },
+                                {render_pass});
+  auto pool = init->Add("command pool", [this]{ CreateCommandPool(); },
+                        {device});
+  auto textures = init->Add("textures", [this]{ CreateTextures(); }, {device});
+  auto buffers = init->Add("buffers", [this]{ CreateBuffers(); }, {pool});
+  auto uniforms = init->Add("uniform buffers", [this]{ CreateUniformBuffers(); },
+                            {swapchain});
+  auto sets = init->Add("descriptor sets", [this]{ CreateDescriptorSets(); },
+                        {layout, buffers, uniforms, textures});
+  init->Add("command buffers", [this]{ CreateCommandBuffers(); },
+            {pipeline, framebuffers, sets});
+  init->Add("frame export", [this]{ CreateExporter(); }, {swapchain});
 }
 
 void Triangle::CreateSurface() {
@@ -242,35 +519,9 @@ void Triangle::CreateSurface() {
   surfaceCreateInfo.window = window_;
   VK_CHECK_RESULT(
     vkCreateXcbSurfaceKHR(instance_, &surfaceCreateInfo, NULL, &surface_));
+}
 
-
-  uint32_t queueCount = 0;
-  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &queueCount, NULL);
-
-  std::cout << "Queue count " << queueCount << std::endl;
-
-  uint32_t graphics_queue_family_index = UINT32_MAX;
-  uint32_t present_queue_family_index = UINT32_MAX;
-
-  std::vector<VkBool32> queue_surface_support(queueCount);
-
-  for (uint32_t i = 0; i < queueCount; ++i) {
-    vkGetPhysicalDeviceSurfaceSupportKHR(physical_device_, i,
-                                         surface_,
-                                         &queue_surface_support[i]);
-    // If there is queue that supports both graphics and present - prefer it
-    if(queue_surface_support[i] ) {
-      graphics_queue_family_index = i;
-      present_queue_family_index = i;
-    }
-  }
-
-  std::cout <<  "Graphics index: " << graphics_queue_family_index << std::endl;
-  std::cout <<  "Graphics index: " << present_queue_family_index << std::endl;
-
-
-  vkGetDeviceQueue(device_, 0, 0, &present_queue_);
-
+void Triangle::CreateSwapChain() {
   VkSurfaceCapabilitiesKHR details;
   VK_CHECK_RESULT(
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device_, surface_, &details));
@@ -294,7 +545,12 @@ void Triangle::CreateSurface() {
   // We skip checks, as always...
   VkSurfaceFormatKHR surfaceFormat = formats[1];
   VkPresentModeKHR presentMode = presentModes[0];
-  VkExtent2D extent = {800, 600};
+  // The window's size, unless the surface leaves it to the swapchain
+  VkExtent2D extent = details.currentExtent;
+  if (extent.width == UINT32_MAX)
+    extent = {width_, height_};
+  swap_chain_extent_ = extent;
+  swapChainImageFormat = surfaceFormat.format;
 
   uint32_t imageCount = 2;
 
@@ -307,6 +563,15 @@ void Triangle::CreateSurface() {
   createInfo.imageExtent = extent;
   createInfo.imageArrayLayers = 1;
   createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  // Exported frames are copied out of the swapchain images
+  if (export_spec_) {
+    if (details.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) {
+      createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    } else {
+      fprintf(stderr, "Swapchain images can't be copied from, not exporting\n");
+      export_spec_ = NULL;
+    }
+  }
 
   createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
   createInfo.queueFamilyIndexCount = 0; // Optional
@@ -319,6 +584,55 @@ void Triangle::CreateSurface() {
 
   createInfo.oldSwapchain = VK_NULL_HANDLE;
 
+  // Queue families picked in InitVulkanPhysicalDevice
+  uint32_t families[] = {graphics_family_, present_family_};
+  if (graphics_family_ != present_family_) {
+    createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+    createInfo.queueFamilyIndexCount = 2;
+    createInfo.pQueueFamilyIndices = families;
+  }
+
+  VkDeviceGroupSwapchainCreateInfoKHR groupInfo = {};
+  if (device_group_size_ > 1) {
+    VkDeviceGroupPresentCapabilitiesKHR caps = {};
+    caps.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_PRESENT_CAPABILITIES_KHR;
+    VK_CHECK_RESULT(vkGetDeviceGroupPresentCapabilitiesKHR(device_, &caps));
+
+    // Every device presenting its own images, otherwise have them go
+    // through a device that can
+    bool all_local = true;
+    for (uint32_t i = 0; i < device_group_size_; ++i)
+      all_local = all_local && (caps.presentMask[i] & (1u << i));
+
+    if (device_group_mode_ == DEVICE_GROUP_SFR &&
+        !(caps.modes & VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_MULTI_DEVICE_BIT_KHR)) {
+      fprintf(stderr, "Device group can't present split frames, using afr\n");
+      device_group_mode_ = DEVICE_GROUP_AFR;
+    }
+    if (device_group_mode_ == DEVICE_GROUP_SFR)
+      device_group_present_mode_ = VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_MULTI_DEVICE_BIT_KHR;
+    else if (all_local && (caps.modes & VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_BIT_KHR))
+      device_group_present_mode_ = VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_BIT_KHR;
+    else if (caps.modes & VK_DEVICE_GROUP_PRESENT_MODE_REMOTE_BIT_KHR)
+      device_group_present_mode_ = VK_DEVICE_GROUP_PRESENT_MODE_REMOTE_BIT_KHR;
+    else {
+      fprintf(stderr, "Device group can't present from every device, using one\n");
+      device_group_mode_ = DEVICE_GROUP_NONE;
+      device_group_size_ = 1;
+    }
+  }
+  if (device_group_size_ > 1) {
+    groupInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_SWAPCHAIN_CREATE_INFO_KHR;
+    groupInfo.modes = device_group_present_mode_;
+    createInfo.pNext = &groupInfo;
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK_RESULT(vkCreateFence(device_, &fenceInfo, NULL, &acquire_fence_));
+    fprintf(stdout, "Device group:   %u devices, %s\n", device_group_size_,
+            device_group_mode_ == DEVICE_GROUP_SFR ? "split frame" : "alternate frame");
+  }
+
   VK_CHECK_RESULT(
     vkCreateSwapchainKHR(device_, &createInfo, NULL, &swap_chain_));
 
@@ -349,9 +663,9 @@ void Triangle::CreateSurface() {
     VK_CHECK_RESULT(
       vkCreateImageView(device_, &createInfo2, NULL, &swap_chain_image_views_[i]));
   }
+}
 
-
-  // Create createDescriptorSetLayout
+void Triangle::CreateDescriptorSetLayout() {
   VkDescriptorSetLayoutBinding uboLayoutBinding = {};
   uboLayoutBinding.binding = 0;
   uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
@@ -359,35 +673,149 @@ void Triangle::CreateSurface() {
   uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
   uboLayoutBinding.pImmutableSamplers = NULL;
 
+  VkDescriptorSetLayoutBinding samplerLayoutBinding = {};
+  samplerLayoutBinding.binding = 1;
+  samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  samplerLayoutBinding.descriptorCount = 1;
+  samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  samplerLayoutBinding.pImmutableSamplers = NULL;
+
+  VkDescriptorSetLayoutBinding layoutBindings[] = {uboLayoutBinding, samplerLayoutBinding};
   VkDescriptorSetLayoutCreateInfo layoutInfo = {};
   layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  layoutInfo.bindingCount = 1;
-  layoutInfo.pBindings = &uboLayoutBinding;
+  layoutInfo.bindingCount = 2;
+  layoutInfo.pBindings = layoutBindings;
 
   VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device_,
     &layoutInfo, NULL, &descriptor_set_layout_));
+}
+
+void Triangle::CreateRenderPass() {
+  VkAttachmentDescription colorAttachment = {};
+  colorAttachment.format = swapChainImageFormat;
+  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+  VkAttachmentReference colorAttachmentRef = {};
+  colorAttachmentRef.attachment = 0;
+  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDescription subpass = {};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = 1;
+  subpass.pColorAttachments = &colorAttachmentRef;
+
+  VkSubpassDependency dependency = {};
+  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependency.dstSubpass = 0;
+  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.srcAccessMask = 0;
+  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+  // Create the render pass
+  VkRenderPassCreateInfo renderPassInfo = {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  renderPassInfo.attachmentCount = 1;
+  renderPassInfo.pAttachments = &colorAttachment;
+  renderPassInfo.subpassCount = 1;
+  renderPassInfo.pSubpasses = &subpass;
+  renderPassInfo.dependencyCount = 1;
+  renderPassInfo.pDependencies = &dependency;
 
+  VK_CHECK_RESULT(
+    vkCreateRenderPass(device_, &renderPassInfo, NULL, &render_pass_));
+}
 
-  // PIPELINE stuff
+// Shader compilation happens here, it runs on its own thread while the
+// uploads go on. Only the generic variant is compiled now, the specialized
+// one follows on the compile thread of pipelines_.
+void Triangle::CreatePipeline() {
   // Let's create the shaders
-  VkShaderModule vertex;
-  VkShaderModule fragment;
+  LoadShaderModule(vertex_code_, VK_SHADER_STAGE_VERTEX_BIT, &vertex_module_);
+  LoadShaderModule(fragment_code_, VK_SHADER_STAGE_FRAGMENT_BIT, &fragment_module_);
+
+  // Create pipeline layout. The generic variant gets the features as a
+  // push constant.
+  VkPushConstantRange pushConstantRange = {};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof(uint32_t);
+
+  VkDescriptorSetLayout setLayouts[] = {descriptor_set_layout_};
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 1;
+  pipelineLayoutInfo.pSetLayouts = setLayouts;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+  VK_CHECK_RESULT(
+    vkCreatePipelineLayout(device_, &pipelineLayoutInfo, NULL, &pipeline_layout_));
+
+  pipelines_.reset(new PipelineVariants(device_,
+    [this](VkPipelineCache cache, const PipelineKey &key, uint32_t features) {
+      return CreatePipelineVariant(cache, key, features);
+    }));
+  // Without a texture there's the white one, no need to sample it
+  pipeline_key_.features = FEATURE_VERTEX_COLOR |
+    (texture_path_ ? FEATURE_TEXTURE : 0);
+  pipeline_key_.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  pipeline_key_.cull_mode = VK_CULL_MODE_BACK_BIT;
+  pipeline_key_.front_face = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  pipeline_key_.blend_enable = VK_TRUE;
+  pipelines_->Prepare(pipeline_key_);
+
+  if (capture_.enabled()) {
+    auto attributeDescriptions = Vertex::getAttributeDescriptions();
+    CapturePipeline state;
+    state.vertex_shader = capture_shaders_[vertex_module_];
+    state.fragment_shader = capture_shaders_[fragment_module_];
+    state.vertex_stride = Vertex::getBindingDescription().stride;
+    state.attributes.assign(attributeDescriptions.begin(), attributeDescriptions.end());
+    state.topology = pipeline_key_.topology;
+    state.cull_mode = pipeline_key_.cull_mode;
+    state.front_face = pipeline_key_.front_face;
+    state.blend_enable = pipeline_key_.blend_enable;
+    state.features = pipeline_key_.features;
+    capture_pipeline_ = capture_.CreatePipeline(state);
+  }
+}
 
-  LoadShaderModule("triangle.vert.spv", &vertex);
-  LoadShaderModule("triangle.frag.spv", &fragment);
+// The pipeline of key with features for specialization constant 0. Runs on
+// the compile thread of pipelines_ too, only reads what stays put until
+// DestroySwapChainObjects() is done with pipelines_.
+VkPipeline Triangle::CreatePipelineVariant(VkPipelineCache cache,
+                                           const PipelineKey &key,
+                                           uint32_t features) {
+  VkSpecializationMapEntry specializationEntry = {};
+  specializationEntry.constantID = 0;
+  specializationEntry.offset = 0;
+  specializationEntry.size = sizeof(uint32_t);
+
+  VkSpecializationInfo specializationInfo = {};
+  specializationInfo.mapEntryCount = 1;
+  specializationInfo.pMapEntries = &specializationEntry;
+  specializationInfo.dataSize = sizeof(features);
+  specializationInfo.pData = &features;
 
   VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
   vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vertShaderStageInfo.module = vertex;
+  vertShaderStageInfo.module = vertex_module_;
   vertShaderStageInfo.pName = "main";
 
   VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
   fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  fragShaderStageInfo.module = fragment;
+  fragShaderStageInfo.module = fragment_module_;
   fragShaderStageInfo.pName = "main";
+  fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
 
   VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
 
@@ -407,20 +835,20 @@ void Triangle::CreateSurface() {
   // Input assembly
   VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
   inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  inputAssembly.topology = key.topology;
   inputAssembly.primitiveRestartEnable = VK_FALSE;
 
   VkViewport viewport = {};
   viewport.x = 0.0f;
   viewport.y = 0.0f;
-  viewport.width = (float) 800;
-  viewport.height = (float) 600;
+  viewport.width = (float) swap_chain_extent_.width;
+  viewport.height = (float) swap_chain_extent_.height;
   viewport.minDepth = 0.0f;
   viewport.maxDepth = 1.0f;
 
   VkRect2D scissor = {};
   scissor.offset = {0, 0};
-  scissor.extent = extent;
+  scissor.extent = swap_chain_extent_;
 
   VkPipelineViewportStateCreateInfo viewportState = {};
   viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -436,8 +864,8 @@ void Triangle::CreateSurface() {
   rasterizer.rasterizerDiscardEnable = VK_FALSE;
   rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
   rasterizer.lineWidth = 1.0f;
-  rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-  rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  rasterizer.cullMode = key.cull_mode;
+  rasterizer.frontFace = key.front_face;
   rasterizer.depthBiasEnable = VK_FALSE;
   rasterizer.depthBiasConstantFactor = 0.0f; // Optional
   rasterizer.depthBiasClamp = 0.0f; // Optional
@@ -459,7 +887,7 @@ void Triangle::CreateSurface() {
   // Color blending
   VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
   colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-  colorBlendAttachment.blendEnable = VK_TRUE;
+  colorBlendAttachment.blendEnable = key.blend_enable;
   colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
   colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
   colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
@@ -489,59 +917,6 @@ void Triangle::CreateSurface() {
   // dynamicState.dynamicStateCount = 2;
   // dynamicState.pDynamicStates = dynamicStates;
 
-  // Create pipeline layout
-  VkDescriptorSetLayout setLayouts[] = {descriptor_set_layout_};
-  VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipelineLayoutInfo.setLayoutCount = 1;
-  pipelineLayoutInfo.pSetLayouts = setLayouts;
-  pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-  pipelineLayoutInfo.pPushConstantRanges = 0; // Optional
-
-  VK_CHECK_RESULT(
-    vkCreatePipelineLayout(device_, &pipelineLayoutInfo, NULL, &pipeline_layout_));
-
-  // Render passes
-  VkAttachmentDescription colorAttachment = {};
-  colorAttachment.format = surfaceFormat.format;
-  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-  VkAttachmentReference colorAttachmentRef = {};
-  colorAttachmentRef.attachment = 0;
-  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-  VkSubpassDescription subpass = {};
-  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpass.colorAttachmentCount = 1;
-  subpass.pColorAttachments = &colorAttachmentRef;
-
-  VkSubpassDependency dependency = {};
-  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-  dependency.dstSubpass = 0;
-  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.srcAccessMask = 0;
-  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
-  // Create the render pass
-  VkRenderPassCreateInfo renderPassInfo = {};
-  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  renderPassInfo.attachmentCount = 1;
-  renderPassInfo.pAttachments = &colorAttachment;
-  renderPassInfo.subpassCount = 1;
-  renderPassInfo.pSubpasses = &subpass;
-  renderPassInfo.dependencyCount = 1;
-  renderPassInfo.pDependencies = &dependency;
-
-  VK_CHECK_RESULT(
-    vkCreateRenderPass(device_, &renderPassInfo, NULL, &render_pass_));
-
   // Create the pipeline (FINALLY)
   VkGraphicsPipelineCreateInfo pipelineInfo = {};
   pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -560,11 +935,13 @@ void Triangle::CreateSurface() {
   pipelineInfo.subpass = 0;
   pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
   pipelineInfo.basePipelineIndex = -1; // Optional
+  VkPipeline pipeline;
   VK_CHECK_RESULT(
-    vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &graphics_pipeline_));
-
-  // Framebuffers
+    vkCreateGraphicsPipelines(device_, cache, 1, &pipelineInfo, NULL, &pipeline));
+  return pipeline;
+}
 
+void Triangle::CreateFramebuffers() {
   swap_chain_frame_buffers_.resize(swap_chain_image_views_.size());
   for (size_t i = 0; i < swap_chain_image_views_.size(); i++) {
     VkImageView attachments[] = {
@@ -575,106 +952,322 @@ void Triangle::CreateSurface() {
     framebufferInfo.renderPass = render_pass_;
     framebufferInfo.attachmentCount = 1;
     framebufferInfo.pAttachments = attachments;
-    framebufferInfo.width = extent.width;
-    framebufferInfo.height = extent.height;
+    framebufferInfo.width = swap_chain_extent_.width;
+    framebufferInfo.height = swap_chain_extent_.height;
     framebufferInfo.layers = 1;
 
     VK_CHECK_RESULT(
       vkCreateFramebuffer(device_, &framebufferInfo, NULL, &swap_chain_frame_buffers_.data()[i]));
   }
+}
 
+void Triangle::CreateCommandPool() {
   // // COMMAND POOLS (YEEEEE)
   VkCommandPoolCreateInfo poolInfo = {};
   poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-  poolInfo.queueFamilyIndex = 0;
-  poolInfo.flags = 0; // Optional
+  poolInfo.queueFamilyIndex = graphics_family_;
+  // Command buffers get recorded again when a texture changes residency
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
   VK_CHECK_RESULT(
     vkCreateCommandPool(device_, &poolInfo, NULL, &command_pool_));
+}
+
+void Triangle::CreateTextures() {
+  // Textures: only the coarse mips are uploaded here, the rest is streamed
+  texture_streamer_.reset(new TextureStreamer(physical_device_, device_,
+    GetQueue(transfer_queue_, transfer_family_),
+    GetQueue(graphics_queue_, graphics_family_), timeline_.get(), texture_budget_));
+  texture_ = UINT32_MAX;
+  if (texture_path_)
+    texture_ = texture_streamer_->Load(texture_path_);
+  if (texture_ == UINT32_MAX)
+    texture_ = texture_streamer_->LoadSolid(0xffffffff);
+  texture_streamer_->Start();
+
+  VkSamplerCreateInfo samplerInfo = {};
+  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerInfo.magFilter = VK_FILTER_LINEAR;
+  samplerInfo.minFilter = VK_FILTER_LINEAR;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.anisotropyEnable = VK_FALSE;
+  samplerInfo.maxAnisotropy = 1.0f;
+  samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+  samplerInfo.unnormalizedCoordinates = VK_FALSE;
+  samplerInfo.compareEnable = VK_FALSE;
+  samplerInfo.minLod = 0.0f;
+  samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+  VK_CHECK_RESULT(
+    vkCreateSampler(device_, &samplerInfo, NULL, &texture_sampler_));
 
-  // Create vertex buffer
-  VkDeviceSize bufferSize = sizeof(vertices_[0]) * vertices_.size();
+}
+
+// Vertices and indices share one staging buffer and go up in a single
+// submission.
+void Triangle::CreateBuffers() {
+  MeshPositions positions = {&vertices_[0].pos.x, sizeof(Vertex) / sizeof(float),
+                             2, vertices_.size()};
+  BuildLodChain(positions, std::vector<uint32_t>(indices_.begin(), indices_.end()),
+                LOD_MAX_LEVELS, 0.5f, &lod_chain_);
+  std::vector<uint16_t> lodIndices(lod_chain_.indices.begin(),
+                                   lod_chain_.indices.end());
+  for (size_t i = 0; i < lod_chain_.levels.size(); i++)
+    fprintf(stdout, "Mesh LOD %zu: %u triangles, error %g\n", i,
+            lod_chain_.levels[i].index_count / 3, lod_chain_.levels[i].error);
+
+  // The scene outlives device rebuilds
+  if (quad_ == UINT32_MAX) {
+    Aabb bounds = {{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), 0.0f},
+                   {-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), 0.0f}};
+    for (const Vertex &v : vertices_) {
+      for (int k = 0; k < 2; k++) {
+        bounds.min[k] = std::min(bounds.min[k], v.pos[k]);
+        bounds.max[k] = std::max(bounds.max[k], v.pos[k]);
+      }
+    }
+    Scene::Transform identity = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+    quad_ = scene_.Create(bounds, identity, 0, 0);
+  }
+
+  VkDeviceSize vertexSize = sizeof(vertices_[0]) * vertices_.size();
+  VkDeviceSize indexSize = sizeof(lodIndices[0]) * lodIndices.size();
 
   VkBuffer stagingBuffer;
   VkDeviceMemory stagingBufferMemory;
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+  CreateBuffer(vertexSize + indexSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                &stagingBuffer, &stagingBufferMemory);
-  void *data;
-  vkMapMemory(device_, stagingBufferMemory, 0, bufferSize, 0, &data);
-  memcpy(data, vertices_.data(), (size_t) bufferSize);
+  char *data;
+  vkMapMemory(device_, stagingBufferMemory, 0, vertexSize + indexSize, 0, (void **) &data);
+  memcpy(data, vertices_.data(), (size_t) vertexSize);
+  memcpy(data + vertexSize, lodIndices.data(), (size_t) indexSize);
   vkUnmapMemory(device_, stagingBufferMemory);
 
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+  CreateBuffer(vertexSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
     &vertex_buffer_, &vertex_buffer_memory_);
+  CreateBuffer(indexSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer_, &index_buffer_memory_);
+
+
+  // Copies go to the transfer queue. With a dedicated transfer family the
+  // buffers are then released to the graphics family, which acquires them
+  // once the copies signal the semaphore.
+  bool transfer = transfer_family_ != graphics_family_;
+  DeviceQueue transferQueue = GetQueue(transfer_queue_, transfer_family_);
+
+  VkCommandPool transferPool = command_pool_;
+  if (transfer) {
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = transfer_family_;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    VK_CHECK_RESULT(
+      vkCreateCommandPool(device_, &poolInfo, NULL, &transferPool));
+  }
+
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandPool = transferPool;
+  allocInfo.commandBufferCount = 1;
+
+  VkCommandBuffer commandBuffer;
+  VK_CHECK_RESULT(vkAllocateCommandBuffers(device_, &allocInfo, &commandBuffer));
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-  CopyBuffer(stagingBuffer, vertex_buffer_, bufferSize);
+  vkBeginCommandBuffer(commandBuffer, &beginInfo);
+  VkBufferCopy vertexCopy = {0, 0, vertexSize};
+  vkCmdCopyBuffer(commandBuffer, stagingBuffer, vertex_buffer_, 1, &vertexCopy);
+  VkBufferCopy indexCopy = {vertexSize, 0, indexSize};
+  vkCmdCopyBuffer(commandBuffer, stagingBuffer, index_buffer_, 1, &indexCopy);
+
+  VkBufferMemoryBarrier barriers[2] = {};
+  for (int i = 0; i < 2; i++) {
+    barriers[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[i].srcQueueFamilyIndex = transfer ? transfer_family_ : VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].dstQueueFamilyIndex = transfer ? graphics_family_ : VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].buffer = i == 0 ? vertex_buffer_ : index_buffer_;
+    barriers[i].offset = 0;
+    barriers[i].size = VK_WHOLE_SIZE;
+  }
+  barriers[0].dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+  barriers[1].dstAccessMask = VK_ACCESS_INDEX_READ_BIT;
+  if (transfer) {
+    // Release, dstAccessMask is ignored here
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL,
+                         2, barriers, 0, NULL);
+  } else {
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, NULL,
+                         2, barriers, 0, NULL);
+  }
+  vkEndCommandBuffer(commandBuffer);
 
-  // Create index buffer
-  bufferSize = sizeof(indices_[0]) * indices_.size();
-  VkBuffer stagingBuffer2;
-  VkDeviceMemory stagingBufferMemory2;
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBuffer2, &stagingBufferMemory2);
+  // Wait on a fence rather than the queue, the texture streamer may be
+  // uploading on it at the same time.
+  VkFenceCreateInfo fenceInfo = {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence;
+  VK_CHECK_RESULT(vkCreateFence(device_, &fenceInfo, NULL, &fence));
+
+  VkSemaphore semaphore = VK_NULL_HANDLE;
+  if (transfer) {
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VK_CHECK_RESULT(vkCreateSemaphore(device_, &semaphoreInfo, NULL, &semaphore));
+  }
 
-  vkMapMemory(device_, stagingBufferMemory2, 0, bufferSize, 0, &data);
-  memcpy(data, indices_.data(), (size_t) bufferSize);
-  vkUnmapMemory(device_, stagingBufferMemory2);
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &commandBuffer;
+  submitInfo.signalSemaphoreCount = transfer ? 1 : 0;
+  submitInfo.pSignalSemaphores = &semaphore;
+  {
+    std::lock_guard<std::mutex> lock(*transferQueue.mutex);
+    VK_CHECK_RESULT(vkQueueSubmit(transferQueue.queue, 1, &submitInfo,
+                                  transfer ? VK_NULL_HANDLE : fence));
+  }
 
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer_, &index_buffer_memory_);
+  VkCommandBuffer acquireBuffer = VK_NULL_HANDLE;
+  if (transfer) {
+    allocInfo.commandPool = command_pool_;
+    VK_CHECK_RESULT(vkAllocateCommandBuffers(device_, &allocInfo, &acquireBuffer));
+    vkBeginCommandBuffer(acquireBuffer, &beginInfo);
+    for (int i = 0; i < 2; i++)
+      barriers[i].srcAccessMask = 0;
+    vkCmdPipelineBarrier(acquireBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, NULL,
+                         2, barriers, 0, NULL);
+    vkEndCommandBuffer(acquireBuffer);
+
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    VkSubmitInfo acquireInfo = {};
+    acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    acquireInfo.waitSemaphoreCount = 1;
+    acquireInfo.pWaitSemaphores = &semaphore;
+    acquireInfo.pWaitDstStageMask = &waitStage;
+    acquireInfo.commandBufferCount = 1;
+    acquireInfo.pCommandBuffers = &acquireBuffer;
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    VK_CHECK_RESULT(vkQueueSubmit(graphics_queue_, 1, &acquireInfo, fence));
+  }
+
+  if (capture_.enabled()) {
+    capture_vertex_buffer_ = capture_.CreateBuffer(vertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    capture_.UploadBuffer(capture_vertex_buffer_, 0, vertices_.data(), vertexSize);
+    capture_index_buffer_ = capture_.CreateBuffer(indexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+    capture_.UploadBuffer(capture_index_buffer_, 0, lodIndices.data(), indexSize);
+    capture_uniform_buffer_ = capture_.CreateBuffer(sizeof(UniformBufferObject),
+                                                    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+  }
 
-  CopyBuffer(stagingBuffer2, index_buffer_, bufferSize);
+  VK_CHECK_RESULT(
+    vkWaitForFences(device_, 1, &fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+  vkDestroyFence(device_, fence, NULL);
+  vkFreeCommandBuffers(device_, transferPool, 1, &commandBuffer);
+  if (transfer) {
+    vkFreeCommandBuffers(device_, command_pool_, 1, &acquireBuffer);
+    vkDestroyCommandPool(device_, transferPool, NULL);
+    vkDestroySemaphore(device_, semaphore, NULL);
+  }
+  vkDestroyBuffer(device_, stagingBuffer, NULL);
+  vkFreeMemory(device_, stagingBufferMemory, NULL);
+}
 
-  bufferSize = sizeof(UniformBufferObject);
+void Triangle::CreateUniformBuffers() {
+  size_t count = swap_chain_images_.size();
+  uniform_buffers_.resize(count);
+  uniform_buffer_memories_.resize(count);
+  uniform_data_.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    CreateBuffer(sizeof(UniformBufferObject), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &uniform_buffers_[i], &uniform_buffer_memories_[i]);
+    VK_CHECK_RESULT(vkMapMemory(device_, uniform_buffer_memories_[i], 0,
+                                sizeof(UniformBufferObject), 0, &uniform_data_[i]));
+  }
+}
 
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniform_staging_buffer_, &uniform_staging_buffer_memory_);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &uniform_buffer_, &uniform_buffer_memory_);
+void Triangle::CreateDescriptorSets() {
+  uint32_t count = swap_chain_images_.size();
 
   // Descriptor POOL...
-  VkDescriptorPoolSize poolSize = {};
-  poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  poolSize.descriptorCount = 1;
+  VkDescriptorPoolSize poolSizes[2] = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  poolSizes[0].descriptorCount = count;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[1].descriptorCount = count;
 
   VkDescriptorPoolCreateInfo poolInfo2 = {};
   poolInfo2.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  poolInfo2.poolSizeCount = 1;
-  poolInfo2.pPoolSizes = &poolSize;
+  poolInfo2.poolSizeCount = 2;
+  poolInfo2.pPoolSizes = poolSizes;
 
-  poolInfo2.maxSets = 1;
+  poolInfo2.maxSets = count;
 
   VK_CHECK_RESULT(vkCreateDescriptorPool(device_, &poolInfo2, NULL, &descriptor_pool_));
 
-  VkDescriptorSetLayout layouts[] = {descriptor_set_layout_};
+  std::vector<VkDescriptorSetLayout> layouts(count, descriptor_set_layout_);
   VkDescriptorSetAllocateInfo allocInfo2 = {};
   allocInfo2.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
   allocInfo2.descriptorPool = descriptor_pool_;
-  allocInfo2.descriptorSetCount = 1;
-  allocInfo2.pSetLayouts = layouts;
+  allocInfo2.descriptorSetCount = count;
+  allocInfo2.pSetLayouts = layouts.data();
 
-  VK_CHECK_RESULT(vkAllocateDescriptorSets(device_, &allocInfo2, &descriptor_set_));
+  descriptor_sets_.resize(count);
+  VK_CHECK_RESULT(vkAllocateDescriptorSets(device_, &allocInfo2, descriptor_sets_.data()));
 
+  texture_view_ = texture_streamer_->view(texture_);
+  for (uint32_t i = 0; i < count; i++)
+    UpdateDescriptorSet(i);
+  CaptureTexture();
+}
+
+void Triangle::UpdateDescriptorSet(uint32_t image) {
   VkDescriptorBufferInfo bufferInfo = {};
-  bufferInfo.buffer = uniform_buffer_;
+  bufferInfo.buffer = uniform_buffers_[image];
   bufferInfo.offset = 0;
   bufferInfo.range = sizeof(UniformBufferObject);
 
-  VkWriteDescriptorSet descriptorWrite = {};
-  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  descriptorWrite.dstSet = descriptor_set_;
-  descriptorWrite.dstBinding = 0;
-  descriptorWrite.dstArrayElement = 0;
-
-  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  descriptorWrite.descriptorCount = 1;
-
-  descriptorWrite.pBufferInfo = &bufferInfo;
-  descriptorWrite.pImageInfo = NULL; // Optional
-  descriptorWrite.pTexelBufferView = NULL; // Optional
-
-  vkUpdateDescriptorSets(device_, 1, &descriptorWrite, 0, NULL);
+  VkDescriptorImageInfo imageInfo = {};
+  imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  imageInfo.imageView = texture_view_;
+  imageInfo.sampler = texture_sampler_;
+
+  VkWriteDescriptorSet descriptorWrites[2] = {};
+  descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrites[0].dstSet = descriptor_sets_[image];
+  descriptorWrites[0].dstBinding = 0;
+  descriptorWrites[0].dstArrayElement = 0;
+
+  descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  descriptorWrites[0].descriptorCount = 1;
+
+  descriptorWrites[0].pBufferInfo = &bufferInfo;
+  descriptorWrites[0].pImageInfo = NULL; // Optional
+  descriptorWrites[0].pTexelBufferView = NULL; // Optional
+
+  descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrites[1].dstSet = descriptor_sets_[image];
+  descriptorWrites[1].dstBinding = 1;
+  descriptorWrites[1].dstArrayElement = 0;
+  descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  descriptorWrites[1].descriptorCount = 1;
+  descriptorWrites[1].pImageInfo = &imageInfo;
+
+  vkUpdateDescriptorSets(device_, 2, descriptorWrites, 0, NULL);
+}
 
-  // Command buffers
+void Triangle::CreateCommandBuffers() {
   command_buffers_.resize(swap_chain_frame_buffers_.size());
   VkCommandBufferAllocateInfo allocInfo = {};
   allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -684,79 +1277,504 @@ void Triangle::CreateSurface() {
   VK_CHECK_RESULT(
     vkAllocateCommandBuffers(device_, &allocInfo, command_buffers_.data()));
 
-  for (size_t i = 0; i < command_buffers_.size(); i++) {
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-    beginInfo.pInheritanceInfo = NULL; // Optional
-
-    vkBeginCommandBuffer(command_buffers_[i], &beginInfo);
-
-    // OK, we are recording now let's do something
-    VkRenderPassBeginInfo renderPassInfo = {};
-    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassInfo.renderPass = render_pass_;
-    renderPassInfo.framebuffer = swap_chain_frame_buffers_[i];
-    renderPassInfo.renderArea.offset = {0, 0};
-    renderPassInfo.renderArea.extent = extent;
-    VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
-    renderPassInfo.clearValueCount = 1;
-    renderPassInfo.pClearValues = &clearColor;
-    vkCmdBeginRenderPass(command_buffers_[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(command_buffers_[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline_);
-
-    VkBuffer vertexBuffers[] = {vertex_buffer_};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(command_buffers_[i], 0, 1, vertexBuffers, offsets);
-    vkCmdBindIndexBuffer(command_buffers_[i], index_buffer_, 0, VK_INDEX_TYPE_UINT16);
-    vkCmdBindDescriptorSets(command_buffers_[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1, &descriptor_set_, 0, NULL);
-    vkCmdDrawIndexed(command_buffers_[i], indices_.size(), 1, 0, 0, 0);
-
-    vkCmdEndRenderPass(command_buffers_[i]);
-    VK_CHECK_RESULT(vkEndCommandBuffer(command_buffers_[i]));
+  if (frame_timestamp_bits_ > 0) {
+    VkQueryPoolCreateInfo queryInfo = {};
+    queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount = 2 * command_buffers_.size();
+    VK_CHECK_RESULT(
+      vkCreateQueryPool(device_, &queryInfo, NULL, &frame_query_pool_));
   }
+
+  image_generic_.assign(command_buffers_.size(), false);
+  image_draw_stats_.assign(command_buffers_.size(), DrawQueue::Stats());
+  for (uint32_t i = 0; i < command_buffers_.size(); i++)
+    RecordCommandBuffer(i);
+  image_values_.assign(command_buffers_.size(), 0);
+  image_dirty_.assign(command_buffers_.size(), false);
+
   VkSemaphoreCreateInfo semaphoreInfo = {};
   semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  for (VkSemaphore &semaphore : image_available_semaphores_)
+    VK_CHECK_RESULT(
+      vkCreateSemaphore(device_, &semaphoreInfo, NULL, &semaphore));
+  render_finished_semaphores_.resize(command_buffers_.size() *
+    (device_group_mode_ == DEVICE_GROUP_SFR ? device_group_size_ : 1));
+  for (VkSemaphore &semaphore : render_finished_semaphores_)
+    VK_CHECK_RESULT(
+      vkCreateSemaphore(device_, &semaphoreInfo, NULL, &semaphore));
+}
+
+void Triangle::CreateExporter() {
+  if (!export_spec_)
+    return;
+  // The images of a device group are split between devices
+  if (device_group_size_ > 1) {
+    fprintf(stderr, "Frame export doesn't handle device groups, not exporting\n");
+    return;
+  }
+  // Rebuilding the device, the output carries on
+  if (exporter_) {
+    exporter_->ResetDevice(physical_device_, device_, graphics_family_,
+                           swapChainImageFormat, swap_chain_extent_);
+    return;
+  }
+  exporter_.reset(new FrameExporter(physical_device_, device_, graphics_family_,
+                                    swapChainImageFormat, swap_chain_extent_,
+                                    EXPORT_RING, true));
+  // Open() says why
+  if (!exporter_->Open(export_spec_))
+    throw std::runtime_error("Can't export frames");
+}
+
+// Hands what is left on the GPU to the writer and waits for it.
+void Triangle::FinishExport() {
+  if (!exporter_)
+    return;
+  try {
+    scheduler_->Wait(scheduler_->last_submitted());
+    scheduler_->Collect();
+  } catch (const VulkanError &e) {
+    fprintf(stderr, "%s, last frames not exported\n", e.what());
+  }
+  exporter_->Close();
+}
+
+// vkDeviceWaitIdle() needs every queue, some are shared with other threads.
+VkResult Triangle::WaitIdle() {
+  std::lock(queue_mutex_, transfer_queue_mutex_, compute_queue_mutex_);
+  VkResult result = vkDeviceWaitIdle(device_);
+  queue_mutex_.unlock();
+  transfer_queue_mutex_.unlock();
+  compute_queue_mutex_.unlock();
+  return result;
+}
+
+// Everything that depends on the swapchain, the GPU being done with it.
+void Triangle::DestroySwapChainObjects() {
+  if (!command_buffers_.empty())
+    vkFreeCommandBuffers(device_, command_pool_, command_buffers_.size(),
+                         command_buffers_.data());
+  command_buffers_.clear();
+  vkDestroyQueryPool(device_, frame_query_pool_, NULL);
+  frame_query_pool_ = VK_NULL_HANDLE;
+  for (VkSemaphore &semaphore : image_available_semaphores_) {
+    vkDestroySemaphore(device_, semaphore, NULL);
+    semaphore = VK_NULL_HANDLE;
+  }
+  for (VkSemaphore semaphore : render_finished_semaphores_)
+    vkDestroySemaphore(device_, semaphore, NULL);
+  render_finished_semaphores_.clear();
+
+  // Frees the sets too
+  vkDestroyDescriptorPool(device_, descriptor_pool_, NULL);
+  descriptor_pool_ = VK_NULL_HANDLE;
+  descriptor_sets_.clear();
+  for (size_t i = 0; i < uniform_buffers_.size(); i++) {
+    vkDestroyBuffer(device_, uniform_buffers_[i], NULL);
+    vkFreeMemory(device_, uniform_buffer_memories_[i], NULL);
+  }
+  uniform_buffers_.clear();
+  uniform_buffer_memories_.clear();
+  uniform_data_.clear();
+
+  for (VkFramebuffer framebuffer : swap_chain_frame_buffers_)
+    vkDestroyFramebuffer(device_, framebuffer, NULL);
+  swap_chain_frame_buffers_.clear();
+  // Pipelines get made again along with the swapchain, don't pile these up
+  pipelines_.reset();
+  for (VkShaderModule module : {vertex_module_, fragment_module_}) {
+    vkDestroyShaderModule(device_, module, NULL);
+    capture_shaders_.erase(module);
+  }
+  vertex_module_ = VK_NULL_HANDLE;
+  fragment_module_ = VK_NULL_HANDLE;
+  vkDestroyPipelineLayout(device_, pipeline_layout_, NULL);
+  pipeline_layout_ = VK_NULL_HANDLE;
+  vkDestroyRenderPass(device_, render_pass_, NULL);
+  render_pass_ = VK_NULL_HANDLE;
+
+  for (VkImageView view : swap_chain_image_views_)
+    vkDestroyImageView(device_, view, NULL);
+  swap_chain_image_views_.clear();
+  swap_chain_images_.clear();
+  vkDestroySwapchainKHR(device_, swap_chain_, NULL);
+  swap_chain_ = VK_NULL_HANDLE;
+  vkDestroyFence(device_, acquire_fence_, NULL);
+  acquire_fence_ = VK_NULL_HANDLE;
+}
+
+// Everything AddDeviceTasks() makes, down to the device. Fine on a lost
+// device, and on one that was only partly built.
+void Triangle::DestroyDeviceObjects() {
+  if (device_ == VK_NULL_HANDLE)
+    return;
+  // Fails on a lost device, which is idle enough
+  WaitIdle();
+  // What it counted since the last update, before its totals go
+  if (texture_streamer_)
+    UpdateMetrics();
+  texture_streamer_.reset();
+  streamer_stats_ = {};
+  // Runs what was deferred when the device is still there, so before the
+  // query pool and exporter go
+  scheduler_.reset();
+  if (exporter_)
+    exporter_->ReleaseDevice();
+  DestroySwapChainObjects();
+
+  vkDestroySampler(device_, texture_sampler_, NULL);
+  texture_sampler_ = VK_NULL_HANDLE;
+  vkDestroyBuffer(device_, vertex_buffer_, NULL);
+  vkFreeMemory(device_, vertex_buffer_memory_, NULL);
+  vertex_buffer_ = VK_NULL_HANDLE;
+  vertex_buffer_memory_ = VK_NULL_HANDLE;
+  vkDestroyBuffer(device_, index_buffer_, NULL);
+  vkFreeMemory(device_, index_buffer_memory_, NULL);
+  index_buffer_ = VK_NULL_HANDLE;
+  index_buffer_memory_ = VK_NULL_HANDLE;
+  vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, NULL);
+  descriptor_set_layout_ = VK_NULL_HANDLE;
+  vkDestroyCommandPool(device_, command_pool_, NULL);
+  command_pool_ = VK_NULL_HANDLE;
+
+  vkDestroyDevice(device_, NULL);
+  device_ = VK_NULL_HANDLE;
+  for (uint64_t &value : frame_values_)
+    value = 0;
+}
+
+// After VK_ERROR_OUT_OF_DATE_KHR, usually a resized window. Returns false
+// while there is nothing to render to.
+bool Triangle::RecreateSwapChain() {
+  VkSurfaceCapabilitiesKHR details;
   VK_CHECK_RESULT(
-    vkCreateSemaphore(device_, &semaphoreInfo, NULL, &image_available_semaphore_));
-  VK_CHECK_RESULT(
-    vkCreateSemaphore(device_, &semaphoreInfo, NULL, &render_finished_semaphore_));
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device_, surface_, &details));
+  if (details.currentExtent.width == 0 || details.currentExtent.height == 0)
+    return false;
+
+  VK_CHECK_RESULT(WaitIdle());
+  // Hands the exported frames over before their images go
+  scheduler_->Collect();
+  VkFormat format = swapChainImageFormat;
+  VkExtent2D extent = swap_chain_extent_;
+  DestroySwapChainObjects();
+
+  CreateSwapChain();
+  CreateRenderPass();
+  CreatePipeline();
+  CreateFramebuffers();
+  CreateUniformBuffers();
+  CreateDescriptorSets();
+  CreateCommandBuffers();
+  if (exporter_ && (format != swapChainImageFormat ||
+                    extent.width != swap_chain_extent_.width ||
+                    extent.height != swap_chain_extent_.height))
+    exporter_->ResetDevice(physical_device_, device_, graphics_family_,
+                           swapChainImageFormat, swap_chain_extent_);
+  swapchain_stale_ = false;
+  swapchain_recreations_++;
+  swapchain_metric_->Add();
+  return true;
+}
+
+// Rebuilds the device from what the CPU kept: vertices, shader code and
+// texture files are still around, everything else is made again. Gives up
+// on errors a rebuild can't help with, and on a device that keeps failing.
+void Triangle::Recover(const VulkanError &error) {
+  auto start = std::chrono::steady_clock::now();
+  VulkanError last = error;
+  for (;;) {
+    fprintf(stderr, "%s\n", last.what());
+    if (!last.recoverable())
+      exit(1);
+    auto now = std::chrono::steady_clock::now();
+    while (!recovery_times_.empty() &&
+           now - recovery_times_.front() > std::chrono::seconds(RECOVERY_WINDOW))
+      recovery_times_.pop_front();
+    if (recovery_times_.size() >= MAX_RECOVERIES) {
+      fprintf(stderr, "Device failed %u times within %u s, giving up\n",
+              (unsigned) MAX_RECOVERIES, (unsigned) RECOVERY_WINDOW);
+      exit(1);
+    }
+    recovery_times_.push_back(now);
+    // What ran out once would run out again
+    if (last.result() == VK_ERROR_OUT_OF_DEVICE_MEMORY)
+      texture_budget_ /= 2;
+
+    try {
+      InitScheduler init;
+      auto teardown = init.Add("teardown", [this]{ DestroyDeviceObjects(); });
+      AddDeviceTasks(&init, teardown, teardown);
+      unsigned threads = std::thread::hardware_concurrency();
+      init.Run(std::min(std::max(threads, 2u), 4u));
+      break;
+    } catch (const VulkanError &e) {
+      last = e;
+    }
+  }
+  swapchain_stale_ = false;
+  recoveries_++;
+  recoveries_metric_->Add();
+  fprintf(stderr, "Recovered from %s in %.1f ms\n", VkResultName(error.result()),
+          std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count());
+}
+
+// Only while the GPU is done with the image, see DrawFrame().
+void Triangle::RecordCommandBuffer(uint32_t i) {
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = 0;
+  beginInfo.pInheritanceInfo = NULL; // Optional
+
+  vkBeginCommandBuffer(command_buffers_[i], &beginInfo);
+  if (frame_query_pool_ != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(command_buffers_[i], frame_query_pool_, 2 * i, 2);
+    vkCmdWriteTimestamp(command_buffers_[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        frame_query_pool_, 2 * i);
+  }
+
+  // OK, we are recording now let's do something
+  VkRenderPassBeginInfo renderPassInfo = {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderPassInfo.renderPass = render_pass_;
+  renderPassInfo.framebuffer = swap_chain_frame_buffers_[i];
+  renderPassInfo.renderArea.offset = {0, 0};
+  renderPassInfo.renderArea.extent = swap_chain_extent_;
+  VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
+  renderPassInfo.clearValueCount = 1;
+  renderPassInfo.pClearValues = &clearColor;
+
+  // Split frame: each device of the group only renders its own band
+  std::vector<VkRect2D> areas;
+  VkDeviceGroupRenderPassBeginInfoKHR groupInfo = {};
+  if (device_group_size_ > 1 && device_group_mode_ == DEVICE_GROUP_SFR) {
+    areas = SplitFrameAreas(swap_chain_extent_, device_group_size_);
+    groupInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_RENDER_PASS_BEGIN_INFO_KHR;
+    groupInfo.deviceMask = DeviceGroupFrameMask(device_group_mode_, device_group_size_, 0);
+    groupInfo.deviceRenderAreaCount = areas.size();
+    groupInfo.pDeviceRenderAreas = areas.data();
+    renderPassInfo.pNext = &groupInfo;
+  }
+  vkCmdBeginRenderPass(command_buffers_[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+  bool specialized;
+  VkPipeline pipeline = pipelines_->Get(pipeline_key_, &specialized);
+  image_generic_[i] = !specialized;
+
+  // The quad is the one draw for now
+  const LodLevel &level = lod_chain_.levels[lod_];
+  DrawPacket packet = {};
+  packet.key = DrawQueue::SortKey(0, 0, 0, 0.0f);
+  packet.pipeline = pipeline;
+  packet.layout = pipeline_layout_;
+  packet.descriptor_set = descriptor_sets_[i];
+  packet.vertex_buffer = vertex_buffer_;
+  packet.index_buffer = index_buffer_;
+  packet.index_type = VK_INDEX_TYPE_UINT16;
+  packet.constants = &pipeline_key_.features;
+  packet.constants_size = sizeof(pipeline_key_.features);
+  packet.constants_stages = VK_SHADER_STAGE_FRAGMENT_BIT;
+  packet.index_count = level.index_count;
+  packet.instance_count = 1;
+  packet.first_index = level.first_index;
+  draw_queue_.Add(packet);
+  draw_stats_ = draw_queue_.Flush(command_buffers_[i], NULL);
+  image_draw_stats_[i] = draw_stats_;
+  sort_time_metric_->Observe(draw_stats_.sort_seconds);
+
+  vkCmdEndRenderPass(command_buffers_[i]);
+  if (frame_query_pool_ != VK_NULL_HANDLE)
+    vkCmdWriteTimestamp(command_buffers_[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        frame_query_pool_, 2 * i + 1);
+  VK_CHECK_RESULT(vkEndCommandBuffer(command_buffers_[i]));
+}
+
+// Mirrors what RecordCommandBuffer puts in the command buffers.
+void Triangle::CaptureFrame() {
+  if (!capture_.enabled())
+    return;
+  capture_.BeginFrame(swap_chain_extent_.width, swap_chain_extent_.height,
+                      swapChainImageFormat);
+  capture_.BindPipeline(capture_pipeline_);
+  capture_.BindVertexBuffer(capture_vertex_buffer_, 0);
+  capture_.BindIndexBuffer(capture_index_buffer_, 0, VK_INDEX_TYPE_UINT16);
+  capture_.BindUniformBuffer(0, capture_uniform_buffer_);
+  capture_.BindTexture(1, capture_texture_);
+  const LodLevel &level = lod_chain_.levels[lod_];
+  capture_.DrawIndexed(level.index_count, 1, level.first_index, 0, 0);
+  capture_.EndFrame();
 }
 
 void Triangle::DrawFrame() {
+  auto now = std::chrono::steady_clock::now();
+  if (frame_ > 0)
+    frame_time_metric_->Observe(
+      std::chrono::duration<double>(now - last_frame_time_).count());
+  last_frame_time_ = now;
+  if (swapchain_stale_ && !RecreateSwapChain())
+    return;
+  // The acquire semaphore of this slot is free again once the submission
+  // that waited on it is done
+  uint32_t slot = frame_ % FRAMES_IN_FLIGHT;
+  scheduler_->Wait(frame_values_[slot]);
+  frame_arena_.Reset();
+  VkSemaphore imageAvailable = image_available_semaphores_[slot];
+
   uint32_t imageIndex;
-  vkAcquireNextImageKHR(device_, swap_chain_, std::numeric_limits<uint64_t>::max(), image_available_semaphore_, VK_NULL_HANDLE, &imageIndex);
+  uint32_t deviceMask = DeviceGroupFrameMask(device_group_mode_, device_group_size_, frame_++);
+  // Which device of the group waits for the image to be acquired and
+  // signals the end of rendering. Split frame waits on the CPU instead as a
+  // binary semaphore can only be waited on by one device.
+  uint32_t deviceIndex = 0;
+  while (!(deviceMask & (1u << deviceIndex)))
+    deviceIndex++;
+  bool waitAcquire = true;
+
+  VkResult acquired;
+  if (device_group_size_ > 1) {
+    waitAcquire = device_group_mode_ != DEVICE_GROUP_SFR;
+    VkAcquireNextImageInfoKHR acquireInfo = {};
+    acquireInfo.sType = VK_STRUCTURE_TYPE_ACQUIRE_NEXT_IMAGE_INFO_KHR;
+    acquireInfo.swapchain = swap_chain_;
+    acquireInfo.timeout = std::numeric_limits<uint64_t>::max();
+    acquireInfo.semaphore = waitAcquire ? imageAvailable : VK_NULL_HANDLE;
+    acquireInfo.fence = waitAcquire ? VK_NULL_HANDLE : acquire_fence_;
+    acquireInfo.deviceMask = deviceMask;
+    acquired = vkAcquireNextImage2KHR(device_, &acquireInfo, &imageIndex);
+    if (!waitAcquire && (acquired == VK_SUCCESS || acquired == VK_SUBOPTIMAL_KHR)) {
+      VK_CHECK_RESULT(vkWaitForFences(device_, 1, &acquire_fence_, VK_TRUE,
+                                      std::numeric_limits<uint64_t>::max()));
+      vkResetFences(device_, 1, &acquire_fence_);
+    }
+  } else {
+    acquired = vkAcquireNextImageKHR(device_, swap_chain_, std::numeric_limits<uint64_t>::max(), imageAvailable, VK_NULL_HANDLE, &imageIndex);
+  }
+  // Suboptimal still presents, out of date gets a new swapchain first
+  if (acquired == VK_ERROR_OUT_OF_DATE_KHR) {
+    swapchain_stale_ = true;
+    return;
+  }
+  if (acquired != VK_SUCCESS && acquired != VK_SUBOPTIMAL_KHR)
+    throw VulkanError(acquired, "vkAcquireNextImageKHR", __FILE__, __LINE__);
+
+  // Wait for the last frame rendered to this image, usually long done, and
+  // run what was deferred until then: its timestamps are read before the
+  // command buffer resets them.
+  scheduler_->Wait(image_values_[imageIndex]);
+  scheduler_->Collect();
+  texture_streamer_->ReleaseRetired(scheduler_->completed());
+
+  UpdateTexture();
+  UpdateUniformBuffer(imageIndex);
+  if (image_generic_[imageIndex] && pipelines_->Ready(pipeline_key_))
+    image_dirty_[imageIndex] = true;
+  if (image_dirty_[imageIndex]) {
+    UpdateDescriptorSet(imageIndex);
+    RecordCommandBuffer(imageIndex);
+    image_dirty_[imageIndex] = false;
+  }
+  CaptureFrame();
+
+  uint32_t renderers = render_finished_semaphores_.size() / command_buffers_.size();
+  VkSemaphore *renderFinished = &render_finished_semaphores_[imageIndex * renderers];
 
   VkSubmitInfo submitInfo = {};
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-  VkSemaphore waitSemaphores[] = {image_available_semaphore_};
+  VkSemaphore waitSemaphores[] = {imageAvailable};
   VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-  submitInfo.waitSemaphoreCount = 1;
+  submitInfo.waitSemaphoreCount = waitAcquire ? 1 : 0;
   submitInfo.pWaitSemaphores = waitSemaphores;
   submitInfo.pWaitDstStageMask = waitStages;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &command_buffers_[imageIndex];
-  VkSemaphore signalSemaphores[] = {render_finished_semaphore_};
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = signalSemaphores;
+  // The readback of an exported frame goes right after it, before present
+  VkCommandBuffer commandBuffers[2] = {command_buffers_[imageIndex], VK_NULL_HANDLE};
+  uint32_t exportSlot;
+  if (exporter_)
+    commandBuffers[1] = exporter_->Record(swap_chain_images_[imageIndex],
+                                          VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                                          &exportSlot);
+  submitInfo.commandBufferCount = commandBuffers[1] != VK_NULL_HANDLE ? 2 : 1;
+  submitInfo.pCommandBuffers = commandBuffers;
+  submitInfo.signalSemaphoreCount = renderers;
+  submitInfo.pSignalSemaphores = renderFinished;
+
+  // Split frame: device i signals semaphore i once its band is done
+  FrameVector<uint32_t> signalIndices(renderers, 0, &frame_arena_);
+  for (uint32_t i = 0; i < signalIndices.size(); ++i)
+    signalIndices[i] = signalIndices.size() > 1 ? i : deviceIndex;
+  VkDeviceGroupSubmitInfoKHR groupSubmitInfo = {};
+  if (device_group_size_ > 1) {
+    groupSubmitInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_SUBMIT_INFO_KHR;
+    groupSubmitInfo.waitSemaphoreCount = submitInfo.waitSemaphoreCount;
+    groupSubmitInfo.pWaitSemaphoreDeviceIndices = &deviceIndex;
+    groupSubmitInfo.commandBufferCount = 1;
+    groupSubmitInfo.pCommandBufferDeviceMasks = &deviceMask;
+    groupSubmitInfo.signalSemaphoreCount = signalIndices.size();
+    groupSubmitInfo.pSignalSemaphoreDeviceIndices = signalIndices.data();
+  }
 
-  VK_CHECK_RESULT(
-    vkQueueSubmit(graphics_queue_, 1, &submitInfo, VK_NULL_HANDLE));
+  uint64_t value = scheduler_->Submit(
+    submitInfo, device_group_size_ > 1 ? &groupSubmitInfo : NULL, deviceIndex);
+  frame_values_[slot] = value;
+  image_values_[imageIndex] = value;
+  if (frame_query_pool_ != VK_NULL_HANDLE) {
+    scheduler_->Defer(value, [this, imageIndex]{
+      uint64_t timestamps[2];
+      if (vkGetQueryPoolResults(device_, frame_query_pool_, 2 * imageIndex, 2,
+                                sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+        timeline_->Add(GpuTimeline::GRAPHICS, timestamps[0], timestamps[1],
+                       frame_timestamp_bits_);
+        uint64_t mask = frame_timestamp_bits_ < 64
+          ? (1ull << frame_timestamp_bits_) - 1 : ~0ull;
+        gpu_time_metric_->Observe(
+          ((timestamps[1] - timestamps[0]) & mask) * timestamp_period_ * 1e-9);
+      }
+    });
+  }
+  if (commandBuffers[1] != VK_NULL_HANDLE)
+    scheduler_->Defer(value, [this, exportSlot]{ exporter_->Ready(exportSlot); });
+  frames_metric_->Add();
+  draws_metric_->Add(image_draw_stats_[imageIndex].draws);
+  binds_metric_->Add(image_draw_stats_[imageIndex].binds());
+  triangles_metric_->Add(lod_chain_.levels[lod_].index_count / 3);
+  if (frame_ % METRICS_INTERVAL == 0)
+    UpdateMetrics();
 
   // PRESENTATION
   VkPresentInfoKHR presentInfo = {};
   presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
-  presentInfo.waitSemaphoreCount = 1;
-  presentInfo.pWaitSemaphores = signalSemaphores;
+  presentInfo.waitSemaphoreCount = renderers;
+  presentInfo.pWaitSemaphores = renderFinished;
 
   VkSwapchainKHR swapChains[] = {swap_chain_};
   presentInfo.swapchainCount = 1;
   presentInfo.pSwapchains = swapChains;
   presentInfo.pImageIndices = &imageIndex;
   presentInfo.pResults = NULL; // Optional
-  vkQueuePresentKHR(present_queue_, &presentInfo);
+
+  VkDeviceGroupPresentInfoKHR groupPresentInfo = {};
+  if (device_group_size_ > 1) {
+    groupPresentInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_PRESENT_INFO_KHR;
+    groupPresentInfo.swapchainCount = 1;
+    groupPresentInfo.pDeviceMasks = &deviceMask;
+    groupPresentInfo.mode = device_group_present_mode_;
+    presentInfo.pNext = &groupPresentInfo;
+  }
+  // Under the mutex of the present queue's family, which is the graphics
+  // one more often than not
+  VkResult presented;
+  {
+    std::lock_guard<std::mutex> lock(
+      *GetQueue(present_queue_, present_family_).mutex);
+    presented = vkQueuePresentKHR(present_queue_, &presentInfo);
+  }
+  if (presented == VK_ERROR_OUT_OF_DATE_KHR)
+    swapchain_stale_ = true;
+  else if (presented != VK_SUCCESS && presented != VK_SUBOPTIMAL_KHR)
+    throw VulkanError(presented, "vkQueuePresentKHR", __FILE__, __LINE__);
 }
 
 void Triangle::InitVulkanPhysicalDevice() {
@@ -769,54 +1787,134 @@ void Triangle::InitVulkanPhysicalDevice() {
   VK_CHECK_RESULT(
     vkEnumeratePhysicalDevices(instance_, &deviceCount, physicalDevices.data()));
 
-  physical_device_ = physicalDevices[0];
-
-  // Let's get the queue family properties of the vulkan device
-  uint32_t pqf_count_;
-  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &pqf_count_, NULL);
+  std::vector<DeviceCandidate> candidates(deviceCount);
+  for (uint32_t i = 0; i < deviceCount; i++) {
+    QueryDeviceCandidate(physicalDevices[i], surface_, &candidates[i]);
+    const VkPhysicalDeviceProperties &physicalProperties = candidates[i].properties;
+    fprintf(stdout, "Device %u Name:  %s\n", i, physicalProperties.deviceName);
+    fprintf(stdout, "Device Type:    %d\n", physicalProperties.deviceType);
+    fprintf(stdout, "Driver Version: %d\n", physicalProperties.driverVersion);
+    fprintf(stdout, "API Version:    %d.%d.%d\n",
+            VK_VERSION_MAJOR(physicalProperties.apiVersion),
+            VK_VERSION_MINOR(physicalProperties.apiVersion),
+            VK_VERSION_PATCH(physicalProperties.apiVersion));
+  }
 
-  std::vector<VkQueueFamilyProperties> physicalDevicesQProperties(pqf_count_);
-  vkGetPhysicalDeviceQueueFamilyProperties(
-    physical_device_, &pqf_count_, physicalDevicesQProperties.data());
+  DeviceRequirements requirements = {};
+  requirements.extensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+                             VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME};
+  requirements.present = true;
 
-  // Now the logical device
+  // TRIANGLE_DEVICE=<index or part of the name> overrides the scoring
+  DeviceChoice choice;
+  if (!SelectDevice(candidates, requirements, getenv("TRIANGLE_DEVICE"), &choice)) {
+    fprintf(stderr, "No usable Vulkan device\n");
+    exit(1);
+  }
+  physical_device_ = physicalDevices[choice.index];
+  graphics_family_ = choice.graphics_family;
+  present_family_ = choice.present_family;
+  transfer_family_ = choice.transfer_family;
+  compute_family_ = choice.compute_family;
+  fprintf(stdout, "Using device %u (%s)\n", choice.index,
+          candidates[choice.index].properties.deviceName);
+  fprintf(stdout, "Queue families: graphics %u, present %u, transfer %u, compute %u\n",
+          graphics_family_, present_family_, transfer_family_, compute_family_);
+
+  // Kept across device rebuilds, along with what it measured
+  if (!timeline_)
+    timeline_.reset(new GpuTimeline(
+      candidates[choice.index].properties.limits.timestampPeriod));
+  frame_timestamp_bits_ =
+    candidates[choice.index].queue_families[graphics_family_].timestampValidBits;
+  timestamp_period_ = candidates[choice.index].properties.limits.timestampPeriod;
+  vkGetPhysicalDeviceMemoryProperties(physical_device_, &memory_properties_);
+  CreateHeapMetrics();
+
+  // Now the logical device, with a queue for every distinct family
   float priorities[] = {1.0f};
-  VkDeviceQueueCreateInfo queueInfo{};
-  queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queueInfo.pNext = NULL;
-  queueInfo.flags = 0;
-  queueInfo.queueFamilyIndex = 0;
-  queueInfo.queueCount = 1;
-  queueInfo.pQueuePriorities = &priorities[0];
-
-  std::vector<const char *> enabledExtensions = {
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+  uint32_t roleFamilies[] = {graphics_family_, present_family_,
+                             transfer_family_, compute_family_};
+  std::vector<VkDeviceQueueCreateInfo> queueInfos;
+  for (uint32_t family : roleFamilies) {
+    bool created = false;
+    for (const VkDeviceQueueCreateInfo &info : queueInfos)
+      created = created || info.queueFamilyIndex == family;
+    if (created)
+      continue;
+    VkDeviceQueueCreateInfo queueInfo = {};
+    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo.queueFamilyIndex = family;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &priorities[0];
+    queueInfos.push_back(queueInfo);
+  }
+
+  std::vector<const char *> enabledExtensions = requirements.extensions;
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+  timelineFeatures.timelineSemaphore = VK_TRUE;
   VkDeviceCreateInfo deviceInfo{};
   deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  deviceInfo.pNext = NULL;
+  deviceInfo.pNext = &timelineFeatures;
   deviceInfo.flags = 0;
-  deviceInfo.enabledLayerCount = validation_layers_.size();
-  deviceInfo.ppEnabledLayerNames = validation_layers_.data();
-  deviceInfo.queueCreateInfoCount = 1;
-  deviceInfo.pQueueCreateInfos = &queueInfo;
+  if (validation_) {
+    deviceInfo.enabledLayerCount = validation_layers_.size();
+    deviceInfo.ppEnabledLayerNames = validation_layers_.data();
+  }
+  deviceInfo.queueCreateInfoCount = queueInfos.size();
+  deviceInfo.pQueueCreateInfos = queueInfos.data();
+  deviceInfo.pEnabledFeatures = &requirements.features;
+
+  // Span the device group the chosen device belongs to, if asked to
+  std::vector<VkPhysicalDevice> groupDevices;
+  if (device_group_mode_ != DEVICE_GROUP_NONE) {
+    uint32_t groupCount = 0;
+    if (vkEnumeratePhysicalDeviceGroupsKHR)
+      vkEnumeratePhysicalDeviceGroupsKHR(instance_, &groupCount, NULL);
+    std::vector<VkPhysicalDeviceGroupPropertiesKHR> groups(groupCount);
+    for (auto &group : groups)
+      group.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GROUP_PROPERTIES_KHR;
+    if (groupCount)
+      vkEnumeratePhysicalDeviceGroupsKHR(instance_, &groupCount, groups.data());
+
+    for (const auto &group : groups) {
+      std::vector<VkPhysicalDevice> members(group.physicalDevices,
+        group.physicalDevices + group.physicalDeviceCount);
+      if (std::find(members.begin(), members.end(), physical_device_) != members.end())
+        groupDevices = members;
+    }
+
+    const std::vector<std::string> &extensions = candidates[choice.index].extensions;
+    bool supported = std::find(extensions.begin(), extensions.end(),
+                               VK_KHR_DEVICE_GROUP_EXTENSION_NAME) != extensions.end();
+    if (groupDevices.size() < 2 || !supported) {
+      fprintf(stderr, "No device group to use, rendering on a single device\n");
+      device_group_mode_ = DEVICE_GROUP_NONE;
+      groupDevices.clear();
+    }
+  }
+
+  VkDeviceGroupDeviceCreateInfoKHR groupInfo = {};
+  if (!groupDevices.empty()) {
+    groupInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_DEVICE_CREATE_INFO_KHR;
+    groupInfo.physicalDeviceCount = groupDevices.size();
+    groupInfo.pPhysicalDevices = groupDevices.data();
+    timelineFeatures.pNext = &groupInfo;
+    enabledExtensions.push_back(VK_KHR_DEVICE_GROUP_EXTENSION_NAME);
+    device_group_size_ = groupDevices.size();
+  }
   deviceInfo.enabledExtensionCount = enabledExtensions.size();
   deviceInfo.ppEnabledExtensionNames = enabledExtensions.data();
-  deviceInfo.pEnabledFeatures = NULL;
 
   VK_CHECK_RESULT(vkCreateDevice(physical_device_, &deviceInfo, NULL, &device_));
-  VkPhysicalDeviceProperties physicalProperties = {};
+  LoadDeviceFunctions(device_);
+  vkGetDeviceQueue(device_, graphics_family_, 0, &graphics_queue_);
+  vkGetDeviceQueue(device_, present_family_, 0, &present_queue_);
+  vkGetDeviceQueue(device_, transfer_family_, 0, &transfer_queue_);
+  vkGetDeviceQueue(device_, compute_family_, 0, &compute_queue_);
 
-  for (uint32_t i = 0; i < deviceCount; i++) {
-    vkGetPhysicalDeviceProperties(physicalDevices[i], &physicalProperties);
-    fprintf(stdout, "Device Name:    %s\n", physicalProperties.deviceName);
-    fprintf(stdout, "Device Type:    %d\n", physicalProperties.deviceType);
-    fprintf(stdout, "Driver Version: %d\n", physicalProperties.driverVersion);
-    fprintf(stdout, "API Version:    %d.%d.%d\n",
-            VK_VERSION_MAJOR(physicalProperties.apiVersion),
-            VK_VERSION_MINOR(physicalProperties.apiVersion),
-            VK_VERSION_PATCH(physicalProperties.apiVersion));
-  }
-  vkGetDeviceQueue(device_, 0, 0, &graphics_queue_);
+  scheduler_.reset(new FrameScheduler(device_, GetQueue(graphics_queue_, graphics_family_)));
 }
 
 void Triangle::InitVulkanInstance() {
@@ -837,8 +1935,10 @@ void Triangle::InitVulkanInstance() {
   //   std::cout << avail_layer.layerName << std::endl;
   // }
 
-  create_info.enabledLayerCount = validation_layers_.size();
-  create_info.ppEnabledLayerNames = validation_layers_.data();
+  if (validation_) {
+    create_info.enabledLayerCount = validation_layers_.size();
+    create_info.ppEnabledLayerNames = validation_layers_.data();
+  }
 
   // // NOTE: Let's query Vulkan to get the enabled extensions
   // uint32_t extension_count = 0;
@@ -862,12 +1962,34 @@ void Triangle::InitVulkanInstance() {
   // We pick the xcb required extension
   std::vector<const char *> enabledExtensions = \
     {VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_XCB_SURFACE_EXTENSION_NAME,
-     VK_EXT_DEBUG_REPORT_EXTENSION_NAME};
+     // VK_KHR_timeline_semaphore depends on it
+     VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME};
+  if (validation_)
+    enabledExtensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
+  if (device_group_mode_ != DEVICE_GROUP_NONE) {
+    uint32_t extension_count = 0;
+    vkEnumerateInstanceExtensionProperties(NULL, &extension_count, NULL);
+    std::vector<VkExtensionProperties> extensions(extension_count);
+    vkEnumerateInstanceExtensionProperties(NULL, &extension_count,
+                                           extensions.data());
+    bool found = false;
+    for (const auto& extension : extensions) {
+      if (strcmp(extension.extensionName, VK_KHR_DEVICE_GROUP_CREATION_EXTENSION_NAME) == 0)
+        found = true;
+    }
+    if (found)
+      enabledExtensions.push_back(VK_KHR_DEVICE_GROUP_CREATION_EXTENSION_NAME);
+    else
+      device_group_mode_ = DEVICE_GROUP_NONE;
+  }
 
   create_info.enabledExtensionCount = enabledExtensions.size();
   create_info.ppEnabledExtensionNames = enabledExtensions.data();
 
   VK_CHECK_RESULT(vkCreateInstance(&create_info, NULL, &instance_));
+  LoadInstanceFunctions(instance_);
+  if (!validation_ || !vkCreateDebugReportCallbackEXT)
+    return;
 
   // Let's add the debug callback function
   VkDebugReportCallbackCreateInfoEXT createInfo = {};
@@ -875,15 +1997,11 @@ void Triangle::InitVulkanInstance() {
   createInfo.flags = VK_DEBUG_REPORT_ERROR_BIT_EXT | VK_DEBUG_REPORT_WARNING_BIT_EXT;
   createInfo.pfnCallback = debugCallback;
 
-  // Get the vkCreateDebugReportCallbackEXT function address
-  auto vkCreateDebugReportCallbackEXT = (PFN_vkCreateDebugReportCallbackEXT)
-    vkGetInstanceProcAddr(instance_, "vkCreateDebugReportCallbackEXT");
-
   VK_CHECK_RESULT(
     vkCreateDebugReportCallbackEXT(instance_, &createInfo, NULL, &callback_));
 }
 
-void Triangle::UpdateUniformBuffer() {
+void Triangle::UpdateUniformBuffer(uint32_t image) {
   UniformBufferObject ubo = {};
   static auto startTime = std::chrono::high_resolution_clock::now();
 
@@ -894,16 +2012,202 @@ void Triangle::UpdateUniformBuffer() {
 
   ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
 
-  ubo.proj = glm::perspective(glm::radians(45.0f), 800 / (float) 600, 0.1f, 10.0f);
+  ubo.proj = glm::perspective(glm::radians(45.0f),
+    swap_chain_extent_.width / (float) swap_chain_extent_.height, 0.1f, 10.0f);
 
   ubo.proj[1][1] *= -1;
 
-  void* data;
-  vkMapMemory(device_, uniform_staging_buffer_memory_, 0, sizeof(ubo), 0, &data);
-  memcpy(data, &ubo, sizeof(ubo));
-  vkUnmapMemory(device_, uniform_staging_buffer_memory_);
+  // How big the quad ends up on screen drives the texture streaming
+  glm::mat4 mvp = ubo.proj * ubo.view * ubo.model;
+  glm::vec2 lo(std::numeric_limits<float>::max());
+  glm::vec2 hi(-std::numeric_limits<float>::max());
+  for (const Vertex &v : vertices_) {
+    glm::vec4 p = mvp * glm::vec4(v.pos, 0.0f, 1.0f);
+    glm::vec2 ndc = glm::vec2(p) / p.w;
+    lo = glm::min(lo, ndc);
+    hi = glm::max(hi, ndc);
+  }
+  glm::vec2 pixels = (hi - lo) * 0.5f *
+    glm::vec2(swap_chain_extent_.width, swap_chain_extent_.height);
+
+  // Nothing to stream for while the quad is out of view
+  Scene::Transform transform;
+  for (int row = 0; row < 3; row++)
+    for (int col = 0; col < 4; col++)
+      transform[row * 4 + col] = ubo.model[col][row];
+  scene_.SetTransform(quad_, transform);
+  scene_.Update();
+  glm::mat4 viewProj = ubo.proj * ubo.view;
+  scene_.Query(FrustumFromMatrix(&viewProj[0][0]), 1, &visible_);
+  bool visible = std::find(visible_.begin(), visible_.end(), quad_) != visible_.end();
+  texture_streamer_->SetScreenSize(texture_, visible ? std::max(pixels.x, pixels.y) : 0.0f);
+
+  // And how big a mesh unit is where the quad sits picks its LOD. A change
+  // means recording the command buffers again, as for textures.
+  float w = (mvp * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)).w;
+  float pixelsPerUnit = w > 0.0f ?
+    swap_chain_extent_.height * fabsf(ubo.proj[1][1]) / (2.0f * w) :
+    std::numeric_limits<float>::max();
+  uint32_t lod = SelectLod(lod_chain_, pixelsPerUnit, LOD_MAX_PIXEL_ERROR);
+  if (lod != lod_) {
+    lod_ = lod;
+    image_dirty_.assign(image_dirty_.size(), true);
+  }
+
+  // Coherent memory, nothing to flush
+  memcpy(uniform_data_[image], &ubo, sizeof(ubo));
+
+  if (capture_.enabled())
+    capture_.UploadBuffer(capture_uniform_buffer_, 0, &ubo, sizeof(ubo));
+}
+
+// Frames still in flight may use the old image, so it is retired until the
+// last submission and every image picks up the new one the next time it is
+// free to be recorded again.
+void Triangle::UpdateTexture() {
+  VkImageView view;
+  if (texture_streamer_->Update(texture_, &view, scheduler_->last_submitted())) {
+    texture_view_ = view;
+    image_dirty_.assign(image_dirty_.size(), true);
+    CaptureTexture();
+  }
+}
 
-  CopyBuffer(uniform_staging_buffer_, uniform_buffer_, sizeof(ubo));
+// Texture images are immutable in the capture, every residency change shows
+// up as a new image.
+void Triangle::CaptureTexture() {
+  if (!capture_.enabled())
+    return;
+  const TextureFile &file = texture_streamer_->file(texture_);
+  uint32_t base = texture_streamer_->base_level(texture_);
+  const TextureLevel &top = file.level(base);
+  capture_texture_ = capture_.CreateImage(file.format(), top.width, top.height,
+                                          file.level_count() - base);
+  for (uint32_t i = base; i < file.level_count(); ++i) {
+    const TextureLevel &level = file.level(i);
+    capture_.UploadImage(capture_texture_, i - base, level.width, level.height,
+                         level.data, level.size);
+  }
+}
+
+void Triangle::PrintStats() {
+  TextureStreamer::Stats stats = texture_streamer_->GetStats();
+  fprintf(stdout, "Textures:       %u, %u/%u levels resident\n",
+          stats.textures, stats.resident_levels, stats.total_levels);
+  fprintf(stdout, "Residency:      %.1f MiB (budget %.1f MiB), %lu evictions\n",
+          stats.committed_bytes / 1048576.0, stats.budget_bytes / 1048576.0,
+          (unsigned long) stats.evictions);
+  fprintf(stdout, "Uploads:        %lu, %.1f MiB at %.1f MiB/s\n",
+          (unsigned long) stats.uploads, stats.uploaded_bytes / 1048576.0,
+          stats.upload_bandwidth / 1048576.0);
+  timeline_->Print(stdout);
+  if (exporter_) {
+    FrameExporter::Stats exportStats = exporter_->GetStats();
+    fprintf(stdout, "Export:         %lu frames, %lu dropped, %.3f ms/frame writing\n",
+            (unsigned long) exportStats.frames, (unsigned long) exportStats.dropped,
+            exportStats.frames ? exportStats.write_seconds * 1000.0 / exportStats.frames : 0.0);
+  }
+  if (pipelines_) {
+    PipelineVariants::Stats pipelineStats = pipelines_->GetStats();
+    fprintf(stdout, "Pipelines:      %u variants, %u compiling, %lu generic binds, %.1f ms compiling\n",
+            pipelineStats.variants, pipelineStats.pending,
+            (unsigned long) pipelineStats.fallbacks,
+            pipelineStats.compile_seconds * 1000.0);
+  }
+  fprintf(stdout, "Draws:          %u packets, %u draws, %u binds per frame, %.3f ms sorting\n",
+          draw_stats_.packets, draw_stats_.draws, draw_stats_.binds(),
+          draw_stats_.sort_seconds * 1000.0);
+  if (recoveries_ || swapchain_recreations_)
+    fprintf(stdout, "Recreated:      device %u times, swapchain %u times\n",
+            recoveries_, swapchain_recreations_);
+  if (steady_frames_)
+    fprintf(stdout, "Heap allocations: %.2f per frame after warmup (%lu frames)\n",
+            (double) steady_allocations_ / steady_frames_,
+            (unsigned long) steady_frames_);
+}
+
+// Everything but the heaps, which need a device
+void Triangle::CreateMetrics() {
+  frames_metric_ = metrics_.AddCounter("triangle_frames_total", "Frames submitted");
+  draws_metric_ = metrics_.AddCounter("triangle_draws_total", "Draw calls submitted");
+  binds_metric_ = metrics_.AddCounter("triangle_binds_total",
+                                      "Pipeline, descriptor set, buffer binds and "
+                                      "constant pushes submitted");
+  sort_time_metric_ = metrics_.AddHistogram(
+    "triangle_draw_sort_seconds", "Time sorting the draws of a command buffer",
+    Metrics::ExponentialBounds(0.000001, 4.0, 10));
+  triangles_metric_ = metrics_.AddCounter("triangle_triangles_total",
+                                          "Triangles submitted");
+  frame_time_metric_ = metrics_.AddHistogram(
+    "triangle_frame_seconds", "Time between frames on the CPU",
+    Metrics::ExponentialBounds(0.00025, 2.0, 12));
+  gpu_time_metric_ = metrics_.AddHistogram(
+    "triangle_gpu_frame_seconds", "GPU time of the frame's command buffer",
+    Metrics::ExponentialBounds(0.00025, 2.0, 12));
+  swapchain_metric_ = metrics_.AddCounter("triangle_swapchain_recreations_total",
+                                          "Swapchains made again for the window");
+  recoveries_metric_ = metrics_.AddCounter("triangle_device_recoveries_total",
+                                           "Devices rebuilt after an error");
+  uploads_metric_ = metrics_.AddCounter("triangle_texture_uploads_total",
+                                        "Texture levels uploaded");
+  upload_bytes_metric_ = metrics_.AddCounter("triangle_texture_upload_bytes_total",
+                                             "Texture bytes uploaded");
+  upload_bandwidth_metric_ = metrics_.AddGauge(
+    "triangle_texture_upload_bandwidth_bytes",
+    "Bytes per second while uploading textures");
+  resident_metric_ = metrics_.AddGauge("triangle_texture_resident_bytes",
+                                       "Device memory held by texture images");
+  budget_metric_ = metrics_.AddGauge("triangle_texture_budget_bytes",
+                                     "Texture residency budget");
+  evictions_metric_ = metrics_.AddCounter("triangle_texture_evictions_total",
+                                          "Texture downgrades for the budget");
+  exported_metric_ = metrics_.AddCounter("triangle_exported_frames_total",
+                                         "Frames written out by the exporter");
+  export_dropped_metric_ = metrics_.AddCounter(
+    "triangle_export_dropped_frames_total", "Frames the exporter had no room for");
+}
+
+// Once, for the heaps of the first device
+void Triangle::CreateHeapMetrics() {
+  if (!heap_size_metrics_.empty())
+    return;
+  for (uint32_t i = 0; i < memory_properties_.memoryHeapCount; i++) {
+    const VkMemoryHeap &heap = memory_properties_.memoryHeaps[i];
+    char labels[64];
+    snprintf(labels, sizeof(labels), "heap=\"%u\",device_local=\"%s\"", i,
+             heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? "true" : "false");
+    heap_size_metrics_.push_back(metrics_.AddGauge(
+      "triangle_memory_heap_size_bytes", "Size of the memory heap", labels));
+    heap_size_metrics_.back()->Set(heap.size);
+    heap_allocated_metrics_.push_back(metrics_.AddGauge(
+      "triangle_memory_heap_allocated_bytes",
+      "Device memory allocated from the heap", labels));
+  }
+}
+
+// The totals other objects keep, every METRICS_INTERVAL frames as getting
+// them takes locks.
+void Triangle::UpdateMetrics() {
+  TextureStreamer::Stats stats = texture_streamer_->GetStats();
+  uploads_metric_->Add(stats.uploads - streamer_stats_.uploads);
+  upload_bytes_metric_->Add(stats.uploaded_bytes - streamer_stats_.uploaded_bytes);
+  upload_bandwidth_metric_->Set(stats.upload_bandwidth);
+  resident_metric_->Set(stats.resident_bytes);
+  budget_metric_->Set(stats.budget_bytes);
+  evictions_metric_->Add(stats.evictions - streamer_stats_.evictions);
+  streamer_stats_ = stats;
+  if (exporter_) {
+    FrameExporter::Stats exportStats = exporter_->GetStats();
+    exported_metric_->Add(exportStats.frames - export_stats_.frames);
+    export_dropped_metric_->Add(exportStats.dropped - export_stats_.dropped);
+    export_stats_ = exportStats;
+  }
+
+  VkDeviceSize heaps[VK_MAX_MEMORY_HEAPS] = {};
+  for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; i++)
+    heaps[memory_properties_.memoryTypes[i].heapIndex] += AllocatedDeviceMemory(i);
+  for (size_t i = 0; i < heap_allocated_metrics_.size(); i++)
+    heap_allocated_metrics_[i]->Set(heaps[i]);
 }
 
 void Triangle::Loop() {
@@ -918,6 +2222,8 @@ void Triangle::Loop() {
         case XCB_CLIENT_MESSAGE: {
           if ((*(xcb_client_message_event_t *)event).data.data32[0] ==
           (*atom_wm_delete_window_).atom) {
+            FinishExport();
+            PrintStats();
             exit(0);
           }
         }
@@ -929,6 +2235,8 @@ void Triangle::Loop() {
               // Esc
               case 9: {
                   free (event);
+                  FinishExport();
+                  PrintStats();
                   xcb_disconnect (connection_);
                   exit(0);
               }
@@ -938,10 +2246,22 @@ void Triangle::Loop() {
       }
 
     }
-    // Stuff should go here?
-    // Update uniform buffer
-    UpdateUniformBuffer();
-    DrawFrame();
+    // The render loop is meant to stay off the heap, tell when it doesn't
+    uint64_t allocations = AllocationCount();
+    try {
+      DrawFrame();
+    } catch (const VulkanError &e) {
+      Recover(e);
+      continue;
+    }
+    if (frame_ > WARMUP_FRAMES) {
+      allocations = AllocationCount() - allocations;
+      if (allocations && !steady_allocations_)
+        fprintf(stderr, "Frame %lu made %lu heap allocations\n",
+                (unsigned long) frame_, (unsigned long) allocations);
+      steady_allocations_ += allocations;
+      steady_frames_++;
+    }
     usleep(1e3);
   }
 
@@ -986,14 +2306,14 @@ void Triangle::CreateWindow(uint32_t x, uint32_t y,
                     screen_->root_visual,           // visual
                     event_mask, value_list);        // masks, not used yet
 
-  // Required to close the program when you close the window
+  // Required to close the program when you close the window. Both requests
+  // go out before waiting on either reply: one round-trip instead of two.
   xcb_intern_atom_cookie_t cookie =
       xcb_intern_atom(connection_, 1, 12, "WM_PROTOCOLS");
-  xcb_intern_atom_reply_t *reply =
-      xcb_intern_atom_reply(connection_, cookie, 0);
-
   xcb_intern_atom_cookie_t cookie2 =
       xcb_intern_atom(connection_, 0, 16, "WM_DELETE_WINDOW");
+  xcb_intern_atom_reply_t *reply =
+      xcb_intern_atom_reply(connection_, cookie, 0);
   atom_wm_delete_window_ =
       xcb_intern_atom_reply(connection_, cookie2, 0);
 
@@ -1013,11 +2333,41 @@ void Triangle::CreateWindow(uint32_t x, uint32_t y,
 int main (int argc, char *argv[]) {
   Triangle a = Triangle();
 
-  // We've got a window
-  a.CreateWindow(300, 200, 800, 600);
-
-  // Let's instance Vulkan now
-  a.InitVulkan();
+  if (argc > 1)
+    a.SetTexturePath(argv[1]);
+
+  // Replay it with ./replay
+  const char *capture = getenv("TRIANGLE_CAPTURE");
+  if (capture && !a.SetCapturePath(capture))
+    return 1;
+  // For videos, e.g. TRIANGLE_EXPORT=png:frames/%05u.png
+  const char *exportSpec = getenv("TRIANGLE_EXPORT");
+  if (exportSpec)
+    a.SetExportSpec(exportSpec);
+  // Editing the shaders, e.g. TRIANGLE_SHADERS=. compiles ./triangle.vert
+  // and ./triangle.frag at startup
+  const char *shaders = getenv("TRIANGLE_SHADERS");
+  if (shaders)
+    a.SetShaderDirectory(shaders);
+  // To try recovery, e.g. TRIANGLE_FAULTS=vkQueueSubmit=VK_ERROR_DEVICE_LOST@500,
+  // see vulkan-errors.h
+  const char *faults = getenv("TRIANGLE_FAULTS");
+  if (faults && !SetFaults(faults))
+    return 1;
+  // For Prometheus, e.g. TRIANGLE_METRICS=tcp:9464, see metrics.h
+  const char *metrics = getenv("TRIANGLE_METRICS");
+  if (metrics && !a.ServeMetrics(metrics))
+    return 1;
+  if (!LoadVulkan())
+    return 1;
+
+  // Window and Vulkan
+  try {
+    a.Init(300, 200, 800, 600);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
 
 
   a.Loop();
@@ -1,10 +1,32 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// Feature bits, see FEATURE_* in triangle.cc. The pipeline variants
+// specialize kFeatures; the generic variant reads them from the push
+// constant instead.
+const uint FEATURE_TEXTURE = 1u;
+const uint FEATURE_VERTEX_COLOR = 2u;
+const uint FEATURES_GENERIC = 0x80000000u;
+
+layout(constant_id = 0) const uint kFeatures = 3u;  // texture and vertex color
+
+layout(push_constant) uniform Features {
+    uint features;
+} pc;
+
+layout(binding = 1) uniform sampler2D texSampler;
+
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    uint features = kFeatures == FEATURES_GENERIC ? pc.features : kFeatures;
+    vec3 color = vec3(1.0);
+    if ((features & FEATURE_VERTEX_COLOR) != 0u)
+        color *= fragColor;
+    if ((features & FEATURE_TEXTURE) != 0u)
+        color *= texture(texSampler, fragTexCoord).rgb;
+    outColor = vec4(color, 1.0);
 }
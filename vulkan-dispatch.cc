@@ -0,0 +1,153 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "vulkan-dispatch.h"
+#include "vulkan-errors.h"
+
+#define VK_DEFINE_FUNCTION(name) PFN_##name name = NULL;
+PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr = NULL;
+VK_GLOBAL_FUNCTIONS(VK_DEFINE_FUNCTION)
+VK_INSTANCE_FUNCTIONS(VK_DEFINE_FUNCTION)
+VK_DEVICE_FUNCTIONS(VK_DEFINE_FUNCTION)
+#undef VK_DEFINE_FUNCTION
+
+namespace {
+
+void *library = NULL;
+
+// With fault injection on, what the pointers pointed to before they were
+// replaced by shims.
+#define VK_DEFINE_REAL(name) \
+  PFN_##name real_##name = NULL; \
+  constexpr char name_##name[] = #name;
+VK_GLOBAL_FUNCTIONS(VK_DEFINE_REAL)
+VK_INSTANCE_FUNCTIONS(VK_DEFINE_REAL)
+VK_DEVICE_FUNCTIONS(VK_DEFINE_REAL)
+#undef VK_DEFINE_REAL
+
+// Functions that can't fail are left alone
+template <typename F, F *Real, const char *Name>
+struct FaultShim {
+  static F Wrap(F fn) { return fn; }
+};
+
+template <typename... Args, VkResult (VKAPI_PTR **Real)(Args...), const char *Name>
+struct FaultShim<VkResult (VKAPI_PTR *)(Args...), Real, Name> {
+  typedef VkResult (VKAPI_PTR *Function)(Args...);
+
+  static VkResult VKAPI_PTR Call(Args... args) {
+    return InjectFault(Name, (*Real)(args...));
+  }
+
+  static Function Wrap(Function fn) {
+    if (!fn)
+      return fn;
+    *Real = fn;
+    return Call;
+  }
+};
+
+#define VK_WRAP_FUNCTION(name) \
+  name = FaultShim<PFN_##name, &real_##name, name_##name>::Wrap(name);
+
+// Device memory accounting, around whatever the pointers were, fault shims
+// included: only allocations that succeeded count.
+PFN_vkAllocateMemory counted_vkAllocateMemory = NULL;
+PFN_vkFreeMemory counted_vkFreeMemory = NULL;
+std::atomic<VkDeviceSize> allocated_memory[VK_MAX_MEMORY_TYPES];
+// Type and size of every live allocation, vkFreeMemory only gets the handle
+std::mutex allocations_mutex;
+std::unordered_map<VkDeviceMemory, std::pair<uint32_t, VkDeviceSize>> allocations;
+
+VkResult VKAPI_PTR CountAllocateMemory(VkDevice device,
+                                       const VkMemoryAllocateInfo *info,
+                                       const VkAllocationCallbacks *allocator,
+                                       VkDeviceMemory *memory) {
+  VkResult result = counted_vkAllocateMemory(device, info, allocator, memory);
+  if (result != VK_SUCCESS || info->memoryTypeIndex >= VK_MAX_MEMORY_TYPES)
+    return result;
+  allocated_memory[info->memoryTypeIndex] += info->allocationSize;
+  std::lock_guard<std::mutex> lock(allocations_mutex);
+  allocations[*memory] = std::make_pair(info->memoryTypeIndex, info->allocationSize);
+  return result;
+}
+
+void VKAPI_PTR CountFreeMemory(VkDevice device, VkDeviceMemory memory,
+                               const VkAllocationCallbacks *allocator) {
+  counted_vkFreeMemory(device, memory, allocator);
+  std::lock_guard<std::mutex> lock(allocations_mutex);
+  auto allocation = allocations.find(memory);
+  if (allocation == allocations.end())
+    return;
+  allocated_memory[allocation->second.first] -= allocation->second.second;
+  allocations.erase(allocation);
+}
+
+}  // namespace
+
+bool LoadVulkan() {
+  if (library)
+    return true;
+  library = dlopen("libvulkan.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (!library)
+    library = dlopen("libvulkan.so", RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    fprintf(stderr, "No Vulkan loader: %s\n", dlerror());
+    return false;
+  }
+  vkGetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)
+    dlsym(library, "vkGetInstanceProcAddr");
+  if (!vkGetInstanceProcAddr) {
+    fprintf(stderr, "The Vulkan loader lacks vkGetInstanceProcAddr\n");
+    return false;
+  }
+
+#define VK_LOAD_FUNCTION(name) \
+  name = (PFN_##name) vkGetInstanceProcAddr(VK_NULL_HANDLE, #name);
+  VK_GLOBAL_FUNCTIONS(VK_LOAD_FUNCTION)
+#undef VK_LOAD_FUNCTION
+  if (FaultsEnabled()) {
+    VK_GLOBAL_FUNCTIONS(VK_WRAP_FUNCTION)
+  }
+  return true;
+}
+
+void LoadInstanceFunctions(VkInstance instance) {
+#define VK_LOAD_FUNCTION(name) \
+  name = (PFN_##name) vkGetInstanceProcAddr(instance, #name);
+  VK_INSTANCE_FUNCTIONS(VK_LOAD_FUNCTION)
+#undef VK_LOAD_FUNCTION
+  if (FaultsEnabled()) {
+    VK_INSTANCE_FUNCTIONS(VK_WRAP_FUNCTION)
+  }
+}
+
+void LoadDeviceFunctions(VkDevice device) {
+#define VK_LOAD_FUNCTION(name) \
+  name = (PFN_##name) vkGetDeviceProcAddr(device, #name);
+  VK_DEVICE_FUNCTIONS(VK_LOAD_FUNCTION)
+#undef VK_LOAD_FUNCTION
+  if (FaultsEnabled()) {
+    VK_DEVICE_FUNCTIONS(VK_WRAP_FUNCTION)
+  }
+
+  // Whatever the previous device didn't free went with it
+  {
+    std::lock_guard<std::mutex> lock(allocations_mutex);
+    allocations.clear();
+    for (std::atomic<VkDeviceSize> &bytes : allocated_memory)
+      bytes = 0;
+  }
+  counted_vkAllocateMemory = vkAllocateMemory;
+  counted_vkFreeMemory = vkFreeMemory;
+  vkAllocateMemory = CountAllocateMemory;
+  vkFreeMemory = CountFreeMemory;
+}
+
+VkDeviceSize AllocatedDeviceMemory(uint32_t memory_type) {
+  return memory_type < VK_MAX_MEMORY_TYPES ? allocated_memory[memory_type].load() : 0;
+}
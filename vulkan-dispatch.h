@@ -0,0 +1,154 @@
+#ifndef _VULKAN_DISPATCH_H
+#define _VULKAN_DISPATCH_H
+
+// The pointers below take the place of the loader's prototypes
+#ifndef VK_NO_PROTOTYPES
+#error "Build with -DVK_NO_PROTOTYPES"
+#endif
+
+#include <vulkan/vulkan.h>
+
+// Vulkan entry points, loaded at runtime rather than linked against the
+// loader.
+//
+// libvulkan is dlopen'd, so binaries start, and can tell what's wrong,
+// where there is no loader. Device level functions come from
+// vkGetDeviceProcAddr and go straight to the driver, instead of through the
+// loader's trampoline which looks up the dispatch table of the object on
+// every call. There is one device at a time, so the pointers are globals
+// named after the functions and call sites read as with prototypes.
+//
+// Every call goes through these pointers: replacing one intercepts all of
+// its calls, for instrumentation or mocks. Fault injection (see
+// vulkan-errors.h) works that way. Extension functions are NULL when the
+// extension isn't there.
+
+// Before any instance
+#define VK_GLOBAL_FUNCTIONS(X) \
+  X(vkCreateInstance) \
+  X(vkEnumerateInstanceExtensionProperties) \
+  X(vkEnumerateInstanceLayerProperties)
+
+// Instance and physical device level, through the loader
+#define VK_INSTANCE_FUNCTIONS(X) \
+  X(vkCreateDebugReportCallbackEXT) \
+  X(vkCreateDevice) \
+  X(vkCreateXcbSurfaceKHR) \
+  X(vkEnumerateDeviceExtensionProperties) \
+  X(vkEnumeratePhysicalDeviceGroupsKHR) \
+  X(vkEnumeratePhysicalDevices) \
+  X(vkGetDeviceProcAddr) \
+  X(vkGetPhysicalDeviceFeatures) \
+  X(vkGetPhysicalDeviceFormatProperties) \
+  X(vkGetPhysicalDeviceMemoryProperties) \
+  X(vkGetPhysicalDeviceProperties) \
+  X(vkGetPhysicalDeviceQueueFamilyProperties) \
+  X(vkGetPhysicalDeviceSurfaceCapabilitiesKHR) \
+  X(vkGetPhysicalDeviceSurfaceFormatsKHR) \
+  X(vkGetPhysicalDeviceSurfacePresentModesKHR) \
+  X(vkGetPhysicalDeviceSurfaceSupportKHR)
+
+// Device, queue and command buffer level, straight from the driver
+#define VK_DEVICE_FUNCTIONS(X) \
+  X(vkAcquireNextImage2KHR) \
+  X(vkAcquireNextImageKHR) \
+  X(vkAllocateCommandBuffers) \
+  X(vkAllocateDescriptorSets) \
+  X(vkAllocateMemory) \
+  X(vkBeginCommandBuffer) \
+  X(vkBindBufferMemory) \
+  X(vkBindImageMemory) \
+  X(vkCmdBeginRenderPass) \
+  X(vkCmdBindDescriptorSets) \
+  X(vkCmdBindIndexBuffer) \
+  X(vkCmdBindPipeline) \
+  X(vkCmdBindVertexBuffers) \
+  X(vkCmdCopyBuffer) \
+  X(vkCmdCopyBufferToImage) \
+  X(vkCmdCopyImageToBuffer) \
+  X(vkCmdDrawIndexed) \
+  X(vkCmdDrawIndexedIndirect) \
+  X(vkCmdEndRenderPass) \
+  X(vkCmdPipelineBarrier) \
+  X(vkCmdPushConstants) \
+  X(vkCmdResetQueryPool) \
+  X(vkCmdWriteTimestamp) \
+  X(vkCreateBuffer) \
+  X(vkCreateCommandPool) \
+  X(vkCreateDescriptorPool) \
+  X(vkCreateDescriptorSetLayout) \
+  X(vkCreateFence) \
+  X(vkCreateFramebuffer) \
+  X(vkCreateGraphicsPipelines) \
+  X(vkCreateImage) \
+  X(vkCreateImageView) \
+  X(vkCreatePipelineCache) \
+  X(vkCreatePipelineLayout) \
+  X(vkCreateQueryPool) \
+  X(vkCreateRenderPass) \
+  X(vkCreateSampler) \
+  X(vkCreateSemaphore) \
+  X(vkCreateShaderModule) \
+  X(vkCreateSwapchainKHR) \
+  X(vkDestroyBuffer) \
+  X(vkDestroyCommandPool) \
+  X(vkDestroyDescriptorPool) \
+  X(vkDestroyDescriptorSetLayout) \
+  X(vkDestroyDevice) \
+  X(vkDestroyFence) \
+  X(vkDestroyFramebuffer) \
+  X(vkDestroyImage) \
+  X(vkDestroyImageView) \
+  X(vkDestroyPipeline) \
+  X(vkDestroyPipelineCache) \
+  X(vkDestroyPipelineLayout) \
+  X(vkDestroyQueryPool) \
+  X(vkDestroyRenderPass) \
+  X(vkDestroySampler) \
+  X(vkDestroySemaphore) \
+  X(vkDestroyShaderModule) \
+  X(vkDestroySwapchainKHR) \
+  X(vkDeviceWaitIdle) \
+  X(vkEndCommandBuffer) \
+  X(vkFreeCommandBuffers) \
+  X(vkFreeMemory) \
+  X(vkGetBufferMemoryRequirements) \
+  X(vkGetDeviceGroupPresentCapabilitiesKHR) \
+  X(vkGetDeviceQueue) \
+  X(vkGetImageMemoryRequirements) \
+  X(vkGetQueryPoolResults) \
+  X(vkGetSemaphoreCounterValueKHR) \
+  X(vkGetSwapchainImagesKHR) \
+  X(vkInvalidateMappedMemoryRanges) \
+  X(vkMapMemory) \
+  X(vkQueuePresentKHR) \
+  X(vkQueueSubmit) \
+  X(vkQueueWaitIdle) \
+  X(vkResetFences) \
+  X(vkUnmapMemory) \
+  X(vkUpdateDescriptorSets) \
+  X(vkWaitForFences) \
+  X(vkWaitSemaphoresKHR)
+
+#define VK_DECLARE_FUNCTION(name) extern PFN_##name name;
+extern PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr;
+VK_GLOBAL_FUNCTIONS(VK_DECLARE_FUNCTION)
+VK_INSTANCE_FUNCTIONS(VK_DECLARE_FUNCTION)
+VK_DEVICE_FUNCTIONS(VK_DECLARE_FUNCTION)
+#undef VK_DECLARE_FUNCTION
+
+// Opens libvulkan and loads the global functions. Prints why and returns
+// false when there's no loader.
+bool LoadVulkan();
+// After vkCreateInstance()
+void LoadInstanceFunctions(VkInstance instance);
+// After vkCreateDevice(), again for a new device. Other threads can't be
+// making device calls meanwhile.
+void LoadDeviceFunctions(VkDevice device);
+
+// Device memory allocated and not freed yet, per memory type index, of the
+// device last given to LoadDeviceFunctions(). Counted by shims in front of
+// vkAllocateMemory and vkFreeMemory. Thread safe.
+VkDeviceSize AllocatedDeviceMemory(uint32_t memory_type);
+
+#endif // _VULKAN_DISPATCH_H
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "vulkan-errors.h"
+
+namespace {
+
+const VkResult kResults[] = {
+  VK_SUCCESS,
+  VK_NOT_READY,
+  VK_TIMEOUT,
+  VK_EVENT_SET,
+  VK_EVENT_RESET,
+  VK_INCOMPLETE,
+  VK_ERROR_OUT_OF_HOST_MEMORY,
+  VK_ERROR_OUT_OF_DEVICE_MEMORY,
+  VK_ERROR_INITIALIZATION_FAILED,
+  VK_ERROR_DEVICE_LOST,
+  VK_ERROR_MEMORY_MAP_FAILED,
+  VK_ERROR_LAYER_NOT_PRESENT,
+  VK_ERROR_EXTENSION_NOT_PRESENT,
+  VK_ERROR_FEATURE_NOT_PRESENT,
+  VK_ERROR_INCOMPATIBLE_DRIVER,
+  VK_ERROR_TOO_MANY_OBJECTS,
+  VK_ERROR_FORMAT_NOT_SUPPORTED,
+  VK_ERROR_FRAGMENTED_POOL,
+  VK_ERROR_OUT_OF_POOL_MEMORY_KHR,
+  VK_ERROR_SURFACE_LOST_KHR,
+  VK_ERROR_NATIVE_WINDOW_IN_USE_KHR,
+  VK_SUBOPTIMAL_KHR,
+  VK_ERROR_OUT_OF_DATE_KHR,
+  VK_ERROR_VALIDATION_FAILED_EXT,
+};
+
+struct FaultRule {
+  std::string function;
+  VkResult result;
+  uint64_t at;
+  uint64_t period;
+  std::atomic<uint64_t> calls{0};
+};
+
+std::vector<std::unique_ptr<FaultRule>> rules;
+bool enabled = false;
+
+bool ParseResult(const std::string &name, VkResult *result) {
+  for (VkResult r : kResults) {
+    if (name == VkResultName(r)) {
+      *result = r;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+const char *VkResultName(VkResult result) {
+  switch (result) {
+#define NAME(r) case r: return #r;
+    NAME(VK_SUCCESS)
+    NAME(VK_NOT_READY)
+    NAME(VK_TIMEOUT)
+    NAME(VK_EVENT_SET)
+    NAME(VK_EVENT_RESET)
+    NAME(VK_INCOMPLETE)
+    NAME(VK_ERROR_OUT_OF_HOST_MEMORY)
+    NAME(VK_ERROR_OUT_OF_DEVICE_MEMORY)
+    NAME(VK_ERROR_INITIALIZATION_FAILED)
+    NAME(VK_ERROR_DEVICE_LOST)
+    NAME(VK_ERROR_MEMORY_MAP_FAILED)
+    NAME(VK_ERROR_LAYER_NOT_PRESENT)
+    NAME(VK_ERROR_EXTENSION_NOT_PRESENT)
+    NAME(VK_ERROR_FEATURE_NOT_PRESENT)
+    NAME(VK_ERROR_INCOMPATIBLE_DRIVER)
+    NAME(VK_ERROR_TOO_MANY_OBJECTS)
+    NAME(VK_ERROR_FORMAT_NOT_SUPPORTED)
+    NAME(VK_ERROR_FRAGMENTED_POOL)
+    NAME(VK_ERROR_OUT_OF_POOL_MEMORY_KHR)
+    NAME(VK_ERROR_SURFACE_LOST_KHR)
+    NAME(VK_ERROR_NATIVE_WINDOW_IN_USE_KHR)
+    NAME(VK_SUBOPTIMAL_KHR)
+    NAME(VK_ERROR_OUT_OF_DATE_KHR)
+    NAME(VK_ERROR_VALIDATION_FAILED_EXT)
+#undef NAME
+    default: {
+      // Only for values no driver should return
+      static thread_local char unknown[32];
+      snprintf(unknown, sizeof(unknown), "VkResult %d", (int) result);
+      return unknown;
+    }
+  }
+}
+
+VulkanError::VulkanError(VkResult result, const char *call, const char *file,
+                         int line)
+    : std::runtime_error(std::string(file) + ":" + std::to_string(line) + ": " +
+                         call + ": " + VkResultName(result)),
+      result_(result) {}
+
+bool SetFaults(const char *spec) {
+  rules.clear();
+  const char *p = spec;
+  while (*p) {
+    const char *end = strchr(p, ',');
+    std::string rule = end ? std::string(p, end - p) : std::string(p);
+    p = end ? end + 1 : p + rule.size();
+
+    size_t equal = rule.find('=');
+    size_t at = rule.find('@');
+    if (equal == std::string::npos || at == std::string::npos || at < equal) {
+      fprintf(stderr, "Bad fault rule %s, expected <function>=<result>@<n>\n",
+              rule.c_str());
+      return false;
+    }
+    std::unique_ptr<FaultRule> fault(new FaultRule());
+    fault->function = rule.substr(0, equal);
+    if (!ParseResult(rule.substr(equal + 1, at - equal - 1), &fault->result)) {
+      fprintf(stderr, "Unknown VkResult in fault rule %s\n", rule.c_str());
+      return false;
+    }
+    char *rest;
+    fault->at = strtoull(rule.c_str() + at + 1, &rest, 10);
+    fault->period = *rest == '+' ? strtoull(rest + 1, &rest, 10) : 0;
+    if (fault->at == 0 || *rest) {
+      fprintf(stderr, "Bad call count in fault rule %s\n", rule.c_str());
+      return false;
+    }
+    rules.push_back(std::move(fault));
+  }
+  enabled = !rules.empty();
+  return true;
+}
+
+bool FaultsEnabled() {
+  return enabled;
+}
+
+VkResult InjectFault(const char *function, VkResult result) {
+  for (const std::unique_ptr<FaultRule> &rule : rules) {
+    if (rule->function != function)
+      continue;
+    uint64_t n = ++rule->calls;
+    bool fire = n == rule->at ||
+      (rule->period && n > rule->at && (n - rule->at) % rule->period == 0);
+    if (fire) {
+      fprintf(stderr, "Injecting %s into call %lu of %s\n",
+              VkResultName(rule->result), (unsigned long) n,
+              rule->function.c_str());
+      return rule->result;
+    }
+  }
+  return result;
+}
@@ -0,0 +1,52 @@
+#ifndef _VULKAN_ERRORS_H
+#define _VULKAN_ERRORS_H
+
+#include <stdint.h>
+#include <stdexcept>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+// Vulkan failures and a way to make them happen on purpose.
+//
+// A failed call throws a VulkanError naming the call and its VkResult. The
+// render loop catches it and, for a lost device or exhausted device
+// memory, tears the device down and builds it again; anything else is
+// fatal. Other threads hand their errors to the render thread.
+
+// VK_ERROR_DEVICE_LOST and friends, "VkResult <n>" for unknown values.
+const char *VkResultName(VkResult result);
+
+class VulkanError : public std::runtime_error {
+public:
+  VulkanError(VkResult result, const char *call, const char *file, int line);
+
+  VkResult result() const { return result_; }
+  // Worth rebuilding the device for
+  bool recoverable() const {
+    return result_ == VK_ERROR_DEVICE_LOST ||
+      result_ == VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  }
+
+private:
+  VkResult result_;
+};
+
+// Fault injection, to exercise the error paths without a flaky GPU.
+//
+// Rules are comma separated, each <function>=<result>@<n>[+<period>]: the
+// nth call of function (counting from 1) returns result instead of what it
+// really returned, then every period calls after that. For example
+//   vkQueueSubmit=VK_ERROR_DEVICE_LOST@500
+//   vkAllocateMemory=VK_ERROR_OUT_OF_DEVICE_MEMORY@20+100
+// The dispatch table (vulkan-dispatch.h) puts a shim in front of every
+// function returning a VkResult when there are rules, so set them before
+// LoadVulkan(). Prints why and returns false on a bad spec.
+bool SetFaults(const char *spec);
+bool FaultsEnabled();
+
+// What function returns with the rules applied, result being what it
+// really returned.
+VkResult InjectFault(const char *function, VkResult result);
+
+#endif // _VULKAN_ERRORS_H
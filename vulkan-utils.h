@@ -3,17 +3,28 @@
 #define _VULKAN_UTILS_H
 
 #include <iostream>
+#include <mutex>
 #include <vulkan/vulkan.h>
 
+#include "vulkan-dispatch.h"
+#include "vulkan-errors.h"
+
+// Throws a VulkanError when f doesn't succeed.
 #define VK_CHECK_RESULT(f) { \
   VkResult res = (f); \
-  if (res != VK_SUCCESS) { \
-    fprintf(stderr, "%s:%d: VkResult != VK_SUCCESS\n", __FILE__, __LINE__); \
-    exit(1); \
-  } \
+  if (res != VK_SUCCESS) \
+    throw VulkanError(res, #f, __FILE__, __LINE__); \
 }
 
-static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
+// A queue with its family and the mutex serializing submissions to it.
+// Roles that end up on the same family share the queue and the mutex.
+struct DeviceQueue {
+  VkQueue queue;
+  uint32_t family;
+  std::mutex *mutex;
+};
+
+static inline VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
     VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objType,
     uint64_t obj, size_t location, int32_t code, const char* layerPrefix,
     const char* msg, void* userData) {
@@ -21,4 +32,20 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
   return VK_FALSE;
 }
 
+// First memory type allowed by type_filter that has all the properties.
+// Returns UINT32_MAX if there's none.
+static inline uint32_t FindMemoryType(VkPhysicalDevice physical_device,
+                                      uint32_t type_filter,
+                                      VkMemoryPropertyFlags properties) {
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memProperties);
+
+  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+    if ((type_filter & (1 << i)) &&
+        (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+      return i;
+  }
+  return UINT32_MAX;
+}
+
 #endif